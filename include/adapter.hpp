@@ -7,6 +7,9 @@
 #include <d3d9.h>
 
 
+struct GLFormatInfo;
+
+
 class D3DAdapter {
 public:
     struct Limits {
@@ -54,16 +57,23 @@ private:
     WORD mVendorId;
     WORD mDeviceId;
     const char *mDescription;
+    // Video memory size in MB.
+    UINT mVideoMemory;
 
     D3DCAPS9 mCaps;
     UsageMap mUsage;
     FormatSampleMap mSamples;
 
+    // Set when the compressed formats need to be decoded in software.
+    bool mDecodeS3TC;
+    bool mDecodeRGTC;
+
     Limits mLimits;
 
     void init_limits();
     void init_caps();
     void init_ids();
+    void init_vidmem();
     void init_usage();
 
 public:
@@ -77,12 +87,19 @@ public:
     WORD getVendorId() const { return mVendorId; }
     WORD getDeviceId() const { return mDeviceId; }
     const char *getDescription() const { return mDescription; }
+    UINT getVideoMemory() const { return mVideoMemory; }
     DWORD getUsage(DWORD restype, D3DFORMAT format) const;
     UINT getSamples(D3DFORMAT format) const;
+    // Returns the format to use in place of a compressed format GL can't
+    // take, or null if it can be used as-is.
+    const GLFormatInfo *getDecodedFormat(D3DFORMAT format) const;
 
     UINT getModeCount(D3DFORMAT format) const;
     HRESULT getModeInfo(D3DFORMAT format, UINT mode, D3DDISPLAYMODE *info) const;
 };
 extern std::vector<D3DAdapter> gAdapterList;
 
+// Overrides the reported video memory size (in MB), if non-0.
+extern UINT VideoMemOverride;
+
 #endif /* ADAPTER_HPP */
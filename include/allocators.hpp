@@ -3,6 +3,7 @@
 
 #include <new>
 #include <limits>
+#include <cstddef>
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -15,6 +16,82 @@ enum class Alignment : size_t {
 };
 
 
+/* Thread-safe allocator for resource data. Requests are rounded up to a size
+ * class, and freed blocks are kept in per-thread and global free lists for
+ * reuse, so frequent reallocations (e.g. buffer discards) don't go to the
+ * system heap. Small classes are carved out of larger slabs, and blocks
+ * larger than the biggest class are mapped directly from the system.
+ */
+class SlabAllocator {
+public:
+    struct Stats {
+        size_t mLiveBytes;
+        size_t mPeakBytes;
+        UINT64 mNumAllocs;
+        UINT64 mNumFrees;
+        UINT64 mNumLargeAllocs;
+        UINT64 mNumSystemAllocs;
+    };
+
+    // All returned memory is aligned to this.
+    static const size_t sAlignment = 32;
+
+    // Returns nullptr if the memory can't be allocated.
+    static void *allocate(size_t size);
+    static void deallocate(void *ptr);
+
+    static Stats getStats();
+    // Traces the current stats and allocation rate, at most once every few
+    // seconds.
+    static void logStats();
+};
+
+
+/* Single-threaded allocator for short-lived bookkeeping that's all released
+ * together, like a shader's parse state. Small requests are carved out of
+ * large chunks, and freed ones are kept in per-size free lists for the next
+ * request of that size. Nothing goes back to the system until the arena is
+ * destroyed, except for large requests, which go to the SlabAllocator.
+ * Callers are responsible for serializing access.
+ */
+class ArenaAllocator {
+public:
+    struct Stats {
+        UINT64 mNumAllocs;
+        UINT64 mAllocBytes;
+        size_t mLiveBytes;
+        size_t mChunkBytes;
+    };
+
+    // All returned memory is aligned to this.
+    static const size_t sAlignment = 16;
+
+private:
+    // Sizes up to this are handled by the arena, in sAlignment steps.
+    static const size_t sMaxSmallSize = 2048;
+    static const size_t sNumClasses = sMaxSmallSize / sAlignment;
+
+    void *mChunks;
+    BYTE *mPos;
+    BYTE *mEnd;
+    void *mFree[sNumClasses];
+    Stats mStats;
+
+    ArenaAllocator(const ArenaAllocator&) = delete;
+    ArenaAllocator& operator=(const ArenaAllocator&) = delete;
+
+public:
+    ArenaAllocator();
+    ~ArenaAllocator();
+
+    // Returns nullptr if the memory can't be allocated.
+    void *allocate(size_t size);
+    void deallocate(void *ptr);
+
+    const Stats &getStats() const { return mStats; }
+};
+
+
 template<typename T, Alignment Align=Alignment::AVX>
 class AlignedAllocator;
 
@@ -63,14 +140,14 @@ public:
 
     pointer allocate(size_type n, typename AlignedAllocator<void, Align>::const_pointer = 0)
     {
-        const size_type alignment = static_cast<size_type>(Align);
-        void *ptr = _aligned_malloc(n * sizeof(T), alignment);
+        static_assert(size_t(Align) <= SlabAllocator::sAlignment, "Alignment too large!");
+        void *ptr = SlabAllocator::allocate(n * sizeof(T));
         if(ptr == nullptr) throw std::bad_alloc();
         return reinterpret_cast<pointer>(ptr);
     }
 
     void deallocate(pointer p, size_type) noexcept
-    { return _aligned_free(p); }
+    { SlabAllocator::deallocate(const_cast<T*>(p)); }
 
     template<class U, class ...Args>
     void construct(U *p, Args&&... args)
@@ -112,14 +189,14 @@ public:
 
     pointer allocate(size_type n, typename AlignedAllocator<void, Align>::const_pointer = 0)
     {
-        const size_type alignment = static_cast<size_type>(Align);
-        void *ptr = _aligned_malloc(n * sizeof(T), alignment);
+        static_assert(size_t(Align) <= SlabAllocator::sAlignment, "Alignment too large!");
+        void *ptr = SlabAllocator::allocate(n * sizeof(T));
         if(ptr == nullptr) throw std::bad_alloc();
         return reinterpret_cast<pointer>(ptr);
     }
 
     void deallocate(pointer p, size_type) noexcept
-    { return _aligned_free(p); }
+    { SlabAllocator::deallocate(const_cast<T*>(p)); }
 
     template<class U, class ...Args>
     void construct(U *p, Args&&... args)
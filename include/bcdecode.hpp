@@ -0,0 +1,23 @@
+#ifndef BCDECODE_HPP
+#define BCDECODE_HPP
+
+#include "glformat.hpp"
+
+
+/* Software decoders for block compressed formats, for when GL lacks the
+ * extension for them. These are hooked up to their formats in
+ * gDecodedFormatList.
+ *
+ * DXT1       -> RGBA8
+ * DXT2, DXT3 -> RGBA8 (DXT2's premultiplied alpha is left as-is)
+ * DXT4, DXT5 -> RGBA8 (likewise for DXT4)
+ * ATI1       -> R8
+ * ATI2       -> RG8
+ */
+extern const GLFormatConversion gDecodeBC1;
+extern const GLFormatConversion gDecodeBC2;
+extern const GLFormatConversion gDecodeBC3;
+extern const GLFormatConversion gDecodeBC4;
+extern const GLFormatConversion gDecodeBC5;
+
+#endif /* BCDECODE_HPP */
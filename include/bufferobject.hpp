@@ -4,15 +4,21 @@
 #include <atomic>
 #include <vector>
 #include <memory>
+#include <map>
 #include <d3d9.h>
 
 #include "glew.h"
 #include "allocators.hpp"
+#include "residency.hpp"
 
 
 class D3DGLDevice;
 
-class D3DGLBufferObject : public IDirect3DVertexBuffer9, public IDirect3DIndexBuffer9 {
+/* Scans count indices of the given format and returns the smallest and
+ * largest values referenced. */
+void CalcIndexRange(const GLubyte *data, D3DFORMAT format, UINT count, UINT &minidx, UINT &maxidx);
+
+class D3DGLBufferObject : public IDirect3DVertexBuffer9, public IDirect3DIndexBuffer9, public ManagedResource {
     std::atomic<ULONG> mRefCount;
     std::atomic<ULONG> mIfaceCount;
 
@@ -39,8 +45,21 @@ class D3DGLBufferObject : public IDirect3DVertexBuffer9, public IDirect3DIndexBu
 
     std::atomic<ULONG> mUpdateInProgress;
 
+    // Index ranges already scanned for draws, keyed by byte offset and count.
+    // Only accessed by the app thread.
+    struct IndexRange {
+        UINT mMin, mMax;
+    };
+    std::map<UINT64,IndexRange> mIndexRanges;
+
+    void invalidateIndexRanges(UINT offset, UINT length);
+
     bool init_common(UINT length, DWORD usage, D3DPOOL pool);
 
+    virtual void evict() final;
+    virtual void restore() final;
+    virtual bool isBound() final;
+
 public:
     D3DGLBufferObject(D3DGLDevice *parent);
     virtual ~D3DGLBufferObject();
@@ -55,9 +74,12 @@ public:
     void initGL(const GLubyte *data);
     void loadBufferDataGL(UINT offset, UINT length, const GLubyte *data, GLbitfield flags);
     void resizeBufferGL(UINT length);
+    void evictGL();
 
     D3DFORMAT getFormat() const { return mFormat; }
 
+    void getIndexRange(UINT offset, UINT count, UINT &minidx, UINT &maxidx);
+
     ULONG addIface() { return ++mIfaceCount; }
     ULONG releaseIface();
 
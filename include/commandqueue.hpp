@@ -54,6 +54,22 @@ public:
     virtual ULONG execute() { return mSkipAmt; }
 };
 
+// Deletes an object on the command thread, after any previously queued
+// commands that reference it.
+template<typename T>
+class CommandDelete : public Command {
+    T *mObject;
+
+public:
+    CommandDelete(T *object) : mObject(object) { }
+
+    virtual ULONG execute()
+    {
+        delete mObject;
+        return sizeof(*this);
+    }
+};
+
 template<typename T>
 class CommandSync : public Command {
 public:
@@ -5,9 +5,16 @@
 
 #include <atomic>
 #include <array>
+#include <vector>
 
 #include "d3dgl.hpp"
 #include "commandqueue.hpp"
+#include "glnamepool.hpp"
+#include "uploadring.hpp"
+#include "residency.hpp"
+#include "texcompress.hpp"
+#include "programcache.hpp"
+#include "shaderregistry.hpp"
 
 
 class D3DGLSwapChain;
@@ -15,7 +22,10 @@ class D3DGLRenderTarget;
 class D3DGLBufferObject;
 class D3DGLVertexShader;
 class D3DGLPixelShader;
+class SharedVertexShader;
+class SharedPixelShader;
 class D3DGLVertexDeclaration;
+class D3DGLPlainSurface;
 
 #define VSF_BINDING_IDX 0
 #define VSI_BINDING_IDX 1
@@ -106,6 +116,24 @@ class D3DGLDevice : public IDirect3DDevice9 {
 
     CommandQueue mQueue;
 
+    // Pre-generated names for resources created by the app
+    GLNamePool mBufferNames;
+    GLNamePool mTextureNames;
+    GLNamePool mRenderbufferNames;
+    GLNamePool mQueryNames;
+
+    UploadRing mUploadRing;
+    ResidencyManager mResidency;
+    TextureCompressor mCompressor;
+    ProgramCache mProgramCache;
+    VariantManifest mVariantManifest;
+    ShaderRegistry<SharedVertexShader> mVShaderRegistry;
+    ShaderRegistry<SharedPixelShader> mPShaderRegistry;
+
+    // Plain surfaces with readbacks in flight, resolved as they finish. Only
+    // used on the command thread.
+    std::vector<D3DGLPlainSurface*> mPendingReadbacks;
+
     const HWND mWindow;
     const DWORD mFlags;
 
@@ -116,6 +144,14 @@ class D3DGLDevice : public IDirect3DDevice9 {
     std::atomic<IDirect3DSurface9*> mDepthStencil;
 
     std::array<std::atomic<IDirect3DBaseTexture9*>,MAX_COMBINED_SAMPLERS> mTextures;
+    // Set when a texture was modified, so bound textures get flushed before
+    // drawing.
+    std::atomic<bool> mTexturesDirty;
+
+    // Texture palettes, only used by the app thread when uploading
+    // palettized textures.
+    std::vector<std::array<PALETTEENTRY,256>> mPalettes;
+    UINT mCurrentPalette;
 
     typedef std::array<std::atomic<DWORD>,33> TexStageStates;
     typedef std::array<std::atomic<DWORD>,14> SamplerStates;
@@ -151,6 +187,7 @@ class D3DGLDevice : public IDirect3DDevice9 {
     std::map<DWORD,D3DGLVertexDeclaration*> mVtxDeclMap;
 
     D3DGLBufferObject *mPrimitiveUserData;
+    D3DGLBufferObject *mPrimitiveUserIndices;
 
     /* Bit-depth of the current depth-stencil buffer */
     UINT mDepthBits;
@@ -175,6 +212,7 @@ class D3DGLDevice : public IDirect3DDevice9 {
     void GLAPIENTRY debugProcGL(GLenum source, GLenum type, GLuint id, GLenum severity,
                                 GLsizei length, const GLchar *message) const;
 
+    void flushTextureUpdates();
     HRESULT sendVtxData(INT startvtx, const StreamSource *srcstreams, UINT num_sources);
 
 public:
@@ -186,6 +224,45 @@ public:
     const D3DAdapter &getAdapter() const { return mAdapter; }
     CommandQueue &getQueue() { return mQueue; }
 
+    GLuint getBufferName() { return mBufferNames.get(mQueue); }
+    GLuint getTextureName() { return mTextureNames.get(mQueue); }
+    GLuint getRenderbufferName() { return mRenderbufferNames.get(mQueue); }
+    GLuint getQueryName() { return mQueryNames.get(mQueue); }
+
+    // Deletes are batched until the next Present, so these may only be
+    // called from the command thread.
+    void deleteBufferGL(GLuint name) { mBufferNames.deferDeleteGL(name); }
+    void deleteTextureGL(GLuint name) { mTextureNames.deferDeleteGL(name); }
+    void deleteQueryGL(GLuint name) { mQueryNames.deferDeleteGL(name); }
+    void flushDeletesGL();
+
+    void addReadbackGL(D3DGLPlainSurface *surface);
+    void removeReadbackGL(D3DGLPlainSurface *surface);
+    // Copies out the readbacks the GPU has finished, called each Present.
+    void pollReadbacksGL();
+
+    UploadRing &getUploadRing() { return mUploadRing; }
+    ResidencyManager &getResidency() { return mResidency; }
+    TextureCompressor &getCompressor() { return mCompressor; }
+    ProgramCache &getProgramCache() { return mProgramCache; }
+    VariantManifest &getVariantManifest() { return mVariantManifest; }
+    ShaderRegistry<SharedVertexShader> &getVShaderRegistry() { return mVShaderRegistry; }
+    ShaderRegistry<SharedPixelShader> &getPShaderRegistry() { return mPShaderRegistry; }
+
+    // Whether a resource is currently set on the device.
+    bool isTextureBound(const IDirect3DBaseTexture9 *texture) const;
+    bool isBufferBound(const D3DGLBufferObject *buffer) const;
+    bool isRenderTarget(const IDirect3DSurface9 *surface) const;
+
+    void setTexturesDirty() { mTexturesDirty = true; }
+
+    // Returns nullptr if the current palette was never set.
+    const PALETTEENTRY *getCurrentPalette() const
+    {
+        if(mCurrentPalette >= mPalettes.size()) return nullptr;
+        return mPalettes[mCurrentPalette].data();
+    }
+
     GLuint getShaderPipeline() const { return mGLState.pipeline; }
 
     void initGL(HDC dc, HGLRC glcontext);
@@ -196,6 +273,9 @@ public:
     void blitFramebufferGL(GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect,
                            GLenum dst_target, GLuint dst_binding, GLint dst_level, const RECT &dst_rect,
                            GLenum filter);
+    void copyImageGL(GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect,
+                     GLenum dst_target, GLuint dst_binding, GLint dst_level, const POINT &dst_point,
+                     bool compressed);
 
     /*** IUnknown methods ***/
     virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
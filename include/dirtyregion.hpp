@@ -0,0 +1,83 @@
+#ifndef DIRTYREGION_HPP
+#define DIRTYREGION_HPP
+
+#include <algorithm>
+#include <vector>
+#include <d3d9.h>
+
+
+inline bool RegionTouches(const RECT &a, const RECT &b)
+{
+    return a.left <= b.right && b.left <= a.right &&
+           a.top <= b.bottom && b.top <= a.bottom;
+}
+inline void RegionUnion(RECT &a, const RECT &b)
+{
+    a.left = std::min(a.left, b.left);
+    a.top = std::min(a.top, b.top);
+    a.right = std::max(a.right, b.right);
+    a.bottom = std::max(a.bottom, b.bottom);
+}
+
+inline bool RegionTouches(const D3DBOX &a, const D3DBOX &b)
+{
+    return a.Left <= b.Right && b.Left <= a.Right &&
+           a.Top <= b.Bottom && b.Top <= a.Bottom &&
+           a.Front <= b.Back && b.Front <= a.Back;
+}
+inline void RegionUnion(D3DBOX &a, const D3DBOX &b)
+{
+    a.Left = std::min(a.Left, b.Left);
+    a.Top = std::min(a.Top, b.Top);
+    a.Front = std::min(a.Front, b.Front);
+    a.Right = std::max(a.Right, b.Right);
+    a.Bottom = std::max(a.Bottom, b.Bottom);
+    a.Back = std::max(a.Back, b.Back);
+}
+
+
+/* A short list of non-touching dirty regions (RECTs or D3DBOXes). Touching
+ * regions are merged into their bounds, and once there are too many, they're
+ * all collapsed into one.
+ */
+template<typename T, size_t MaxRegions=4>
+class DirtyRegionList {
+    std::vector<T> mRegions;
+
+public:
+    void add(const T &region)
+    {
+        T merged = region;
+        bool changed;
+        do {
+            // Merging may grow the region to touch ones already checked, so
+            // keep going until nothing else merges.
+            changed = false;
+            for(auto iter = mRegions.begin();iter != mRegions.end();)
+            {
+                if(!RegionTouches(*iter, merged))
+                    ++iter;
+                else
+                {
+                    RegionUnion(merged, *iter);
+                    iter = mRegions.erase(iter);
+                    changed = true;
+                }
+            }
+        } while(changed);
+
+        if(mRegions.size() >= MaxRegions)
+        {
+            for(const T &other : mRegions)
+                RegionUnion(merged, other);
+            mRegions.clear();
+        }
+        mRegions.push_back(merged);
+    }
+
+    bool empty() const { return mRegions.empty(); }
+    const std::vector<T> &get() const { return mRegions; }
+    void clear() { mRegions.clear(); }
+};
+
+#endif /* DIRTYREGION_HPP */
@@ -0,0 +1,25 @@
+#ifndef FORMATCONV_HPP
+#define FORMATCONV_HPP
+
+#include "glformat.hpp"
+
+
+/* Conversions for D3D formats GL has no direct equivalent for. These are
+ * hooked up to their formats in gFormatList.
+ *
+ * A8R3G3B2 -> BGRA8
+ * R8G8B8   -> BGRX8 (GL takes 24-bit pixels, but drivers rarely like it)
+ * A4L4     -> L8A8
+ * P8, A8P8 -> RGBA8, looked up in the palette (a grey ramp if there is none)
+ * L6V5U5   -> RGBA8 snorm, as U, V, L, 1
+ * X8L8V8U8 -> RGBA8 snorm, as U, V, L, 1 (L loses its lowest bit)
+ */
+extern const GLFormatConversion gConvA8R3G3B2;
+extern const GLFormatConversion gConvR8G8B8;
+extern const GLFormatConversion gConvA4L4;
+extern const GLFormatConversion gConvP8;
+extern const GLFormatConversion gConvA8P8;
+extern const GLFormatConversion gConvL6V5U5;
+extern const GLFormatConversion gConvX8L8V8U8;
+
+#endif /* FORMATCONV_HPP */
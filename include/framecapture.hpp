@@ -0,0 +1,104 @@
+#ifndef FRAMECAPTURE_HPP
+#define FRAMECAPTURE_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "glew.h"
+
+
+// Set to record presented frames to the named file. Files ending in .y4m get
+// YUV 4:2:0 video, others get raw BGRA frames. Either way, frames are dropped
+// or repeated to play back at CaptureFrameRate.
+extern std::string CaptureFile;
+extern UINT CaptureFrameRate;
+
+class D3DGLDevice;
+
+/* Records presented frames without stalling the GPU or the app. Each frame is
+ * read into one of a ring of pixel pack buffers, which is copied out once its
+ * fence signals, and a writer thread saves it to disk. Frames are dropped when
+ * all the pack buffers are still in flight, or the writer falls behind.
+ * Besides construction and init, it is only used on the command thread, and
+ * must be deleted there.
+ */
+class FrameCapture {
+    static const size_t sNumPackBuffers = 3;
+    static const size_t sMaxQueuedFrames = 8;
+
+    struct PackBuffer {
+        GLuint mBufferId;
+        GLsync mFence;
+        // How many output frames this one fills.
+        UINT mCount;
+    };
+
+    struct QueuedFrame {
+        std::vector<GLubyte> mData;
+        UINT mCount;
+    };
+
+    D3DGLDevice *mParent;
+    UINT mWidth, mHeight;
+    size_t mFrameSize;
+    bool mIsY4M;
+
+    // In-flight pack buffers, oldest first. Only used on the command thread.
+    std::array<PackBuffer,sNumPackBuffers> mPackBuffers;
+    size_t mReadIdx;
+    size_t mNumInFlight;
+
+    // Paces the presented frames to the output rate. Only used on the
+    // command thread.
+    LARGE_INTEGER mTimerFreq;
+    LARGE_INTEGER mStartTime;
+    UINT64 mFramesDue;
+    // Output frames lost to drops, repeated with the next frame that's kept.
+    UINT mFramesMissed;
+
+    FILE *mFile;
+    HANDLE mThread;
+    CRITICAL_SECTION mLock;
+    CONDITION_VARIABLE mWorkCond;
+    std::deque<QueuedFrame> mQueued;
+    std::vector<std::vector<GLubyte>> mFreeFrames;
+    size_t mNumFrames;
+    bool mQuit;
+
+    // Only used by the writer thread.
+    std::vector<GLubyte> mYUVData;
+
+    UINT mFramesWritten;
+    std::atomic<UINT> mFramesDropped;
+
+    FrameCapture(const FrameCapture&) = delete;
+    FrameCapture& operator=(const FrameCapture&) = delete;
+
+    void writeFrame(const std::vector<GLubyte> &frame);
+
+    DWORD CALLBACK writerLoop(void);
+    static DWORD CALLBACK thread_func(void *arg)
+    { return reinterpret_cast<FrameCapture*>(arg)->writerLoop(); }
+
+    // Hands off the frames the GPU has finished reading.
+    void retireGL(bool wait);
+
+public:
+    FrameCapture(D3DGLDevice *parent, UINT width, UINT height);
+    ~FrameCapture();
+
+    bool init(const std::string &filename);
+
+    // Queues a read of the presented frame, which has to be in a
+    // single-sampled renderbuffer.
+    void captureGL(GLuint renderbuffer);
+};
+
+#endif /* FRAMECAPTURE_HPP */
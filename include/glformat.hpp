@@ -15,6 +15,8 @@
 #define D3DFMT_ATI2 D3DFMT4CC('A','T','I','2')
 #define D3DFMT_NULL D3DFMT4CC('N','U','L','L')
 
+struct GLFormatConversion;
+
 struct GLFormatInfo {
     GLenum internalformat;
     GLenum format;
@@ -23,6 +25,9 @@ struct GLFormatInfo {
     int bytesperblock; /* Same as bytesperpixel for uncompressed formats */
     GLbitfield buffermask;
     GLbitfield flags;
+    /* Set for D3D formats GL can't take directly, which get converted to
+     * format/type on upload. */
+    const GLFormatConversion *conversion;
 
     enum FlagBits {
         Normal = 0,
@@ -45,5 +50,31 @@ struct GLFormatInfo {
     }
 };
 extern const std::map<DWORD,GLFormatInfo> gFormatList;
+/* Replacements for compressed formats, used when GL lacks support for them. */
+extern const std::map<DWORD,GLFormatInfo> gDecodedFormatList;
+
+struct GLFormatConversion {
+    /* Converts count pixels from the D3D format to the GL format, or back.
+     * The palette is only used by palettized formats, and may be null. */
+    typedef void (*ConvertFunc)(GLubyte *dst, const GLubyte *src, UINT count, const PALETTEENTRY *palette);
+    /* Decodes a rect of compressed blocks, for compressed formats GL doesn't
+     * support. The width and height are in pixels. */
+    typedef void (*DecodeFunc)(GLubyte *dst, const GLubyte *src, int srcpitch, int width, int height);
+
+    ConvertFunc toGL;
+    ConvertFunc fromGL; /* Null if the format can't be converted back */
+    int glbytesperpixel;
+    DecodeFunc decode; /* Used instead of toGL if set */
+
+    /* Converted rows are packed for GL's default unpack alignment. */
+    int calcPitch(int w) const
+    { return GLFormatInfo::calcPitch(w, glbytesperpixel); }
+
+    void toGLRect(GLubyte *dst, const GLubyte *src, int srcpitch, int width, int height,
+                  const PALETTEENTRY *palette) const;
+    void toGLBox(GLubyte *dst, const GLubyte *src, int srcpitch, int srcslice, int width, int height,
+                 int depth, const PALETTEENTRY *palette) const;
+    void fromGLRect(GLubyte *dst, int dstpitch, const GLubyte *src, int width, int height) const;
+};
 
 #endif /* GLFORMAT_HPP */
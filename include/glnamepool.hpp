@@ -0,0 +1,65 @@
+#ifndef GLNAMEPOOL_HPP
+#define GLNAMEPOOL_HPP
+
+#include <atomic>
+#include <array>
+#include <vector>
+
+#include "glew.h"
+
+
+class CommandQueue;
+
+/* A pool of pre-generated GL object names. The command thread fills it in
+ * batches, and any thread may reserve a name from it, so objects know their
+ * GL name at creation time without a round trip to the command thread.
+ */
+class GLNamePool {
+public:
+    enum Type {
+        Buffer,
+        Texture,
+        Renderbuffer,
+        Query
+    };
+
+private:
+    static const size_t sPoolSize = 256;
+    static const size_t sPoolMask = sPoolSize-1;
+    // Request a refill once the pool drops below this many names.
+    static const size_t sLowWater = sPoolSize/4;
+
+    const Type mType;
+
+    // Only the command thread writes names (advancing mWritePos); readers
+    // claim names by advancing mReadPos.
+    std::array<GLuint,sPoolSize> mNames;
+    std::atomic<size_t> mReadPos;
+    std::atomic<size_t> mWritePos;
+    std::atomic<bool> mRefillPending;
+
+    // Names of destroyed objects, deleted together by flushDeletesGL. Only
+    // accessed by the command thread.
+    std::vector<GLuint> mDeleteList;
+
+    void requestRefill(CommandQueue &queue);
+
+    GLNamePool(const GLNamePool&) = delete;
+    GLNamePool& operator=(const GLNamePool&) = delete;
+
+public:
+    GLNamePool(Type type);
+
+    // Reserves a name, waiting for the command thread if the pool is empty.
+    // Must not be called with the queue locked, as it may send a refill.
+    GLuint get(CommandQueue &queue);
+
+    void refillGL();
+    void deinitGL();
+
+    // Queues a name for deletion, flushing the list if it's grown large.
+    void deferDeleteGL(GLuint name);
+    void flushDeletesGL();
+};
+
+#endif /* GLNAMEPOOL_HPP */
@@ -0,0 +1,133 @@
+#ifndef LOCKBUFFER_HPP
+#define LOCKBUFFER_HPP
+
+#include <d3d9.h>
+
+#include "glew.h"
+#include "commandqueue.hpp"
+
+
+struct GLFormatInfo;
+class D3DGLDevice;
+
+/* A pixel buffer for locking surfaces that only exist on the GPU. Locking
+ * reads the surface back into the buffer and maps it for the app, and
+ * unlocking writes the locked region back from it. The readback can be
+ * queued ahead of the lock, so the lock only waits on its fence. Besides
+ * construction, it is only used on the command thread, and must be deleted
+ * there.
+ */
+class LockBuffer {
+    D3DGLDevice *mParent;
+    GLuint mBufferId;
+    GLsizeiptr mSize;
+    GLsizeiptr mAllocSize;
+    GLubyte *mMappedPtr;
+    // Set while a queued readback may still be in flight.
+    GLsync mReadFence;
+
+    // Renderbuffers can't be written to directly, so the locked region gets
+    // uploaded to this and blitted over.
+    GLuint mStagingTexId;
+
+    LockBuffer(const LockBuffer&) = delete;
+    LockBuffer& operator=(const LockBuffer&) = delete;
+
+    void allocGL(GLsizeiptr size);
+
+public:
+    LockBuffer(D3DGLDevice *parent, GLsizeiptr size);
+    ~LockBuffer();
+
+    // Valid on the app thread once a synchronous read completes.
+    GLubyte *getMappedPtr() const { return mMappedPtr; }
+
+    // Queues a read of the surface (a texture level or face, or a
+    // renderbuffer) into the buffer, without waiting on it.
+    void packGL(GLenum target, GLuint id, GLint level, const GLFormatInfo *format, bool compressed,
+                UINT width, UINT height);
+    // Maps the buffer with the surface's contents. Unless current is set,
+    // meaning the buffer already has or is getting them, the surface is read
+    // back first. Discarding skips the readback.
+    void readGL(GLenum target, GLuint id, GLint level, const GLFormatInfo *format, bool compressed,
+                UINT width, UINT height, bool discard, bool current);
+    // Unmaps the buffer and, if writeback is set, writes the region back to
+    // the surface.
+    void writeGL(GLenum target, GLuint id, GLint level, const GLFormatInfo *format, bool compressed,
+                 UINT width, UINT height, const RECT &rect, bool writeback);
+};
+
+
+// Takes everything by value, as render targets may be destroyed before these
+// are processed. The LockBuffer itself is deleted after them.
+class LockBufferPackCmd : public Command {
+    LockBuffer *mTarget;
+    GLenum mSrcTarget;
+    GLuint mSrcId;
+    GLint mLevel;
+    const GLFormatInfo *mFormat;
+    bool mCompressed;
+    UINT mWidth, mHeight;
+
+public:
+    LockBufferPackCmd(LockBuffer *target, GLenum src_target, GLuint src_id, GLint level, const GLFormatInfo *format, bool compressed, UINT width, UINT height)
+      : mTarget(target), mSrcTarget(src_target), mSrcId(src_id), mLevel(level), mFormat(format)
+      , mCompressed(compressed), mWidth(width), mHeight(height)
+    { }
+
+    virtual ULONG execute()
+    {
+        mTarget->packGL(mSrcTarget, mSrcId, mLevel, mFormat, mCompressed, mWidth, mHeight);
+        return sizeof(*this);
+    }
+};
+
+class LockBufferReadCmd : public Command {
+    LockBuffer *mTarget;
+    GLenum mSrcTarget;
+    GLuint mSrcId;
+    GLint mLevel;
+    const GLFormatInfo *mFormat;
+    bool mCompressed;
+    UINT mWidth, mHeight;
+    bool mDiscard;
+    bool mCurrent;
+
+public:
+    LockBufferReadCmd(LockBuffer *target, GLenum src_target, GLuint src_id, GLint level, const GLFormatInfo *format, bool compressed, UINT width, UINT height, bool discard, bool current)
+      : mTarget(target), mSrcTarget(src_target), mSrcId(src_id), mLevel(level), mFormat(format)
+      , mCompressed(compressed), mWidth(width), mHeight(height), mDiscard(discard), mCurrent(current)
+    { }
+
+    virtual ULONG execute()
+    {
+        mTarget->readGL(mSrcTarget, mSrcId, mLevel, mFormat, mCompressed, mWidth, mHeight, mDiscard, mCurrent);
+        return sizeof(*this);
+    }
+};
+
+class LockBufferWriteCmd : public Command {
+    LockBuffer *mTarget;
+    GLenum mDstTarget;
+    GLuint mDstId;
+    GLint mLevel;
+    const GLFormatInfo *mFormat;
+    bool mCompressed;
+    UINT mWidth, mHeight;
+    RECT mRect;
+    bool mWriteBack;
+
+public:
+    LockBufferWriteCmd(LockBuffer *target, GLenum dst_target, GLuint dst_id, GLint level, const GLFormatInfo *format, bool compressed, UINT width, UINT height, const RECT &rect, bool writeback)
+      : mTarget(target), mDstTarget(dst_target), mDstId(dst_id), mLevel(level), mFormat(format)
+      , mCompressed(compressed), mWidth(width), mHeight(height), mRect(rect), mWriteBack(writeback)
+    { }
+
+    virtual ULONG execute()
+    {
+        mTarget->writeGL(mDstTarget, mDstId, mLevel, mFormat, mCompressed, mWidth, mHeight, mRect, mWriteBack);
+        return sizeof(*this);
+    }
+};
+
+#endif /* LOCKBUFFER_HPP */
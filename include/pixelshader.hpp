@@ -4,37 +4,77 @@
 #include <atomic>
 #include <vector>
 #include <map>
+#include <memory>
 #include <d3d9.h>
 
 #include "glew.h"
 #include "commandqueue.hpp"
+#include "shaderbuild.hpp"
 
 
 class D3DGLDevice;
 
-class D3DGLPixelShader : public IDirect3DPixelShader9 {
-    std::atomic<ULONG> mRefCount;
-
+/* The parse results and GL programs shared by the pixel shader objects
+ * created with the same bytecode. Variants are translated on the thread pool,
+ * and their programs started on the command thread as soon as they're
+ * translated.
+ */
+class SharedPixelShader {
     D3DGLDevice *mParent;
 
+    std::vector<DWORD> mCode;
+    UINT64 mCodeHash;
+
+    // Commands in flight for this shader, and translations that have yet to
+    // send their start command.
     std::atomic<ULONG> mPendingUpdates;
-    std::map<UINT,GLuint> mPrograms;
+    std::atomic<ULONG> mPendingStarts;
+
+    // App thread state. The sampler mask comes from the first translation.
+    std::map<UINT,std::shared_ptr<ShaderTranslation>> mTranslations;
+    bool mHaveInfo;
     UINT mSamplerMask; // Bitmask of used samplers
     UINT mShadowSamplers; // Bitmask of samplers that have a shadow texture format
 
-    std::vector<DWORD> mCode;
+    // Command thread state.
+    std::map<UINT,GLuint> mPrograms;
+    std::map<UINT,PendingProgram> mStartedPrograms;
+
+    static void translationDone(ShaderTranslation *translation, void *userdata);
+    ShaderTranslation *getTranslation(UINT shadowsamplers);
+    void getInfo();
 
 public:
-    D3DGLPixelShader(D3DGLDevice *parent);
-    virtual ~D3DGLPixelShader();
+    SharedPixelShader(D3DGLDevice *parent);
+    ~SharedPixelShader();
 
-    bool init(const DWORD *data);
+    bool init(const DWORD *data, size_t count, UINT64 hash);
 
-    GLuint compileShaderGL(UINT shadowsamplers);
+    void startProgramGL(ShaderTranslation *translation);
+    GLuint compileShaderGL(ShaderTranslation *translation);
+    void startDone() { --mPendingStarts; }
 
-    ULONG getPendingUpdates() const { return mPendingUpdates; }
+    const std::vector<DWORD> &getCode() const { return mCode; }
 
+    // Caller is responsible for holding the device's queue lock.
     void setProgram(GLuint pipeline, UINT shadowmask, bool force);
+};
+
+class D3DGLPixelShader : public IDirect3DPixelShader9 {
+    std::atomic<ULONG> mRefCount;
+
+    D3DGLDevice *mParent;
+
+    std::shared_ptr<SharedPixelShader> mShared;
+
+public:
+    D3DGLPixelShader(D3DGLDevice *parent);
+    virtual ~D3DGLPixelShader();
+
+    bool init(const DWORD *data);
+
+    void setProgram(GLuint pipeline, UINT shadowmask, bool force)
+    { mShared->setProgram(pipeline, shadowmask, force); }
 
     /*** IUnknown methods ***/
     virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
@@ -46,35 +86,35 @@ public:
 };
 
 
-class CompileAndSetPShaderCmd : public Command {
-    D3DGLPixelShader *mTarget;
-    GLuint mPipeline;
-    UINT mShadowSamplers;
+class StartPShaderCmd : public Command {
+    SharedPixelShader *mTarget;
+    ShaderTranslation *mTranslation;
 
 public:
-    CompileAndSetPShaderCmd(D3DGLPixelShader *target, GLuint pipeline, UINT shadowsamplers=0)
-      : mTarget(target), mPipeline(pipeline), mShadowSamplers(shadowsamplers) { }
+    StartPShaderCmd(SharedPixelShader *target, ShaderTranslation *translation)
+      : mTarget(target), mTranslation(translation) { }
 
     virtual ULONG execute()
     {
-        GLuint program = mTarget->compileShaderGL(mShadowSamplers);
-        glUseProgramStages(mPipeline, GL_FRAGMENT_SHADER_BIT, program);
-        checkGLError();
+        mTarget->startProgramGL(mTranslation);
+        mTarget->startDone();
         return sizeof(*this);
     }
 };
 
-class SetPShaderCmd : public Command {
+class CompileAndSetPShaderCmd : public Command {
+    SharedPixelShader *mTarget;
     GLuint mPipeline;
-    GLuint mProgram;
+    ShaderTranslation *mTranslation;
 
 public:
-    SetPShaderCmd(GLuint pipeline, GLuint program)
-      : mPipeline(pipeline), mProgram(program) { }
+    CompileAndSetPShaderCmd(SharedPixelShader *target, GLuint pipeline, ShaderTranslation *translation)
+      : mTarget(target), mPipeline(pipeline), mTranslation(translation) { }
 
     virtual ULONG execute()
     {
-        glUseProgramStages(mPipeline, GL_FRAGMENT_SHADER_BIT, mProgram);
+        GLuint program = mTarget->compileShaderGL(mTranslation);
+        glUseProgramStages(mPipeline, GL_FRAGMENT_SHADER_BIT, program);
         checkGLError();
         return sizeof(*this);
     }
@@ -23,6 +23,14 @@ class D3DGLPlainSurface : public IDirect3DSurface9 {
     std::shared_ptr<GLubyte> mBufData;
     std::atomic<ULONG> mPendingUpdates;
 
+    // Readbacks are queued into a pixel pack buffer, and only copied to
+    // mBufData once the fence signals or the data is needed. Only used on the
+    // command thread.
+    GLuint mPackBufferId;
+    GLsizeiptr mPackBufferSize;
+    GLsync mReadFence;
+    RECT mReadRect;
+
     enum LockType {
         LT_Unlocked,
         LT_ReadOnly,
@@ -39,10 +47,24 @@ public:
 
     const D3DSURFACE_DESC &getDesc() const { return mDesc; }
     const GLFormatInfo &getFormat() const { return *mGLFormat; }
+    bool isCompressed() const { return mIsCompressed; }
 
-    std::atomic<ULONG> &getPendingUpdates() { return mPendingUpdates; };
     std::shared_ptr<GLubyte> getBufData() const { return mBufData; }
 
+    // Queues a read of src_rect from a render target (a texture level or
+    // face, or a renderbuffer) to dst_point in the surface. GL converts from
+    // the source format.
+    void queueReadback(GLenum src_target, GLuint src_binding, GLint src_level,
+                       const RECT &src_rect, const POINT &dst_point);
+    // Waits for any queued readback to land in the buffer data.
+    void finishReadback();
+
+    void readbackGL(GLenum src_target, GLuint src_binding, GLint src_level,
+                    const RECT &src_rect, const POINT &dst_point);
+    // Copies a completed readback into the buffer data. Returns false if the
+    // GPU hasn't finished it, unless told to wait.
+    bool resolveReadbackGL(bool wait);
+
     /*** IUnknown methods ***/
     virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
     virtual ULONG WINAPI AddRef() final;
@@ -0,0 +1,90 @@
+#ifndef PROGRAMCACHE_HPP
+#define PROGRAMCACHE_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "glew.h"
+
+
+// Set to a directory to keep linked shader programs in between runs.
+extern std::string ShaderCacheDir;
+
+// 64-bit FNV-1a, for keying shader code.
+const UINT64 HashBasis = 14695981039346656037ull;
+UINT64 HashBytes(UINT64 hash, const void *data, size_t len);
+
+/* Keeps linked shader program binaries on disk, so later runs can skip
+ * compiling the GLSL. Entries are keyed by a hash of the D3D shader code and
+ * its variant, along with the MojoShader version and the GL implementation,
+ * so a driver or translator update just misses the old entries. Only used on
+ * the command thread.
+ */
+class ProgramCache {
+    bool mEnabled;
+    // Hash of everything besides the shader that affects the binary.
+    UINT64 mEnvHash;
+
+    ULONG mNumHits;
+    ULONG mNumMisses;
+    ULONG mNumRejected;
+
+    ProgramCache(const ProgramCache&) = delete;
+    ProgramCache& operator=(const ProgramCache&) = delete;
+
+    std::string getPath(UINT64 key) const;
+
+public:
+    ProgramCache();
+    ~ProgramCache();
+
+    void initGL();
+
+    bool isEnabled() const { return mEnabled; }
+
+    UINT64 makeKey(GLenum type, const std::vector<DWORD> &code, UINT variant) const;
+
+    // Returns a linked program, or 0 if it isn't cached or the driver rejects
+    // the binary.
+    GLuint loadGL(UINT64 key);
+    void storeGL(UINT64 key, GLuint program);
+};
+
+
+/* Remembers which shadow sampler variants of each shader were used, in a
+ * manifest next to the program cache, so later runs can build them when the
+ * shader is created instead of on the draw that first needs them. Shaders are
+ * identified by a hash of their code. Thread-safe.
+ */
+class VariantManifest {
+    CRITICAL_SECTION mLock;
+    bool mEnabled;
+    std::string mPath;
+    // Code hash and shadow sampler mask pairs.
+    std::set<std::pair<UINT64,UINT>> mVariants;
+
+    ULONG mNumLoaded;
+    ULONG mNumRecorded;
+
+    VariantManifest(const VariantManifest&) = delete;
+    VariantManifest& operator=(const VariantManifest&) = delete;
+
+public:
+    VariantManifest();
+    ~VariantManifest();
+
+    // Reads the manifest left by previous runs, if the cache is enabled.
+    void load();
+
+    // Returns the shadow sampler masks previously used with the shader.
+    std::vector<UINT> get(UINT64 hash);
+    // Notes the shader being used with the mask, adding it to the manifest if
+    // it's new.
+    void record(UINT64 hash, UINT mask);
+};
+
+#endif /* PROGRAMCACHE_HPP */
@@ -36,7 +36,6 @@ public:
 
     GLuint getQueryId() const { return mQueryId; }
 
-    void initGL();
     void beginQueryGL();
     void endQueryGL();
     void queryDataGL();
@@ -9,6 +9,7 @@
 
 struct GLFormatInfo;
 class D3DGLDevice;
+class LockBuffer;
 
 class D3DGLRenderTarget : public IDirect3DSurface9 {
     std::atomic<ULONG> mRefCount;
@@ -18,16 +19,24 @@ class D3DGLRenderTarget : public IDirect3DSurface9 {
     const GLFormatInfo *mGLFormat;
     D3DSURFACE_DESC mDesc;
     bool mIsAuto;
+    bool mIsLockable;
 
     GLuint mId;
 
+    enum LockType {
+        LT_Unlocked,
+        LT_ReadOnly,
+        LT_Full
+    };
+    std::atomic<LockType> mLock;
+    RECT mLockRegion;
+    LockBuffer *mLockBuffer;
+
 public:
     D3DGLRenderTarget(D3DGLDevice *parent);
     virtual ~D3DGLRenderTarget();
 
-    bool init(const D3DSURFACE_DESC *desc, bool isauto=false);
-
-    void initGL();
+    bool init(const D3DSURFACE_DESC *desc, bool isauto=false, bool lockable=false);
 
     const D3DSURFACE_DESC &getDesc() const { return mDesc; }
     GLuint getId() const { return mId; }
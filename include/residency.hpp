@@ -0,0 +1,92 @@
+#ifndef RESIDENCY_HPP
+#define RESIDENCY_HPP
+
+#include <atomic>
+#include <list>
+#include <d3d9.h>
+
+
+class ResidencyManager;
+
+/* Base for managed pool resources. These keep a system memory copy, so their
+ * GL storage can be evicted when over budget and restored when next used.
+ */
+class ManagedResource {
+    std::list<ManagedResource*>::iterator mLruPos;
+    UINT64 mLastUsed;
+    UINT64 mSize;
+    bool mTracked;
+    bool mResident;
+
+    friend class ResidencyManager;
+
+protected:
+    ManagedResource();
+    virtual ~ManagedResource() { }
+
+    bool isEvicted() const { return mTracked && !mResident; }
+
+    // Frees the GL storage, keeping the GL object name valid.
+    virtual void evict() = 0;
+    // Reallocates the GL storage and reloads it from system memory.
+    virtual void restore() = 0;
+    // Resources currently set on the device can't be evicted.
+    virtual bool isBound() = 0;
+};
+
+
+/* Tracks the GL memory used by resources against a budget, and evicts the
+ * least recently used managed resources to stay under it. Only called from
+ * app threads.
+ */
+class ResidencyManager {
+    UINT64 mBudget;
+    // Bytes used by resident managed resources, and by default pool resources
+    // which can't be evicted.
+    UINT64 mResidentBytes;
+    std::atomic<UINT64> mFixedBytes;
+    UINT64 mFrame;
+
+    // Resident managed resources, most recently used first.
+    std::list<ManagedResource*> mLru;
+
+    ULONG mNumEvicted;
+    ULONG mNumRestored;
+
+    std::atomic<bool> mSpinLock;
+    void lock()
+    {
+        while(mSpinLock.exchange(true) == true)
+            SwitchToThread();
+    }
+    void unlock() { mSpinLock = false; }
+
+    void evictLocked(ManagedResource *res);
+    void enforceBudgetLocked();
+
+    ResidencyManager(const ResidencyManager&) = delete;
+    ResidencyManager& operator=(const ResidencyManager&) = delete;
+
+public:
+    ResidencyManager();
+
+    void setBudget(UINT64 budget) { mBudget = budget; }
+
+    // Managed resources are added after their GL storage is created.
+    void add(ManagedResource *res, UINT64 size);
+    void remove(ManagedResource *res);
+    // Updates the size of the resource's GL storage.
+    void resize(ManagedResource *res, UINT64 size);
+    // Marks the resource as used this frame, restoring it if it was evicted.
+    // Resources that weren't added are ignored.
+    void touch(ManagedResource *res);
+
+    void addFixed(UINT64 size) { mFixedBytes += size; }
+    void removeFixed(UINT64 size) { mFixedBytes -= size; }
+
+    void nextFrame();
+    void evictAll();
+    UINT64 getAvailable();
+};
+
+#endif /* RESIDENCY_HPP */
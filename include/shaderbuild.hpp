@@ -0,0 +1,104 @@
+#ifndef SHADERBUILD_HPP
+#define SHADERBUILD_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "glew.h"
+#include "allocators.hpp"
+#include "mojoshader/mojoshader.h"
+
+
+class ProgramCache;
+
+/* A MojoShader translation of one variant of a shader. It's queued on the
+ * thread pool when started, and whichever thread needs it before a worker
+ * gets to it translates it itself. Only the default variant parses the
+ * bytecode; the others are emitted again from what it parsed. Everything
+ * MojoShader allocates for them comes out of the default variant's arena.
+ */
+class ShaderTranslation {
+public:
+    // Called on the worker thread once the translation is done.
+    typedef void (*DoneFunc)(ShaderTranslation *translation, void *userdata);
+
+private:
+    enum State {
+        TS_Pending,
+        TS_Running,
+        TS_Done
+    };
+
+    const std::vector<DWORD> mCode;
+    const UINT mShadowSamplers;
+    const MOJOSHADER_parseData *mParseData;
+    std::atomic<State> mState;
+
+    // The default variant, for the others.
+    const std::shared_ptr<ShaderTranslation> mBase;
+
+    // Kept by the default variant, for emitting the others. The lock also
+    // covers the arena once the default variant is parsed.
+    MOJOSHADER_intermediate *mIntermediate;
+    CRITICAL_SECTION mEmitLock;
+    ArenaAllocator mArena;
+
+    static void *ArenaMalloc(int bytes, void *data);
+    static void ArenaFree(void *ptr, void *data);
+
+    const MOJOSHADER_parseData *emitVariant(UINT shadowsamplers);
+
+    class Task;
+
+    ShaderTranslation(const ShaderTranslation&) = delete;
+    ShaderTranslation& operator=(const ShaderTranslation&) = delete;
+
+public:
+    // The default variant, without shadow samplers.
+    ShaderTranslation(const std::vector<DWORD> &code);
+    ShaderTranslation(const std::shared_ptr<ShaderTranslation> &base, UINT shadowsamplers);
+    ~ShaderTranslation();
+
+    // Queues the translation on the thread pool, calling func when it's done.
+    // Returns false if there are no workers, in which case it's translated
+    // when first needed and func is never called.
+    static bool Start(const std::shared_ptr<ShaderTranslation> &translation, DoneFunc func, void *userdata);
+
+    UINT getShadowSamplers() const { return mShadowSamplers; }
+
+    // Returns the parse results, translating or waiting on it first if
+    // needed. Check error_count before using it.
+    const MOJOSHADER_parseData *get();
+};
+
+
+/* A program that's been started on the command thread, but maybe not
+ * finished by the driver.
+ */
+struct PendingProgram {
+    GLuint mProgram;
+    UINT64 mCacheKey;
+    bool mCached;
+};
+
+// Lets the driver compile shaders on its own threads, when it supports
+// GL_KHR_parallel_shader_compile.
+void InitShaderBuildGL();
+
+/* Starts building a separable program for the translation, or loads it from
+ * the program cache. Vertex attributes are bound to their index in the parse
+ * results' attribute list. This doesn't wait on the driver. Returns a 0
+ * program if it couldn't be started.
+ */
+PendingProgram StartProgramGL(ProgramCache &cache, GLenum type, const std::vector<DWORD> &code,
+                              ShaderTranslation *translation);
+/* Waits for a started program to link, logging any problems, and stores it
+ * in the program cache. Returns 0 if it failed, after deleting it.
+ */
+GLuint FinishProgramGL(ProgramCache &cache, const PendingProgram &pending, ShaderTranslation *translation);
+
+#endif /* SHADERBUILD_HPP */
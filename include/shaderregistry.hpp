@@ -0,0 +1,100 @@
+#ifndef SHADERREGISTRY_HPP
+#define SHADERREGISTRY_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <cstring>
+#include <map>
+#include <memory>
+
+#include "trace.hpp"
+#include "programcache.hpp"
+
+
+class D3DGLDevice;
+
+// Finds the length of D3D shader bytecode in tokens, including the version
+// and end tokens. Returns 0 if the version or instruction stream is
+// malformed. Translation does the full check later.
+size_t GetShaderTokenCount(const DWORD *data);
+
+/* Maps shader bytecode to the state shared by the shader objects created
+ * from it, so creating the same shader again reuses its parse results and GL
+ * programs. The registry doesn't keep the shared state alive; it goes away
+ * with the last shader object using it. T needs an
+ * init(const DWORD*, size_t, UINT64) method taking the bytecode, its token
+ * count and its hash, and a getCode() method returning the tokens it was made
+ * with.
+ */
+template<typename T>
+class ShaderRegistry {
+    CRITICAL_SECTION mLock;
+    std::multimap<UINT64,std::weak_ptr<T>> mShaders;
+
+    ULONG mNumCreated;
+    ULONG mNumShared;
+
+    ShaderRegistry(const ShaderRegistry&) = delete;
+    ShaderRegistry& operator=(const ShaderRegistry&) = delete;
+
+    std::shared_ptr<T> find(UINT64 hash, const DWORD *data, size_t count)
+    {
+        std::shared_ptr<T> ret;
+        EnterCriticalSection(&mLock);
+        auto iter = mShaders.lower_bound(hash);
+        while(iter != mShaders.end() && iter->first == hash)
+        {
+            std::shared_ptr<T> shader = iter->second.lock();
+            if(!shader)
+            {
+                iter = mShaders.erase(iter);
+                continue;
+            }
+            const auto &code = shader->getCode();
+            if(code.size() == count && memcmp(code.data(), data, count*sizeof(DWORD)) == 0)
+            {
+                ret = std::move(shader);
+                ++mNumShared;
+                break;
+            }
+            ++iter;
+        }
+        LeaveCriticalSection(&mLock);
+        return ret;
+    }
+
+public:
+    ShaderRegistry() : mNumCreated(0), mNumShared(0)
+    { InitializeCriticalSection(&mLock); }
+    ~ShaderRegistry()
+    {
+        TRACE("Shader registry: %lu created, %lu shared\n", mNumCreated, mNumShared);
+        DeleteCriticalSection(&mLock);
+    }
+
+    // Returns the shared state for the bytecode, creating it if needed.
+    // Returns null if the shared state fails to initialize.
+    std::shared_ptr<T> get(D3DGLDevice *parent, const DWORD *data)
+    {
+        size_t count = GetShaderTokenCount(data);
+        if(!count) return std::shared_ptr<T>();
+        UINT64 hash = HashBytes(HashBasis, data, count*sizeof(DWORD));
+        std::shared_ptr<T> shader = find(hash, data, count);
+        if(shader) return shader;
+
+        // Made outside the lock. Another thread making the same shader at the
+        // same time just ends up with its own.
+        shader.reset(new T(parent));
+        if(!shader->init(data, count, hash))
+            return std::shared_ptr<T>();
+
+        EnterCriticalSection(&mLock);
+        mShaders.insert(std::make_pair(hash, std::weak_ptr<T>(shader)));
+        ++mNumCreated;
+        LeaveCriticalSection(&mLock);
+        return shader;
+    }
+};
+
+#endif /* SHADERREGISTRY_HPP */
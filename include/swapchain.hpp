@@ -5,9 +5,12 @@
 #include <vector>
 #include <d3d9.h>
 
+#include "glew.h"
+
 
 class D3DGLDevice;
 class D3DGLRenderTarget;
+class FrameCapture;
 
 class D3DGLSwapChain : public IDirect3DSwapChain9 {
     std::atomic<ULONG> mRefCount;
@@ -23,6 +26,13 @@ class D3DGLSwapChain : public IDirect3DSwapChain9 {
 
     std::atomic<ULONG> mPendingSwaps;
 
+    // Records presented frames, when enabled.
+    FrameCapture *mCapture;
+
+    // A single-sampled copy of the last presented frame, made at each
+    // Present, since the app draws over the backbuffer afterward.
+    D3DGLRenderTarget *mFrontBuffer;
+
     void addIface();
     void releaseIface();
 
@@ -30,7 +40,7 @@ public:
     D3DGLSwapChain(D3DGLDevice *parent);
     virtual ~D3DGLSwapChain();
 
-    void swapBuffersGL(size_t backbuffer);
+    void swapBuffersGL(size_t backbuffer, GLuint frontbuffer);
 
     bool init(const D3DPRESENT_PARAMETERS *params, HWND window, bool isauto=false);
 
@@ -0,0 +1,86 @@
+#ifndef TEXCOMPRESS_HPP
+#define TEXCOMPRESS_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include "glew.h"
+
+
+// Set to compress eligible managed textures in the background.
+extern bool CompressTextures;
+
+/* BC encoders for D3D's 32-bit BGRA pixels. The rect is padded out to whole
+ * blocks by repeating the edge pixels. BC1 is always encoded in its 4-color
+ * mode, so it's opaque.
+ */
+void EncodeBC1(GLubyte *dst, int dstpitch, const GLubyte *src, int srcpitch, int width, int height);
+void EncodeBC3(GLubyte *dst, int dstpitch, const GLubyte *src, int srcpitch, int width, int height);
+
+
+/* Runs texture compression tasks on low priority worker threads. Tasks are
+ * finished back on an app thread once a frame, so the results can be applied
+ * without racing the app.
+ */
+class TextureCompressor {
+public:
+    class Task {
+        std::atomic<bool> mDone;
+
+        friend class TextureCompressor;
+
+    protected:
+        Task() : mDone(false) { }
+
+    public:
+        virtual ~Task() { }
+
+        // Set once run() has completed. Tasks can be finished without being
+        // run, when the compressor is stopped.
+        bool isDone() const { return mDone.load(); }
+
+        // Called on a worker thread.
+        virtual void run() = 0;
+        // Called on an app thread after the task is run, or dropped. The
+        // task is deleted afterward.
+        virtual void finish() = 0;
+    };
+
+private:
+    bool mEnabled;
+    std::vector<HANDLE> mThreads;
+
+    CRITICAL_SECTION mLock;
+    CONDITION_VARIABLE mWorkCond;
+    std::deque<Task*> mPending;
+    std::vector<Task*> mCompleted;
+    bool mQuit;
+
+    TextureCompressor(const TextureCompressor&) = delete;
+    TextureCompressor& operator=(const TextureCompressor&) = delete;
+
+    void startThreads();
+
+    DWORD CALLBACK workerLoop(void);
+    static DWORD CALLBACK thread_func(void *arg)
+    { return reinterpret_cast<TextureCompressor*>(arg)->workerLoop(); }
+
+public:
+    TextureCompressor();
+    ~TextureCompressor();
+
+    void setEnabled(bool enabled) { mEnabled = enabled; }
+    bool isEnabled() const { return mEnabled; }
+
+    void submit(Task *task);
+    // Finishes the completed tasks.
+    void update();
+    // Stops the worker threads, and finishes all remaining tasks.
+    void stop();
+};
+
+#endif /* TEXCOMPRESS_HPP */
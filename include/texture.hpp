@@ -2,18 +2,22 @@
 #define TEXTURE_HPP
 
 #include <atomic>
+#include <memory>
 #include <vector>
 #include <d3d9.h>
 
 #include "glew.h"
 #include "allocators.hpp"
+#include "dirtyregion.hpp"
+#include "residency.hpp"
 
 
 struct GLFormatInfo;
 class D3DGLDevice;
 class D3DGLTextureSurface;
+class LockBuffer;
 
-class D3DGLTexture : public IDirect3DTexture9 {
+class D3DGLTexture : public IDirect3DTexture9, public ManagedResource {
     std::atomic<ULONG> mRefCount;
     std::atomic<ULONG> mIfaceCount;
 
@@ -23,17 +27,49 @@ class D3DGLTexture : public IDirect3DTexture9 {
     bool mIsCompressed;
     GLuint mTexId;
     std::vector<GLubyte,AlignedAllocator<GLubyte>> mSysMem;
+    // Size of the GL storage, for residency tracking.
+    UINT mStorageSize;
 
     RECT mDirtyRect;
     std::atomic<ULONG> mUpdateInProgress;
+    // Set when a surface has regions that need to be uploaded.
+    std::atomic<bool> mDirty;
+    // Bumped whenever the GPU copy changes, so surfaces can tell if their
+    // lock buffer still has the current contents.
+    std::atomic<ULONG> mContentSerial;
 
     D3DSURFACE_DESC mDesc;
     std::vector<D3DGLTextureSurface*> mSurfaces;
     std::atomic<DWORD> mLodLevel;
+    // Managed textures only have GL storage for levels from the LOD down,
+    // with the LOD being GL's base level.
+    DWORD mStorageLod;
+
+    // Managed textures that aren't written to after they're first used can
+    // be compressed in the background, keeping the uncompressed data in
+    // system memory.
+    enum CompressState {
+        CS_None,
+        CS_Pending,
+        CS_Compressed,
+        CS_Never
+    };
+    std::atomic<CompressState> mCompressState;
+    // Counts writable locks, to catch those made while compressing.
+    std::atomic<ULONG> mWriteCount;
+    const GLFormatInfo *mCompressedFormat;
+    std::shared_ptr<GLubyte> mCompressedData;
+
+    void markWritten();
+    UINT calcStorageSize() const;
 
     void addIface();
     void releaseIface();
 
+    virtual void evict() final;
+    virtual void restore() final;
+    virtual bool isBound() final;
+
     friend class D3DGLTextureSurface;
 
 public:
@@ -42,15 +78,40 @@ public:
 
     bool init(const D3DSURFACE_DESC *desc, UINT levels);
     void updateTexture(DWORD level, const RECT &rect, const GLubyte *dataPtr);
+    // Uploads a copy of the data for a rect of the level. src points to the
+    // rect's first pixel (or block), with rows srcpitch bytes apart.
+    void uploadRect(DWORD level, const RECT &rect, const GLubyte *src, int srcpitch);
+    void flushUpdates();
+    // Gets and clears the dirty rect, in level 0 coordinates.
+    bool takeDirtyRect(RECT &rect);
+    // Queues the texture for compression if it's eligible, when it's set
+    // for drawing.
+    void checkCompress();
+    void encodeCompressed(std::shared_ptr<GLubyte> &data, const GLFormatInfo *&format, UINT &size);
+    void finishCompress(const std::shared_ptr<GLubyte> &data, const GLFormatInfo *format, UINT size,
+                        ULONG writecount, bool done);
+
+    // Called for anything that writes to the GPU copy of a default pool
+    // texture, besides its own locks.
+    void markContentChanged() { ++mContentSerial; }
 
     const D3DSURFACE_DESC &getDesc() const { return mDesc; }
     GLuint getTextureId() const { return mTexId; }
     const GLFormatInfo &getFormat() const { return *mGLFormat; }
+    bool isCompressed() const { return mIsCompressed; }
+    D3DGLTextureSurface *getSurface(UINT level) const { return mSurfaces[level]; }
 
-    void initGL();
+    void initGL(DWORD lod);
     void deinitGL();
     void genMipmapGL();
-    void loadTexLevelGL(DWORD level, const RECT &rect, const GLubyte *dataPtr);
+    void clearLevelsGL(GLint first, GLint end);
+    // Gives storage to the levels from lod to end, making lod the base level.
+    void addLevelsGL(DWORD lod, DWORD end);
+    // Frees the levels from oldlod to lod, making lod the base level.
+    void dropLevelsGL(DWORD oldlod, DWORD lod);
+    void evictGL();
+    void loadCompressedGL(const GLFormatInfo *format, const GLubyte *data, DWORD lod, DWORD end);
+    void loadTexLevelGL(DWORD level, const RECT &rect, const GLubyte *dataPtr, GLsizei len, size_t stagedEnd, bool converted);
 
     /*** IUnknown methods ***/
     virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
@@ -92,6 +153,12 @@ class D3DGLTextureSurface : public IDirect3DSurface9 {
     };
     std::atomic<LockType> mLock;
     RECT mLockRegion;
+    DirtyRegionList<RECT> mDirtyRegions;
+    // Used to lock default pool textures, which have no system memory copy.
+    LockBuffer *mLockBuffer;
+    // The parent's content serial when the lock buffer last got, or was
+    // queued to get, the surface's contents.
+    ULONG mReadSerial;
 
     UINT mDataOffset;
     UINT mDataLength;
@@ -101,10 +168,19 @@ public:
     virtual ~D3DGLTextureSurface();
 
     void init(UINT offset, UINT length);
+    void flushUpdates();
+    void reload();
+    // Queues a readback into the lock buffer, if the surface was locked
+    // before, so the next lock doesn't have to wait on the GPU.
+    void queueReadback();
     D3DGLTexture *getParent() { return mParent; }
     const GLFormatInfo &getFormat() const { return mParent->getFormat(); }
     UINT getLevel() const { return mLevel; }
+    UINT getDataOffset() const { return mDataOffset; }
+    // The level's system memory copy, for non-default pool textures.
+    const GLubyte *getSysMemData() const;
     UINT getDataLength() const { return mDataLength; }
+    bool isLocked() const { return mLock != LT_Unlocked; }
 
     /*** IUnknown methods ***/
     virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
@@ -7,6 +7,7 @@
 
 #include "glew.h"
 #include "allocators.hpp"
+#include "dirtyregion.hpp"
 
 
 struct GLFormatInfo;
@@ -23,9 +24,14 @@ class D3DGLTexture3D : public IDirect3DVolumeTexture9 {
     bool mIsCompressed;
     GLuint mTexId;
     std::vector<GLubyte,AlignedAllocator<GLubyte>> mSysMem;
+    // Size of the GL storage, for residency tracking. Volume textures can't
+    // be evicted, so it's counted as fixed.
+    UINT mStorageSize;
 
     D3DBOX mDirtyBox;
     std::atomic<ULONG> mUpdateInProgress;
+    // Set when a volume has regions that need to be uploaded.
+    std::atomic<bool> mDirty;
 
     D3DVOLUME_DESC mDesc;
     std::vector<D3DGLTextureVolume*> mVolumes;
@@ -42,6 +48,7 @@ public:
 
     bool init(const D3DVOLUME_DESC *desc, UINT levels);
     void updateTexture(DWORD level, const D3DBOX &box, const GLubyte *dataPtr);
+    void flushUpdates();
 
     const D3DVOLUME_DESC &getDesc() const { return mDesc; }
     GLuint getTextureId() const { return mTexId; }
@@ -50,7 +57,8 @@ public:
     void initGL();
     void deinitGL();
     void genMipmapGL();
-    void loadTexLevelGL(DWORD level, const D3DBOX &box, const GLubyte *dataPtr);
+    void setLodGL(DWORD lod);
+    void loadTexLevelGL(DWORD level, const D3DBOX &box, const GLubyte *dataPtr, GLsizei len, size_t stagedEnd, bool converted);
 
     /*** IUnknown methods ***/
     virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
@@ -92,6 +100,7 @@ class D3DGLTextureVolume : public IDirect3DVolume9 {
     };
     std::atomic<LockType> mLock;
     D3DBOX mLockRegion;
+    DirtyRegionList<D3DBOX> mDirtyRegions;
 
     UINT mDataOffset;
     UINT mDataLength;
@@ -101,6 +110,7 @@ public:
     virtual ~D3DGLTextureVolume();
 
     void init(UINT offset, UINT length);
+    void flushUpdates();
     D3DGLTexture3D *getParent() { return mParent; }
     const GLFormatInfo &getFormat() const { return mParent->getFormat(); }
     UINT getLevel() const { return mLevel; }
@@ -8,13 +8,16 @@
 
 #include "glew.h"
 #include "allocators.hpp"
+#include "dirtyregion.hpp"
+#include "residency.hpp"
 
 
 struct GLFormatInfo;
 class D3DGLDevice;
 class D3DGLCubeSurface;
+class LockBuffer;
 
-class D3DGLCubeTexture : public IDirect3DCubeTexture9 {
+class D3DGLCubeTexture : public IDirect3DCubeTexture9, public ManagedResource {
     std::atomic<ULONG> mRefCount;
     std::atomic<ULONG> mIfaceCount;
 
@@ -24,9 +27,16 @@ class D3DGLCubeTexture : public IDirect3DCubeTexture9 {
     bool mIsCompressed;
     GLuint mTexId;
     std::vector<GLubyte,AlignedAllocator<GLubyte>> mSysMem;
+    // Size of the GL storage, for residency tracking.
+    UINT mStorageSize;
 
     std::array<RECT,6> mDirtyRect;
     std::atomic<ULONG> mUpdateInProgress;
+    // Set when a surface has regions that need to be uploaded.
+    std::atomic<bool> mDirty;
+    // Bumped whenever the GPU copy changes, so surfaces can tell if their
+    // lock buffer still has the current contents.
+    std::atomic<ULONG> mContentSerial;
 
     D3DSURFACE_DESC mDesc;
     std::vector<std::array<D3DGLCubeSurface*,6>> mSurfaces;
@@ -35,6 +45,10 @@ class D3DGLCubeTexture : public IDirect3DCubeTexture9 {
     void addIface();
     void releaseIface();
 
+    virtual void evict() final;
+    virtual void restore() final;
+    virtual bool isBound() final;
+
     friend class D3DGLCubeSurface;
 
 public:
@@ -43,15 +57,29 @@ public:
 
     bool init(const D3DSURFACE_DESC *desc, UINT levels);
     void updateTexture(DWORD level, GLint facenum, const RECT &rect, const GLubyte *dataPtr);
+    // Uploads a copy of the data for a rect of the face's level. src points
+    // to the rect's first pixel (or block), with rows srcpitch bytes apart.
+    void uploadRect(DWORD level, GLint facenum, const RECT &rect, const GLubyte *src, int srcpitch);
+    void flushUpdates();
+    // Gets and clears the face's dirty rect, in level 0 coordinates.
+    bool takeDirtyRect(GLint facenum, RECT &rect);
+
+    // Called for anything that writes to the GPU copy of a default pool
+    // texture, besides its own locks.
+    void markContentChanged() { ++mContentSerial; }
 
     const D3DSURFACE_DESC &getDesc() const { return mDesc; }
     GLuint getTextureId() const { return mTexId; }
     const GLFormatInfo &getFormat() const { return *mGLFormat; }
+    bool isCompressed() const { return mIsCompressed; }
+    D3DGLCubeSurface *getSurface(UINT level, GLint facenum) const { return mSurfaces[level][facenum]; }
 
     void initGL();
     void deinitGL();
     void genMipmapGL();
-    void loadTexLevelGL(DWORD level, GLint facenum, const RECT &rect, const GLubyte *dataPtr);
+    void setLodGL(DWORD lod);
+    void evictGL();
+    void loadTexLevelGL(DWORD level, GLint facenum, const RECT &rect, const GLubyte *dataPtr, GLsizei len, size_t stagedEnd, bool converted);
 
     /*** IUnknown methods ***/
     virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
@@ -94,6 +122,12 @@ class D3DGLCubeSurface : public IDirect3DSurface9 {
     };
     std::atomic<LockType> mLock;
     RECT mLockRegion;
+    DirtyRegionList<RECT> mDirtyRegions;
+    // Used to lock default pool textures, which have no system memory copy.
+    LockBuffer *mLockBuffer;
+    // The parent's content serial when the lock buffer last got, or was
+    // queued to get, the surface's contents.
+    ULONG mReadSerial;
 
     UINT mDataOffset;
     UINT mDataLength;
@@ -103,11 +137,19 @@ public:
     virtual ~D3DGLCubeSurface();
 
     void init(UINT offset, UINT length);
+    void flushUpdates();
+    void reload();
+    // Queues a readback into the lock buffer, if the surface was locked
+    // before, so the next lock doesn't have to wait on the GPU.
+    void queueReadback();
     D3DGLCubeTexture *getParent() { return mParent; }
     const GLFormatInfo &getFormat() const { return mParent->getFormat(); }
     UINT getLevel() const { return mLevel; }
+    GLint getFaceNum() const { return mFaceNum; }
     GLenum getTarget() const;
     UINT getDataLength() const { return mDataLength; }
+    // The level's system memory copy, for non-default pool textures.
+    const GLubyte *getSysMemData() const;
 
     /*** IUnknown methods ***/
     virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
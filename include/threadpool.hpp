@@ -0,0 +1,75 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <atomic>
+#include <deque>
+#include <vector>
+
+
+/* A pool of worker threads for splitting CPU-heavy work into batches. The
+ * calling thread takes part in the work, and returns once it's all done. One
+ * job runs at a time; other callers wait their turn. Workers also run
+ * standalone tasks in the background, between jobs.
+ */
+class ThreadPool {
+public:
+    // Processes items [start, end).
+    typedef void (*RangeFunc)(UINT start, UINT end, void *userdata);
+
+    class Task {
+    public:
+        virtual ~Task() { }
+        virtual void run() = 0;
+    };
+
+private:
+    std::vector<HANDLE> mThreads;
+
+    // Serializes callers.
+    CRITICAL_SECTION mJobLock;
+
+    CRITICAL_SECTION mLock;
+    CONDITION_VARIABLE mWorkCond;
+    CONDITION_VARIABLE mDoneCond;
+
+    // The current job, set while the caller holds mJobLock.
+    RangeFunc mFunc;
+    void *mUserData;
+    UINT mCount;
+    UINT mBatchSize;
+    std::atomic<UINT> mNextItem;
+    UINT64 mJobId;
+    UINT mNumActive;
+
+    std::deque<Task*> mTasks;
+
+    ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void work(RangeFunc func, void *userdata, UINT count, UINT batch);
+
+    DWORD CALLBACK workerLoop(void);
+    static DWORD CALLBACK thread_func(void *arg)
+    { return reinterpret_cast<ThreadPool*>(arg)->workerLoop(); }
+
+public:
+    // Created on first use. The pool is never destroyed, as its threads can't
+    // be safely stopped while the DLL is detaching.
+    static ThreadPool &get();
+
+    UINT getNumThreads() const { return mThreads.size()+1; }
+
+    // Calls func over count items, in batches of the given size.
+    void run(UINT count, UINT batch, RangeFunc func, void *userdata);
+
+    // Runs the task on a worker thread, and deletes it after. Returns false
+    // without taking the task if there are no workers.
+    bool submit(Task *task);
+};
+
+#endif /* THREADPOOL_HPP */
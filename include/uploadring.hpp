@@ -0,0 +1,59 @@
+#ifndef UPLOADRING_HPP
+#define UPLOADRING_HPP
+
+#include <atomic>
+#include <deque>
+#include <utility>
+
+#include "glew.h"
+
+
+/* A persistently mapped pixel unpack buffer used as a ring for staging
+ * texture uploads. The app thread copies data into reserved space, and the
+ * command thread uploads from the buffer offset and fences it, so the space
+ * can be reused once the GPU is done reading it.
+ */
+class UploadRing {
+    static const size_t sRingSize = 16*1024*1024;
+    static const size_t sRingMask = sRingSize-1;
+    // Uploads bigger than this go through the normal path, to avoid
+    // stalling on the ring.
+    static const size_t sMaxUploadSize = sRingSize/4;
+
+    GLuint mBufferId;
+    GLubyte *mMappedPtr;
+
+    // Reserved up to mWritePos, which is only used by the app thread (with
+    // the queue locked). The command thread releases space up to mFreePos as
+    // the GPU finishes with it.
+    size_t mWritePos;
+    std::atomic<size_t> mFreePos;
+
+    // Command thread only.
+    std::deque<std::pair<GLsync,size_t>> mFences;
+
+    UploadRing(const UploadRing&) = delete;
+    UploadRing& operator=(const UploadRing&) = delete;
+
+public:
+    UploadRing();
+
+    void initGL();
+    void deinitGL();
+
+    GLuint getBufferId() const { return mBufferId; }
+
+    // Reserves space for an upload, returning the mapped pointer to copy to,
+    // the offset in the buffer to upload from, and the ring position to fence
+    // after the upload. Returns nullptr if there isn't enough space. Must be
+    // called with the queue locked, and the upload must be sent before
+    // unlocking.
+    GLubyte *reserve(size_t len, GLintptr &offset, size_t &endpos);
+
+    // Fences the uploads issued so far, which read up to endpos.
+    void fenceGL(size_t endpos);
+    // Releases space from completed uploads.
+    void retireGL();
+};
+
+#endif /* UPLOADRING_HPP */
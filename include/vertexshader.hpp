@@ -4,40 +4,64 @@
 #include <atomic>
 #include <vector>
 #include <map>
+#include <memory>
 #include <d3d9.h>
 
 #include "glew.h"
 #include "commandqueue.hpp"
+#include "shaderbuild.hpp"
 
 
 class D3DGLDevice;
 
-class D3DGLVertexShader : public IDirect3DVertexShader9 {
-    std::atomic<ULONG> mRefCount;
-
+/* The parse results and GL programs shared by the vertex shader objects
+ * created with the same bytecode. Variants are translated on the thread pool,
+ * and their programs started on the command thread as soon as they're
+ * translated, so they're usually done by the time a draw needs them. Each
+ * variant's program is kept, so switching between them is just a pipeline
+ * stage change.
+ */
+class SharedVertexShader {
     D3DGLDevice *mParent;
 
+    std::vector<DWORD> mCode;
+    UINT64 mCodeHash;
+
+    // Commands in flight for this shader, and translations that have yet to
+    // send their start command.
     std::atomic<ULONG> mPendingUpdates;
-    std::atomic<GLuint> mProgram;
+    std::atomic<ULONG> mPendingStarts;
+
+    // App thread state. The sampler mask and attribute locations come from
+    // the first translation, so they're only set once it's done. Attributes
+    // are bound to the same locations in every variant, so the one map
+    // serves them all.
+    std::map<UINT,std::shared_ptr<ShaderTranslation>> mTranslations;
+    bool mHaveInfo;
+    bool mProgramSet;
     UINT mSamplerMask; // Bitmask of used samplers
     UINT mShadowSamplers; // Bitmask of samplers that have a shadow texture format
 
-    std::vector<DWORD> mCode;
-
     std::map<USHORT,GLint> mUsageMap;
 
-public:
-    D3DGLVertexShader(D3DGLDevice *parent);
-    virtual ~D3DGLVertexShader();
+    // Command thread state.
+    std::map<UINT,GLuint> mPrograms;
+    std::map<UINT,PendingProgram> mStartedPrograms;
 
-    bool init(const DWORD *data);
+    static void translationDone(ShaderTranslation *translation, void *userdata);
+    ShaderTranslation *getTranslation(UINT shadowsamplers);
+    void getInfo();
+
+public:
+    SharedVertexShader(D3DGLDevice *parent);
+    ~SharedVertexShader();
 
-    GLuint compileShaderGL(UINT shadowsamplers);
+    bool init(const DWORD *data, size_t count, UINT64 hash);
 
-    void addPendingUpdate() { ++mPendingUpdates; }
-    ULONG getPendingUpdates() { return mPendingUpdates; }
+    void startProgramGL(ShaderTranslation *translation);
+    GLuint compileShaderGL(ShaderTranslation *translation);
+    void startDone() { --mPendingStarts; }
 
-    GLuint getProgram() const { return mProgram; }
     GLint getLocation(BYTE usage, BYTE index) const
     {
         auto idx = mUsageMap.find((usage<<8) | index);
@@ -45,7 +69,30 @@ public:
         return idx->second;
     }
 
+    const std::vector<DWORD> &getCode() const { return mCode; }
+
+    // Sets the program on the pipeline, for the current shadow samplers.
+    // Caller is responsible for holding the device's queue lock.
+    void setProgram(GLuint pipeline);
     void checkShadowSamplers(UINT mask);
+};
+
+class D3DGLVertexShader : public IDirect3DVertexShader9 {
+    std::atomic<ULONG> mRefCount;
+
+    D3DGLDevice *mParent;
+
+    std::shared_ptr<SharedVertexShader> mShared;
+
+public:
+    D3DGLVertexShader(D3DGLDevice *parent);
+    virtual ~D3DGLVertexShader();
+
+    bool init(const DWORD *data);
+
+    GLint getLocation(BYTE usage, BYTE index) const { return mShared->getLocation(usage, index); }
+    void setProgram(GLuint pipeline) { mShared->setProgram(pipeline); }
+    void checkShadowSamplers(UINT mask) { mShared->checkShadowSamplers(mask); }
 
     /*** IUnknown methods ***/
     virtual HRESULT WINAPI QueryInterface(REFIID riid, void **obj) final;
@@ -57,35 +104,35 @@ public:
 };
 
 
-class CompileAndSetVShaderCmd : public Command {
-    D3DGLVertexShader *mTarget;
-    GLuint mPipeline;
-    UINT mShadowSamplers;
+class StartVShaderCmd : public Command {
+    SharedVertexShader *mTarget;
+    ShaderTranslation *mTranslation;
 
 public:
-    CompileAndSetVShaderCmd(D3DGLVertexShader *target, GLuint pipeline, UINT shadowsamplers=0)
-      : mTarget(target), mPipeline(pipeline), mShadowSamplers(shadowsamplers) { }
+    StartVShaderCmd(SharedVertexShader *target, ShaderTranslation *translation)
+      : mTarget(target), mTranslation(translation) { }
 
     virtual ULONG execute()
     {
-        GLuint program = mTarget->compileShaderGL(mShadowSamplers);
-        glUseProgramStages(mPipeline, GL_VERTEX_SHADER_BIT, program);
-        checkGLError();
+        mTarget->startProgramGL(mTranslation);
+        mTarget->startDone();
         return sizeof(*this);
     }
 };
 
-class SetVShaderCmd : public Command {
+class CompileAndSetVShaderCmd : public Command {
+    SharedVertexShader *mTarget;
     GLuint mPipeline;
-    GLuint mProgram;
+    ShaderTranslation *mTranslation;
 
 public:
-    SetVShaderCmd(GLuint pipeline, GLuint program)
-      : mPipeline(pipeline), mProgram(program) { }
+    CompileAndSetVShaderCmd(SharedVertexShader *target, GLuint pipeline, ShaderTranslation *translation)
+      : mTarget(target), mPipeline(pipeline), mTranslation(translation) { }
 
     virtual ULONG execute()
     {
-        glUseProgramStages(mPipeline, GL_VERTEX_SHADER_BIT, mProgram);
+        GLuint program = mTarget->compileShaderGL(mTranslation);
+        glUseProgramStages(mPipeline, GL_VERTEX_SHADER_BIT, program);
         checkGLError();
         return sizeof(*this);
     }
@@ -7,6 +7,7 @@
 
 #include <vector>
 #include <sstream>
+#include <string>
 #include <cstdio>
 
 #include "glew.h"
@@ -23,6 +24,11 @@
 eLogLevel LogLevel = FIXME_;
 FILE *LogFile = stderr;
 eLogLevel GLDebugLevel = NONE_;
+UINT VideoMemOverride = 0;
+bool CompressTextures = false;
+std::string CaptureFile;
+UINT CaptureFrameRate = 60;
+std::string ShaderCacheDir;
 
 
 static CRITICAL_SECTION LogLock;
@@ -127,6 +133,40 @@ BOOL WINAPI DllMain(HINSTANCE hModule, DWORD reason, void */*lpReserved*/)
                     ERR("Invalid log level: %s\n", str);
             }
 
+            str = getenv("D3DGL_VIDMEM");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0')
+                    VideoMemOverride = val;
+                else
+                    ERR("Invalid video memory size: %s\n", str);
+            }
+
+            str = getenv("D3DGL_COMPRESS_TEXTURES");
+            if(str && str[0] != '\0')
+                CompressTextures = (strtoul(str, nullptr, 10) != 0);
+
+            str = getenv("D3DGL_CAPTURE_FILE");
+            if(str && str[0] != '\0')
+                CaptureFile = str;
+
+            str = getenv("D3DGL_CAPTURE_FPS");
+            if(str && str[0] != '\0')
+            {
+                char *end = nullptr;
+                unsigned long val = strtoul(str, &end, 10);
+                if(end && *end == '\0' && val > 0)
+                    CaptureFrameRate = val;
+                else
+                    ERR("Invalid capture frame rate: %s\n", str);
+            }
+
+            str = getenv("D3DGL_SHADER_CACHE");
+            if(str && str[0] != '\0')
+                ShaderCacheDir = str;
+
             TRACE("DLL_PROCESS_ATTACH\n");
             break;
 
@@ -52,12 +52,47 @@ typedef struct {
     int relative_component;
 } SourceArgInfo;
 
+// What's recorded when a shader is parsed with MOJOSHADER_parseIntermediate()...
+typedef enum
+{
+    EMIT_INSTRUCTION,
+    EMIT_PHASE,
+    EMIT_END
+} EmitType;
+
+// ...a snapshot of the parse state that each emitter call looks at, so
+//  MOJOSHADER_emitVariant() can call the emitters again without reparsing.
+typedef struct EmitRecord
+{
+    EmitType type;
+    uint32 opcode;
+    int position;
+    DestArgInfo dest_arg;
+    SourceArgInfo source_args[5];
+    SourceArgInfo predicate_arg;
+    uint32 dwords[4];
+    uint32 instruction_controls;
+    uint32 previous_opcode;
+    int predicated;
+    int loops;
+    int reps;
+    int texm3x2pad_dst0;
+    int texm3x2pad_src0;
+    int texm3x3pad_dst0;
+    int texm3x3pad_src0;
+    int texm3x3pad_dst1;
+    int texm3x3pad_src1;
+} EmitRecord;
+
 struct Profile;  // predeclare.
 
 // Context...this is state that changes as we parse through a shader...
 typedef struct Context {
     int isfail;
     int current_position;
+    MOJOSHADER_malloc malloc;
+    MOJOSHADER_free free;
+    void *malloc_data;
     const uint32 *orig_tokens;
     const uint32 *tokens;
     uint32 tokencount;
@@ -126,8 +161,38 @@ typedef struct Context {
     int texm3x3pad_src0;
     int texm3x3pad_dst1;
     int texm3x3pad_src1;
+    int uniform_float4_base;
+    char *profile_name;
+    int recording;
+    EmitRecord *records;
+    int record_count;
+    int record_space;
 } Context;
 
+
+// What we hand back when we can't allocate the real results. It's static, so
+//  MOJOSHADER_freeParseData() knows to leave it alone.
+static MOJOSHADER_error MOJOSHADER_out_of_mem_error = {
+    "Out of memory", NULL, MOJOSHADER_POSITION_NONE
+};
+
+static MOJOSHADER_parseData MOJOSHADER_out_of_mem_data = {
+    1, &MOJOSHADER_out_of_mem_error, 0, 0, 0, 0, 0, MOJOSHADER_TYPE_UNKNOWN,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+
+// Allocations go through the app's allocator, if it gave us one.
+static inline void *Malloc(Context *ctx, const size_t len)
+{
+    return ctx->malloc((int) len, ctx->malloc_data);
+}
+
+static inline void Free(Context *ctx, void *ptr)
+{
+    ctx->free(ptr, ctx->malloc_data);
+}
+
 // Profile entry points...
 
 // one emit function for each opcode in each profile.
@@ -190,7 +255,7 @@ static int set_output(Context *ctx, Buffer **section)
     // only create output sections on first use.
     if(*section == NULL)
     {
-        *section = buffer_create(256);
+        *section = buffer_create(256, ctx->malloc, ctx->free, ctx->malloc_data);
         if(*section == NULL) return 0;
     }
 
@@ -306,12 +371,12 @@ static inline MOJOSHADER_samplerType cvtD3DToMojoSamplerType(const TextureType t
 
 // Deal with register lists...  !!! FIXME: I sort of hate this.
 
-static void free_reglist(RegisterList *item)
+static void free_reglist(Context *ctx, RegisterList *item)
 {
     while (item != NULL)
     {
         RegisterList *next = item->next;
-        free(item);
+        Free(ctx, item);
         item = next;
     }
 }
@@ -320,7 +385,7 @@ static inline uint32 reg_to_ui32(const RegisterType regtype, const int regnum)
 { return ((uint32)regtype) | (((uint32)regnum)<<16); }
 
 // !!! FIXME: ditch this for a hash table.
-static RegisterList *reglist_insert(RegisterList *prev,
+static RegisterList *reglist_insert(Context *ctx, RegisterList *prev,
                                     const RegisterType regtype,
                                     const int regnum)
 {
@@ -339,7 +404,13 @@ static RegisterList *reglist_insert(RegisterList *prev,
     }
 
     // we need to insert an entry after (prev).
-    item = malloc(sizeof(RegisterList));
+    item = (RegisterList *) Malloc(ctx, sizeof(RegisterList));
+    if(item == NULL)
+    {
+        fail(ctx, "Out of memory");
+        return NULL;
+    }
+
     item->regtype = regtype;
     item->regnum = regnum;
     item->usage = MOJOSHADER_USAGE_UNKNOWN;
@@ -386,7 +457,7 @@ static inline RegisterList *set_used_register(Context *ctx, const RegisterType r
                                               const int regnum, const int written)
 {
     RegisterList *reg = NULL;
-    reg = reglist_insert(&ctx->used_registers, regtype, regnum);
+    reg = reglist_insert(ctx, &ctx->used_registers, regtype, regnum);
     if(reg && written) reg->written = 1;
     return reg;
 }
@@ -400,7 +471,7 @@ static inline int get_used_register(Context *ctx, const RegisterType regtype,
 static inline void set_defined_register(Context *ctx, const RegisterType rtype,
                                         const int regnum)
 {
-    reglist_insert(&ctx->defined_registers, rtype, regnum);
+    reglist_insert(ctx, &ctx->defined_registers, rtype, regnum);
 }
 
 static inline int get_defined_register(Context *ctx, const RegisterType rtype,
@@ -413,7 +484,10 @@ static void add_attribute_register(Context *ctx, const RegisterType rtype,
                                    const int regnum, const MOJOSHADER_usage usage,
                                    const int index, const int writemask, int flags)
 {
-    RegisterList *item = reglist_insert(&ctx->attributes, rtype, regnum);
+    RegisterList *item = reglist_insert(ctx, &ctx->attributes, rtype, regnum);
+    if(item == NULL)
+        return;
+
     item->usage = usage;
     item->index = index;
     item->writemask = writemask;
@@ -432,7 +506,9 @@ static inline void add_sampler(Context *ctx, const int regnum,
 
     // !!! FIXME: make sure it doesn't exist?
     // !!! FIXME:  (ps_1_1 assume we can add it multiple times...)
-    RegisterList *item = reglist_insert(&ctx->samplers, rtype, regnum);
+    RegisterList *item = reglist_insert(ctx, &ctx->samplers, rtype, regnum);
+    if(item == NULL)
+        return;
 
     if (ctx->samplermap != NULL)
     {
@@ -695,7 +771,10 @@ static const char *get_GLSL_varname(Context *ctx, RegisterType rt, int regnum)
 {
     char buf[64];
     get_GLSL_varname_in_buf(ctx, rt, regnum, buf, sizeof(buf));
-    return strdup(buf);
+    char *retval = (char *) Malloc(ctx, strlen(buf) + 1);
+    if(retval != NULL)
+        strcpy(retval, buf);
+    return retval;
 }
 
 
@@ -3369,7 +3448,13 @@ static int parse_args_TEXLD(Context *ctx)
 
 static ConstantsList *alloc_constant_listitem(Context *ctx)
 {
-    ConstantsList *item = malloc(sizeof(ConstantsList));
+    ConstantsList *item = (ConstantsList *) Malloc(ctx, sizeof(ConstantsList));
+    if(item == NULL)
+    {
+        fail(ctx, "Out of memory");
+        return NULL;
+    }
+
     memset(item, 0, sizeof(ConstantsList));
     item->next = ctx->constants;
     ctx->constants = item;
@@ -3392,6 +3477,8 @@ static void state_DEF(Context *ctx)
     else
     {
         ConstantsList *item = alloc_constant_listitem(ctx);
+        if(item == NULL)
+            return;
         item->constant.index = regnum;
         item->constant.type = MOJOSHADER_UNIFORM_FLOAT;
         memcpy(item->constant.value.f, ctx->dwords,
@@ -3414,6 +3501,8 @@ static void state_DEFI(Context *ctx)
     else
     {
         ConstantsList *item = alloc_constant_listitem(ctx);
+        if(item == NULL)
+            return;
         item->constant.index = regnum;
         item->constant.type = MOJOSHADER_UNIFORM_INT;
         memcpy(item->constant.value.i, ctx->dwords,
@@ -3436,6 +3525,8 @@ static void state_DEFB(Context *ctx)
     else
     {
         ConstantsList *item = alloc_constant_listitem(ctx);
+        if(item == NULL)
+            return;
         item->constant.index = regnum;
         item->constant.type = MOJOSHADER_UNIFORM_BOOL;
         item->constant.value.b = ctx->dwords[0] ? 1 : 0;
@@ -3633,7 +3724,12 @@ static void check_call_loop_wrappage(Context *ctx, const int regnum)
 
     const int current_usage = (ctx->loops > 0) ? 1 : -1;
     RegisterList *reg = reglist_find(&ctx->used_registers, REG_TYPE_LABEL, regnum);
-    assert(reg != NULL);
+    if(reg == NULL)
+    {
+        // Only if we ran out of memory adding it.
+        assert(isfail(ctx));
+        return;
+    }
 
     if(reg->misc == 0)
         reg->misc = current_usage;
@@ -4152,6 +4248,70 @@ static const Instruction instructions[] = {
 };
 
 
+// remember what the emitters see, for MOJOSHADER_emitVariant()...
+
+static void record_emit(Context *ctx, const EmitType type, const uint32 opcode)
+{
+    if(ctx->record_count == ctx->record_space)
+    {
+        const int space = (ctx->record_space > 0) ? ctx->record_space*2 : 64;
+        EmitRecord *records = (EmitRecord *) Malloc(ctx, sizeof(EmitRecord) * space);
+        if(records == NULL)
+        {
+            fail(ctx, "Out of memory");
+            return;
+        }
+        if(ctx->records != NULL)
+        {
+            memcpy(records, ctx->records, sizeof(EmitRecord) * ctx->record_count);
+            Free(ctx, ctx->records);
+        }
+        ctx->records = records;
+        ctx->record_space = space;
+    }
+
+    EmitRecord *rec = &ctx->records[ctx->record_count++];
+    rec->type = type;
+    rec->opcode = opcode;
+    rec->position = ctx->current_position;
+    rec->dest_arg = ctx->dest_arg;
+    memcpy(rec->source_args, ctx->source_args, sizeof(rec->source_args));
+    rec->predicate_arg = ctx->predicate_arg;
+    memcpy(rec->dwords, ctx->dwords, sizeof(rec->dwords));
+    rec->instruction_controls = ctx->instruction_controls;
+    rec->previous_opcode = ctx->previous_opcode;
+    rec->predicated = ctx->predicated;
+    rec->loops = ctx->loops;
+    rec->reps = ctx->reps;
+    rec->texm3x2pad_dst0 = ctx->texm3x2pad_dst0;
+    rec->texm3x2pad_src0 = ctx->texm3x2pad_src0;
+    rec->texm3x3pad_dst0 = ctx->texm3x3pad_dst0;
+    rec->texm3x3pad_src0 = ctx->texm3x3pad_src0;
+    rec->texm3x3pad_dst1 = ctx->texm3x3pad_dst1;
+    rec->texm3x3pad_src1 = ctx->texm3x3pad_src1;
+}
+
+static void restore_emit(Context *ctx, const EmitRecord *rec)
+{
+    ctx->current_position = rec->position;
+    ctx->dest_arg = rec->dest_arg;
+    memcpy(ctx->source_args, rec->source_args, sizeof(ctx->source_args));
+    ctx->predicate_arg = rec->predicate_arg;
+    memcpy(ctx->dwords, rec->dwords, sizeof(ctx->dwords));
+    ctx->instruction_controls = rec->instruction_controls;
+    ctx->previous_opcode = rec->previous_opcode;
+    ctx->predicated = rec->predicated;
+    ctx->loops = rec->loops;
+    ctx->reps = rec->reps;
+    ctx->texm3x2pad_dst0 = rec->texm3x2pad_dst0;
+    ctx->texm3x2pad_src0 = rec->texm3x2pad_src0;
+    ctx->texm3x3pad_dst0 = rec->texm3x3pad_dst0;
+    ctx->texm3x3pad_src0 = rec->texm3x3pad_src0;
+    ctx->texm3x3pad_dst1 = rec->texm3x3pad_dst1;
+    ctx->texm3x3pad_src1 = rec->texm3x3pad_src1;
+}
+
+
 // parse various token types...
 
 static int parse_instruction_token(Context *ctx)
@@ -4218,7 +4378,11 @@ static int parse_instruction_token(Context *ctx)
     ctx->instruction_count += instruction->slots;
 
     if(!isfail(ctx))
+    {
+        if(ctx->recording)
+            record_emit(ctx, EMIT_INSTRUCTION, opcode);
         emitter(ctx);  // call the profile's emitter.
+    }
 
     if(ctx->reset_texmpad)
     {
@@ -4333,7 +4497,11 @@ static int parse_end_token(Context *ctx)
         fail(ctx, "end token before end of stream");
 
     if(!isfail(ctx))
+    {
+        if(ctx->recording)
+            record_emit(ctx, EMIT_END, 0);
         ctx->profile->end_emitter(ctx);
+    }
 
     return 1;
 }
@@ -4349,7 +4517,11 @@ static int parse_phase_token(Context *ctx)
         fail(ctx, "phase token only available in 1.4 pixel shaders");
 
     if(!isfail(ctx))
+    {
+        if(ctx->recording)
+            record_emit(ctx, EMIT_PHASE, 0);
         ctx->profile->phase_emitter(ctx);
+    }
 
     return 1;
 }
@@ -4406,10 +4578,20 @@ static Context *build_context(const char *profile,
                               const unsigned int bufsize,
                               const MOJOSHADER_samplerMap *smap,
                               const unsigned int smapcount,
-                              const unsigned int shadowsamp)
+                              const unsigned int shadowsamp,
+                              MOJOSHADER_malloc m, MOJOSHADER_free f, void *d)
 {
-    Context *ctx = malloc(sizeof(Context));
+    if(m == NULL) m = MOJOSHADER_internal_malloc;
+    if(f == NULL) f = MOJOSHADER_internal_free;
+
+    Context *ctx = (Context *) m(sizeof(Context), d);
+    if(ctx == NULL)
+        return NULL;
+
     memset(ctx, 0, sizeof (Context));
+    ctx->malloc = m;
+    ctx->free = f;
+    ctx->malloc_data = d;
 
     ctx->tokens = (const uint32 *) tokenbuf;
     ctx->orig_tokens = (const uint32 *) tokenbuf;
@@ -4426,17 +4608,17 @@ static Context *build_context(const char *profile,
     ctx->texm3x3pad_dst1 = -1;
     ctx->texm3x3pad_src1 = -1;
 
-    ctx->errors = errorlist_create();
+    ctx->errors = errorlist_create(m, f, d);
     if(ctx->errors == NULL)
     {
-        free(ctx);
+        f(ctx, d);
         return NULL;
     }
 
     if(!set_output(ctx, &ctx->mainline))
     {
         errorlist_destroy(ctx->errors);
-        free(ctx);
+        f(ctx, d);
         return NULL;
     }
 
@@ -4451,12 +4633,12 @@ static Context *build_context(const char *profile,
 }
 
 
-static void free_constants_list(ConstantsList *item)
+static void free_constants_list(Context *ctx, ConstantsList *item)
 {
     while(item != NULL)
     {
         ConstantsList *next = item->next;
-        free(item);
+        Free(ctx, item);
         item = next;
     }
 }
@@ -4473,14 +4655,18 @@ static void destroy_context(Context *ctx)
     buffer_destroy(ctx->mainline_intro);
     buffer_destroy(ctx->mainline);
     buffer_destroy(ctx->ignore);
-    free_constants_list(ctx->constants);
-    free_reglist(ctx->used_registers.next);
-    free_reglist(ctx->defined_registers.next);
-    free_reglist(ctx->uniforms.next);
-    free_reglist(ctx->attributes.next);
-    free_reglist(ctx->samplers.next);
+    free_constants_list(ctx, ctx->constants);
+    free_reglist(ctx, ctx->used_registers.next);
+    free_reglist(ctx, ctx->defined_registers.next);
+    free_reglist(ctx, ctx->uniforms.next);
+    free_reglist(ctx, ctx->attributes.next);
+    free_reglist(ctx, ctx->samplers.next);
     errorlist_destroy(ctx->errors);
-    free(ctx);
+    if(ctx->records != NULL)
+        Free(ctx, ctx->records);
+    if(ctx->profile_name != NULL)
+        Free(ctx, ctx->profile_name);
+    Free(ctx, ctx);
 }
 
 
@@ -4505,7 +4691,12 @@ static inline const char *alloc_varname(Context *ctx, const RegisterList *reg)
 static MOJOSHADER_constant *build_constants(Context *ctx)
 {
     const size_t len = sizeof(MOJOSHADER_constant) * ctx->constant_count;
-    MOJOSHADER_constant *retval = malloc(len);
+    MOJOSHADER_constant *retval = (MOJOSHADER_constant *) Malloc(ctx, len);
+    if(retval == NULL)
+    {
+        fail(ctx, "Out of memory");
+        return NULL;
+    }
 
     ConstantsList *item = ctx->constants;
     int i;
@@ -4527,7 +4718,12 @@ static MOJOSHADER_constant *build_constants(Context *ctx)
 static MOJOSHADER_sampler *build_samplers(Context *ctx)
 {
     const size_t len = sizeof(MOJOSHADER_sampler) * ctx->sampler_count;
-    MOJOSHADER_sampler *retval = malloc(len);
+    MOJOSHADER_sampler *retval = (MOJOSHADER_sampler *) Malloc(ctx, len);
+    if(retval == NULL)
+    {
+        fail(ctx, "Out of memory");
+        return NULL;
+    }
 
     RegisterList *item = ctx->samplers.next;
     int i;
@@ -4562,7 +4758,13 @@ static MOJOSHADER_attribute *build_attributes(Context *ctx, int *_count)
     }
 
     const size_t len = sizeof (MOJOSHADER_attribute) * ctx->attribute_count;
-    MOJOSHADER_attribute *retval = malloc(len);
+    MOJOSHADER_attribute *retval = (MOJOSHADER_attribute *) Malloc(ctx, len);
+    if(retval == NULL)
+    {
+        fail(ctx, "Out of memory");
+        *_count = 0;
+        return NULL;
+    }
     memset(retval, 0, len);
 
     RegisterList *item = ctx->attributes.next;
@@ -4630,7 +4832,13 @@ static MOJOSHADER_attribute *build_outputs(Context *ctx, int *_count)
     }
 
     const size_t len = sizeof(MOJOSHADER_attribute) * ctx->attribute_count;
-    MOJOSHADER_attribute *retval = malloc(len);
+    MOJOSHADER_attribute *retval = (MOJOSHADER_attribute *) Malloc(ctx, len);
+    if(retval == NULL)
+    {
+        fail(ctx, "Out of memory");
+        *_count = 0;
+        return NULL;
+    }
     memset(retval, 0, len);
 
     RegisterList *item = ctx->attributes.next;
@@ -4683,8 +4891,14 @@ static MOJOSHADER_parseData *build_parsedata(Context *ctx)
     int attribute_count = 0;
     int output_count = 0;
 
-    retval = malloc(sizeof(MOJOSHADER_parseData));
+    retval = (MOJOSHADER_parseData *) Malloc(ctx, sizeof(MOJOSHADER_parseData));
+    if(retval == NULL)
+        return &MOJOSHADER_out_of_mem_data;
+
     memset(retval, '\0', sizeof (MOJOSHADER_parseData));
+    retval->malloc = ctx->malloc;
+    retval->free = ctx->free;
+    retval->malloc_data = ctx->malloc_data;
 
     if(!isfail(ctx)) output = build_output(ctx, &output_len);
     if(!isfail(ctx)) constants = build_constants(ctx);
@@ -4700,28 +4914,39 @@ static MOJOSHADER_parseData *build_parsedata(Context *ctx)
     {
         int i;
 
-        free(output);
-        free(constants);
+        if(output != NULL)
+            Free(ctx, output);
+        if(constants != NULL)
+            Free(ctx, constants);
 
         if(attributes != NULL)
         {
             for(i = 0; i < attribute_count; i++)
-                free((void*)attributes[i].name);
-            free(attributes);
+            {
+                if(attributes[i].name != NULL)
+                    Free(ctx, (void*)attributes[i].name);
+            }
+            Free(ctx, attributes);
         }
 
         if(outputs != NULL)
         {
             for(i = 0; i < output_count; i++)
-                free((void*)outputs[i].name);
-            free(outputs);
+            {
+                if(outputs[i].name != NULL)
+                    Free(ctx, (void*)outputs[i].name);
+            }
+            Free(ctx, outputs);
         }
 
         if(samplers != NULL)
         {
             for(i = 0; i < ctx->sampler_count; i++)
-                free((void*)samplers[i].name);
-            free(samplers);
+            {
+                if(samplers[i].name != NULL)
+                    Free(ctx, (void*)samplers[i].name);
+            }
+            Free(ctx, samplers);
         }
     }
     else
@@ -4866,6 +5091,8 @@ static void process_definitions(Context *ctx)
         ctx->uniform_bool_count = Max(ctx->uniform_bool_count, 16);
 
     // ...and samplers...
+    // (texbem samplers add uniforms as they're emitted.)
+    ctx->uniform_float4_base = ctx->uniform_float4_count;
     for(item = ctx->samplers.next; item != NULL; item = item->next)
     {
         ctx->sampler_count++;
@@ -4891,25 +5118,13 @@ static void process_definitions(Context *ctx)
 //  attempts to read from a temporary register that has not been written by a
 //  previous instruction."  (true for ps_1_*, maybe others). Check this.
 
-const MOJOSHADER_parseData *MOJOSHADER_parse(const char *profile,
-                                             const unsigned char *tokenbuf,
-                                             const unsigned int bufsize,
-                                             const MOJOSHADER_samplerMap *smap,
-                                             const unsigned int smapcount,
-                                             const unsigned int shadowsamp)
+static void parse_tokens(Context *ctx, const char *profile)
 {
-    MOJOSHADER_parseData *retval = NULL;
-    Context *ctx = NULL;
     int rc = 0;
     int failed = 0;
 
-    ctx = build_context(profile, tokenbuf, bufsize, smap, smapcount, shadowsamp);
     if(isfail(ctx))
-    {
-        retval = build_parsedata(ctx);
-        destroy_context(ctx);
-        return retval;
-    }
+        return;
 
     // Version token always comes first.
     ctx->current_position = 0;
@@ -4918,11 +5133,7 @@ const MOJOSHADER_parseData *MOJOSHADER_parse(const char *profile,
     // drop out now if this definitely isn't bytecode. Saves lots of
     //  meaningless errors flooding through.
     if(rc < 0)
-    {
-        retval = build_parsedata(ctx);
-        destroy_context(ctx);
-        return retval;
-    }
+        return;
 
     if((uint32)rc > ctx->tokencount)
     {
@@ -4976,44 +5187,243 @@ const MOJOSHADER_parseData *MOJOSHADER_parse(const char *profile,
         ctx->profile->finalize_emitter(ctx);
 
     ctx->isfail = failed;
+}
+
+const MOJOSHADER_parseData *MOJOSHADER_parse(const char *profile,
+                                             const unsigned char *tokenbuf,
+                                             const unsigned int bufsize,
+                                             const MOJOSHADER_samplerMap *smap,
+                                             const unsigned int smapcount,
+                                             const unsigned int shadowsamp,
+                                             MOJOSHADER_malloc m,
+                                             MOJOSHADER_free f,
+                                             void *d)
+{
+    MOJOSHADER_parseData *retval = NULL;
+    Context *ctx = NULL;
+
+    ctx = build_context(profile, tokenbuf, bufsize, smap, smapcount, shadowsamp, m, f, d);
+    if(ctx == NULL)
+        return &MOJOSHADER_out_of_mem_data;
+
+    parse_tokens(ctx, profile);
+
     retval = build_parsedata(ctx);
     destroy_context(ctx);
     return retval;
 }
 
 
+struct MOJOSHADER_intermediate
+{
+    Context *ctx;
+};
+
+const MOJOSHADER_parseData *MOJOSHADER_parseIntermediate(const char *profile,
+                                             const unsigned char *tokenbuf,
+                                             const unsigned int bufsize,
+                                             const MOJOSHADER_samplerMap *smap,
+                                             const unsigned int smapcount,
+                                             const unsigned int shadowsamp,
+                                             MOJOSHADER_malloc m,
+                                             MOJOSHADER_free f,
+                                             void *d,
+                                             MOJOSHADER_intermediate **intermediate)
+{
+    MOJOSHADER_parseData *retval = NULL;
+    Context *ctx = NULL;
+
+    *intermediate = NULL;
+
+    ctx = build_context(profile, tokenbuf, bufsize, smap, smapcount, shadowsamp, m, f, d);
+    if(ctx == NULL)
+        return &MOJOSHADER_out_of_mem_data;
+
+    ctx->recording = 1;
+    parse_tokens(ctx, profile);
+
+    retval = build_parsedata(ctx);
+    if(retval->error_count == 0 && retval->output != NULL)
+    {
+        // The start emitter wants the profile as it was asked for.
+        ctx->profile_name = (char *) Malloc(ctx, strlen(profile) + 1);
+        if(ctx->profile_name != NULL)
+        {
+            strcpy(ctx->profile_name, profile);
+            *intermediate = (MOJOSHADER_intermediate *)
+                Malloc(ctx, sizeof(MOJOSHADER_intermediate));
+        }
+        if(*intermediate != NULL)
+        {
+            // Only the parser looks at the sampler map, and it's not ours.
+            ctx->samplermap = NULL;
+            ctx->samplermap_count = 0;
+            ctx->recording = 0;
+            (*intermediate)->ctx = ctx;
+            return retval;
+        }
+    }
+
+    destroy_context(ctx);
+    return retval;
+}
+
+
+// The emitting half of process_definitions(). The register lists are
+//  already sorted out from the first time through.
+static void emit_definitions(Context *ctx)
+{
+    RegisterList *item;
+
+    for(item = ctx->used_registers.next; item != NULL; item = item->next)
+    {
+        if(get_defined_register(ctx, item->regtype, item->regnum))
+            continue;
+
+        switch(item->regtype)
+        {
+            case REG_TYPE_ADDRESS:
+            case REG_TYPE_PREDICATE:
+            case REG_TYPE_TEMP:
+            case REG_TYPE_LOOP:
+            case REG_TYPE_LABEL:
+                ctx->profile->global_emitter(ctx, item->regtype, item->regnum);
+                break;
+            default:
+                break;
+        }
+    }
+
+    for(item = ctx->uniforms.next; item != NULL; item = item->next)
+        ctx->profile->uniform_emitter(ctx, item->regtype, item->regnum);
+
+    ctx->uniform_float4_count = ctx->uniform_float4_base;
+    for(item = ctx->samplers.next; item != NULL; item = item->next)
+        ctx->profile->sampler_emitter(ctx, item->regnum, (TextureType)item->index,
+                                      item->misc != 0);
+
+    for(item = ctx->attributes.next; item != NULL; item = item->next)
+        ctx->profile->attribute_emitter(ctx, item->regtype, item->regnum,
+                                        item->usage, item->index,
+                                        item->writemask, item->misc);
+}
+
+const MOJOSHADER_parseData *MOJOSHADER_emitVariant(MOJOSHADER_intermediate *intermediate,
+                                                   const unsigned int shadowsamp)
+{
+    Context *ctx = intermediate->ctx;
+    Buffer **buffers[] = {
+        &ctx->preflight, &ctx->globals, &ctx->helpers, &ctx->subroutines,
+        &ctx->mainline_intro, &ctx->mainline, &ctx->ignore
+    };
+    int failed = 0;
+    size_t i;
+    int j;
+
+    // Start over with empty output. Everything else the emitters look at is
+    //  either done being built, or comes from the records.
+    for(i = 0; i < STATICARRAYLEN(buffers); i++)
+    {
+        if(*buffers[i] != NULL)
+            buffer_empty(*buffers[i]);
+    }
+    ctx->output = NULL;
+    ctx->output_stack_len = 0;
+    ctx->indent = 0;
+    ctx->glsl_generated_lit_helper = 0;
+    ctx->glsl_generated_texldd_setup = 0;
+    ctx->glsl_generated_texm3x3spec_helper = 0;
+    ctx->shadow_samplers = shadowsamp;
+    ctx->isfail = 0;
+
+    if(!set_output(ctx, &ctx->mainline))
+        fail(ctx, "Out of memory");
+    else
+    {
+        ctx->current_position = 0;
+        ctx->profile->start_emitter(ctx, ctx->profile_name);
+    }
+
+    for(j = 0; j < ctx->record_count; j++)
+    {
+        const EmitRecord *rec = &ctx->records[j];
+
+        if(isfail(ctx))
+        {
+            failed = 1;
+            ctx->isfail = 0;
+        }
+
+        restore_emit(ctx, rec);
+        if(rec->type == EMIT_INSTRUCTION)
+            instructions[rec->opcode].emitter[ctx->profileid](ctx);
+        else if(rec->type == EMIT_PHASE)
+            ctx->profile->phase_emitter(ctx);
+        else if(rec->type == EMIT_END)
+            ctx->profile->end_emitter(ctx);
+    }
+
+    ctx->current_position = MOJOSHADER_POSITION_AFTER;
+    failed |= isfail(ctx);
+
+    if(!failed)
+    {
+        emit_definitions(ctx);
+        failed = isfail(ctx);
+    }
+
+    if(!failed)
+        ctx->profile->finalize_emitter(ctx);
+
+    ctx->isfail = failed;
+    return build_parsedata(ctx);
+}
+
+
+void MOJOSHADER_freeIntermediate(MOJOSHADER_intermediate *intermediate)
+{
+    if(intermediate == NULL) return;  // no-op.
+    Context *ctx = intermediate->ctx;
+    Free(ctx, intermediate);
+    destroy_context(ctx);
+}
+
+
 void MOJOSHADER_freeParseData(const MOJOSHADER_parseData *_data)
 {
     MOJOSHADER_parseData *data = (MOJOSHADER_parseData*)_data;
-    if(data == NULL) return;  // no-op.
+    if((data == NULL) || (data == &MOJOSHADER_out_of_mem_data))
+        return;  // no-op.
 
+    MOJOSHADER_free f = (data->free == NULL) ? MOJOSHADER_internal_free : data->free;
+    void *d = data->malloc_data;
     int i;
 
-    // we don't free(data->profile), because that's internal static data.
+    // we don't f(data->profile), because that's internal static data.
 
-    free((void*)data->output);
-    free((void*)data->constants);
+    f((void*)data->output, d);
+    f((void*)data->constants, d);
 
     for(i = 0; i < data->error_count; i++)
     {
-        free((void*)data->errors[i].error);
-        free((void*)data->errors[i].filename);
+        f((void*)data->errors[i].error, d);
+        f((void*)data->errors[i].filename, d);
     }
-    free((void*)data->errors);
+    f((void*)data->errors, d);
 
     for(i = 0; i < data->attribute_count; i++)
-        free((void*)data->attributes[i].name);
-    free((void*)data->attributes);
+        f((void*)data->attributes[i].name, d);
+    f((void*)data->attributes, d);
 
     for(i = 0; i < data->output_count; i++)
-        free((void*)data->outputs[i].name);
-    free((void*)data->outputs);
+        f((void*)data->outputs[i].name, d);
+    f((void*)data->outputs, d);
 
     for(i = 0; i < data->sampler_count; i++)
-        free((void*)data->samplers[i].name);
-    free((void*)data->samplers);
+        f((void*)data->samplers[i].name, d);
+    f((void*)data->samplers, d);
 
-    free(data);
+    f(data, d);
 }
 
 
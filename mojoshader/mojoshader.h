@@ -36,6 +36,17 @@ extern "C" {
  */
 int MOJOSHADER_version(void);
 
+/*
+ * These allocators work just like the C runtime's malloc() and free()
+ *  (in fact, they probably use malloc() and free() internally if you don't
+ *  specify your own allocator, but don't rely on that behaviour).
+ * (data) is the pointer you supplied when specifying these allocator
+ *  callbacks, in case you need instance-specific data...it is passed through
+ *  to your allocator unmolested, and can be NULL if you like.
+ */
+typedef void *(*MOJOSHADER_malloc)(int bytes, void *data);
+typedef void (*MOJOSHADER_free)(void *ptr, void *data);
+
 /*
  * These are enum values, but they also can be used in bitmasks, so we can
  *  test if an opcode is acceptable: if (op->shader_types & ourtype) {} ...
@@ -380,6 +391,21 @@ typedef struct MOJOSHADER_parseData
      * This can be NULL on error or if (output_count) is zero.
      */
     MOJOSHADER_attribute *outputs;
+
+    /*
+     * This is the malloc implementation you passed to MOJOSHADER_parse().
+     */
+    MOJOSHADER_malloc malloc;
+
+    /*
+     * This is the free implementation you passed to MOJOSHADER_parse().
+     */
+    MOJOSHADER_free free;
+
+    /*
+     * This is the pointer you passed as opaque data for your allocator.
+     */
+    void *malloc_data;
 } MOJOSHADER_parseData;
 
 
@@ -473,6 +499,13 @@ int MOJOSHADER_maxShaderModel(const char *profile);
  *  risk a buffer overflow if you have corrupt data, etc. Supply the value
  *  if you can.
  *
+ * As parsing requires some memory to be allocated, you may provide a custom
+ *  allocator to this function, which will be used to allocate/free memory.
+ *  They function just like malloc() and free(). We do not use realloc().
+ *  If you don't care, pass NULL in for the allocator functions. If your
+ *  allocator needs instance-specific data, you may supply it with the
+ *  (d) parameter. This pointer is passed as-is to your (m) and (f) functions.
+ *
  * This function is thread safe, so long as (m) and (f) are too, and that
  *  (tokenbuf) remains intact for the duration of the call. This allows you
  *  to parse several shaders on separate CPU cores at the same time.
@@ -482,7 +515,10 @@ const MOJOSHADER_parseData *MOJOSHADER_parse(const char *profile,
                                              const unsigned int bufsize,
                                              const MOJOSHADER_samplerMap *smap,
                                              const unsigned int smapcount,
-                                             const unsigned int shadowsamp);
+                                             const unsigned int shadowsamp,
+                                             MOJOSHADER_malloc m,
+                                             MOJOSHADER_free f,
+                                             void *d);
 
 /*
  * Call this to dispose of parsing results when you are done with them.
@@ -495,6 +531,55 @@ const MOJOSHADER_parseData *MOJOSHADER_parse(const char *profile,
  */
 void MOJOSHADER_freeParseData(const MOJOSHADER_parseData *data);
 
+
+/*
+ * Parsing once, emitting many times.
+ *
+ * Output that only differs by (shadowsamp) doesn't need the bytecode parsed
+ *  again. MOJOSHADER_parseIntermediate() works like MOJOSHADER_parse(), but
+ *  also hands back what MOJOSHADER_emitVariant() needs to build the output
+ *  for other shadow samplers, by running only the profile's emitters over
+ *  what the parser found.
+ *
+ * (*intermediate) is set to NULL if the shader didn't parse cleanly. If it
+ *  isn't, (tokenbuf) must stay intact until it's passed to
+ *  MOJOSHADER_freeIntermediate(). (smap) is only used during the call.
+ *
+ * The returned MOJOSHADER_parseData is separate from the intermediate, and
+ *  is freed with MOJOSHADER_freeParseData() as usual. The intermediate, and
+ *  the results of MOJOSHADER_emitVariant(), use the same allocator.
+ */
+typedef struct MOJOSHADER_intermediate MOJOSHADER_intermediate;
+
+const MOJOSHADER_parseData *MOJOSHADER_parseIntermediate(const char *profile,
+                                             const unsigned char *tokenbuf,
+                                             const unsigned int bufsize,
+                                             const MOJOSHADER_samplerMap *smap,
+                                             const unsigned int smapcount,
+                                             const unsigned int shadowsamp,
+                                             MOJOSHADER_malloc m,
+                                             MOJOSHADER_free f,
+                                             void *d,
+                                             MOJOSHADER_intermediate **intermediate);
+
+/*
+ * Emits the shader parsed into (intermediate) again, with another set of
+ *  shadow samplers. The results are the same as MOJOSHADER_parse() would
+ *  give with the same bytecode and (shadowsamp).
+ *
+ * This function is NOT thread safe for the same (intermediate); it reuses
+ *  the intermediate's output buffers. Different intermediates can be used
+ *  on separate threads at the same time.
+ */
+const MOJOSHADER_parseData *MOJOSHADER_emitVariant(MOJOSHADER_intermediate *intermediate,
+                                                   const unsigned int shadowsamp);
+
+/*
+ * Call this to dispose of an intermediate when you are done emitting from
+ *  it. Passing a NULL here is a safe no-op.
+ */
+void MOJOSHADER_freeIntermediate(MOJOSHADER_intermediate *intermediate);
+
 #ifdef __cplusplus
 }
 #endif
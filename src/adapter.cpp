@@ -480,6 +480,9 @@ D3DAdapter::D3DAdapter(UINT adapter_num)
   , mVendorId(HW_VENDOR_SOFTWARE)
   , mDeviceId(CARD_WINE)
   , mDescription("Unknown Device")
+  , mVideoMemory(128)
+  , mDecodeS3TC(false)
+  , mDecodeRGTC(false)
 {
     memset(&mCaps, 0, sizeof(mCaps));
 }
@@ -1092,6 +1095,7 @@ void D3DAdapter::init_ids()
                 if(gpu_description_table[i].card == mDeviceId)
                 {
                     mDescription = gpu_description_table[i].description;
+                    mVideoMemory = gpu_description_table[i].vidmem;
                     break;
                 }
                 ++i;
@@ -1105,8 +1109,37 @@ void D3DAdapter::init_ids()
     WARN("Failed to match a GPU, using %04x:%04x for adapter %u", mVendorId, mDeviceId, mOrdinal);
 }
 
+void D3DAdapter::init_vidmem()
+{
+    if(VideoMemOverride)
+        mVideoMemory = VideoMemOverride;
+    else if(GLEW_NVX_gpu_memory_info)
+    {
+        // Reported in KB.
+        GLint vidmem = 0;
+        glGetIntegerv(GL_GPU_MEMORY_INFO_DEDICATED_VIDMEM_NVX, &vidmem);
+        if(vidmem > 0)
+            mVideoMemory = vidmem / 1024;
+    }
+    else if(GLEW_ATI_meminfo)
+    {
+        // Only the free memory is available, which is close enough before
+        // anything is allocated. Also reported in KB.
+        GLint meminfo[4] = { 0, 0, 0, 0 };
+        glGetIntegerv(GL_TEXTURE_FREE_MEMORY_ATI, meminfo);
+        if(meminfo[0] > 0)
+            mVideoMemory = meminfo[0] / 1024;
+    }
+    TRACE("Using %uMB of video memory for adapter %u\n", mVideoMemory, mOrdinal);
+}
+
 void D3DAdapter::init_usage()
 {
+    mDecodeS3TC = !GLEW_EXT_texture_compression_s3tc;
+    mDecodeRGTC = !GLEW_VERSION_3_0 && !GLEW_ARB_texture_compression_rgtc;
+    if(mDecodeS3TC) WARN("GL_EXT_texture_compression_s3tc not supported, DXTn textures will be decoded\n");
+    if(mDecodeRGTC) WARN("GL_ARB_texture_compression_rgtc not supported, ATIn textures will be decoded\n");
+
     if(!GLEW_VERSION_4_3 && !GLEW_ARB_internalformat_query2)
     {
         ERR("GL4.3 nor GL_ARB_internalformat_query2 are supported! Lots of checks will fail...\n");
@@ -1115,33 +1148,39 @@ void D3DAdapter::init_usage()
 
     ResTypeFormatPair typefmt;
     DWORD usage;
-    for(const auto &format : gFormatList)
+    for(const auto &entry : gFormatList)
     {
+        const GLFormatInfo *decoded = getDecodedFormat((D3DFORMAT)entry.first);
+        const GLFormatInfo &info = decoded ? *decoded : entry.second;
         GLint res;
 
         // SURFACE is either a plain surface (PBO), or a RenderTarget/DepthStencil surface (Renderbuffer)
-        typefmt = std::make_pair(D3DRTYPE_SURFACE, (D3DFORMAT)format.first);
+        typefmt = std::make_pair(D3DRTYPE_SURFACE, (D3DFORMAT)entry.first);
         usage = D3DUSAGE_DYNAMIC;
-        if((format.second.buffermask&GL_COLOR_BUFFER_BIT))
+        if(info.conversion)
+        {
+            // Converted formats can only be sampled from.
+        }
+        else if((info.buffermask&GL_COLOR_BUFFER_BIT))
         {
             res = GL_FALSE;
-            glGetInternalformativ(GL_RENDERBUFFER, format.second.internalformat, GL_FRAMEBUFFER_RENDERABLE, 1, &res);
+            glGetInternalformativ(GL_RENDERBUFFER, info.internalformat, GL_FRAMEBUFFER_RENDERABLE, 1, &res);
             if(res == GL_FULL_SUPPORT) usage |= D3DUSAGE_RENDERTARGET;
 
             res = GL_FALSE;
-            glGetInternalformativ(GL_RENDERBUFFER, format.second.internalformat, GL_FRAMEBUFFER_BLEND, 1, &res);
+            glGetInternalformativ(GL_RENDERBUFFER, info.internalformat, GL_FRAMEBUFFER_BLEND, 1, &res);
             if(res == GL_FULL_SUPPORT) usage |= D3DUSAGE_QUERY_POSTPIXELSHADER_BLENDING;
         }
         else
         {
             res = GL_FALSE;
-            glGetInternalformativ(GL_RENDERBUFFER, format.second.internalformat, GL_FRAMEBUFFER_RENDERABLE, 1, &res);
+            glGetInternalformativ(GL_RENDERBUFFER, info.internalformat, GL_FRAMEBUFFER_RENDERABLE, 1, &res);
             if(res == GL_FULL_SUPPORT) usage |= D3DUSAGE_DEPTHSTENCIL;
         }
         mUsage.insert(std::make_pair(typefmt, usage));
 
         // VOLUME is a 3D plain surface (PBO). Not valid as a RenderTarget or DepthStencil surface.
-        typefmt = std::make_pair(D3DRTYPE_VOLUME, (D3DFORMAT)format.first);
+        typefmt = std::make_pair(D3DRTYPE_VOLUME, (D3DFORMAT)entry.first);
         usage = D3DUSAGE_DYNAMIC;
         mUsage.insert(std::make_pair(typefmt, usage));
 
@@ -1158,43 +1197,47 @@ void D3DAdapter::init_usage()
         };
         for(const auto &textype : texture_types)
         {
-            typefmt = std::make_pair(textype.rtype, (D3DFORMAT)format.first);
+            typefmt = std::make_pair(textype.rtype, (D3DFORMAT)entry.first);
             usage = D3DUSAGE_DYNAMIC | D3DUSAGE_QUERY_WRAPANDMIP;
 
             res = GL_FALSE;
-            glGetInternalformativ(textype.gltype, format.second.internalformat, GL_MANUAL_GENERATE_MIPMAP, 1, &res);
+            glGetInternalformativ(textype.gltype, info.internalformat, GL_MANUAL_GENERATE_MIPMAP, 1, &res);
             if(res == GL_FULL_SUPPORT) usage |= D3DUSAGE_AUTOGENMIPMAP;
 
             res = GL_FALSE;
-            glGetInternalformativ(textype.gltype, format.second.internalformat, GL_FILTER, 1, &res);
+            glGetInternalformativ(textype.gltype, info.internalformat, GL_FILTER, 1, &res);
             if(res != GL_FALSE) usage |= D3DUSAGE_QUERY_FILTER;
 
             res = GL_FALSE;
-            glGetInternalformativ(textype.gltype, format.second.internalformat, GL_VERTEX_TEXTURE, 1, &res);
+            glGetInternalformativ(textype.gltype, info.internalformat, GL_VERTEX_TEXTURE, 1, &res);
             if(res == GL_FULL_SUPPORT) usage |= D3DUSAGE_QUERY_VERTEXTEXTURE;
 
             res = GL_FALSE;
-            glGetInternalformativ(textype.gltype, format.second.internalformat, GL_SRGB_DECODE_ARB, 1, &res);
+            glGetInternalformativ(textype.gltype, info.internalformat, GL_SRGB_DECODE_ARB, 1, &res);
             if(res != GL_FALSE) usage |= D3DUSAGE_QUERY_SRGBREAD;
 
-            if((format.second.buffermask&GL_COLOR_BUFFER_BIT))
+            if(info.conversion)
+            {
+                // Converted formats can't be rendered to.
+            }
+            else if((info.buffermask&GL_COLOR_BUFFER_BIT))
             {
                 res = GL_FALSE;
-                glGetInternalformativ(textype.gltype, format.second.internalformat, GL_FRAMEBUFFER_RENDERABLE, 1, &res);
+                glGetInternalformativ(textype.gltype, info.internalformat, GL_FRAMEBUFFER_RENDERABLE, 1, &res);
                 if(res == GL_FULL_SUPPORT) usage |= D3DUSAGE_RENDERTARGET;
 
                 res = GL_FALSE;
-                glGetInternalformativ(textype.gltype, format.second.internalformat, GL_FRAMEBUFFER_BLEND, 1, &res);
+                glGetInternalformativ(textype.gltype, info.internalformat, GL_FRAMEBUFFER_BLEND, 1, &res);
                 if(res == GL_FULL_SUPPORT) usage |= D3DUSAGE_QUERY_POSTPIXELSHADER_BLENDING;
 
                 res = GL_FALSE;
-                glGetInternalformativ(textype.gltype, format.second.internalformat, GL_SRGB_WRITE, 1, &res);
+                glGetInternalformativ(textype.gltype, info.internalformat, GL_SRGB_WRITE, 1, &res);
                 if(res == GL_FULL_SUPPORT) usage |= D3DUSAGE_QUERY_SRGBWRITE;
             }
             else
             {
                 res = GL_FALSE;
-                glGetInternalformativ(textype.gltype, format.second.internalformat, GL_FRAMEBUFFER_RENDERABLE, 1, &res);
+                glGetInternalformativ(textype.gltype, info.internalformat, GL_FRAMEBUFFER_RENDERABLE, 1, &res);
                 if(res == GL_FULL_SUPPORT) usage |= D3DUSAGE_DEPTHSTENCIL;
             }
             mUsage.insert(std::make_pair(typefmt, usage));
@@ -1202,18 +1245,19 @@ void D3DAdapter::init_usage()
 
         UINT sample_count_mask = 0;
         res = 0;
-        glGetInternalformativ(GL_RENDERBUFFER, format.second.internalformat, GL_NUM_SAMPLE_COUNTS, 1, &res);
+        if(!info.conversion)
+            glGetInternalformativ(GL_RENDERBUFFER, info.internalformat, GL_NUM_SAMPLE_COUNTS, 1, &res);
         if(res > 0)
         {
             std::vector<GLint> sample_counts(res);
-            glGetInternalformativ(GL_RENDERBUFFER, format.second.internalformat, GL_SAMPLES, sample_counts.size(), sample_counts.data());
+            glGetInternalformativ(GL_RENDERBUFFER, info.internalformat, GL_SAMPLES, sample_counts.size(), sample_counts.data());
             for(GLint count : sample_counts)
             {
                 if(count > 1 && count < 34)
                     sample_count_mask |= 1<<(count-2);
             }
             if(sample_count_mask)
-                mSamples[(D3DFORMAT)format.first] = sample_count_mask;
+                mSamples[(D3DFORMAT)entry.first] = sample_count_mask;
         }
     }
 
@@ -1278,6 +1322,7 @@ bool D3DAdapter::init()
         init_limits();
         init_caps();
         init_ids();
+        init_vidmem();
         init_usage();
         retval = true;
     }
@@ -1301,6 +1346,21 @@ DWORD D3DAdapter::getUsage(DWORD restype, D3DFORMAT format) const
     return 0;
 }
 
+const GLFormatInfo *D3DAdapter::getDecodedFormat(D3DFORMAT format) const
+{
+    if(!mDecodeS3TC && !mDecodeRGTC)
+        return nullptr;
+
+    bool rgtc = (format == D3DFMT_ATI1 || format == D3DFMT_ATI2);
+    if(rgtc ? !mDecodeRGTC : !mDecodeS3TC)
+        return nullptr;
+
+    auto fmtinfo = gDecodedFormatList.find(format);
+    if(fmtinfo == gDecodedFormatList.end())
+        return nullptr;
+    return &fmtinfo->second;
+}
+
 UINT D3DAdapter::getSamples(D3DFORMAT format) const
 {
     FormatSampleMap::const_iterator samples = mSamples.find(format);
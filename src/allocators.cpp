@@ -0,0 +1,483 @@
+
+#include "allocators.hpp"
+
+#include <atomic>
+#include <array>
+
+#include "trace.hpp"
+
+
+namespace
+{
+
+// Every block starts with a header, which is padded out to keep the data
+// aligned.
+struct BlockHeader {
+    size_t mClass;
+    size_t mSize;
+    BlockHeader *mNext;
+};
+const size_t HEADER_SIZE = SlabAllocator::sAlignment;
+static_assert(sizeof(BlockHeader) <= HEADER_SIZE, "Block header is too large!");
+
+// Size classes (including the header) go from 64 bytes to 4MB, with two
+// classes per power of two (64, 96, 128, 192, ...).
+const size_t MIN_CLASS_SHIFT = 6;
+const size_t MAX_CLASS_SHIFT = 22;
+const size_t NUM_CLASSES = (MAX_CLASS_SHIFT-MIN_CLASS_SHIFT)*2 + 1;
+const size_t MAX_CLASS_SIZE = size_t(1)<<MAX_CLASS_SHIFT;
+// Class index marking a block mapped directly from the system.
+const size_t LARGE_CLASS = ~size_t(0);
+
+// Classes up to this size are carved out of slabs, which are never returned
+// to the system. Bigger classes get individual allocations.
+const size_t MAX_SLAB_CLASS_SIZE = 16*1024;
+const size_t SLAB_SIZE = 256*1024;
+
+// How many bytes of free blocks each thread keeps per class before handing
+// some back to the global lists, and how many bytes the global lists keep
+// per class before freeing individually allocated blocks.
+const size_t THREAD_CACHE_SIZE = 1024*1024;
+const size_t GLOBAL_CACHE_SIZE = 16*1024*1024;
+
+const DWORD STATS_LOG_INTERVAL = 5000;
+
+
+inline size_t ClassSize(size_t idx)
+{
+    size_t shift = MIN_CLASS_SHIFT + idx/2;
+    return (idx&1) ? (size_t(3)<<(shift-1)) : (size_t(1)<<shift);
+}
+
+inline size_t SizeToClass(size_t size)
+{
+    if(size <= (size_t(1)<<MIN_CLASS_SHIFT))
+        return 0;
+
+    // Find the power of two containing the size, 2^(bits-1) < size <= 2^bits
+    size_t bits = 0;
+    for(size_t val = size-1;val;val >>= 1)
+        ++bits;
+    if(size <= (size_t(3)<<(bits-2)))
+        return (bits-1-MIN_CLASS_SHIFT)*2 + 1;
+    return (bits-MIN_CLASS_SHIFT)*2;
+}
+
+// The number of blocks a thread cache holds for a given class.
+inline size_t ThreadCacheLimit(size_t idx)
+{
+    size_t limit = THREAD_CACHE_SIZE / ClassSize(idx);
+    return (limit < 2) ? 2 : limit;
+}
+
+inline void *BlockData(BlockHeader *block)
+{ return reinterpret_cast<BYTE*>(block) + HEADER_SIZE; }
+
+inline BlockHeader *DataBlock(void *ptr)
+{ return reinterpret_cast<BlockHeader*>(reinterpret_cast<BYTE*>(ptr) - HEADER_SIZE); }
+
+
+std::atomic<size_t> gLiveBytes(0);
+std::atomic<size_t> gPeakBytes(0);
+std::atomic<UINT64> gNumAllocs(0);
+std::atomic<UINT64> gNumFrees(0);
+std::atomic<UINT64> gNumLargeAllocs(0);
+std::atomic<UINT64> gNumSystemAllocs(0);
+
+void AddLiveBytes(size_t size)
+{
+    size_t live = (gLiveBytes += size);
+    size_t peak = gPeakBytes.load();
+    while(live > peak && !gPeakBytes.compare_exchange_weak(peak, live)) {
+    }
+}
+
+
+// The global free lists, shared by all threads.
+class GlobalPool {
+    std::atomic<bool> mSpinLock;
+    std::array<BlockHeader*,NUM_CLASSES> mFree;
+    std::array<size_t,NUM_CLASSES> mCount;
+
+    void lock()
+    {
+        while(mSpinLock.exchange(true) == true)
+            SwitchToThread();
+    }
+    void unlock() { mSpinLock = false; }
+
+    static BlockHeader *allocSlab(size_t idx, BlockHeader *&last, size_t &count);
+
+public:
+    GlobalPool() : mSpinLock(false)
+    {
+        mFree.fill(nullptr);
+        mCount.fill(0);
+    }
+
+    // Gets a chain of up to 'count' free blocks, allocating more if needed.
+    // Returns the number of blocks in the chain.
+    size_t get(size_t idx, size_t count, BlockHeader *&head);
+    // Returns a chain of free blocks ending with 'tail'.
+    void put(size_t idx, BlockHeader *head, BlockHeader *tail, size_t count);
+};
+GlobalPool gPool;
+
+BlockHeader *GlobalPool::allocSlab(size_t idx, BlockHeader *&last, size_t &count)
+{
+    const size_t size = ClassSize(idx);
+    BYTE *slab = reinterpret_cast<BYTE*>(_aligned_malloc(SLAB_SIZE, HEADER_SIZE));
+    if(!slab) return nullptr;
+    ++gNumSystemAllocs;
+
+    count = SLAB_SIZE / size;
+    BlockHeader *head = nullptr;
+    for(size_t i = count;i > 0;--i)
+    {
+        BlockHeader *block = reinterpret_cast<BlockHeader*>(slab + (i-1)*size);
+        block->mClass = idx;
+        block->mSize = size;
+        block->mNext = head;
+        if(!head) last = block;
+        head = block;
+    }
+    return head;
+}
+
+size_t GlobalPool::get(size_t idx, size_t count, BlockHeader *&head)
+{
+    size_t got = 0;
+    BlockHeader *tail = nullptr;
+    head = nullptr;
+
+    lock();
+    while(got < count && mFree[idx])
+    {
+        BlockHeader *block = mFree[idx];
+        mFree[idx] = block->mNext;
+        --mCount[idx];
+
+        block->mNext = nullptr;
+        if(tail) tail->mNext = block;
+        else head = block;
+        tail = block;
+        ++got;
+    }
+    unlock();
+    if(got > 0)
+        return got;
+
+    const size_t size = ClassSize(idx);
+    if(size <= MAX_SLAB_CLASS_SIZE)
+    {
+        // Take what was requested out of a new slab, and put the rest in the
+        // global list.
+        BlockHeader *last;
+        size_t total;
+        head = allocSlab(idx, last, total);
+        if(!head) return 0;
+
+        BlockHeader *block = head;
+        for(got = 1;got < count && got < total;++got)
+            block = block->mNext;
+        if(BlockHeader *rest = block->mNext)
+        {
+            block->mNext = nullptr;
+            put(idx, rest, last, total-got);
+        }
+        return got;
+    }
+
+    head = reinterpret_cast<BlockHeader*>(_aligned_malloc(size, HEADER_SIZE));
+    if(!head) return 0;
+    ++gNumSystemAllocs;
+    head->mClass = idx;
+    head->mSize = size;
+    head->mNext = nullptr;
+    return 1;
+}
+
+void GlobalPool::put(size_t idx, BlockHeader *head, BlockHeader *tail, size_t count)
+{
+    const size_t size = ClassSize(idx);
+    BlockHeader *excess = nullptr;
+
+    lock();
+    tail->mNext = mFree[idx];
+    mFree[idx] = head;
+    mCount[idx] += count;
+    if(size > MAX_SLAB_CLASS_SIZE)
+    {
+        // Release individually allocated blocks beyond the cache limit.
+        size_t limit = GLOBAL_CACHE_SIZE / size;
+        while(mCount[idx] > limit)
+        {
+            BlockHeader *block = mFree[idx];
+            mFree[idx] = block->mNext;
+            --mCount[idx];
+            block->mNext = excess;
+            excess = block;
+        }
+    }
+    unlock();
+
+    while(excess)
+    {
+        BlockHeader *next = excess->mNext;
+        _aligned_free(excess);
+        excess = next;
+    }
+}
+
+
+// Free blocks kept by each thread, so most allocations don't need the global
+// lock.
+class ThreadCache {
+    std::array<BlockHeader*,NUM_CLASSES> mFree;
+    std::array<size_t,NUM_CLASSES> mCount;
+
+public:
+    ThreadCache()
+    {
+        mFree.fill(nullptr);
+        mCount.fill(0);
+    }
+    ~ThreadCache()
+    {
+        for(size_t idx = 0;idx < NUM_CLASSES;++idx)
+        {
+            if(!mFree[idx]) continue;
+            BlockHeader *tail = mFree[idx];
+            while(tail->mNext)
+                tail = tail->mNext;
+            gPool.put(idx, mFree[idx], tail, mCount[idx]);
+        }
+    }
+
+    BlockHeader *get(size_t idx)
+    {
+        if(!mFree[idx])
+        {
+            // Refill half the cache at once.
+            mCount[idx] = gPool.get(idx, (ThreadCacheLimit(idx)+1)/2, mFree[idx]);
+            if(!mFree[idx]) return nullptr;
+        }
+        BlockHeader *block = mFree[idx];
+        mFree[idx] = block->mNext;
+        --mCount[idx];
+        return block;
+    }
+
+    void put(BlockHeader *block)
+    {
+        const size_t idx = block->mClass;
+        block->mNext = mFree[idx];
+        mFree[idx] = block;
+        if(++mCount[idx] <= ThreadCacheLimit(idx))
+            return;
+
+        // Too many cached, so give half back.
+        size_t count = mCount[idx] / 2;
+        BlockHeader *head = mFree[idx];
+        BlockHeader *tail = head;
+        for(size_t i = 1;i < count;++i)
+            tail = tail->mNext;
+        mFree[idx] = tail->mNext;
+        mCount[idx] -= count;
+        gPool.put(idx, head, tail, count);
+    }
+};
+thread_local ThreadCache tCache;
+
+} // namespace
+
+
+void *SlabAllocator::allocate(size_t size)
+{
+    if(size > std::numeric_limits<size_t>::max() - HEADER_SIZE - 0xffff)
+        return nullptr;
+    size += HEADER_SIZE;
+
+    BlockHeader *block;
+    if(size <= MAX_CLASS_SIZE)
+    {
+        block = tCache.get(SizeToClass(size));
+        if(!block) return nullptr;
+    }
+    else
+    {
+        // Large blocks are mapped directly, rounded up to the allocation
+        // granularity.
+        size = (size+0xffff) & ~size_t(0xffff);
+        block = reinterpret_cast<BlockHeader*>(
+            VirtualAlloc(nullptr, size, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE)
+        );
+        if(!block) return nullptr;
+        block->mClass = LARGE_CLASS;
+        block->mSize = size;
+        ++gNumLargeAllocs;
+        ++gNumSystemAllocs;
+    }
+    block->mNext = nullptr;
+
+    ++gNumAllocs;
+    AddLiveBytes(block->mSize);
+    return BlockData(block);
+}
+
+void SlabAllocator::deallocate(void *ptr)
+{
+    if(!ptr) return;
+
+    BlockHeader *block = DataBlock(ptr);
+    gLiveBytes -= block->mSize;
+    ++gNumFrees;
+
+    if(block->mClass == LARGE_CLASS)
+        VirtualFree(block, 0, MEM_RELEASE);
+    else
+        tCache.put(block);
+}
+
+SlabAllocator::Stats SlabAllocator::getStats()
+{
+    Stats stats;
+    stats.mLiveBytes = gLiveBytes.load();
+    stats.mPeakBytes = gPeakBytes.load();
+    stats.mNumAllocs = gNumAllocs.load();
+    stats.mNumFrees = gNumFrees.load();
+    stats.mNumLargeAllocs = gNumLargeAllocs.load();
+    stats.mNumSystemAllocs = gNumSystemAllocs.load();
+    return stats;
+}
+
+void SlabAllocator::logStats()
+{
+    static std::atomic<DWORD> last_time(GetTickCount());
+    static std::atomic<UINT64> last_allocs(0);
+
+    DWORD now = GetTickCount();
+    DWORD last = last_time.load();
+    if(now-last < STATS_LOG_INTERVAL || !last_time.compare_exchange_strong(last, now))
+        return;
+
+    Stats stats = getStats();
+    UINT64 allocs = stats.mNumAllocs - last_allocs.exchange(stats.mNumAllocs);
+    TRACE("Live %lu bytes, peak %lu bytes, %lu allocs/sec, %lu large, %lu from system\n",
+          (ULONG)stats.mLiveBytes, (ULONG)stats.mPeakBytes, (ULONG)(allocs*1000 / (now-last)),
+          (ULONG)stats.mNumLargeAllocs, (ULONG)stats.mNumSystemAllocs);
+}
+
+
+namespace
+{
+
+// Each arena allocation is preceded by its size class, padded out to keep the
+// data aligned. Free blocks keep the next free block in their data.
+struct ArenaHeader {
+    size_t mClass;
+    size_t mSize; // Only for large blocks
+};
+const size_t ARENA_HEADER_SIZE = ArenaAllocator::sAlignment;
+static_assert(sizeof(ArenaHeader) <= ARENA_HEADER_SIZE, "Arena header is too large!");
+
+// Sized so chunks fill a SlabAllocator class exactly. The start of each chunk
+// links to the next.
+const size_t ARENA_CHUNK_SIZE = 64*1024 - HEADER_SIZE;
+const size_t ARENA_CHUNK_START = ArenaAllocator::sAlignment;
+
+inline ArenaHeader *ArenaBlock(void *ptr)
+{ return reinterpret_cast<ArenaHeader*>(reinterpret_cast<BYTE*>(ptr) - ARENA_HEADER_SIZE); }
+
+inline size_t ArenaClassSize(size_t idx)
+{ return (idx+1) * ArenaAllocator::sAlignment; }
+
+} // namespace
+
+
+ArenaAllocator::ArenaAllocator()
+  : mChunks(nullptr)
+  , mPos(nullptr)
+  , mEnd(nullptr)
+  , mStats{0, 0, 0, 0}
+{
+    for(size_t idx = 0;idx < sNumClasses;++idx)
+        mFree[idx] = nullptr;
+}
+
+ArenaAllocator::~ArenaAllocator()
+{
+    while(mChunks)
+    {
+        void *next = *reinterpret_cast<void**>(mChunks);
+        SlabAllocator::deallocate(mChunks);
+        mChunks = next;
+    }
+}
+
+void *ArenaAllocator::allocate(size_t size)
+{
+    if(size > sMaxSmallSize)
+    {
+        if(size > std::numeric_limits<size_t>::max() - ARENA_HEADER_SIZE)
+            return nullptr;
+        void *ptr = SlabAllocator::allocate(size + ARENA_HEADER_SIZE);
+        if(!ptr) return nullptr;
+
+        ArenaHeader *block = reinterpret_cast<ArenaHeader*>(ptr);
+        block->mClass = LARGE_CLASS;
+        block->mSize = size;
+        ++mStats.mNumAllocs;
+        mStats.mAllocBytes += size;
+        mStats.mLiveBytes += size;
+        return reinterpret_cast<BYTE*>(ptr) + ARENA_HEADER_SIZE;
+    }
+
+    const size_t idx = (size > 0) ? (size-1) / sAlignment : 0;
+    void *ptr = mFree[idx];
+    if(ptr)
+        mFree[idx] = *reinterpret_cast<void**>(ptr);
+    else
+    {
+        const size_t total = ARENA_HEADER_SIZE + ArenaClassSize(idx);
+        if(size_t(mEnd - mPos) < total)
+        {
+            // Whatever's left of the current chunk is dropped.
+            BYTE *chunk = reinterpret_cast<BYTE*>(SlabAllocator::allocate(ARENA_CHUNK_SIZE));
+            if(!chunk) return nullptr;
+            *reinterpret_cast<void**>(chunk) = mChunks;
+            mChunks = chunk;
+            mPos = chunk + ARENA_CHUNK_START;
+            mEnd = chunk + ARENA_CHUNK_SIZE;
+            mStats.mChunkBytes += ARENA_CHUNK_SIZE;
+        }
+
+        ArenaHeader *block = reinterpret_cast<ArenaHeader*>(mPos);
+        block->mClass = idx;
+        mPos += total;
+        ptr = reinterpret_cast<BYTE*>(block) + ARENA_HEADER_SIZE;
+    }
+
+    ++mStats.mNumAllocs;
+    mStats.mAllocBytes += ArenaClassSize(idx);
+    mStats.mLiveBytes += ArenaClassSize(idx);
+    return ptr;
+}
+
+void ArenaAllocator::deallocate(void *ptr)
+{
+    if(!ptr) return;
+
+    ArenaHeader *block = ArenaBlock(ptr);
+    const size_t idx = block->mClass;
+    if(idx == LARGE_CLASS)
+    {
+        mStats.mLiveBytes -= block->mSize;
+        SlabAllocator::deallocate(block);
+        return;
+    }
+
+    mStats.mLiveBytes -= ArenaClassSize(idx);
+    *reinterpret_cast<void**>(ptr) = mFree[idx];
+    mFree[idx] = ptr;
+}
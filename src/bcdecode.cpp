@@ -0,0 +1,235 @@
+
+#include "bcdecode.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "threadpool.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2_INTRINSICS
+#endif
+
+
+namespace
+{
+
+// Rects with at least this many blocks get split across the thread pool, a
+// block row or so at a time.
+const UINT PARALLEL_MIN_BLOCKS = 64*64;
+const UINT PARALLEL_BATCH_ROWS = 4;
+
+inline UINT Expand5(UINT v) { return (v<<3) | (v>>2); }
+inline UINT Expand6(UINT v) { return (v<<2) | (v>>4); }
+
+inline UINT PackRGBA(UINT r, UINT g, UINT b, UINT a)
+{ return r | (g<<8) | (b<<16) | (a<<24); }
+
+inline UINT64 Load48(const GLubyte *src)
+{
+    return UINT64(src[0]) | (UINT64(src[1])<<8) | (UINT64(src[2])<<16) |
+           (UINT64(src[3])<<24) | (UINT64(src[4])<<32) | (UINT64(src[5])<<40);
+}
+
+
+/* Decodes an 8-byte color block to 16 RGBA pixels. With punch-through, c0 <= c1
+ * selects the 3-color mode with a transparent black, as DXT1 does. The DXT2-5
+ * color blocks always use 4 colors.
+ */
+void DecodeColorBlock(UINT *out, const GLubyte *src, bool punchthrough)
+{
+    UINT c0 = src[0] | (src[1]<<8);
+    UINT c1 = src[2] | (src[3]<<8);
+    UINT r0 = Expand5(c0>>11), g0 = Expand6((c0>>5)&0x3f), b0 = Expand5(c0&0x1f);
+    UINT r1 = Expand5(c1>>11), g1 = Expand6((c1>>5)&0x3f), b1 = Expand5(c1&0x1f);
+
+    UINT pal[4];
+    pal[0] = PackRGBA(r0, g0, b0, 255);
+    pal[1] = PackRGBA(r1, g1, b1, 255);
+    if(c0 > c1 || !punchthrough)
+    {
+        pal[2] = PackRGBA((r0*2 + r1)/3, (g0*2 + g1)/3, (b0*2 + b1)/3, 255);
+        pal[3] = PackRGBA((r0 + r1*2)/3, (g0 + g1*2)/3, (b0 + b1*2)/3, 255);
+    }
+    else
+    {
+        pal[2] = PackRGBA((r0 + r1)/2, (g0 + g1)/2, (b0 + b1)/2, 255);
+        pal[3] = 0;
+    }
+
+#ifdef HAVE_SSE2_INTRINSICS
+    const __m128i p0 = _mm_set1_epi32(pal[0]);
+    const __m128i p1 = _mm_set1_epi32(pal[1]);
+    const __m128i p2 = _mm_set1_epi32(pal[2]);
+    const __m128i p3 = _mm_set1_epi32(pal[3]);
+    // Multiplying by these moves each pixel's 2-bit index up to bits 6-7.
+    const __m128i shifts = _mm_setr_epi32(1<<6, 1<<4, 1<<2, 1);
+    const __m128i mask = _mm_set1_epi32(3);
+    for(int y = 0;y < 4;++y)
+    {
+        __m128i idx = _mm_mullo_epi16(_mm_set1_epi32(src[4+y]), shifts);
+        idx = _mm_and_si128(_mm_srli_epi32(idx, 6), mask);
+
+        __m128i c = _mm_and_si128(_mm_cmpeq_epi32(idx, _mm_setzero_si128()), p0);
+        c = _mm_or_si128(c, _mm_and_si128(_mm_cmpeq_epi32(idx, _mm_set1_epi32(1)), p1));
+        c = _mm_or_si128(c, _mm_and_si128(_mm_cmpeq_epi32(idx, _mm_set1_epi32(2)), p2));
+        c = _mm_or_si128(c, _mm_and_si128(_mm_cmpeq_epi32(idx, mask), p3));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + y*4), c);
+    }
+#else
+    for(int y = 0;y < 4;++y)
+    {
+        UINT bits = src[4+y];
+        for(int x = 0;x < 4;++x)
+            out[y*4 + x] = pal[(bits>>(x*2)) & 3];
+    }
+#endif
+}
+
+/* Decodes an 8-byte BC3/BC4 style alpha block, writing every stride'th byte. */
+void DecodeAlphaBlock(GLubyte *out, int stride, const GLubyte *src)
+{
+    UINT a0 = src[0];
+    UINT a1 = src[1];
+
+    GLubyte pal[8];
+    pal[0] = a0;
+    pal[1] = a1;
+    if(a0 > a1)
+    {
+        for(UINT i = 1;i < 7;++i)
+            pal[i+1] = ((7-i)*a0 + i*a1) / 7;
+    }
+    else
+    {
+        for(UINT i = 1;i < 5;++i)
+            pal[i+1] = ((5-i)*a0 + i*a1) / 5;
+        pal[6] = 0;
+        pal[7] = 255;
+    }
+
+    // Each row of 4 takes 12 bits, so the 48 index bits are split in halves.
+    for(int half = 0;half < 2;++half)
+    {
+        UINT bits = src[2 + half*3] | (src[3 + half*3]<<8) | (src[4 + half*3]<<16);
+        for(int i = 0;i < 8;++i)
+            out[(half*8 + i)*stride] = pal[(bits>>(i*3)) & 7];
+    }
+}
+
+
+/* Block decoders, writing a 4x4 block of tightly packed pixels. */
+void DecodeBlockBC1(GLubyte *out, const GLubyte *src)
+{
+    DecodeColorBlock(reinterpret_cast<UINT*>(out), src, true);
+}
+
+void DecodeBlockBC2(GLubyte *out, const GLubyte *src)
+{
+    DecodeColorBlock(reinterpret_cast<UINT*>(out), src+8, false);
+    // Explicit 4-bit alpha, two pixels to a byte.
+    for(int i = 0;i < 8;++i)
+    {
+        out[(i*2  )*4 + 3] = (src[i]&0x0f) * 0x11;
+        out[(i*2+1)*4 + 3] = (src[i]>>4) * 0x11;
+    }
+}
+
+void DecodeBlockBC3(GLubyte *out, const GLubyte *src)
+{
+    DecodeColorBlock(reinterpret_cast<UINT*>(out), src+8, false);
+    DecodeAlphaBlock(out+3, 4, src);
+}
+
+void DecodeBlockBC4(GLubyte *out, const GLubyte *src)
+{
+    DecodeAlphaBlock(out, 1, src);
+}
+
+void DecodeBlockBC5(GLubyte *out, const GLubyte *src)
+{
+    DecodeAlphaBlock(out, 2, src);
+    DecodeAlphaBlock(out+1, 2, src+8);
+}
+
+
+struct DecodeJob {
+    void (*decodeBlock)(GLubyte *out, const GLubyte *src);
+    int blocksize;
+    int bpp;
+
+    GLubyte *dst;
+    int dstpitch;
+    const GLubyte *src;
+    int srcpitch;
+    int width;
+    int height;
+};
+
+void DecodeBlockRows(UINT start, UINT end, void *userdata)
+{
+    const DecodeJob *job = reinterpret_cast<const DecodeJob*>(userdata);
+    const int bpp = job->bpp;
+    const int blockswide = (job->width+3) / 4;
+
+    alignas(16) GLubyte block[4*4*4];
+    for(UINT by = start;by < end;++by)
+    {
+        const GLubyte *src = job->src + by*job->srcpitch;
+        GLubyte *dst = job->dst + by*4*job->dstpitch;
+        int rows = std::min(4, job->height - int(by*4));
+        for(int bx = 0;bx < blockswide;++bx)
+        {
+            job->decodeBlock(block, src + bx*job->blocksize);
+
+            // Edge blocks are clipped to the rect.
+            int cols = std::min(4, job->width - bx*4);
+            for(int y = 0;y < rows;++y)
+                memcpy(dst + y*job->dstpitch + bx*4*bpp, block + y*4*bpp, cols*bpp);
+        }
+    }
+}
+
+void DecodeRect(void (*decodeBlock)(GLubyte*,const GLubyte*), int blocksize, int bpp,
+                GLubyte *dst, const GLubyte *src, int srcpitch, int width, int height)
+{
+    DecodeJob job;
+    job.decodeBlock = decodeBlock;
+    job.blocksize = blocksize;
+    job.bpp = bpp;
+    job.dst = dst;
+    job.dstpitch = GLFormatInfo::calcPitch(width, bpp);
+    job.src = src;
+    job.srcpitch = srcpitch;
+    job.width = width;
+    job.height = height;
+
+    UINT blockrows = (height+3) / 4;
+    UINT numblocks = blockrows * ((width+3) / 4);
+    if(numblocks >= PARALLEL_MIN_BLOCKS)
+        ThreadPool::get().run(blockrows, PARALLEL_BATCH_ROWS, DecodeBlockRows, &job);
+    else
+        DecodeBlockRows(0, blockrows, &job);
+}
+
+
+void DecodeBC1(GLubyte *dst, const GLubyte *src, int srcpitch, int width, int height)
+{ DecodeRect(DecodeBlockBC1, 8, 4, dst, src, srcpitch, width, height); }
+void DecodeBC2(GLubyte *dst, const GLubyte *src, int srcpitch, int width, int height)
+{ DecodeRect(DecodeBlockBC2, 16, 4, dst, src, srcpitch, width, height); }
+void DecodeBC3(GLubyte *dst, const GLubyte *src, int srcpitch, int width, int height)
+{ DecodeRect(DecodeBlockBC3, 16, 4, dst, src, srcpitch, width, height); }
+void DecodeBC4(GLubyte *dst, const GLubyte *src, int srcpitch, int width, int height)
+{ DecodeRect(DecodeBlockBC4, 8, 1, dst, src, srcpitch, width, height); }
+void DecodeBC5(GLubyte *dst, const GLubyte *src, int srcpitch, int width, int height)
+{ DecodeRect(DecodeBlockBC5, 16, 2, dst, src, srcpitch, width, height); }
+
+} // namespace
+
+
+const GLFormatConversion gDecodeBC1{ nullptr, nullptr, 4, DecodeBC1 };
+const GLFormatConversion gDecodeBC2{ nullptr, nullptr, 4, DecodeBC2 };
+const GLFormatConversion gDecodeBC3{ nullptr, nullptr, 4, DecodeBC3 };
+const GLFormatConversion gDecodeBC4{ nullptr, nullptr, 1, DecodeBC4 };
+const GLFormatConversion gDecodeBC5{ nullptr, nullptr, 2, DecodeBC5 };
@@ -1,21 +1,146 @@
 
 #include "bufferobject.hpp"
 
+#include <algorithm>
+#include <climits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2_INTRINSICS
+#endif
+
 #include "device.hpp"
 #include "private_iids.hpp"
 
 
+namespace
+{
+
+// Maximum number of index ranges remembered per buffer before the cache is
+// flushed. Apps generally draw from a handful of fixed ranges, so this only
+// guards against unbounded growth from streaming index data.
+const size_t MAX_CACHED_INDEX_RANGES = 64;
+
+void CalcIndexRange16(const GLushort *idx, UINT count, UINT &minidx, UINT &maxidx)
+{
+    UINT lo = 0xffff;
+    UINT hi = 0;
+    UINT i = 0;
+
+#ifdef HAVE_SSE2_INTRINSICS
+    if(count >= 8)
+    {
+        // SSE2 only has signed 16-bit min/max, so flip the sign bit to map
+        // the unsigned range onto the signed one.
+        const __m128i bias = _mm_set1_epi16(-0x8000);
+        __m128i vmin = _mm_set1_epi16(0x7fff);
+        __m128i vmax = _mm_set1_epi16(-0x8000);
+        for(;count-i >= 8;i += 8)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(idx+i));
+            v = _mm_xor_si128(v, bias);
+            vmin = _mm_min_epi16(vmin, v);
+            vmax = _mm_max_epi16(vmax, v);
+        }
+
+        alignas(16) GLushort mins[8];
+        alignas(16) GLushort maxs[8];
+        _mm_store_si128(reinterpret_cast<__m128i*>(mins), _mm_xor_si128(vmin, bias));
+        _mm_store_si128(reinterpret_cast<__m128i*>(maxs), _mm_xor_si128(vmax, bias));
+        for(int j = 0;j < 8;++j)
+        {
+            lo = std::min<UINT>(lo, mins[j]);
+            hi = std::max<UINT>(hi, maxs[j]);
+        }
+    }
+#endif
+    for(;i < count;++i)
+    {
+        lo = std::min<UINT>(lo, idx[i]);
+        hi = std::max<UINT>(hi, idx[i]);
+    }
+
+    minidx = lo;
+    maxidx = hi;
+}
+
+void CalcIndexRange32(const GLuint *idx, UINT count, UINT &minidx, UINT &maxidx)
+{
+    UINT lo = 0xffffffff;
+    UINT hi = 0;
+    UINT i = 0;
+
+#ifdef HAVE_SSE2_INTRINSICS
+    if(count >= 4)
+    {
+        // SSE2 lacks 32-bit min/max altogether. Bias into the signed range
+        // and select using signed compares.
+        const __m128i bias = _mm_set1_epi32(INT_MIN);
+        __m128i vmin = _mm_set1_epi32(INT_MAX);
+        __m128i vmax = _mm_set1_epi32(INT_MIN);
+        for(;count-i >= 4;i += 4)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(idx+i));
+            v = _mm_xor_si128(v, bias);
+            __m128i lt = _mm_cmplt_epi32(v, vmin);
+            __m128i gt = _mm_cmpgt_epi32(v, vmax);
+            vmin = _mm_or_si128(_mm_and_si128(lt, v), _mm_andnot_si128(lt, vmin));
+            vmax = _mm_or_si128(_mm_and_si128(gt, v), _mm_andnot_si128(gt, vmax));
+        }
+
+        alignas(16) GLuint mins[4];
+        alignas(16) GLuint maxs[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(mins), _mm_xor_si128(vmin, bias));
+        _mm_store_si128(reinterpret_cast<__m128i*>(maxs), _mm_xor_si128(vmax, bias));
+        for(int j = 0;j < 4;++j)
+        {
+            lo = std::min(lo, mins[j]);
+            hi = std::max(hi, maxs[j]);
+        }
+    }
+#endif
+    for(;i < count;++i)
+    {
+        lo = std::min(lo, idx[i]);
+        hi = std::max(hi, idx[i]);
+    }
+
+    minidx = lo;
+    maxidx = hi;
+}
+
+} // namespace
+
+void CalcIndexRange(const GLubyte *data, D3DFORMAT format, UINT count, UINT &minidx, UINT &maxidx)
+{
+    if(count == 0)
+    {
+        minidx = maxidx = 0;
+        return;
+    }
+
+    if(format == D3DFMT_INDEX16)
+        CalcIndexRange16(reinterpret_cast<const GLushort*>(data), count, minidx, maxidx);
+    else if(format == D3DFMT_INDEX32)
+        CalcIndexRange32(reinterpret_cast<const GLuint*>(data), count, minidx, maxidx);
+    else
+    {
+        ERR("Unexpected index format: %s\n", d3dfmt_to_str(format));
+        minidx = maxidx = 0;
+    }
+}
+
+
 void D3DGLBufferObject::initGL(const GLubyte *data)
 {
     UINT data_len = (mLength+15) & ~15;
 
     GLenum usage = (mUsage&D3DUSAGE_DYNAMIC) ? GL_DYNAMIC_DRAW : GL_STREAM_DRAW;
 
-    glGenBuffers(1, &mBufferId);
     glNamedBufferDataEXT(mBufferId, data_len, data, usage);
     checkGLError();
 
-    mUpdateInProgress = 0;
+    --mUpdateInProgress;
 }
 class InitBufferObjectCmd : public Command {
     D3DGLBufferObject *mTarget;
@@ -33,36 +158,42 @@ public:
     }
 };
 
-class DestroyBufferCmd : public Command {
-    GLuint mBufferId;
+void D3DGLBufferObject::resizeBufferGL(UINT length)
+{
+    UINT data_len = (length+15) & ~15;
+    glNamedBufferDataEXT(mBufferId, data_len, nullptr, GL_STREAM_DRAW);
+    checkGLError();
+}
+class ResizeBufferCmd : public Command {
+    D3DGLBufferObject *mTarget;
+    UINT mLength;
 
 public:
-    DestroyBufferCmd(GLuint buffer) : mBufferId(buffer) { }
+    ResizeBufferCmd(D3DGLBufferObject *target, UINT length) : mTarget(target), mLength(length) { }
 
     virtual ULONG execute()
     {
-        glDeleteBuffers(1, &mBufferId);
-        checkGLError();
+        mTarget->resizeBufferGL(mLength);
         return sizeof(*this);
     }
 };
 
-void D3DGLBufferObject::resizeBufferGL(UINT length)
+void D3DGLBufferObject::evictGL()
 {
-    UINT data_len = (length+15) & ~15;
-    glNamedBufferDataEXT(mBufferId, data_len, nullptr, GL_STREAM_DRAW);
+    // Drop the storage but keep the buffer object, so its name stays valid.
+    GLenum usage = (mUsage&D3DUSAGE_DYNAMIC) ? GL_DYNAMIC_DRAW : GL_STREAM_DRAW;
+    glNamedBufferDataEXT(mBufferId, 0, nullptr, usage);
     checkGLError();
 }
-class ResizeBufferCmd : public Command {
+class EvictBufferCmd : public Command {
     D3DGLBufferObject *mTarget;
-    UINT mLength;
 
 public:
-    ResizeBufferCmd(D3DGLBufferObject *target, UINT length) : mTarget(target), mLength(length) { }
+    EvictBufferCmd(D3DGLBufferObject *target) : mTarget(target) { }
 
     virtual ULONG execute()
     {
-        mTarget->resizeBufferGL(mLength);
+        mTarget->evictGL();
         return sizeof(*this);
     }
 };
@@ -120,13 +251,10 @@ D3DGLBufferObject::D3DGLBufferObject(D3DGLDevice *parent)
 
 D3DGLBufferObject::~D3DGLBufferObject()
 {
+    // Deleted on the command thread, so there are no more pending updates.
     if(mBufferId)
-    {
-        mParent->getQueue().send<DestroyBufferCmd>(mBufferId);
-        while(mUpdateInProgress)
-            mParent->getQueue().wakeAndSleep();
-        mBufferId = 0;
-    }
+        mParent->deleteBufferGL(mBufferId);
+    mBufferId = 0;
 }
 
 bool D3DGLBufferObject::init_common(UINT length, DWORD usage, D3DPOOL pool)
@@ -150,8 +278,14 @@ bool D3DGLBufferObject::init_common(UINT length, DWORD usage, D3DPOOL pool)
     mBufData.reset(DataAllocator<GLubyte>()(data_len), DataDeallocator<GLubyte>());
     memset(mBufData.get(), 0, data_len);
 
+    mBufferId = mParent->getBufferName();
     mUpdateInProgress = 1;
-    mParent->getQueue().sendSync<InitBufferObjectCmd>(this, mBufData);
+    mParent->getQueue().send<InitBufferObjectCmd>(this, mBufData);
+
+    if(mPool == D3DPOOL_MANAGED)
+        mParent->getResidency().add(this, data_len);
+    else
+        mParent->getResidency().addFixed(data_len);
 
     return true;
 }
@@ -217,31 +351,106 @@ bool D3DGLBufferObject::init_ibo(UINT length, DWORD usage, D3DFORMAT format, D3D
 
 void D3DGLBufferObject::resetBufferData(const GLubyte *data, GLuint length)
 {
+    mIndexRanges.clear();
+
     ++mUpdateInProgress;
     mParent->getQueue().lock();
+    // The data needs a new allocation if it's growing, or if the command
+    // thread still has to read the current one.
+    bool realloc = (mUpdateInProgress > 1);
     if(length > mLength)
     {
+        if(mPool != D3DPOOL_MANAGED)
+            mParent->getResidency().addFixed(((length+15)&~15) - ((mLength+15)&~15));
         mLength = length;
         mParent->getQueue().doSend<ResizeBufferCmd>(this, length);
+        realloc = true;
     }
-    if(mUpdateInProgress > 1)
+    if(realloc)
     {
         UINT data_len = (mLength+15) & ~15;
         mBufData.reset(DataAllocator<GLubyte>()(data_len), DataDeallocator<GLubyte>());
     }
     memcpy(mBufData.get(), data, length);
 
-    mParent->getQueue().doSend<LoadBufferDataCmd>(this, 0, mLength, mBufData, 0);
+    mParent->getQueue().doSend<LoadBufferDataCmd>(this, 0, length, mBufData, 0);
     mParent->getQueue().unlock();
 }
 
+void D3DGLBufferObject::invalidateIndexRanges(UINT offset, UINT length)
+{
+    if(mIndexRanges.empty())
+        return;
+
+    UINT idxsize = (mFormat == D3DFMT_INDEX32) ? 4 : 2;
+    auto iter = mIndexRanges.begin();
+    while(iter != mIndexRanges.end())
+    {
+        UINT start = UINT(iter->first>>32);
+        UINT end = start + UINT(iter->first&0xffffffff)*idxsize;
+        if(start < offset+length && offset < end)
+            iter = mIndexRanges.erase(iter);
+        else
+            ++iter;
+    }
+}
+
+void D3DGLBufferObject::getIndexRange(UINT offset, UINT count, UINT &minidx, UINT &maxidx)
+{
+    UINT idxsize = (mFormat == D3DFMT_INDEX32) ? 4 : 2;
+    if(offset >= mLength || count > (mLength-offset)/idxsize)
+    {
+        WARN("Index range out of bounds (%u + %u*%u > %u)\n", offset, count, idxsize, mLength);
+        count = (offset < mLength) ? (mLength-offset)/idxsize : 0;
+    }
+
+    UINT64 key = (UINT64(offset)<<32) | count;
+    auto iter = mIndexRanges.find(key);
+    if(iter != mIndexRanges.end())
+    {
+        minidx = iter->second.mMin;
+        maxidx = iter->second.mMax;
+        return;
+    }
+
+    CalcIndexRange(mBufData.get()+offset, mFormat, count, minidx, maxidx);
+    TRACE("Scanned %u indices at offset %u: range %u -> %u\n", count, offset, minidx, maxidx);
+
+    if(mIndexRanges.size() >= MAX_CACHED_INDEX_RANGES)
+        mIndexRanges.clear();
+    mIndexRanges.insert(std::make_pair(key, IndexRange{minidx, maxidx}));
+}
+
 ULONG D3DGLBufferObject::releaseIface()
 {
     ULONG ret = --mIfaceCount;
-    if(ret == 0) delete this;
+    if(ret == 0)
+    {
+        if(mPool == D3DPOOL_MANAGED)
+            mParent->getResidency().remove(this);
+        else
+            mParent->getResidency().removeFixed((mLength+15) & ~15);
+        mParent->getQueue().send<CommandDelete<D3DGLBufferObject>>(this);
+    }
     return ret;
 }
 
+void D3DGLBufferObject::evict()
+{
+    mParent->getQueue().send<EvictBufferCmd>(this);
+}
+
+void D3DGLBufferObject::restore()
+{
+    ++mUpdateInProgress;
+    mParent->getQueue().send<InitBufferObjectCmd>(this, mBufData);
+}
+
+bool D3DGLBufferObject::isBound()
+{
+    return mParent->isBufferBound(this);
+}
+
 
 HRESULT D3DGLBufferObject::QueryInterface(REFIID riid, void **obj)
 {
@@ -335,7 +544,8 @@ DWORD D3DGLBufferObject::GetPriority()
 
 void D3DGLBufferObject::PreLoad()
 {
-    FIXME("iface %p : stub!\n", this);
+    TRACE("iface %p\n", this);
+    mParent->getResidency().touch(this);
 }
 
 D3DRESOURCETYPE D3DGLBufferObject::GetType()
@@ -434,15 +644,24 @@ HRESULT D3DGLBufferObject::Unlock()
 
     if(mLock != LT_ReadOnly)
     {
-        ++mUpdateInProgress;
-        GLbitfield flags = 0;
         if((mLockedFlags&D3DLOCK_DISCARD))
-            flags |= GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_WRITE_BIT;
-        else if((mLockedFlags&D3DLOCK_NOOVERWRITE))
-            flags |= GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_WRITE_BIT;
-        mParent->getQueue().send<LoadBufferDataCmd>(this,
-            mLockedOffset, mLockedLength, mBufData, flags
-        );
+            mIndexRanges.clear();
+        else
+            invalidateIndexRanges(mLockedOffset, mLockedLength);
+
+        // Evicted buffers get reloaded in full when restored.
+        if(!isEvicted())
+        {
+            ++mUpdateInProgress;
+            GLbitfield flags = 0;
+            if((mLockedFlags&D3DLOCK_DISCARD))
+                flags |= GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_WRITE_BIT;
+            else if((mLockedFlags&D3DLOCK_NOOVERWRITE))
+                flags |= GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_WRITE_BIT;
+            mParent->getQueue().send<LoadBufferDataCmd>(this,
+                mLockedOffset, mLockedLength, mBufData, flags
+            );
+        }
     }
 
     mLockedOffset = 0;
@@ -1,6 +1,7 @@
 
 #include "device.hpp"
 
+#include <algorithm>
 #include <array>
 #include <sstream>
 #include <d3d9.h>
@@ -1021,11 +1022,13 @@ class DrawGLElementsCmd : public Command {
     GLenum mType;
     GLubyte *mPointer;
     GLsizei mNumInstances;
-    GLsizei mBaseVtx;
+    GLuint mStart;
+    GLuint mEnd;
+    GLint mBaseVtx;
 
 public:
-    DrawGLElementsCmd(GLState &glstate, GLenum mode, GLint count, GLenum type, GLubyte *pointer, GLsizei num_instances, GLsizei basevtx)
-      : mGLState(glstate), mMode(mode), mCount(count), mType(type), mPointer(pointer), mNumInstances(num_instances), mBaseVtx(basevtx)
+    DrawGLElementsCmd(GLState &glstate, GLenum mode, GLint count, GLenum type, GLubyte *pointer, GLsizei num_instances, GLuint start, GLuint end, GLint basevtx)
+      : mGLState(glstate), mMode(mode), mCount(count), mType(type), mPointer(pointer), mNumInstances(num_instances), mStart(start), mEnd(end), mBaseVtx(basevtx)
     { }
 
     virtual ULONG execute()
@@ -1036,7 +1039,12 @@ public:
             mGLState.current_framebuffer[1] = mGLState.main_framebuffer;
             glBindFramebuffer(GL_FRAMEBUFFER, mGLState.main_framebuffer);
         }
-        glDrawElementsInstancedBaseVertex(mMode, mCount, mType, mPointer, mNumInstances, mBaseVtx);
+        // The range lets the driver only pull in the vertices actually used,
+        // but there's no instanced version of it.
+        if(mNumInstances == 1)
+            glDrawRangeElementsBaseVertex(mMode, mStart, mEnd, mCount, mType, mPointer, mBaseVtx);
+        else
+            glDrawElementsInstancedBaseVertex(mMode, mCount, mType, mPointer, mNumInstances, mBaseVtx);
         checkGLError();
 
         return sizeof(*this);
@@ -1073,30 +1081,6 @@ done:
     --pendingupdates;
     checkGLError();
 }
-class ReadFramebufferCmd : public Command {
-    D3DGLDevice *mTarget;
-    GLenum mSrcTarget;
-    GLuint mSrcBinding;
-    GLint mSrcLevel;
-    RECT mSrcRect;
-    GLenum mFormat;
-    GLenum mType;
-    std::shared_ptr<GLubyte> mData;
-    std::atomic<ULONG> &mPendingUpdates;
-
-public:
-    ReadFramebufferCmd(D3DGLDevice *target, GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect, GLenum format, GLenum type, std::shared_ptr<GLubyte> data, std::atomic<ULONG> &pendingupdates)
-      : mTarget(target), mSrcTarget(src_target), mSrcBinding(src_binding), mSrcLevel(src_level), mSrcRect(src_rect)
-      , mFormat(format), mType(type), mData(data), mPendingUpdates(pendingupdates)
-    { }
-
-    virtual ULONG execute()
-    {
-        mTarget->readFramebufferGL(mSrcTarget, mSrcBinding, mSrcLevel, mSrcRect,
-                                   mFormat, mType, mData.get(), mPendingUpdates);
-        return sizeof(*this);
-    }
-};
 
 
 void D3DGLDevice::blitFramebufferGL(GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect, GLenum dst_target, GLuint dst_binding, GLint dst_level, const RECT &dst_rect, GLenum filter)
@@ -1187,6 +1171,78 @@ public:
     }
 };
 
+
+static bool IsCubeFaceTarget(GLenum target)
+{
+    return target == GL_TEXTURE_CUBE_MAP_POSITIVE_X || target == GL_TEXTURE_CUBE_MAP_NEGATIVE_X ||
+           target == GL_TEXTURE_CUBE_MAP_POSITIVE_Y || target == GL_TEXTURE_CUBE_MAP_NEGATIVE_Y ||
+           target == GL_TEXTURE_CUBE_MAP_POSITIVE_Z || target == GL_TEXTURE_CUBE_MAP_NEGATIVE_Z;
+}
+
+void D3DGLDevice::copyImageGL(GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect, GLenum dst_target, GLuint dst_binding, GLint dst_level, const POINT &dst_point, bool compressed)
+{
+    if(!GLEW_VERSION_4_3 && !GLEW_ARB_copy_image)
+    {
+        // Color formats can still be copied with a blit.
+        if(compressed)
+        {
+            FIXME("Can't copy compressed images without ARB_copy_image\n");
+            return;
+        }
+        RECT dst_rect = { dst_point.x, dst_point.y,
+                          dst_point.x + (src_rect.right-src_rect.left),
+                          dst_point.y + (src_rect.bottom-src_rect.top) };
+        blitFramebufferGL(src_target, src_binding, src_level, src_rect,
+                          dst_target, dst_binding, dst_level, dst_rect, GL_NEAREST);
+        return;
+    }
+
+    // Cube faces are copied as layers of the cube map.
+    GLint src_z = 0, dst_z = 0;
+    if(IsCubeFaceTarget(src_target))
+    {
+        src_z = src_target - GL_TEXTURE_CUBE_MAP_POSITIVE_X;
+        src_target = GL_TEXTURE_CUBE_MAP;
+    }
+    if(IsCubeFaceTarget(dst_target))
+    {
+        dst_z = dst_target - GL_TEXTURE_CUBE_MAP_POSITIVE_X;
+        dst_target = GL_TEXTURE_CUBE_MAP;
+    }
+
+    glCopyImageSubData(src_binding, src_target, src_level, src_rect.left, src_rect.top, src_z,
+                       dst_binding, dst_target, dst_level, dst_point.x, dst_point.y, dst_z,
+                       src_rect.right-src_rect.left, src_rect.bottom-src_rect.top, 1);
+    checkGLError();
+}
+class CopyImageCmd : public Command {
+    D3DGLDevice *mTarget;
+    GLenum mSrcTarget;
+    GLuint mSrcBinding;
+    GLint mSrcLevel;
+    RECT mSrcRect;
+    GLenum mDstTarget;
+    GLuint mDstBinding;
+    GLint mDstLevel;
+    POINT mDstPoint;
+    bool mCompressed;
+
+public:
+    CopyImageCmd(D3DGLDevice *target, GLenum src_target, GLuint src_binding, GLint src_level, const RECT &src_rect, GLenum dst_target, GLuint dst_binding, GLint dst_level, const POINT &dst_point, bool compressed)
+      : mTarget(target), mSrcTarget(src_target), mSrcBinding(src_binding), mSrcLevel(src_level), mSrcRect(src_rect)
+      , mDstTarget(dst_target), mDstBinding(dst_binding), mDstLevel(dst_level), mDstPoint(dst_point)
+      , mCompressed(compressed)
+    { }
+
+    virtual ULONG execute()
+    {
+        mTarget->copyImageGL(mSrcTarget, mSrcBinding, mSrcLevel, mSrcRect,
+                             mDstTarget, mDstBinding, mDstLevel, mDstPoint,
+                             mCompressed);
+        return sizeof(*this);
+    }
+};
+
 void D3DGLDevice::debugProcGL(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei /*length*/, const GLchar *message) const
 {
     std::stringstream sstr;
@@ -1275,6 +1331,9 @@ void D3DGLDevice::initGL(HDC dc, HGLRC glcontext)
     glBindProgramPipeline(mGLState.pipeline);
     checkGLError();
 
+    mProgramCache.initGL();
+    InitShaderBuildGL();
+
     glGenFramebuffers(1, &mGLState.main_framebuffer);
     glGenFramebuffers(2, mGLState.copy_framebuffers);
     checkGLError();
@@ -1325,6 +1384,13 @@ void D3DGLDevice::initGL(HDC dc, HGLRC glcontext)
 
     glFrontFace(GL_CCW);
     checkGLError();
+
+    mBufferNames.refillGL();
+    mTextureNames.refillGL();
+    mRenderbufferNames.refillGL();
+    mQueryNames.refillGL();
+
+    mUploadRing.initGL();
 }
 class InitGLDeviceCmd : public Command {
     D3DGLDevice *mTarget;
@@ -1342,6 +1408,13 @@ public:
 
 void D3DGLDevice::deinitGL()
 {
+    mQueryNames.deinitGL();
+    mRenderbufferNames.deinitGL();
+    mTextureNames.deinitGL();
+    mBufferNames.deinitGL();
+
+    mUploadRing.deinitGL();
+
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
     glDeleteBuffers(1, &mGLState.vtx_state_uniform_buffer);
@@ -1361,6 +1434,38 @@ void D3DGLDevice::deinitGL()
 
     wglMakeCurrent(nullptr, nullptr);
 }
+void D3DGLDevice::flushDeletesGL()
+{
+    mBufferNames.flushDeletesGL();
+    mTextureNames.flushDeletesGL();
+    mQueryNames.flushDeletesGL();
+}
+
+void D3DGLDevice::addReadbackGL(D3DGLPlainSurface *surface)
+{
+    if(std::find(mPendingReadbacks.begin(), mPendingReadbacks.end(), surface) == mPendingReadbacks.end())
+        mPendingReadbacks.push_back(surface);
+}
+
+void D3DGLDevice::removeReadbackGL(D3DGLPlainSurface *surface)
+{
+    auto iter = std::find(mPendingReadbacks.begin(), mPendingReadbacks.end(), surface);
+    if(iter != mPendingReadbacks.end())
+        mPendingReadbacks.erase(iter);
+}
+
+void D3DGLDevice::pollReadbacksGL()
+{
+    auto iter = mPendingReadbacks.begin();
+    while(iter != mPendingReadbacks.end())
+    {
+        if(!(*iter)->resolveReadbackGL(false))
+            ++iter;
+        else
+            iter = mPendingReadbacks.erase(iter);
+    }
+}
+
 class DeinitGLDeviceCmd : public Command {
     D3DGLDevice *mTarget;
 
@@ -1380,11 +1485,17 @@ D3DGLDevice::D3DGLDevice(Direct3DGL *parent, const D3DAdapter &adapter, HWND win
   , mAdapter(adapter)
   , mGLDeviceCtx(nullptr)
   , mGLContext(nullptr)
+  , mBufferNames(GLNamePool::Buffer)
+  , mTextureNames(GLNamePool::Texture)
+  , mRenderbufferNames(GLNamePool::Renderbuffer)
+  , mQueryNames(GLNamePool::Query)
   , mWindow(window)
   , mFlags(flags)
   , mAutoDepthStencil(nullptr)
   , mSwapchains{nullptr}
   , mDepthStencil(nullptr)
+  , mTexturesDirty(false)
+  , mCurrentPalette(0)
   , mInScene(false)
   , mVSConstantsF{0.0f}
   , mPSConstantsF{0.0f}
@@ -1393,6 +1504,7 @@ D3DGLDevice::D3DGLDevice(Direct3DGL *parent, const D3DAdapter &adapter, HWND win
   , mVertexDecl(nullptr)
   , mIndexBuffer(nullptr)
   , mPrimitiveUserData(nullptr)
+  , mPrimitiveUserIndices(nullptr)
   , mDepthBits(0)
   , mShadowSamplers(0)
   , mNewPixelShader(false)
@@ -1417,8 +1529,16 @@ D3DGLDevice::D3DGLDevice(Direct3DGL *parent, const D3DAdapter &adapter, HWND win
 
 D3DGLDevice::~D3DGLDevice()
 {
-    delete mPrimitiveUserData;
+    // Finish with the textures being compressed while they can still be
+    // deleted.
+    mCompressor.stop();
+
+    if(mPrimitiveUserData)
+        mQueue.send<CommandDelete<D3DGLBufferObject>>(mPrimitiveUserData);
     mPrimitiveUserData = nullptr;
+    if(mPrimitiveUserIndices)
+        mQueue.send<CommandDelete<D3DGLBufferObject>>(mPrimitiveUserIndices);
+    mPrimitiveUserIndices = nullptr;
 
     for(auto &stream : mStreams)
     {
@@ -1463,6 +1583,15 @@ D3DGLDevice::~D3DGLDevice()
 
 bool D3DGLDevice::init(D3DPRESENT_PARAMETERS *params)
 {
+    mResidency.setBudget(UINT64(mAdapter.getVideoMemory()) * 1024*1024);
+    if(CompressTextures)
+    {
+        if(mAdapter.getDecodedFormat(D3DFMT_DXT1))
+            WARN("Texture compression requested, but S3TC is not supported\n");
+        else
+            mCompressor.setEnabled(true);
+    }
+
     if(params->BackBufferCount > 1)
     {
         WARN("Too many backbuffers requested (%u)\n", params->BackBufferCount);
@@ -1471,12 +1600,6 @@ bool D3DGLDevice::init(D3DPRESENT_PARAMETERS *params)
     }
     params->BackBufferCount = 1;
 
-    if((params->Flags&D3DPRESENTFLAG_LOCKABLE_BACKBUFFER))
-    {
-        FIXME("Lockable backbuffer not currently supported\n");
-        return false;
-    }
-
     if(!(mAdapter.getUsage(D3DRTYPE_SURFACE, params->BackBufferFormat)&D3DUSAGE_RENDERTARGET))
     {
         WARN("Format %s is not a valid rendertarget format\n", d3dfmt_to_str(params->BackBufferFormat));
@@ -1541,6 +1664,8 @@ bool D3DGLDevice::init(D3DPRESENT_PARAMETERS *params)
     }
 
     mQueue.sendSync<InitGLDeviceCmd>(this, mGLDeviceCtx, mGLContext);
+    // After the GL init, which creates the cache directory.
+    mVariantManifest.load();
 
     return SUCCEEDED(Reset(params));
 }
@@ -1555,11 +1680,11 @@ HRESULT D3DGLDevice::sendVtxData(INT startvtx, const StreamSource *sources, UINT
         return D3D_OK;
     }
 
-    /* Wait for the vertex shader to finish building if it's in the process of
-     * doing so. We need its UsageMap to set the proper vertex attributes.
+    /* This waits for the vertex shader's translation if it's still going. We
+     * need its UsageMap to set the proper vertex attributes, but not the GL
+     * program itself.
      */
-    while(vshader->checkShadowSamplers(mShadowSamplers),vshader->getPendingUpdates() > 0)
-        mQueue.wakeAndSleep();
+    vshader->checkShadowSamplers(mShadowSamplers);
 
     if(D3DGLPixelShader *pshader = mPixelShader)
         pshader->setProgram(mGLState.pipeline, mShadowSamplers, mNewPixelShader.exchange(false));
@@ -1678,14 +1803,18 @@ HRESULT D3DGLDevice::TestCooperativeLevel()
 
 UINT D3DGLDevice::GetAvailableTextureMem()
 {
-    FIXME("iface %p : stub!\n", this);
-    return 0;
+    TRACE("iface %p\n", this);
+
+    // Reported in whole MBs, like Windows does.
+    UINT64 avail = mResidency.getAvailable() & ~UINT64(0xfffff);
+    return (UINT)std::min<UINT64>(avail, 0xfff00000u);
 }
 
 HRESULT D3DGLDevice::EvictManagedResources()
 {
-    FIXME("iface %p : stub!\n", this);
-    return E_NOTIMPL;
+    TRACE("iface %p\n", this);
+    mResidency.evictAll();
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::GetDirect3D(IDirect3D9 **d3d9)
@@ -1780,12 +1909,6 @@ HRESULT D3DGLDevice::CreateAdditionalSwapChain(D3DPRESENT_PARAMETERS *params, ID
     }
     params->BackBufferCount = 1;
 
-    if((params->Flags&D3DPRESENTFLAG_LOCKABLE_BACKBUFFER))
-    {
-        FIXME("Lockable backbuffer not currently supported\n");
-        return D3DERR_INVALIDCALL;
-    }
-
     if(!(mAdapter.getUsage(D3DRTYPE_SURFACE, params->BackBufferFormat)&D3DUSAGE_RENDERTARGET))
     {
         WARN("Format %s is not a valid rendertarget format\n", d3dfmt_to_str(params->BackBufferFormat));
@@ -1881,12 +2004,6 @@ HRESULT D3DGLDevice::Reset(D3DPRESENT_PARAMETERS *params)
     }
     params->BackBufferCount = 1;
 
-    if((params->Flags&D3DPRESENTFLAG_LOCKABLE_BACKBUFFER))
-    {
-        FIXME("Lockable backbuffer not currently supported\n");
-        return D3DERR_INVALIDCALL;
-    }
-
     if(!(mAdapter.getUsage(D3DRTYPE_SURFACE, params->BackBufferFormat)&D3DUSAGE_RENDERTARGET))
     {
         WARN("Format %s is not a valid rendertarget format\n", d3dfmt_to_str(params->BackBufferFormat));
@@ -2268,12 +2385,6 @@ HRESULT D3DGLDevice::CreateRenderTarget(UINT width, UINT height, D3DFORMAT forma
         WARN("NULL surface storage specified\n");
         return D3DERR_INVALIDCALL;
     }
-    if(lockable)
-    {
-        FIXME("Lockable rendertargets not implemented\n");
-        return D3DERR_INVALIDCALL;
-    }
-
     HRESULT hr = D3D_OK;
     DWORD realusage = mAdapter.getUsage(D3DRTYPE_SURFACE, format);
     if(!(D3DUSAGE_RENDERTARGET&realusage))
@@ -2293,7 +2404,7 @@ HRESULT D3DGLDevice::CreateRenderTarget(UINT width, UINT height, D3DFORMAT forma
     desc.Height = height;
 
     D3DGLRenderTarget *rtarget = new D3DGLRenderTarget(this);
-    if(!rtarget->init(&desc))
+    if(!rtarget->init(&desc, false, lockable))
     {
         delete rtarget;
         return D3DERR_INVALIDCALL;
@@ -2352,35 +2463,436 @@ HRESULT D3DGLDevice::CreateDepthStencilSurface(UINT width, UINT height, D3DFORMA
 }
 
 
+// Finds the start of a rect in a level's system memory, and the row pitch.
+static const GLubyte *GetSysMemRect(const GLubyte *data, const GLFormatInfo &format, bool compressed, UINT width, const RECT &rect, int &pitch)
+{
+    if(compressed)
+    {
+        pitch = GLFormatInfo::calcBlockPitch(width, format.bytesperblock);
+        return data + (rect.top/4*pitch) + (rect.left/4*format.bytesperblock);
+    }
+    pitch = GLFormatInfo::calcPitch(width, format.bytesperpixel);
+    return data + (rect.top*pitch) + (rect.left*format.bytesperpixel);
+}
+
+// Scales a level 0 dirty rect to the given level, rounding out to whole
+// blocks for compressed formats.
+static RECT GetLevelDirtyRect(const RECT &dirty, UINT level, UINT width, UINT height, bool compressed)
+{
+    LONG round = (1<<level) - 1;
+    RECT rect = { std::max<LONG>(dirty.left, 0)>>level, std::max<LONG>(dirty.top, 0)>>level,
+                  (dirty.right+round)>>level, (dirty.bottom+round)>>level };
+    if(compressed)
+    {
+        rect.left &= ~3;
+        rect.top &= ~3;
+        rect.right = (rect.right+3) & ~3;
+        rect.bottom = (rect.bottom+3) & ~3;
+    }
+    rect.right = std::min(rect.right, (LONG)width);
+    rect.bottom = std::min(rect.bottom, (LONG)height);
+    return rect;
+}
+
+// Finds which source level matches the destination's first level, since the
+// source may have more levels.
+static bool GetUpdateLevels(const D3DSURFACE_DESC &srcdesc, UINT srclevels, const D3DSURFACE_DESC &dstdesc, UINT dstlevels, UINT &srclevel)
+{
+    if(srcdesc.Format != dstdesc.Format)
+        return false;
+    if(dstdesc.Pool != D3DPOOL_DEFAULT ||
+       (srcdesc.Pool != D3DPOOL_SYSTEMMEM && srcdesc.Pool != D3DPOOL_DEFAULT))
+        return false;
+
+    srclevel = 0;
+    while(srclevel < srclevels && std::max(1u, srcdesc.Width>>srclevel) > dstdesc.Width)
+        ++srclevel;
+    if(std::max(1u, srcdesc.Width>>srclevel) != dstdesc.Width ||
+       std::max(1u, srcdesc.Height>>srclevel) != dstdesc.Height)
+        return false;
+    return srclevels-srclevel >= dstlevels;
+}
+
+static HRESULT UpdateTexture2D(D3DGLDevice *device, D3DGLTexture *src, D3DGLTexture *dst)
+{
+    const D3DSURFACE_DESC &srcdesc = src->getDesc();
+    const D3DSURFACE_DESC &dstdesc = dst->getDesc();
+    UINT dstlevels = dst->GetLevelCount();
+    UINT srclevel;
+    if(!GetUpdateLevels(srcdesc, src->GetLevelCount(), dstdesc, dstlevels, srclevel))
+    {
+        WARN("Incompatible textures: src=%ux%u %s pool 0x%x, dst=%ux%u %s pool 0x%x\n",
+             srcdesc.Width, srcdesc.Height, d3dfmt_to_str(srcdesc.Format), srcdesc.Pool,
+             dstdesc.Width, dstdesc.Height, d3dfmt_to_str(dstdesc.Format), dstdesc.Pool);
+        return D3DERR_INVALIDCALL;
+    }
+    // Auto-generated mipmaps are made from the first level.
+    if((dstdesc.Usage&D3DUSAGE_AUTOGENMIPMAP))
+        dstlevels = 1;
+
+    RECT dirty;
+    if(!src->takeDirtyRect(dirty))
+        return D3D_OK;
+    dst->markContentChanged();
+
+    bool compressed = src->isCompressed();
+    for(UINT i = 0;i < dstlevels;++i)
+    {
+        UINT w = std::max(1u, dstdesc.Width>>i);
+        UINT h = std::max(1u, dstdesc.Height>>i);
+        RECT rect = GetLevelDirtyRect(dirty, srclevel+i, w, h, compressed);
+        if(rect.left >= rect.right || rect.top >= rect.bottom)
+            continue;
+
+        if(srcdesc.Pool == D3DPOOL_DEFAULT)
+            device->getQueue().send<CopyImageCmd>(device,
+                GL_TEXTURE_2D, src->getTextureId(), srclevel+i, rect,
+                GL_TEXTURE_2D, dst->getTextureId(), i, POINT{rect.left, rect.top},
+                compressed
+            );
+        else
+        {
+            int pitch;
+            const GLubyte *data = GetSysMemRect(src->getSurface(srclevel+i)->getSysMemData(),
+                                                src->getFormat(), compressed, w, rect, pitch);
+            dst->uploadRect(i, rect, data, pitch);
+        }
+    }
+    if(srcdesc.Pool == D3DPOOL_DEFAULT && (dstdesc.Usage&D3DUSAGE_AUTOGENMIPMAP))
+        dst->GenerateMipSubLevels();
+
+    return D3D_OK;
+}
+
+static HRESULT UpdateTextureCube(D3DGLDevice *device, D3DGLCubeTexture *src, D3DGLCubeTexture *dst)
+{
+    const D3DSURFACE_DESC &srcdesc = src->getDesc();
+    const D3DSURFACE_DESC &dstdesc = dst->getDesc();
+    UINT dstlevels = dst->GetLevelCount();
+    UINT srclevel;
+    if(!GetUpdateLevels(srcdesc, src->GetLevelCount(), dstdesc, dstlevels, srclevel))
+    {
+        WARN("Incompatible textures: src=%ux%u %s pool 0x%x, dst=%ux%u %s pool 0x%x\n",
+             srcdesc.Width, srcdesc.Height, d3dfmt_to_str(srcdesc.Format), srcdesc.Pool,
+             dstdesc.Width, dstdesc.Height, d3dfmt_to_str(dstdesc.Format), dstdesc.Pool);
+        return D3DERR_INVALIDCALL;
+    }
+    if((dstdesc.Usage&D3DUSAGE_AUTOGENMIPMAP))
+        dstlevels = 1;
+    dst->markContentChanged();
+
+    bool compressed = src->isCompressed();
+    for(GLint face = 0;face < 6;++face)
+    {
+        RECT dirty;
+        if(!src->takeDirtyRect(face, dirty))
+            continue;
+
+        for(UINT i = 0;i < dstlevels;++i)
+        {
+            UINT w = std::max(1u, dstdesc.Width>>i);
+            UINT h = std::max(1u, dstdesc.Height>>i);
+            RECT rect = GetLevelDirtyRect(dirty, srclevel+i, w, h, compressed);
+            if(rect.left >= rect.right || rect.top >= rect.bottom)
+                continue;
+
+            D3DGLCubeSurface *srcsurface = src->getSurface(srclevel+i, face);
+            if(srcdesc.Pool == D3DPOOL_DEFAULT)
+                device->getQueue().send<CopyImageCmd>(device,
+                    srcsurface->getTarget(), src->getTextureId(), srclevel+i, rect,
+                    dst->getSurface(i, face)->getTarget(), dst->getTextureId(), i,
+                    POINT{rect.left, rect.top}, compressed
+                );
+            else
+            {
+                int pitch;
+                const GLubyte *data = GetSysMemRect(srcsurface->getSysMemData(), src->getFormat(),
+                                                    compressed, w, rect, pitch);
+                dst->uploadRect(i, face, rect, data, pitch);
+            }
+        }
+    }
+    if(srcdesc.Pool == D3DPOOL_DEFAULT && (dstdesc.Usage&D3DUSAGE_AUTOGENMIPMAP))
+        dst->GenerateMipSubLevels();
+
+    return D3D_OK;
+}
+
 HRESULT D3DGLDevice::UpdateSurface(IDirect3DSurface9 *srcsurface, const RECT *srcrect, IDirect3DSurface9 *dstsurface, const POINT *dstpoint)
 {
-    FIXME("iface %p, srcsurface %p, srcrect %p, dstsurface %p, dstpoint %p : stub!\n", this, srcsurface, srcrect, dstsurface, dstpoint);
-    return E_NOTIMPL;
+    TRACE("iface %p, srcsurface %p, srcrect %p, dstsurface %p, dstpoint %p\n", this, srcsurface, srcrect, dstsurface, dstpoint);
+
+    if(!srcsurface || !dstsurface)
+        return D3DERR_INVALIDCALL;
+
+    D3DSURFACE_DESC srcdesc, dstdesc;
+    if(FAILED(srcsurface->GetDesc(&srcdesc)) || FAILED(dstsurface->GetDesc(&dstdesc)))
+        return D3DERR_INVALIDCALL;
+    if(srcdesc.Format != dstdesc.Format || dstdesc.Pool != D3DPOOL_DEFAULT ||
+       (srcdesc.Pool != D3DPOOL_SYSTEMMEM && srcdesc.Pool != D3DPOOL_DEFAULT) ||
+       srcdesc.MultiSampleType != D3DMULTISAMPLE_NONE || dstdesc.MultiSampleType != D3DMULTISAMPLE_NONE)
+    {
+        WARN("Incompatible surfaces: src=%s pool 0x%x ms 0x%x, dst=%s pool 0x%x ms 0x%x\n",
+             d3dfmt_to_str(srcdesc.Format), srcdesc.Pool, srcdesc.MultiSampleType,
+             d3dfmt_to_str(dstdesc.Format), dstdesc.Pool, dstdesc.MultiSampleType);
+        return D3DERR_INVALIDCALL;
+    }
+
+    RECT src_rect = { 0, 0, (LONG)srcdesc.Width, (LONG)srcdesc.Height };
+    if(srcrect) src_rect = *srcrect;
+    POINT dst_point = { 0, 0 };
+    if(dstpoint) dst_point = *dstpoint;
+    RECT dst_rect = { dst_point.x, dst_point.y,
+                      dst_point.x + (src_rect.right-src_rect.left),
+                      dst_point.y + (src_rect.bottom-src_rect.top) };
+    if(src_rect.left < 0 || src_rect.top < 0 || src_rect.left >= src_rect.right ||
+       src_rect.top >= src_rect.bottom || src_rect.right > (LONG)srcdesc.Width ||
+       src_rect.bottom > (LONG)srcdesc.Height || dst_rect.left < 0 || dst_rect.top < 0 ||
+       dst_rect.right > (LONG)dstdesc.Width || dst_rect.bottom > (LONG)dstdesc.Height)
+    {
+        WARN("Invalid rect: src %ld,%ld x %ld,%ld, dst %ld,%ld x %ld,%ld\n",
+             src_rect.left, src_rect.top, src_rect.right, src_rect.bottom,
+             dst_rect.left, dst_rect.top, dst_rect.right, dst_rect.bottom);
+        return D3DERR_INVALIDCALL;
+    }
+
+    union {
+        void *pointer;
+        D3DGLTextureSurface *tex2dsurface;
+        D3DGLRenderTarget *surface;
+        D3DGLCubeSurface *cubesurface;
+        D3DGLPlainSurface *plainsurface;
+    };
+
+    // Default pool sources are copied on the GPU, others are uploaded from
+    // their system memory.
+    GLenum src_target = GL_NONE;
+    GLuint src_binding = 0;
+    GLint src_level = 0;
+    const GLubyte *src_data = nullptr;
+    std::shared_ptr<GLubyte> plaindata;
+    const GLFormatInfo *src_format = nullptr;
+    bool compressed = false;
+    if(SUCCEEDED(srcsurface->QueryInterface(IID_D3DGLTextureSurface, &pointer)))
+    {
+        D3DGLTexture *texture = tex2dsurface->getParent();
+        if(srcdesc.Pool == D3DPOOL_DEFAULT)
+        {
+            src_target = GL_TEXTURE_2D;
+            src_binding = texture->getTextureId();
+            src_level = tex2dsurface->getLevel();
+        }
+        else
+            src_data = tex2dsurface->getSysMemData();
+        src_format = &texture->getFormat();
+        compressed = texture->isCompressed();
+        tex2dsurface->Release();
+    }
+    else if(SUCCEEDED(srcsurface->QueryInterface(IID_D3DGLCubeSurface, &pointer)))
+    {
+        D3DGLCubeTexture *texture = cubesurface->getParent();
+        if(srcdesc.Pool == D3DPOOL_DEFAULT)
+        {
+            src_target = cubesurface->getTarget();
+            src_binding = texture->getTextureId();
+            src_level = cubesurface->getLevel();
+        }
+        else
+            src_data = cubesurface->getSysMemData();
+        src_format = &texture->getFormat();
+        compressed = texture->isCompressed();
+        cubesurface->Release();
+    }
+    else if(SUCCEEDED(srcsurface->QueryInterface(IID_D3DGLRenderTarget, &pointer)))
+    {
+        src_target = GL_RENDERBUFFER;
+        src_binding = surface->getId();
+        src_level = 0;
+        src_format = &surface->getFormat();
+        surface->Release();
+    }
+    else if(SUCCEEDED(srcsurface->QueryInterface(IID_D3DGLPlainSurface, &pointer)))
+    {
+        // Wait for any readback into it to finish.
+        plainsurface->finishReadback();
+        plaindata = plainsurface->getBufData();
+        src_data = plaindata.get();
+        src_format = &plainsurface->getFormat();
+        compressed = plainsurface->isCompressed();
+        plainsurface->Release();
+    }
+    else
+    {
+        FIXME("Unhandled source surface: %p\n", srcsurface);
+        return D3DERR_INVALIDCALL;
+    }
+
+    if(compressed)
+    {
+        // Compressed copies have to be of whole blocks, except at the edges.
+        if((src_rect.left&3) || (src_rect.top&3) || (dst_rect.left&3) || (dst_rect.top&3) ||
+           ((src_rect.right&3) && src_rect.right != (LONG)srcdesc.Width) ||
+           ((src_rect.bottom&3) && src_rect.bottom != (LONG)srcdesc.Height))
+        {
+            WARN("Unaligned compressed rect: %ld,%ld x %ld,%ld\n", src_rect.left, src_rect.top,
+                 src_rect.right, src_rect.bottom);
+            return D3DERR_INVALIDCALL;
+        }
+    }
+
+    if(SUCCEEDED(dstsurface->QueryInterface(IID_D3DGLTextureSurface, &pointer)))
+    {
+        D3DGLTexture *texture = tex2dsurface->getParent();
+        texture->markContentChanged();
+        if(src_data)
+        {
+            int pitch;
+            const GLubyte *data = GetSysMemRect(src_data, *src_format, compressed, srcdesc.Width,
+                                                src_rect, pitch);
+            texture->uploadRect(tex2dsurface->getLevel(), dst_rect, data, pitch);
+        }
+        else
+            mQueue.send<CopyImageCmd>(this, src_target, src_binding, src_level, src_rect,
+                GL_TEXTURE_2D, texture->getTextureId(), tex2dsurface->getLevel(), dst_point,
+                compressed
+            );
+        tex2dsurface->Release();
+    }
+    else if(SUCCEEDED(dstsurface->QueryInterface(IID_D3DGLCubeSurface, &pointer)))
+    {
+        D3DGLCubeTexture *texture = cubesurface->getParent();
+        texture->markContentChanged();
+        if(src_data)
+        {
+            int pitch;
+            const GLubyte *data = GetSysMemRect(src_data, *src_format, compressed, srcdesc.Width,
+                                                src_rect, pitch);
+            texture->uploadRect(cubesurface->getLevel(), cubesurface->getFaceNum(), dst_rect,
+                                data, pitch);
+        }
+        else
+            mQueue.send<CopyImageCmd>(this, src_target, src_binding, src_level, src_rect,
+                cubesurface->getTarget(), texture->getTextureId(), cubesurface->getLevel(),
+                dst_point, compressed
+            );
+        cubesurface->Release();
+    }
+    else if(!src_data && SUCCEEDED(dstsurface->QueryInterface(IID_D3DGLRenderTarget, &pointer)))
+    {
+        mQueue.send<CopyImageCmd>(this, src_target, src_binding, src_level, src_rect,
+                                  GL_RENDERBUFFER, surface->getId(), 0, dst_point, compressed);
+        surface->Release();
+    }
+    else
+    {
+        FIXME("Unhandled destination surface: %p\n", dstsurface);
+        return D3DERR_INVALIDCALL;
+    }
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::UpdateTexture(IDirect3DBaseTexture9 *srctexture, IDirect3DBaseTexture9 *dsttexture)
 {
-    FIXME("iface %p, srctexture %p, dsttexture %p : stub!\n", this, srctexture, dsttexture);
-    return E_NOTIMPL;
+    TRACE("iface %p, srctexture %p, dsttexture %p\n", this, srctexture, dsttexture);
+
+    if(!srctexture || !dsttexture)
+        return D3DERR_INVALIDCALL;
+
+    D3DRESOURCETYPE type = srctexture->GetType();
+    if(dsttexture->GetType() != type)
+    {
+        WARN("Mismatched texture types: 0x%x, 0x%x\n", type, dsttexture->GetType());
+        return D3DERR_INVALIDCALL;
+    }
+
+    HRESULT hr = D3DERR_INVALIDCALL;
+    if(type == D3DRTYPE_TEXTURE)
+    {
+        D3DGLTexture *src, *dst;
+        if(FAILED(srctexture->QueryInterface(IID_D3DGLTexture, (void**)&src)))
+        {
+            FIXME("Unhandled source texture: %p\n", srctexture);
+            return D3DERR_INVALIDCALL;
+        }
+        if(SUCCEEDED(dsttexture->QueryInterface(IID_D3DGLTexture, (void**)&dst)))
+        {
+            hr = UpdateTexture2D(this, src, dst);
+            dst->Release();
+        }
+        else
+            FIXME("Unhandled destination texture: %p\n", dsttexture);
+        src->Release();
+    }
+    else if(type == D3DRTYPE_CUBETEXTURE)
+    {
+        D3DGLCubeTexture *src, *dst;
+        if(FAILED(srctexture->QueryInterface(IID_D3DGLCubeTexture, (void**)&src)))
+        {
+            FIXME("Unhandled source texture: %p\n", srctexture);
+            return D3DERR_INVALIDCALL;
+        }
+        if(SUCCEEDED(dsttexture->QueryInterface(IID_D3DGLCubeTexture, (void**)&dst)))
+        {
+            hr = UpdateTextureCube(this, src, dst);
+            dst->Release();
+        }
+        else
+            FIXME("Unhandled destination texture: %p\n", dsttexture);
+        src->Release();
+    }
+    else
+    {
+        FIXME("Unhandled texture type: 0x%x\n", type);
+        hr = E_NOTIMPL;
+    }
+
+    return hr;
 }
 
 HRESULT D3DGLDevice::GetRenderTargetData(IDirect3DSurface9 *rtsurface, IDirect3DSurface9 *dstsurface)
 {
-    TRACE("iface %p, rtsurface %p, dstsurface %p : semi-stub\n", this, rtsurface, dstsurface);
+    TRACE("iface %p, rtsurface %p, dstsurface %p\n", this, rtsurface, dstsurface);
+
+    if(!rtsurface || !dstsurface)
+        return D3DERR_INVALIDCALL;
 
     GLenum src_target = GL_NONE;
     GLuint src_binding = 0;
     GLint src_level = 0;
     D3DSURFACE_DESC srcdesc;
 
-    D3DGLRenderTarget *rtarget;
-    if(SUCCEEDED(rtsurface->QueryInterface(IID_D3DGLRenderTarget, (void**)&rtarget)))
+    union {
+        void *pointer;
+        D3DGLTextureSurface *tex2dsurface;
+        D3DGLRenderTarget *surface;
+        D3DGLCubeSurface *cubesurface;
+        D3DGLPlainSurface *plainsurface;
+    };
+
+    if(SUCCEEDED(rtsurface->QueryInterface(IID_D3DGLRenderTarget, &pointer)))
     {
-        srcdesc = rtarget->getDesc();
+        srcdesc = surface->getDesc();
         src_target = GL_RENDERBUFFER;
-        src_binding = rtarget->getId();
+        src_binding = surface->getId();
         src_level = 0;
-        rtarget->Release();
+        surface->Release();
+    }
+    else if(SUCCEEDED(rtsurface->QueryInterface(IID_D3DGLTextureSurface, &pointer)))
+    {
+        tex2dsurface->GetDesc(&srcdesc);
+        src_target = GL_TEXTURE_2D;
+        src_binding = tex2dsurface->getParent()->getTextureId();
+        src_level = tex2dsurface->getLevel();
+        tex2dsurface->Release();
+    }
+    else if(SUCCEEDED(rtsurface->QueryInterface(IID_D3DGLCubeSurface, &pointer)))
+    {
+        cubesurface->GetDesc(&srcdesc);
+        src_target = cubesurface->getTarget();
+        src_binding = cubesurface->getParent()->getTextureId();
+        src_level = cubesurface->getLevel();
+        cubesurface->Release();
     }
     else
     {
@@ -2401,19 +2913,13 @@ HRESULT D3DGLDevice::GetRenderTargetData(IDirect3DSurface9 *rtsurface, IDirect3D
         return D3DERR_INVALIDCALL;
     }
 
-    D3DGLPlainSurface *plainsurface;
-    if(SUCCEEDED(dstsurface->QueryInterface(IID_D3DGLPlainSurface, (void**)&plainsurface)))
+    if(SUCCEEDED(dstsurface->QueryInterface(IID_D3DGLPlainSurface, &pointer)))
     {
-        std::atomic<ULONG> &pendingupdates = plainsurface->getPendingUpdates();
-        std::shared_ptr<GLubyte> data = plainsurface->getBufData();
-        GLFormatInfo format = plainsurface->getFormat();
+        // Queued into a pack buffer, so neither the GPU nor this thread waits
+        // until the surface is locked.
         RECT rect{ 0, 0, (LONG)srcdesc.Width, (LONG)srcdesc.Height };
-
-        ++pendingupdates;
-        mQueue.send<ReadFramebufferCmd>(this, src_target, src_binding, src_level, rect,
-            format.format, format.type, data, make_ref(pendingupdates)
-        );
-
+        POINT point{ 0, 0 };
+        plainsurface->queueReadback(src_target, src_binding, src_level, rect, point);
         plainsurface->Release();
     }
     else
@@ -2427,8 +2933,15 @@ HRESULT D3DGLDevice::GetRenderTargetData(IDirect3DSurface9 *rtsurface, IDirect3D
 
 HRESULT D3DGLDevice::GetFrontBufferData(UINT swapchain, IDirect3DSurface9 *dstsurface)
 {
-    FIXME("iface %p, swapchain %u, dstsurface %p : stub!\n", this, swapchain, dstsurface);
-    return E_NOTIMPL;
+    TRACE("iface %p, swapchain %u, dstsurface %p\n", this, swapchain, dstsurface);
+
+    if(swapchain >= mSwapchains.size())
+    {
+        WARN("Out of range swapchain (%u >= %u)\n", swapchain, mSwapchains.size());
+        return D3DERR_INVALIDCALL;
+    }
+
+    return mSwapchains[swapchain]->GetFrontBufferData(dstsurface);
 }
 
 HRESULT D3DGLDevice::StretchRect(IDirect3DSurface9 *srcSurface, const RECT *srcRect, IDirect3DSurface9 *dstSurface, const RECT *dstRect, D3DTEXTUREFILTERTYPE filter)
@@ -2503,6 +3016,7 @@ HRESULT D3DGLDevice::StretchRect(IDirect3DSurface9 *srcSurface, const RECT *srcR
         dst_binding = tex2dsurface->getParent()->getTextureId();
         dst_level = tex2dsurface->getLevel();
         dst_mask = tex2dsurface->getFormat().buffermask;
+        tex2dsurface->getParent()->markContentChanged();
         tex2dsurface->Release();
     }
     else if(SUCCEEDED(dstSurface->QueryInterface(IID_D3DGLRenderTarget, &pointer)))
@@ -2519,6 +3033,7 @@ HRESULT D3DGLDevice::StretchRect(IDirect3DSurface9 *srcSurface, const RECT *srcR
         dst_binding = cubesurface->getParent()->getTextureId();
         dst_level = cubesurface->getLevel();
         dst_mask = cubesurface->getFormat().buffermask;
+        cubesurface->getParent()->markContentChanged();
         cubesurface->Release();
     }
     else
@@ -2611,6 +3126,30 @@ HRESULT D3DGLDevice::CreateOffscreenPlainSurface(UINT width, UINT height, D3DFOR
     return D3D_OK;
 }
 
+// Texture surfaces that get locked start reading back once they're no longer
+// drawn to, so the next lock doesn't have to wait on the GPU.
+static void QueueRenderTargetReadback(const D3DGLDevice *device, IDirect3DSurface9 *rtarget)
+{
+    if(device->isRenderTarget(rtarget))
+        return;
+
+    union {
+        void *pointer;
+        D3DGLTextureSurface *tex2dsurface;
+        D3DGLCubeSurface *cubesurface;
+    };
+    if(SUCCEEDED(rtarget->QueryInterface(IID_D3DGLTextureSurface, &pointer)))
+    {
+        tex2dsurface->queueReadback();
+        tex2dsurface->Release();
+    }
+    else if(SUCCEEDED(rtarget->QueryInterface(IID_D3DGLCubeSurface, &pointer)))
+    {
+        cubesurface->queueReadback();
+        cubesurface->Release();
+    }
+}
+
 HRESULT D3DGLDevice::SetRenderTarget(DWORD index, IDirect3DSurface9 *rtarget)
 {
     TRACE("iface %p, index %lu, rendertarget %p\n", this, index, rtarget);
@@ -2635,7 +3174,11 @@ HRESULT D3DGLDevice::SetRenderTarget(DWORD index, IDirect3DSurface9 *rtarget)
             GL_RENDERBUFFER, 0, 0
         );
         mQueue.unlock();
-        if(rtarget) rtarget->Release();
+        if(rtarget)
+        {
+            QueueRenderTargetReadback(this, rtarget);
+            rtarget->Release();
+        }
         return D3D_OK;
     }
 
@@ -2655,6 +3198,7 @@ HRESULT D3DGLDevice::SetRenderTarget(DWORD index, IDirect3DSurface9 *rtarget)
             return D3DERR_INVALIDCALL;
         }
 
+        tex2d->markContentChanged();
         mQueue.lock();
         rtarget = mRenderTargets[index].exchange(tex2dsurface);
         mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState), GL_COLOR_ATTACHMENT0+index,
@@ -2688,6 +3232,7 @@ HRESULT D3DGLDevice::SetRenderTarget(DWORD index, IDirect3DSurface9 *rtarget)
             return D3DERR_INVALIDCALL;
         }
 
+        cubetex->markContentChanged();
         mQueue.lock();
         rtarget = mRenderTargets[index].exchange(cubesurface);
         mQueue.doSend<SetFBAttachmentCmd>(make_ref(mGLState), GL_COLOR_ATTACHMENT0+index,
@@ -2701,7 +3246,11 @@ HRESULT D3DGLDevice::SetRenderTarget(DWORD index, IDirect3DSurface9 *rtarget)
         rtarget->AddRef();
         rtarget = mRenderTargets[index].exchange(rtarget);
     }
-    if(rtarget) rtarget->Release();
+    if(rtarget)
+    {
+        QueueRenderTargetReadback(this, rtarget);
+        rtarget->Release();
+    }
 
     return D3D_OK;
 }
@@ -3326,6 +3875,67 @@ HRESULT D3DGLDevice::GetTexture(DWORD stage, IDirect3DBaseTexture9 **texture)
     return D3D_OK;
 }
 
+bool D3DGLDevice::isTextureBound(const IDirect3DBaseTexture9 *texture) const
+{
+    for(const auto &tex : mTextures)
+    {
+        if(tex.load() == texture)
+            return true;
+    }
+    return false;
+}
+
+bool D3DGLDevice::isRenderTarget(const IDirect3DSurface9 *surface) const
+{
+    for(const auto &rtarget : mRenderTargets)
+    {
+        if(rtarget.load() == surface)
+            return true;
+    }
+    return false;
+}
+
+bool D3DGLDevice::isBufferBound(const D3DGLBufferObject *buffer) const
+{
+    for(const auto &stream : mStreams)
+    {
+        if(stream.mBuffer == buffer)
+            return true;
+    }
+    return mIndexBuffer.load() == buffer;
+}
+
+void D3DGLDevice::flushTextureUpdates()
+{
+    for(auto &texture : mTextures)
+    {
+        IDirect3DBaseTexture9 *tex = texture.load();
+        if(!tex) continue;
+
+        union {
+            void *pointer;
+            D3DGLTexture *tex2d;
+            D3DGLCubeTexture *cubetex;
+            D3DGLTexture3D *tex3d;
+        };
+        if(SUCCEEDED(tex->QueryInterface(IID_D3DGLTexture, &pointer)))
+        {
+            tex2d->flushUpdates();
+            tex2d->Release();
+        }
+        else if(SUCCEEDED(tex->QueryInterface(IID_D3DGLCubeTexture, &pointer)))
+        {
+            cubetex->flushUpdates();
+            cubetex->Release();
+        }
+        else if(SUCCEEDED(tex->QueryInterface(IID_D3DGLTexture3D, &pointer)))
+        {
+            tex3d->flushUpdates();
+            tex3d->Release();
+        }
+    }
+}
+
 HRESULT D3DGLDevice::SetTexture(DWORD stage, IDirect3DBaseTexture9 *texture)
 {
     TRACE("iface %p, stage %lu, texture %p\n", this, stage, texture);
@@ -3359,15 +3969,20 @@ HRESULT D3DGLDevice::SetTexture(DWORD stage, IDirect3DBaseTexture9 *texture)
     };
     if(SUCCEEDED(texture->QueryInterface(IID_D3DGLTexture, &pointer)))
     {
+        mResidency.touch(tex2d);
         type = GL_TEXTURE_2D;
         binding = tex2d->getTextureId();
         texflags = tex2d->getFormat().flags;
+        tex2d->flushUpdates();
+        tex2d->checkCompress();
     }
     else if(SUCCEEDED(texture->QueryInterface(IID_D3DGLCubeTexture, &pointer)))
     {
+        mResidency.touch(cubetex);
         type = GL_TEXTURE_CUBE_MAP;
         binding = cubetex->getTextureId();
         texflags = cubetex->getFormat().flags;
+        cubetex->flushUpdates();
     }
     else
     {
@@ -3569,26 +4184,55 @@ HRESULT D3DGLDevice::ValidateDevice(DWORD *numpasses)
 
 HRESULT D3DGLDevice::SetPaletteEntries(UINT pnum, const PALETTEENTRY *entries)
 {
-    FIXME("iface %p, pnum %u, entries %p : stub!\n", this, pnum, entries);
-    return E_NOTIMPL;
+    TRACE("iface %p, pnum %u, entries %p\n", this, pnum, entries);
+
+    if(pnum > 0xffff || !entries)
+    {
+        WARN("Invalid palette %u, or null entries %p\n", pnum, entries);
+        return D3DERR_INVALIDCALL;
+    }
+
+    // Palettes are only applied when palettized textures are uploaded, so
+    // textures that were already loaded keep their old colors.
+    if(pnum >= mPalettes.size())
+        mPalettes.resize(pnum+1);
+    std::copy(entries, entries+256, mPalettes[pnum].begin());
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::GetPaletteEntries(UINT pnum, PALETTEENTRY *entries)
 {
-    FIXME("iface %p, pnum %u, entries %p : stub!\n", this, pnum, entries);
-    return E_NOTIMPL;
+    TRACE("iface %p, pnum %u, entries %p\n", this, pnum, entries);
+
+    if(pnum >= mPalettes.size() || !entries)
+    {
+        WARN("Invalid palette %u, or null entries %p\n", pnum, entries);
+        return D3DERR_INVALIDCALL;
+    }
+
+    std::copy(mPalettes[pnum].begin(), mPalettes[pnum].end(), entries);
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::SetCurrentTexturePalette(UINT pnum)
 {
-    FIXME("iface %p, pnum %u : stub!\n", this, pnum);
-    return E_NOTIMPL;
+    TRACE("iface %p, pnum %u\n", this, pnum);
+
+    if(pnum >= mPalettes.size())
+    {
+        WARN("Palette %u not set\n", pnum);
+        return D3DERR_INVALIDCALL;
+    }
+
+    mCurrentPalette = pnum;
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::GetCurrentTexturePalette(UINT *pnum)
 {
-    FIXME("iface %p, pnum %p : stub!\n", this, pnum);
-    return E_NOTIMPL;
+    TRACE("iface %p, pnum %p\n", this, pnum);
+    *pnum = mCurrentPalette;
+    return D3D_OK;
 }
 
 HRESULT D3DGLDevice::SetScissorRect(const RECT *rect)
@@ -3648,6 +4292,9 @@ HRESULT D3DGLDevice::DrawPrimitive(D3DPRIMITIVETYPE type, UINT startvtx, UINT co
 {
     TRACE("iface %p, type 0x%x, startVtx %u, count %u\n", this, type, startvtx, count);
 
+    if(mTexturesDirty.exchange(false))
+        flushTextureUpdates();
+
     mQueue.lock();
     HRESULT hr = sendVtxData(startvtx, mStreams.data(), mStreams.size());
     if(SUCCEEDED(hr))
@@ -3664,6 +4311,9 @@ HRESULT D3DGLDevice::DrawIndexedPrimitive(D3DPRIMITIVETYPE type, INT startvtx, U
 {
     TRACE("iface %p, type 0x%x, startvtx %d, minvtx %u, numvtx %u, startidx %u, count %u\n", this, type, startvtx, minvtx, numvtx, startidx, count);
 
+    if(mTexturesDirty.exchange(false))
+        flushTextureUpdates();
+
     if(type == D3DPT_POINTLIST)
     {
         WARN("Pointlist not allowed for indexed rendering\n");
@@ -3690,8 +4340,17 @@ HRESULT D3DGLDevice::DrawIndexedPrimitive(D3DPRIMITIVETYPE type, INT startvtx, U
             GLenum mode = GetGLDrawMode(type, count);
             GLenum type = GetGLIndexType(idxbuffer->getFormat(), startidx);
             GLubyte *pointer = ((GLubyte*)nullptr) + startidx;
+
+            // The start vertex is already applied to the attribute pointers,
+            // so the index range is relative to it.
+            UINT minidx, maxidx;
+            idxbuffer->getIndexRange(startidx, count, minidx, maxidx);
+            if(minidx < minvtx || maxidx >= minvtx+numvtx)
+                TRACE("Indices reference vertices outside of the given range (%u -> %u, expected %u -> %u)\n",
+                      minidx, maxidx, minvtx, minvtx+numvtx-1);
+
             mQueue.doSend<DrawGLElementsCmd>(make_ref(mGLState),
-                mode, count, type, pointer, num_instances, minvtx
+                mode, count, type, pointer, num_instances, minidx, maxidx, 0
             );
         }
     }
@@ -3703,6 +4362,9 @@ HRESULT D3DGLDevice::DrawPrimitiveUP(D3DPRIMITIVETYPE type, UINT count, const vo
 {
     TRACE("iface %p, type 0x%x, count %u, vtxData %p, vtxStride %u\n", this, type, count, vtxData, vtxStride);
 
+    if(mTexturesDirty.exchange(false))
+        flushTextureUpdates();
+
     GLenum mode = GetGLDrawMode(type, count);
 
     if(!mPrimitiveUserData)
@@ -3724,11 +4386,11 @@ HRESULT D3DGLDevice::DrawPrimitiveUP(D3DPRIMITIVETYPE type, UINT count, const vo
     stream.mStride = vtxStride;
     stream.mFreq = mStreams[0].mFreq;
 
+    D3DGLBufferObject *oldstream = nullptr;
     HRESULT hr = sendVtxData(0, &stream, 1);
     if(SUCCEEDED(hr))
     {
-        if(mStreams[0].mBuffer)
-            mStreams[0].mBuffer->releaseIface();
+        oldstream = mStreams[0].mBuffer;
         mStreams[0].mBuffer = nullptr;
         mStreams[0].mOffset = 0;
         mStreams[0].mStride = 0;
@@ -3737,13 +4399,96 @@ HRESULT D3DGLDevice::DrawPrimitiveUP(D3DPRIMITIVETYPE type, UINT count, const vo
     }
     mQueue.unlock();
 
+    if(oldstream) oldstream->releaseIface();
+
     return hr;
 }
 
 HRESULT D3DGLDevice::DrawIndexedPrimitiveUP(D3DPRIMITIVETYPE type, UINT minvtx, UINT numvtx, UINT count, const void *idxdata, D3DFORMAT idxformat, const void *vtxdata, UINT vtxstride)
 {
-    FIXME("iface %p, type 0x%x, minvtx %u, numvtx %u, count %u, idexdata %p, idxformat %s, vtxdata %p, vtxstride %u : stub!\n", this, type, minvtx, numvtx, count, idxdata, d3dfmt_to_str(idxformat), vtxdata, vtxstride);
-    return E_NOTIMPL;
+    TRACE("iface %p, type 0x%x, minvtx %u, numvtx %u, count %u, idexdata %p, idxformat %s, vtxdata %p, vtxstride %u\n", this, type, minvtx, numvtx, count, idxdata, d3dfmt_to_str(idxformat), vtxdata, vtxstride);
+
+    if(mTexturesDirty.exchange(false))
+        flushTextureUpdates();
+
+    if(type == D3DPT_POINTLIST)
+    {
+        WARN("Pointlist not allowed for indexed rendering\n");
+        return D3DERR_INVALIDCALL;
+    }
+    if(idxformat != D3DFMT_INDEX16 && idxformat != D3DFMT_INDEX32)
+    {
+        WARN("Invalid index format: %s\n", d3dfmt_to_str(idxformat));
+        return D3DERR_INVALIDCALL;
+    }
+
+    GLenum mode = GetGLDrawMode(type, count);
+    UINT idxlen = count;
+    GLenum idxtype = GetGLIndexType(idxformat, idxlen);
+
+    // Only the vertices the indices actually reference need to be uploaded.
+    // The base vertex then offsets the indices back to the start of it.
+    UINT minidx, maxidx;
+    CalcIndexRange(reinterpret_cast<const GLubyte*>(idxdata), idxformat, count, minidx, maxidx);
+    UINT vtxlen = (maxidx-minidx+1) * vtxstride;
+
+    if(!mPrimitiveUserData)
+    {
+        mPrimitiveUserData = new D3DGLBufferObject(this);
+        if(!mPrimitiveUserData->init_vbo(vtxlen, D3DUSAGE_WRITEONLY, 0, D3DPOOL_DEFAULT))
+        {
+            ERR("Failed to initialize vertex data storage\n");
+            delete mPrimitiveUserData;
+            mPrimitiveUserData = nullptr;
+            return D3DERR_INVALIDCALL;
+        }
+    }
+    if(!mPrimitiveUserIndices)
+    {
+        mPrimitiveUserIndices = new D3DGLBufferObject(this);
+        if(!mPrimitiveUserIndices->init_ibo(idxlen, D3DUSAGE_WRITEONLY, idxformat, D3DPOOL_DEFAULT))
+        {
+            ERR("Failed to initialize index data storage\n");
+            delete mPrimitiveUserIndices;
+            mPrimitiveUserIndices = nullptr;
+            return D3DERR_INVALIDCALL;
+        }
+    }
+    mPrimitiveUserData->resetBufferData(reinterpret_cast<const GLubyte*>(vtxdata) + minidx*vtxstride,
+                                        vtxlen);
+    mPrimitiveUserIndices->resetBufferData(reinterpret_cast<const GLubyte*>(idxdata), idxlen);
+
+    D3DGLBufferObject *oldstream = nullptr;
+    D3DGLBufferObject *oldindices = nullptr;
+
+    mQueue.lock();
+    StreamSource stream;
+    stream.mBuffer = mPrimitiveUserData;
+    stream.mOffset = 0;
+    stream.mStride = vtxstride;
+    stream.mFreq = mStreams[0].mFreq;
+
+    HRESULT hr = sendVtxData(0, &stream, 1);
+    if(SUCCEEDED(hr))
+    {
+        // Like DrawPrimitiveUP, this resets stream 0 and the index buffer.
+        oldstream = mStreams[0].mBuffer;
+        mStreams[0].mBuffer = nullptr;
+        mStreams[0].mOffset = 0;
+        mStreams[0].mStride = 0;
+        oldindices = mIndexBuffer.exchange(nullptr);
+
+        mQueue.doSend<ElementArraySet>(mPrimitiveUserIndices->getBufferId());
+        mQueue.doSend<DrawGLElementsCmd>(make_ref(mGLState),
+            mode, count, idxtype, nullptr, 1/*num_instances*/, minidx, maxidx, -(GLint)minidx
+        );
+    }
+    mQueue.unlock();
+
+    if(oldstream) oldstream->releaseIface();
+    if(oldindices) oldindices->releaseIface();
+
+    return hr;
 }
 
 HRESULT D3DGLDevice::ProcessVertices(UINT startidx, UINT dstidx, UINT vtxcount, IDirect3DVertexBuffer9 *dstbuffer, IDirect3DVertexDeclaration9 *vtxdecl, DWORD flags)
@@ -3884,9 +4629,6 @@ HRESULT D3DGLDevice::SetVertexShader(IDirect3DVertexShader9 *shader)
     }
 
     mQueue.lock();
-    // Wait for pending updates to finish, in case we need to rebuild with new parameters.
-    while(vshader && vshader->getPendingUpdates() > 0)
-        mQueue.wakeAndSleep();
     D3DGLVertexShader *oldshader = mVertexShader.exchange(vshader);
     if(vshader)
     {
@@ -3894,13 +4636,7 @@ HRESULT D3DGLDevice::SetVertexShader(IDirect3DVertexShader9 *shader)
         // appropriate global values, and the new shader's local constants
         // should be filled with what the shader defined.
 
-        if(GLuint program = vshader->getProgram())
-            mQueue.doSend<SetVShaderCmd>(mGLState.pipeline, program);
-        else
-        {
-            vshader->addPendingUpdate();
-            mQueue.doSend<CompileAndSetVShaderCmd>(vshader, mGLState.pipeline);
-        }
+        vshader->setProgram(mGLState.pipeline);
     }
     else if(oldshader)
     {
@@ -4033,6 +4769,7 @@ HRESULT D3DGLDevice::SetStreamSource(UINT index, IDirect3DVertexBuffer9 *stream,
     D3DGLBufferObject *buffer;
     if(FAILED(stream->QueryInterface(IID_D3DGLBufferObject, (void**)&buffer)))
         return D3DERR_INVALIDCALL;
+    mResidency.touch(buffer);
     buffer->addIface();
 
     if(mStreams[index].mBuffer)
@@ -4116,6 +4853,7 @@ HRESULT D3DGLDevice::SetIndices(IDirect3DIndexBuffer9 *index)
         HRESULT hr;
         hr = index->QueryInterface(IID_D3DGLBufferObject, (void**)&buffer);
         if(FAILED(hr)) return D3DERR_INVALIDCALL;
+        mResidency.touch(buffer);
         buffer->addIface();
         buffer->Release();
     }
@@ -4168,9 +4906,6 @@ HRESULT D3DGLDevice::SetPixelShader(IDirect3DPixelShader9 *shader)
     }
 
     mQueue.lock();
-    // Wait for pending updates to finish, in case we need to rebuild with new parameters.
-    while(pshader && pshader->getPendingUpdates() > 0)
-        mQueue.wakeAndSleep();
     D3DGLPixelShader *oldshader = mPixelShader.exchange(pshader);
     if(pshader)
     {
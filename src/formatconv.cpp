@@ -0,0 +1,425 @@
+
+#include "formatconv.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2_INTRINSICS
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#define HAVE_SSSE3_INTRINSICS
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#define HAVE_AVX2_INTRINSICS
+#endif
+
+
+namespace
+{
+
+inline UINT Expand2(UINT v) { return v * 0x55; }
+inline UINT Expand3(UINT v) { return (v<<5) | (v<<2) | (v>>1); }
+inline UINT Expand4(UINT v) { return v * 0x11; }
+inline UINT Expand6(UINT v) { return (v<<1) | (v>>5); }
+
+// Signed normalized 5-bit to 7-bit magnitude, with -16 clamped to -15.
+inline int ExpandSigned5(int v)
+{
+    int m = std::min(std::abs(v), 15);
+    m = (m<<3) | (m>>1);
+    return (v < 0) ? -m : m;
+}
+inline int ShrinkSigned8(int v)
+{
+    int m = std::min(std::abs(v), 127) >> 3;
+    return (v < 0) ? -m : m;
+}
+
+
+/* The vector kernels are written once against these, and built with the
+ * widest set the compiler targets. */
+#ifdef HAVE_SSE2_INTRINSICS
+struct SSE2Ops {
+    typedef __m128i V;
+    static const UINT sBytes = 16;
+
+    static V load(const GLubyte *src) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)); }
+    static void store(GLubyte *dst, V v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), v); }
+
+    static V set8(char v) { return _mm_set1_epi8(v); }
+    static V set16(short v) { return _mm_set1_epi16(v); }
+    static V set32(int v) { return _mm_set1_epi32(v); }
+
+    static V and_(V a, V b) { return _mm_and_si128(a, b); }
+    static V or_(V a, V b) { return _mm_or_si128(a, b); }
+    static V xor_(V a, V b) { return _mm_xor_si128(a, b); }
+    static V sub16(V a, V b) { return _mm_sub_epi16(a, b); }
+    static V min16(V a, V b) { return _mm_min_epi16(a, b); }
+    static V mullo16(V a, V b) { return _mm_mullo_epi16(a, b); }
+
+    template<int N> static V shl16(V a) { return _mm_slli_epi16(a, N); }
+    template<int N> static V shr16(V a) { return _mm_srli_epi16(a, N); }
+    template<int N> static V sar16(V a) { return _mm_srai_epi16(a, N); }
+    template<int N> static V shl32(V a) { return _mm_slli_epi32(a, N); }
+    template<int N> static V shr32(V a) { return _mm_srli_epi32(a, N); }
+
+    // Interleaves byte channels a and b into 2-byte pixels.
+    static void storePairs(GLubyte *dst, V a, V b)
+    {
+        store(dst, _mm_unpacklo_epi8(a, b));
+        store(dst+16, _mm_unpackhi_epi8(a, b));
+    }
+    // Interleaves four channels of 16-bit values in 0..255 into 4-byte pixels.
+    static void storeQuads(GLubyte *dst, V c0, V c1, V c2, V c3)
+    {
+        V lo = or_(c0, shl16<8>(c1));
+        V hi = or_(c2, shl16<8>(c3));
+        store(dst, _mm_unpacklo_epi16(lo, hi));
+        store(dst+16, _mm_unpackhi_epi16(lo, hi));
+    }
+};
+#endif
+
+#ifdef HAVE_AVX2_INTRINSICS
+struct AVX2Ops {
+    typedef __m256i V;
+    static const UINT sBytes = 32;
+
+    static V load(const GLubyte *src) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src)); }
+    static void store(GLubyte *dst, V v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), v); }
+
+    static V set8(char v) { return _mm256_set1_epi8(v); }
+    static V set16(short v) { return _mm256_set1_epi16(v); }
+    static V set32(int v) { return _mm256_set1_epi32(v); }
+
+    static V and_(V a, V b) { return _mm256_and_si256(a, b); }
+    static V or_(V a, V b) { return _mm256_or_si256(a, b); }
+    static V xor_(V a, V b) { return _mm256_xor_si256(a, b); }
+    static V sub16(V a, V b) { return _mm256_sub_epi16(a, b); }
+    static V min16(V a, V b) { return _mm256_min_epi16(a, b); }
+    static V mullo16(V a, V b) { return _mm256_mullo_epi16(a, b); }
+
+    template<int N> static V shl16(V a) { return _mm256_slli_epi16(a, N); }
+    template<int N> static V shr16(V a) { return _mm256_srli_epi16(a, N); }
+    template<int N> static V sar16(V a) { return _mm256_srai_epi16(a, N); }
+    template<int N> static V shl32(V a) { return _mm256_slli_epi32(a, N); }
+    template<int N> static V shr32(V a) { return _mm256_srli_epi32(a, N); }
+
+    // The unpacks work within each 128-bit lane, so the halves need to be
+    // put back in order.
+    static void storePairs(GLubyte *dst, V a, V b)
+    {
+        V p0 = _mm256_unpacklo_epi8(a, b);
+        V p1 = _mm256_unpackhi_epi8(a, b);
+        store(dst, _mm256_permute2x128_si256(p0, p1, 0x20));
+        store(dst+32, _mm256_permute2x128_si256(p0, p1, 0x31));
+    }
+    static void storeQuads(GLubyte *dst, V c0, V c1, V c2, V c3)
+    {
+        V lo = or_(c0, shl16<8>(c1));
+        V hi = or_(c2, shl16<8>(c3));
+        V p0 = _mm256_unpacklo_epi16(lo, hi);
+        V p1 = _mm256_unpackhi_epi16(lo, hi);
+        store(dst, _mm256_permute2x128_si256(p0, p1, 0x20));
+        store(dst+32, _mm256_permute2x128_si256(p0, p1, 0x31));
+    }
+};
+typedef AVX2Ops VecOps;
+#define HAVE_VECTOR_OPS
+#elif defined(HAVE_SSE2_INTRINSICS)
+typedef SSE2Ops VecOps;
+#define HAVE_VECTOR_OPS
+#endif
+
+
+#ifdef HAVE_VECTOR_OPS
+template<typename Ops>
+UINT ConvertA8R3G3B2Vec(GLubyte *dst, const GLubyte *src, UINT count)
+{
+    typedef typename Ops::V V;
+    const UINT step = Ops::sBytes / 2;
+    UINT i = 0;
+    for(;count-i >= step;i += step)
+    {
+        V v = Ops::load(src + i*2);
+        V r = Ops::and_(Ops::template shr16<5>(v), Ops::set16(7));
+        V g = Ops::and_(Ops::template shr16<2>(v), Ops::set16(7));
+        V b = Ops::and_(v, Ops::set16(3));
+        V a = Ops::template shr16<8>(v);
+        r = Ops::or_(Ops::or_(Ops::template shl16<5>(r), Ops::template shl16<2>(r)), Ops::template shr16<1>(r));
+        g = Ops::or_(Ops::or_(Ops::template shl16<5>(g), Ops::template shl16<2>(g)), Ops::template shr16<1>(g));
+        b = Ops::mullo16(b, Ops::set16(0x55));
+        Ops::storeQuads(dst + i*4, b, g, r, a);
+    }
+    return i;
+}
+
+template<typename Ops>
+UINT ConvertA4L4Vec(GLubyte *dst, const GLubyte *src, UINT count)
+{
+    typedef typename Ops::V V;
+    const UINT step = Ops::sBytes;
+    UINT i = 0;
+    for(;count-i >= step;i += step)
+    {
+        V v = Ops::load(src + i);
+        // Nibbles shifted within 16-bit lanes stay in their own byte.
+        V l = Ops::and_(v, Ops::set8(0x0f));
+        V a = Ops::and_(Ops::template shr16<4>(v), Ops::set8(0x0f));
+        l = Ops::or_(l, Ops::template shl16<4>(l));
+        a = Ops::or_(a, Ops::template shl16<4>(a));
+        Ops::storePairs(dst + i*2, l, a);
+    }
+    return i;
+}
+
+template<typename Ops>
+typename Ops::V ExpandSigned5Vec(typename Ops::V v)
+{
+    typedef typename Ops::V V;
+    V s = Ops::template sar16<15>(v);
+    V m = Ops::min16(Ops::sub16(Ops::xor_(v, s), s), Ops::set16(15));
+    m = Ops::or_(Ops::template shl16<3>(m), Ops::template shr16<1>(m));
+    return Ops::and_(Ops::sub16(Ops::xor_(m, s), s), Ops::set16(0xff));
+}
+
+template<typename Ops>
+UINT ConvertL6V5U5Vec(GLubyte *dst, const GLubyte *src, UINT count)
+{
+    typedef typename Ops::V V;
+    const UINT step = Ops::sBytes / 2;
+    UINT i = 0;
+    for(;count-i >= step;i += step)
+    {
+        V v = Ops::load(src + i*2);
+        V du = ExpandSigned5Vec<Ops>(Ops::template sar16<11>(Ops::template shl16<11>(v)));
+        V dv = ExpandSigned5Vec<Ops>(Ops::template sar16<11>(Ops::template shl16<6>(v)));
+        V l = Ops::template shr16<10>(v);
+        l = Ops::or_(Ops::template shl16<1>(l), Ops::template shr16<5>(l));
+        Ops::storeQuads(dst + i*4, du, dv, l, Ops::set16(0x7f));
+    }
+    return i;
+}
+
+template<typename Ops>
+UINT ConvertX8L8V8U8Vec(GLubyte *dst, const GLubyte *src, UINT count)
+{
+    typedef typename Ops::V V;
+    const UINT step = Ops::sBytes / 4;
+    UINT i = 0;
+    for(;count-i >= step;i += step)
+    {
+        V v = Ops::load(src + i*4);
+        V l = Ops::template shl32<16>(Ops::and_(Ops::template shr32<17>(v), Ops::set32(0x7f)));
+        V out = Ops::or_(Ops::or_(Ops::and_(v, Ops::set32(0xffff)), l), Ops::set32(0x7f000000));
+        Ops::store(dst + i*4, out);
+    }
+    return i;
+}
+#endif
+
+
+void ConvertA8R3G3B2(GLubyte *dst, const GLubyte *src, UINT count, const PALETTEENTRY*)
+{
+    UINT i = 0;
+#ifdef HAVE_VECTOR_OPS
+    i = ConvertA8R3G3B2Vec<VecOps>(dst, src, count);
+#endif
+    for(;i < count;++i)
+    {
+        UINT v = src[i*2] | (src[i*2 + 1]<<8);
+        dst[i*4 + 0] = Expand2(v&3);
+        dst[i*4 + 1] = Expand3((v>>2)&7);
+        dst[i*4 + 2] = Expand3((v>>5)&7);
+        dst[i*4 + 3] = v>>8;
+    }
+}
+void ConvertBackA8R3G3B2(GLubyte *dst, const GLubyte *src, UINT count, const PALETTEENTRY*)
+{
+    for(UINT i = 0;i < count;++i)
+    {
+        dst[i*2 + 0] = (src[i*4 + 2]&0xe0) | ((src[i*4 + 1]>>3)&0x1c) | (src[i*4 + 0]>>6);
+        dst[i*2 + 1] = src[i*4 + 3];
+    }
+}
+
+void ConvertR8G8B8(GLubyte *dst, const GLubyte *src, UINT count, const PALETTEENTRY*)
+{
+    UINT i = 0;
+#ifdef HAVE_SSSE3_INTRINSICS
+    // Each load reads 16 bytes for 4 pixels, so stop while there's enough
+    // input left to not overrun.
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    for(;count-i >= 6;i += 4)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i*3));
+        v = _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i*4), v);
+    }
+#endif
+    for(;i < count;++i)
+    {
+        dst[i*4 + 0] = src[i*3 + 0];
+        dst[i*4 + 1] = src[i*3 + 1];
+        dst[i*4 + 2] = src[i*3 + 2];
+        dst[i*4 + 3] = 0xff;
+    }
+}
+void ConvertBackR8G8B8(GLubyte *dst, const GLubyte *src, UINT count, const PALETTEENTRY*)
+{
+    for(UINT i = 0;i < count;++i)
+    {
+        dst[i*3 + 0] = src[i*4 + 0];
+        dst[i*3 + 1] = src[i*4 + 1];
+        dst[i*3 + 2] = src[i*4 + 2];
+    }
+}
+
+void ConvertA4L4(GLubyte *dst, const GLubyte *src, UINT count, const PALETTEENTRY*)
+{
+    UINT i = 0;
+#ifdef HAVE_VECTOR_OPS
+    i = ConvertA4L4Vec<VecOps>(dst, src, count);
+#endif
+    for(;i < count;++i)
+    {
+        dst[i*2 + 0] = Expand4(src[i]&0x0f);
+        dst[i*2 + 1] = Expand4(src[i]>>4);
+    }
+}
+void ConvertBackA4L4(GLubyte *dst, const GLubyte *src, UINT count, const PALETTEENTRY*)
+{
+    for(UINT i = 0;i < count;++i)
+        dst[i] = (src[i*2 + 1]&0xf0) | (src[i*2 + 0]>>4);
+}
+
+
+// Builds RGBA pixels for each palette index. PALETTEENTRY's alpha is in
+// peFlags.
+void BuildPaletteTable(UINT *table, const PALETTEENTRY *palette)
+{
+    for(UINT i = 0;i < 256;++i)
+    {
+        if(palette)
+            table[i] = palette[i].peRed | (palette[i].peGreen<<8) | (palette[i].peBlue<<16) |
+                       (palette[i].peFlags<<24);
+        else
+            table[i] = i | (i<<8) | (i<<16) | 0xff000000;
+    }
+}
+
+void ConvertP8(GLubyte *dst, const GLubyte *src, UINT count, const PALETTEENTRY *palette)
+{
+    UINT table[256];
+    BuildPaletteTable(table, palette);
+
+    UINT *out = reinterpret_cast<UINT*>(dst);
+    UINT i = 0;
+#ifdef HAVE_AVX2_INTRINSICS
+    for(;count-i >= 8;i += 8)
+    {
+        __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i)));
+        __m256i v = _mm256_i32gather_epi32(reinterpret_cast<const int*>(table), idx, 4);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), v);
+    }
+#endif
+    for(;i < count;++i)
+        out[i] = table[src[i]];
+}
+
+void ConvertA8P8(GLubyte *dst, const GLubyte *src, UINT count, const PALETTEENTRY *palette)
+{
+    UINT table[256];
+    BuildPaletteTable(table, palette);
+
+    UINT *out = reinterpret_cast<UINT*>(dst);
+    UINT i = 0;
+#ifdef HAVE_AVX2_INTRINSICS
+    const __m256i rgbmask = _mm256_set1_epi32(0x00ffffff);
+    for(;count-i >= 8;i += 8)
+    {
+        __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i*2)));
+        __m256i idx = _mm256_and_si256(v, _mm256_set1_epi32(0xff));
+        __m256i rgb = _mm256_i32gather_epi32(reinterpret_cast<const int*>(table), idx, 4);
+        __m256i a = _mm256_slli_epi32(_mm256_srli_epi32(v, 8), 24);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                            _mm256_or_si256(_mm256_and_si256(rgb, rgbmask), a));
+    }
+#endif
+    for(;i < count;++i)
+        out[i] = (table[src[i*2]]&0x00ffffff) | (src[i*2 + 1]<<24);
+}
+
+
+void ConvertL6V5U5(GLubyte *dst, const GLubyte *src, UINT count, const PALETTEENTRY*)
+{
+    UINT i = 0;
+#ifdef HAVE_VECTOR_OPS
+    i = ConvertL6V5U5Vec<VecOps>(dst, src, count);
+#endif
+    for(;i < count;++i)
+    {
+        int v = src[i*2] | (src[i*2 + 1]<<8);
+        int du = (v&0x1f) - ((v&0x10)<<1);
+        int dv = ((v>>5)&0x1f) - (((v>>5)&0x10)<<1);
+        dst[i*4 + 0] = ExpandSigned5(du) & 0xff;
+        dst[i*4 + 1] = ExpandSigned5(dv) & 0xff;
+        dst[i*4 + 2] = Expand6(v>>10);
+        dst[i*4 + 3] = 0x7f;
+    }
+}
+void ConvertBackL6V5U5(GLubyte *dst, const GLubyte *src, UINT count, const PALETTEENTRY*)
+{
+    for(UINT i = 0;i < count;++i)
+    {
+        int du = ShrinkSigned8((signed char)src[i*4 + 0]) & 0x1f;
+        int dv = ShrinkSigned8((signed char)src[i*4 + 1]) & 0x1f;
+        int l = std::max<int>((signed char)src[i*4 + 2], 0) >> 1;
+        int v = du | (dv<<5) | (l<<10);
+        dst[i*2 + 0] = v & 0xff;
+        dst[i*2 + 1] = v >> 8;
+    }
+}
+
+void ConvertX8L8V8U8(GLubyte *dst, const GLubyte *src, UINT count, const PALETTEENTRY*)
+{
+    UINT i = 0;
+#ifdef HAVE_VECTOR_OPS
+    i = ConvertX8L8V8U8Vec<VecOps>(dst, src, count);
+#endif
+    for(;i < count;++i)
+    {
+        dst[i*4 + 0] = src[i*4 + 0];
+        dst[i*4 + 1] = src[i*4 + 1];
+        dst[i*4 + 2] = src[i*4 + 2] >> 1;
+        dst[i*4 + 3] = 0x7f;
+    }
+}
+void ConvertBackX8L8V8U8(GLubyte *dst, const GLubyte *src, UINT count, const PALETTEENTRY*)
+{
+    for(UINT i = 0;i < count;++i)
+    {
+        UINT l = std::max<int>((signed char)src[i*4 + 2], 0);
+        dst[i*4 + 0] = src[i*4 + 0];
+        dst[i*4 + 1] = src[i*4 + 1];
+        dst[i*4 + 2] = (l<<1) | (l>>6);
+        dst[i*4 + 3] = 0xff;
+    }
+}
+
+} // namespace
+
+
+const GLFormatConversion gConvA8R3G3B2{ ConvertA8R3G3B2, ConvertBackA8R3G3B2, 4, nullptr };
+const GLFormatConversion gConvR8G8B8{ ConvertR8G8B8, ConvertBackR8G8B8, 4, nullptr };
+const GLFormatConversion gConvA4L4{ ConvertA4L4, ConvertBackA4L4, 2, nullptr };
+// The palette can't be reversed, so palettized textures can't be read back.
+const GLFormatConversion gConvP8{ ConvertP8, nullptr, 4, nullptr };
+const GLFormatConversion gConvA8P8{ ConvertA8P8, nullptr, 4, nullptr };
+const GLFormatConversion gConvL6V5U5{ ConvertL6V5U5, ConvertBackL6V5U5, 4, nullptr };
+const GLFormatConversion gConvX8L8V8U8{ ConvertX8L8V8U8, ConvertBackX8L8V8U8, 4, nullptr };
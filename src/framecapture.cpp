@@ -0,0 +1,296 @@
+
+#include "framecapture.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#include "trace.hpp"
+#include "device.hpp"
+
+
+FrameCapture::FrameCapture(D3DGLDevice *parent, UINT width, UINT height)
+  : mParent(parent)
+  , mWidth(width)
+  , mHeight(height)
+  , mFrameSize(width*height*4)
+  , mIsY4M(false)
+  , mReadIdx(0)
+  , mNumInFlight(0)
+  , mFramesDue(0)
+  , mFramesMissed(0)
+  , mFile(nullptr)
+  , mThread(nullptr)
+  , mNumFrames(0)
+  , mQuit(false)
+  , mFramesWritten(0)
+  , mFramesDropped(0)
+{
+    for(PackBuffer &buf : mPackBuffers)
+    {
+        buf.mBufferId = 0;
+        buf.mFence = 0;
+        buf.mCount = 0;
+    }
+    QueryPerformanceFrequency(&mTimerFreq);
+    mStartTime.QuadPart = 0;
+    InitializeCriticalSection(&mLock);
+    InitializeConditionVariable(&mWorkCond);
+}
+
+FrameCapture::~FrameCapture()
+{
+    // Let the frames already read finish, so the recording doesn't lose its
+    // last moments.
+    if(mPackBuffers[0].mBufferId)
+    {
+        retireGL(true);
+        for(PackBuffer &buf : mPackBuffers)
+            glDeleteBuffers(1, &buf.mBufferId);
+        checkGLError();
+    }
+
+    if(mThread)
+    {
+        EnterCriticalSection(&mLock);
+        mQuit = true;
+        WakeAllConditionVariable(&mWorkCond);
+        LeaveCriticalSection(&mLock);
+
+        WaitForSingleObject(mThread, INFINITE);
+        CloseHandle(mThread);
+        mThread = nullptr;
+    }
+    DeleteCriticalSection(&mLock);
+
+    if(mFile)
+    {
+        WARN("Captured %u frames, dropped %u\n", mFramesWritten, mFramesDropped.load());
+        fclose(mFile);
+    }
+    mFile = nullptr;
+}
+
+bool FrameCapture::init(const std::string &filename)
+{
+    size_t extpos = filename.rfind('.');
+    if(extpos != std::string::npos)
+    {
+        std::string ext = filename.substr(extpos+1);
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        mIsY4M = (ext == "y4m");
+    }
+
+    mFile = fopen(filename.c_str(), "wb");
+    if(!mFile)
+    {
+        ERR("Failed to open %s for writing\n", filename.c_str());
+        return false;
+    }
+    if(mIsY4M)
+        fprintf(mFile, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg\n", mWidth, mHeight,
+                std::max(CaptureFrameRate, 1u));
+
+    mThread = CreateThread(nullptr, 256*1024, thread_func, this, 0, nullptr);
+    if(!mThread)
+    {
+        ERR("Failed to create capture thread, error %lu\n", GetLastError());
+        return false;
+    }
+    // Keep the writer from taking time away from the app.
+    SetThreadPriority(mThread, THREAD_PRIORITY_BELOW_NORMAL);
+
+    TRACE("Capturing %ux%u frames to %s\n", mWidth, mHeight, filename.c_str());
+    return true;
+}
+
+
+void FrameCapture::writeFrame(const std::vector<GLubyte> &frame)
+{
+    if(!mIsY4M)
+    {
+        fwrite(frame.data(), 1, mFrameSize, mFile);
+        return;
+    }
+
+    // Full-range BT.601, with the chroma averaged over each 2x2 block.
+    UINT cw = (mWidth+1) / 2;
+    UINT ch = (mHeight+1) / 2;
+    mYUVData.resize(mWidth*mHeight + cw*ch*2);
+    GLubyte *yplane = mYUVData.data();
+    GLubyte *uplane = yplane + mWidth*mHeight;
+    GLubyte *vplane = uplane + cw*ch;
+
+    const GLubyte *src = frame.data();
+    for(UINT i = 0;i < mWidth*mHeight;++i)
+    {
+        int b = src[i*4 + 0], g = src[i*4 + 1], r = src[i*4 + 2];
+        yplane[i] = (19595*r + 38470*g + 7471*b + 32768) >> 16;
+    }
+    for(UINT y = 0;y < ch;++y)
+    {
+        UINT y0 = y*2, y1 = std::min(y*2+1, mHeight-1);
+        for(UINT x = 0;x < cw;++x)
+        {
+            UINT x0 = x*2, x1 = std::min(x*2+1, mWidth-1);
+            const GLubyte *p00 = &src[(y0*mWidth + x0)*4];
+            const GLubyte *p01 = &src[(y0*mWidth + x1)*4];
+            const GLubyte *p10 = &src[(y1*mWidth + x0)*4];
+            const GLubyte *p11 = &src[(y1*mWidth + x1)*4];
+            int b = (p00[0] + p01[0] + p10[0] + p11[0] + 2) >> 2;
+            int g = (p00[1] + p01[1] + p10[1] + p11[1] + 2) >> 2;
+            int r = (p00[2] + p01[2] + p10[2] + p11[2] + 2) >> 2;
+            int u = (-11059*r - 21709*g + 32768*b + (128<<16) + 32768) >> 16;
+            int v = (32768*r - 27439*g - 5329*b + (128<<16) + 32768) >> 16;
+            uplane[y*cw + x] = std::min(u, 255);
+            vplane[y*cw + x] = std::min(v, 255);
+        }
+    }
+
+    fputs("FRAME\n", mFile);
+    fwrite(mYUVData.data(), 1, mYUVData.size(), mFile);
+}
+
+DWORD FrameCapture::writerLoop(void)
+{
+    EnterCriticalSection(&mLock);
+    while(1)
+    {
+        while(mQueued.empty() && !mQuit)
+            SleepConditionVariableCS(&mWorkCond, &mLock, INFINITE);
+        // Finish writing what's queued before quitting.
+        if(mQueued.empty()) break;
+
+        QueuedFrame frame(std::move(mQueued.front()));
+        mQueued.pop_front();
+        LeaveCriticalSection(&mLock);
+
+        for(UINT i = 0;i < frame.mCount;++i)
+            writeFrame(frame.mData);
+        mFramesWritten += frame.mCount;
+
+        EnterCriticalSection(&mLock);
+        mFreeFrames.push_back(std::move(frame.mData));
+    }
+    LeaveCriticalSection(&mLock);
+
+    fflush(mFile);
+    return 0;
+}
+
+
+void FrameCapture::retireGL(bool wait)
+{
+    while(mNumInFlight > 0)
+    {
+        PackBuffer &buf = mPackBuffers[mReadIdx];
+        GLenum ret;
+        if(!wait)
+            ret = glClientWaitSync(buf.mFence, 0, 0);
+        else do {
+            ret = glClientWaitSync(buf.mFence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        } while(ret == GL_TIMEOUT_EXPIRED);
+        if(ret == GL_TIMEOUT_EXPIRED)
+            break;
+        glDeleteSync(buf.mFence);
+        buf.mFence = 0;
+        mReadIdx = (mReadIdx+1) % sNumPackBuffers;
+        --mNumInFlight;
+
+        // Take a free frame, or make a new one if the writer isn't too far
+        // behind.
+        std::vector<GLubyte> frame;
+        EnterCriticalSection(&mLock);
+        if(!mFreeFrames.empty())
+        {
+            frame = std::move(mFreeFrames.back());
+            mFreeFrames.pop_back();
+        }
+        else if(mNumFrames < sMaxQueuedFrames)
+        {
+            frame.resize(mFrameSize);
+            ++mNumFrames;
+        }
+        LeaveCriticalSection(&mLock);
+        if(frame.empty())
+        {
+            TRACE("Writer is behind, dropping frame\n");
+            ++mFramesDropped;
+            mFramesMissed += buf.mCount;
+            continue;
+        }
+
+        const GLubyte *src = reinterpret_cast<const GLubyte*>(
+            glMapNamedBufferRangeEXT(buf.mBufferId, 0, mFrameSize, GL_MAP_READ_BIT)
+        );
+        if(!src)
+        {
+            ERR("Failed to map capture buffer\n");
+            ++mFramesDropped;
+            mFramesMissed += buf.mCount;
+            EnterCriticalSection(&mLock);
+            mFreeFrames.push_back(std::move(frame));
+            LeaveCriticalSection(&mLock);
+            continue;
+        }
+        memcpy(frame.data(), src, mFrameSize);
+        glUnmapNamedBufferEXT(buf.mBufferId);
+
+        EnterCriticalSection(&mLock);
+        mQueued.push_back(QueuedFrame{std::move(frame), buf.mCount});
+        WakeConditionVariable(&mWorkCond);
+        LeaveCriticalSection(&mLock);
+    }
+    checkGLError();
+}
+
+void FrameCapture::captureGL(GLuint renderbuffer)
+{
+    if(!mPackBuffers[0].mBufferId)
+    {
+        for(PackBuffer &buf : mPackBuffers)
+        {
+            glGenBuffers(1, &buf.mBufferId);
+            glNamedBufferDataEXT(buf.mBufferId, mFrameSize, nullptr, GL_STREAM_READ);
+        }
+        checkGLError();
+    }
+
+    retireGL(false);
+
+    // Work out how many output frames this one covers at the capture rate.
+    // Presenting faster than that skips frames, and slower repeats them.
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    if(!mStartTime.QuadPart)
+        mStartTime = now;
+    UINT64 due = (UINT64)(now.QuadPart-mStartTime.QuadPart) * std::max(CaptureFrameRate, 1u) /
+                 (UINT64)mTimerFreq.QuadPart + 1;
+    if(due <= mFramesDue)
+        return;
+    UINT count = (UINT)(due-mFramesDue) + mFramesMissed;
+    mFramesDue = due;
+    mFramesMissed = 0;
+
+    if(mNumInFlight == sNumPackBuffers)
+    {
+        TRACE("No capture buffer free, dropping frame\n");
+        ++mFramesDropped;
+        mFramesMissed += count;
+        return;
+    }
+
+    PackBuffer &buf = mPackBuffers[(mReadIdx+mNumInFlight) % sNumPackBuffers];
+    buf.mCount = count;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, buf.mBufferId);
+    // Nothing waits on this; the fence tracks the read instead.
+    std::atomic<ULONG> pending(1);
+    RECT rect{ 0, 0, (LONG)mWidth, (LONG)mHeight };
+    mParent->readFramebufferGL(GL_RENDERBUFFER, renderbuffer, 0, rect,
+                               GL_BGRA, GL_UNSIGNED_BYTE, nullptr, pending);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    buf.mFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ++mNumInFlight;
+    checkGLError();
+}
@@ -0,0 +1,161 @@
+
+#include "glnamepool.hpp"
+
+#include "commandqueue.hpp"
+#include "trace.hpp"
+
+
+namespace
+{
+
+void GenNamesGL(GLNamePool::Type type, GLsizei count, GLuint *names)
+{
+    switch(type)
+    {
+        case GLNamePool::Buffer:
+            glGenBuffers(count, names);
+            break;
+        case GLNamePool::Texture:
+            glGenTextures(count, names);
+            break;
+        case GLNamePool::Renderbuffer:
+            glGenRenderbuffers(count, names);
+            break;
+        case GLNamePool::Query:
+            glGenQueries(count, names);
+            break;
+    }
+    checkGLError();
+}
+
+void DeleteNamesGL(GLNamePool::Type type, GLsizei count, const GLuint *names)
+{
+    switch(type)
+    {
+        case GLNamePool::Buffer:
+            glDeleteBuffers(count, names);
+            break;
+        case GLNamePool::Texture:
+            glDeleteTextures(count, names);
+            break;
+        case GLNamePool::Renderbuffer:
+            glDeleteRenderbuffers(count, names);
+            break;
+        case GLNamePool::Query:
+            glDeleteQueries(count, names);
+            break;
+    }
+    checkGLError();
+}
+
+} // namespace
+
+
+class RefillNamePoolCmd : public Command {
+    GLNamePool *mTarget;
+
+public:
+    RefillNamePoolCmd(GLNamePool *target) : mTarget(target) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->refillGL();
+        return sizeof(*this);
+    }
+};
+
+
+GLNamePool::GLNamePool(Type type)
+  : mType(type)
+  , mNames{0}
+  , mReadPos(0)
+  , mWritePos(0)
+  , mRefillPending(false)
+{
+}
+
+void GLNamePool::refillGL()
+{
+    size_t writepos = mWritePos.load();
+    size_t count = sPoolSize - (writepos-mReadPos.load());
+    if(count > 0)
+    {
+        // Generate into a contiguous block, then copy into the ring since the
+        // free space may wrap around.
+        std::array<GLuint,sPoolSize> names;
+        GenNamesGL(mType, count, names.data());
+        for(size_t i = 0;i < count;++i)
+            mNames[(writepos+i)&sPoolMask] = names[i];
+        mWritePos.store(writepos+count);
+        TRACE("Generated %u names for pool %p\n", (UINT)count, this);
+    }
+
+    mRefillPending = false;
+}
+
+void GLNamePool::deinitGL()
+{
+    flushDeletesGL();
+
+    size_t readpos = mReadPos.load();
+    size_t writepos = mWritePos.load();
+
+    std::array<GLuint,sPoolSize> names;
+    size_t count = 0;
+    for(;readpos != writepos;++readpos)
+        names[count++] = mNames[readpos&sPoolMask];
+    mReadPos.store(writepos);
+
+    if(count > 0)
+        DeleteNamesGL(mType, count, names.data());
+}
+
+void GLNamePool::deferDeleteGL(GLuint name)
+{
+    mDeleteList.push_back(name);
+    if(mDeleteList.size() >= sPoolSize)
+        flushDeletesGL();
+}
+
+void GLNamePool::flushDeletesGL()
+{
+    if(mDeleteList.empty())
+        return;
+
+    TRACE("Deleting %u names from pool %p\n", (UINT)mDeleteList.size(), this);
+    DeleteNamesGL(mType, mDeleteList.size(), mDeleteList.data());
+    mDeleteList.clear();
+}
+
+void GLNamePool::requestRefill(CommandQueue &queue)
+{
+    if(!mRefillPending.exchange(true))
+        queue.send<RefillNamePoolCmd>(this);
+}
+
+GLuint GLNamePool::get(CommandQueue &queue)
+{
+    size_t readpos = mReadPos.load();
+    while(1)
+    {
+        size_t avail = mWritePos.load() - readpos;
+        if(avail == 0)
+        {
+            FIXME("Name pool %p empty, waiting for refill\n", this);
+            requestRefill(queue);
+            queue.wakeAndSleep();
+            readpos = mReadPos.load();
+            continue;
+        }
+
+        // The name must be read before claiming it, as the slot may be
+        // refilled once the read position moves past it.
+        GLuint name = mNames[readpos&sPoolMask];
+        if(mReadPos.compare_exchange_weak(readpos, readpos+1))
+        {
+            if(avail-1 < sLowWater)
+                requestRefill(queue);
+            return name;
+        }
+    }
+}
@@ -0,0 +1,214 @@
+
+#include "lockbuffer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "trace.hpp"
+#include "glformat.hpp"
+#include "device.hpp"
+
+
+LockBuffer::LockBuffer(D3DGLDevice *parent, GLsizeiptr size)
+  : mParent(parent)
+  , mBufferId(parent->getBufferName())
+  , mSize(size)
+  , mAllocSize(0)
+  , mMappedPtr(nullptr)
+  , mReadFence(0)
+  , mStagingTexId(0)
+{
+}
+
+LockBuffer::~LockBuffer()
+{
+    if(mMappedPtr)
+        glUnmapNamedBufferEXT(mBufferId);
+    mMappedPtr = nullptr;
+
+    if(mReadFence)
+        glDeleteSync(mReadFence);
+    mReadFence = 0;
+
+    mParent->deleteBufferGL(mBufferId);
+    if(mStagingTexId)
+        glDeleteTextures(1, &mStagingTexId);
+    mStagingTexId = 0;
+    checkGLError();
+}
+
+void LockBuffer::allocGL(GLsizeiptr size)
+{
+    if(size > mAllocSize)
+    {
+        glNamedBufferDataEXT(mBufferId, size, nullptr, GL_STREAM_READ);
+        mAllocSize = size;
+    }
+}
+
+void LockBuffer::packGL(GLenum target, GLuint id, GLint level, const GLFormatInfo *format, bool compressed, UINT width, UINT height)
+{
+    // GL can only give back the converted format, which may need more room.
+    const GLFormatConversion *conv = format->conversion;
+    allocGL(conv ? std::max<GLsizeiptr>(mSize, conv->calcPitch(width)*height) : mSize);
+    if(mReadFence)
+        glDeleteSync(mReadFence);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, mBufferId);
+    if(target == GL_RENDERBUFFER)
+    {
+        // Nothing waits on this; the fence tracks the read instead.
+        std::atomic<ULONG> pending(1);
+        RECT rect{ 0, 0, (LONG)width, (LONG)height };
+        mParent->readFramebufferGL(target, id, 0, rect, format->format, format->type,
+                                   nullptr, pending);
+    }
+    else if(compressed && !conv)
+        glGetCompressedTextureImageEXT(id, target, level, nullptr);
+    else
+    {
+        glPixelStorei(GL_PACK_ROW_LENGTH, width);
+        glGetTextureImageEXT(id, target, level, format->format, format->type, nullptr);
+        glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    mReadFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    checkGLError();
+}
+
+void LockBuffer::readGL(GLenum target, GLuint id, GLint level, const GLFormatInfo *format, bool compressed, UINT width, UINT height, bool discard, bool current)
+{
+    if(discard)
+    {
+        // Anything still being read back isn't needed.
+        if(mReadFence)
+            glDeleteSync(mReadFence);
+        mReadFence = 0;
+
+        allocGL(mSize);
+        mMappedPtr = reinterpret_cast<GLubyte*>(glMapNamedBufferRangeEXT(mBufferId, 0, mAllocSize,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT
+        ));
+        checkGLError();
+        if(!mMappedPtr)
+            ERR("Failed to map lock buffer\n");
+        return;
+    }
+
+    if(!current)
+        packGL(target, id, level, format, compressed, width, height);
+
+    // A readback that was just done, or is still pending from earlier, has
+    // to finish before the data can be used. Otherwise the buffer still has
+    // the contents from the last lock.
+    bool unpack = (mReadFence != 0);
+    if(mReadFence)
+    {
+        GLenum ret;
+        do {
+            ret = glClientWaitSync(mReadFence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        } while(ret == GL_TIMEOUT_EXPIRED);
+        if(ret == GL_WAIT_FAILED)
+            ERR("Failed to wait on lock buffer fence\n");
+        glDeleteSync(mReadFence);
+        mReadFence = 0;
+    }
+
+    mMappedPtr = reinterpret_cast<GLubyte*>(glMapNamedBufferRangeEXT(mBufferId, 0, mAllocSize,
+        GL_MAP_READ_BIT | GL_MAP_WRITE_BIT
+    ));
+    checkGLError();
+
+    const GLFormatConversion *conv = format->conversion;
+    if(!mMappedPtr)
+        ERR("Failed to map lock buffer\n");
+    else if(unpack && conv)
+    {
+        // The buffer got the converted format, so convert it back in place.
+        std::vector<GLubyte> pixels(mMappedPtr, mMappedPtr + conv->calcPitch(width)*height);
+        conv->fromGLRect(mMappedPtr, GLFormatInfo::calcPitch(width, format->bytesperpixel),
+                         pixels.data(), width, height);
+    }
+}
+
+void LockBuffer::writeGL(GLenum target, GLuint id, GLint level, const GLFormatInfo *format, bool compressed, UINT width, UINT height, const RECT &rect, bool writeback)
+{
+    if(writeback && format->conversion && mMappedPtr)
+    {
+        // Convert the region out of the buffer before unmapping it, and
+        // upload that instead.
+        const GLFormatConversion *conv = format->conversion;
+        int pitch = GLFormatInfo::calcPitch(width, format->bytesperpixel);
+        const GLubyte *src = mMappedPtr + (rect.top*pitch) + (rect.left*format->bytesperpixel);
+        std::vector<GLubyte> pixels(conv->calcPitch(rect.right-rect.left) * (rect.bottom-rect.top));
+        conv->toGLRect(pixels.data(), src, pitch, rect.right-rect.left, rect.bottom-rect.top, nullptr);
+
+        glUnmapNamedBufferEXT(mBufferId);
+        mMappedPtr = nullptr;
+        glTextureSubImage2DEXT(id, target, level,
+            rect.left, rect.top, rect.right-rect.left, rect.bottom-rect.top,
+            format->format, format->type, pixels.data()
+        );
+        checkGLError();
+        return;
+    }
+
+    if(mMappedPtr)
+        glUnmapNamedBufferEXT(mBufferId);
+    mMappedPtr = nullptr;
+    if(!writeback)
+    {
+        checkGLError();
+        return;
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mBufferId);
+    if(compressed)
+    {
+        // Compressed uploads can't skip part of a block row, so send the
+        // whole rows of blocks the rect touches, across the full width.
+        int pitch = GLFormatInfo::calcBlockPitch(width, format->bytesperblock);
+        LONG top = rect.top & ~3;
+        LONG bottom = std::min<LONG>((rect.bottom+3) & ~3, height);
+        GLsizei rows = (bottom-top+3) / 4;
+        glCompressedTextureSubImage2DEXT(id, target, level,
+            0, top, width, bottom-top,
+            format->internalformat, rows*pitch, (const GLubyte*)(GLintptr)(top/4*pitch)
+        );
+    }
+    else
+    {
+        int pitch = GLFormatInfo::calcPitch(width, format->bytesperpixel);
+        GLintptr offset = (rect.top*pitch) + (rect.left*format->bytesperpixel);
+
+        GLuint dst_id = id;
+        GLenum dst_target = target;
+        if(target == GL_RENDERBUFFER)
+        {
+            if(!mStagingTexId)
+            {
+                glGenTextures(1, &mStagingTexId);
+                glTextureParameteriEXT(mStagingTexId, GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+                glTextureImage2DEXT(mStagingTexId, GL_TEXTURE_2D, 0, format->internalformat,
+                                    width, height, 0, format->format, format->type, nullptr);
+            }
+            dst_id = mStagingTexId;
+            dst_target = GL_TEXTURE_2D;
+        }
+
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+        glTextureSubImage2DEXT(dst_id, dst_target, level,
+            rect.left, rect.top, rect.right-rect.left, rect.bottom-rect.top,
+            format->format, format->type, (const GLubyte*)offset
+        );
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    checkGLError();
+
+    if(target == GL_RENDERBUFFER)
+        mParent->blitFramebufferGL(GL_TEXTURE_2D, mStagingTexId, 0, rect,
+                                   GL_RENDERBUFFER, id, 0, rect, GL_NEAREST);
+}
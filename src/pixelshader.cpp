@@ -1,95 +1,66 @@
 
 #include "pixelshader.hpp"
 
-#include <sstream>
-
 #include "mojoshader/mojoshader.h"
 #include "device.hpp"
+#include "programcache.hpp"
 #include "trace.hpp"
 #include "private_iids.hpp"
 
 
-GLuint D3DGLPixelShader::compileShaderGL(UINT shadowmask)
+void SharedPixelShader::startProgramGL(ShaderTranslation *translation)
 {
-    const MOJOSHADER_parseData *shader = nullptr;
-    GLuint program = 0;
+    UINT mask = translation->getShadowSamplers();
+    if(mPrograms.count(mask) || mStartedPrograms.count(mask))
+        return;
 
-    shader = MOJOSHADER_parse(MOJOSHADER_PROFILE_GLSL330,
-        reinterpret_cast<const unsigned char*>(mCode.data()),
-        mCode.size() * sizeof(decltype(mCode)::value_type),
-        nullptr, 0, shadowmask
-    );
-    if(shader->error_count > 0)
+    mStartedPrograms.insert(std::make_pair(mask,
+        StartProgramGL(mParent->getProgramCache(), GL_FRAGMENT_SHADER, mCode, translation)
+    ));
+}
+
+GLuint SharedPixelShader::compileShaderGL(ShaderTranslation *translation)
+{
+    UINT mask = translation->getShadowSamplers();
+    auto prog = mPrograms.find(mask);
+    if(prog != mPrograms.end())
     {
-        std::stringstream sstr;
-        for(int i = 0;i < shader->error_count;++i)
-            sstr<< shader->errors[i].error_position<<":"<<shader->errors[i].error <<std::endl;
-        ERR("Failed to parse shader:\n----\n%s\n----\n", sstr.str().c_str());
-        goto done;
+        --mPendingUpdates;
+        return prog->second;
     }
-    if(mCode.size() != (std::size_t)shader->token_count)
-        ERR("Token count mismatch (previous: %u, now: %d)\n",
-            mCode.size(), shader->token_count);
-    TRACE("Parsed shader:\n----\n%s\n----\n", shader->output);
 
+    PendingProgram pending;
+    auto iter = mStartedPrograms.find(mask);
+    if(iter != mStartedPrograms.end())
     {
-        program = glCreateShaderProgramv(GL_FRAGMENT_SHADER, 1, &shader->output);
-        checkGLError();
-        if(!program)
-        {
-            FIXME("Failed to create shader program\n");
-            goto done;
-        }
-
-        GLint logLen = 0;
-        GLint status = GL_FALSE;
-        glGetProgramiv(program, GL_LINK_STATUS, &status);
-        if(status == GL_FALSE)
-        {
-            glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLen);
-            std::vector<char> log(logLen+1);
-            glGetProgramInfoLog(program, logLen, &logLen, log.data());
-            FIXME("Shader not linked:\n----\n%s\n----\nShader text:\n----\n%s\n----\n",
-                  log.data(), shader->output);
-
-            glDeleteProgram(program);
-            program = 0;
-            checkGLError();
-
-            goto done;
-        }
-
-        mPrograms.insert(std::make_pair(shadowmask, program));
-        TRACE("Created fragment shader program 0x%x\n", program);
-
-        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLen);
-        if(logLen > 4)
-        {
-            std::vector<char> log(logLen+1);
-            glGetProgramInfoLog(program, logLen, &logLen, log.data());
-            WARN("Compile warning log:\n----\n%s\n----\nShader text:\n----\n%s\n----\n",
-                 log.data(), shader->output);
-        }
+        pending = iter->second;
+        mStartedPrograms.erase(iter);
     }
+    else
+        pending = StartProgramGL(mParent->getProgramCache(), GL_FRAGMENT_SHADER, mCode, translation);
 
+    GLuint program = FinishProgramGL(mParent->getProgramCache(), pending, translation);
+    if(program)
     {
+        const MOJOSHADER_parseData *shader = translation->get();
+        TRACE("Created fragment shader program 0x%x\n", program);
+
         GLuint v4f_idx = glGetUniformBlockIndex(program, "ps_vec4");
         if(v4f_idx != GL_INVALID_INDEX)
             glUniformBlockBinding(program, v4f_idx, PSF_BINDING_IDX);
-    }
-
-    for(int i = 0;i < shader->sampler_count;++i)
-    {
-        GLint loc = glGetUniformLocation(program, shader->samplers[i].name);
-        TRACE("Got sampler %s:%d at location %d\n", shader->samplers[i].name,
-            shader->samplers[i].index, loc);
-        glProgramUniform1i(program, loc, shader->samplers[i].index);
-    }
 
-    checkGLError();
+        for(int i = 0;i < shader->sampler_count;++i)
+        {
+            GLint loc = glGetUniformLocation(program, shader->samplers[i].name);
+            TRACE("Got sampler %s:%d at location %d\n", shader->samplers[i].name,
+                shader->samplers[i].index, loc);
+            glProgramUniform1i(program, loc, shader->samplers[i].index);
+        }
 
-done:
-    MOJOSHADER_freeParseData(shader);
+        checkGLError();
+    }
+    // A failed program is remembered too, so it isn't retried every draw.
+    mPrograms.insert(std::make_pair(mask, program));
 
     --mPendingUpdates;
     return program;
@@ -110,85 +81,147 @@ public:
 };
 
 
-D3DGLPixelShader::D3DGLPixelShader(D3DGLDevice *parent)
-  : mRefCount(0)
-  , mParent(parent)
+SharedPixelShader::SharedPixelShader(D3DGLDevice *parent)
+  : mParent(parent)
+  , mCodeHash(0)
   , mPendingUpdates(0)
+  , mPendingStarts(0)
+  , mHaveInfo(false)
   , mSamplerMask(0)
+  , mShadowSamplers(0)
 {
-    mParent->AddRef();
 }
 
-D3DGLPixelShader::~D3DGLPixelShader()
+SharedPixelShader::~SharedPixelShader()
 {
-    if(mPendingUpdates > 0)
+    // Nothing else is referencing this now, so once the queued commands are
+    // done, the command thread state is safe to look at.
+    while(mPendingUpdates > 0 || mPendingStarts > 0)
         mParent->getQueue().wakeAndSleep();
-    for(auto &program : mPrograms)
-        mParent->getQueue().send<DeinitPShaderCmd>(program.second);
-    mParent->Release();
-}
 
-bool D3DGLPixelShader::init(const DWORD *data)
-{
-    if(*data>>16 != 0xffff)
+    for(auto &program : mPrograms)
     {
-        WARN("Shader is not a pixel shader (0x%04lx, expected 0xffff)\n", *data>>16);
-        return false;
+        if(program.second)
+            mParent->getQueue().send<DeinitPShaderCmd>(program.second);
+    }
+    for(auto &started : mStartedPrograms)
+    {
+        if(started.second.mProgram)
+            mParent->getQueue().send<DeinitPShaderCmd>(started.second.mProgram);
     }
+}
 
+bool SharedPixelShader::init(const DWORD *data, size_t count, UINT64 hash)
+{
     TRACE("Parsing %s shader %lu.%lu using profile %s\n",
           (((*data>>16)==0xfffe) ? "vertex" : ((*data>>16)==0xffff) ? "pixel" : "unknown"),
           (*data>>8)&0xff, *data&0xff, MOJOSHADER_PROFILE_GLSL330);
 
-    const MOJOSHADER_parseData *shader = MOJOSHADER_parse(MOJOSHADER_PROFILE_GLSL330,
-        reinterpret_cast<const unsigned char*>(data), 0, nullptr, 0, 0
-    );
-    if(shader->error_count > 0)
+    mCode.insert(mCode.end(), data, data+count);
+    mCodeHash = hash;
+
+    // Get the default variant going, so it's likely done by the time the
+    // first draw needs it. Same for the variants used in earlier runs.
+    getTranslation(0);
+    for(UINT mask : mParent->getVariantManifest().get(mCodeHash))
     {
-        std::stringstream sstr;
-        for(int i = 0;i < shader->error_count;++i)
-            sstr<< shader->errors[i].error_position<<":"<<shader->errors[i].error <<std::endl;
-        ERR("Failed to parse shader:\n----\n%s\n----\n", sstr.str().c_str());
-        MOJOSHADER_freeParseData(shader);
-        return false;
+        TRACE("Starting recorded shadow sampler variant 0x%x\n", mask);
+        getTranslation(mask);
     }
-    // Save the tokens used
-    mCode.insert(mCode.end(), data, data+shader->token_count);
 
-    TRACE("Parsed shader:\n----\n%s\n----\n", shader->output);
+    return true;
+}
+
+void SharedPixelShader::translationDone(ShaderTranslation *translation, void *userdata)
+{
+    SharedPixelShader *self = static_cast<SharedPixelShader*>(userdata);
+    self->mParent->getQueue().send<StartPShaderCmd>(self, translation);
+}
+
+ShaderTranslation *SharedPixelShader::getTranslation(UINT shadowsamplers)
+{
+    auto iter = mTranslations.find(shadowsamplers);
+    if(iter != mTranslations.end())
+        return iter->second.get();
+
+    // Other variants are emitted from the default one's parse.
+    std::shared_ptr<ShaderTranslation> translation;
+    if(shadowsamplers == 0)
+        translation.reset(new ShaderTranslation(mCode));
+    else
+    {
+        getTranslation(0);
+        translation.reset(new ShaderTranslation(mTranslations[0], shadowsamplers));
+    }
+    mTranslations.insert(std::make_pair(shadowsamplers, translation));
 
+    ++mPendingStarts;
+    if(!ShaderTranslation::Start(translation, translationDone, this))
+        --mPendingStarts;
+    return translation.get();
+}
+
+void SharedPixelShader::getInfo()
+{
+    if(mHaveInfo) return;
+
+    const MOJOSHADER_parseData *shader = getTranslation(0)->get();
+    // Creation only checks the bytecode's structure, so translation errors
+    // are reported the first time the shader is used.
+    if(shader->error_count > 0)
+        ERR("Pixel shader %p failed to translate, it won't draw: %s\n", this,
+            shader->errors[0].error);
     for(int i = 0;i < shader->sampler_count;++i)
         mSamplerMask |= 1<<shader->samplers[i].index;
 
-    MOJOSHADER_freeParseData(shader);
-
-    return true;
+    mHaveInfo = true;
 }
 
-void D3DGLPixelShader::setProgram(GLuint pipeline, UINT shadowmask, bool force)
+void SharedPixelShader::setProgram(GLuint pipeline, UINT shadowmask, bool force)
 {
-    CommandQueue &queue = mParent->getQueue();
-    while(mPendingUpdates > 0)
-        queue.wakeAndSleep();
+    getInfo();
 
     shadowmask &= mSamplerMask;
-    auto iter = mPrograms.find(shadowmask);
-    if(iter != mPrograms.end())
-    {
-        if(force || mShadowSamplers != shadowmask)
-        {
-            mShadowSamplers = shadowmask;
-            queue.doSend<SetPShaderCmd>(pipeline, iter->second);
-        }
-    }
-    else
-    {
+    if(!force && mShadowSamplers == shadowmask)
+        return;
+
+    if(!mTranslations.count(shadowmask))
         TRACE("Building program for shadow sampler mask 0x%x\n", shadowmask);
+    if(shadowmask != 0 && mShadowSamplers != shadowmask)
+        mParent->getVariantManifest().record(mCodeHash, shadowmask);
+
+    mShadowSamplers = shadowmask;
+    ++mPendingUpdates;
+    mParent->getQueue().doSend<CompileAndSetPShaderCmd>(this, pipeline,
+        getTranslation(shadowmask)
+    );
+}
+
+
+D3DGLPixelShader::D3DGLPixelShader(D3DGLDevice *parent)
+  : mRefCount(0)
+  , mParent(parent)
+{
+    mParent->AddRef();
+}
 
-        mShadowSamplers = shadowmask;
-        ++mPendingUpdates;
-        queue.doSend<CompileAndSetPShaderCmd>(this, pipeline, shadowmask);
+D3DGLPixelShader::~D3DGLPixelShader()
+{
+    // The shared state needs the device until it's gone.
+    mShared.reset();
+    mParent->Release();
+}
+
+bool D3DGLPixelShader::init(const DWORD *data)
+{
+    if(*data>>16 != 0xffff)
+    {
+        WARN("Shader is not a pixel shader (0x%04lx, expected 0xffff)\n", *data>>16);
+        return false;
     }
+
+    mShared = mParent->getPShaderRegistry().get(mParent, data);
+    return mShared != nullptr;
 }
 
 
@@ -234,8 +267,9 @@ HRESULT D3DGLPixelShader::GetFunction(void *data, UINT *size)
 {
     TRACE("iface %p, data %p, size %p\n", this, data, size);
 
-    *size = mCode.size() * sizeof(decltype(mCode)::value_type);
+    const std::vector<DWORD> &code = mShared->getCode();
+    *size = code.size() * sizeof(DWORD);
     if(data)
-        memcpy(data, mCode.data(), mCode.size() * sizeof(decltype(mCode)::value_type));
+        memcpy(data, code.data(), code.size() * sizeof(DWORD));
     return D3D_OK;
 }
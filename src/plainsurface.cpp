@@ -8,18 +8,70 @@
 #include "allocators.hpp"
 
 
+namespace
+{
+
+class PlainSurfaceReadbackCmd : public Command {
+    D3DGLPlainSurface *mTarget;
+    GLenum mSrcTarget;
+    GLuint mSrcBinding;
+    GLint mSrcLevel;
+    RECT mSrcRect;
+    POINT mDstPoint;
+
+public:
+    PlainSurfaceReadbackCmd(D3DGLPlainSurface *target, GLenum src_target, GLuint src_binding, GLint src_level,
+                            const RECT &src_rect, const POINT &dst_point)
+      : mTarget(target), mSrcTarget(src_target), mSrcBinding(src_binding), mSrcLevel(src_level)
+      , mSrcRect(src_rect), mDstPoint(dst_point)
+    { }
+
+    virtual ULONG execute()
+    {
+        mTarget->readbackGL(mSrcTarget, mSrcBinding, mSrcLevel, mSrcRect, mDstPoint);
+        return sizeof(*this);
+    }
+};
+
+class PlainSurfaceResolveCmd : public Command {
+    D3DGLPlainSurface *mTarget;
+
+public:
+    PlainSurfaceResolveCmd(D3DGLPlainSurface *target) : mTarget(target) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->resolveReadbackGL(true);
+        return sizeof(*this);
+    }
+};
+
+} // namespace
+
+
 D3DGLPlainSurface::D3DGLPlainSurface(D3DGLDevice *parent)
   : mRefCount(0)
   , mParent(parent)
   , mPendingUpdates(0)
+  , mPackBufferId(0)
+  , mPackBufferSize(0)
+  , mReadFence(0)
   , mLock(LT_Unlocked)
 {
 }
 
 D3DGLPlainSurface::~D3DGLPlainSurface()
 {
-    while(mPendingUpdates > 0)
-        mParent->getQueue().wakeAndSleep();
+    // Surfaces that were read back into are deleted on the command thread.
+    if(mPackBufferId)
+    {
+        if(mReadFence)
+            glDeleteSync(mReadFence);
+        mReadFence = 0;
+        mParent->removeReadbackGL(this);
+        mParent->deleteBufferGL(mPackBufferId);
+        mPackBufferId = 0;
+    }
 }
 
 bool D3DGLPlainSurface::init(const D3DSURFACE_DESC *desc)
@@ -51,6 +103,131 @@ bool D3DGLPlainSurface::init(const D3DSURFACE_DESC *desc)
 }
 
 
+void D3DGLPlainSurface::readbackGL(GLenum src_target, GLuint src_binding, GLint src_level,
+                                   const RECT &src_rect, const POINT &dst_point)
+{
+    if(mReadFence)
+    {
+        // Replaced before the last one was resolved.
+        glDeleteSync(mReadFence);
+        mReadFence = 0;
+        --mPendingUpdates;
+    }
+
+    const GLFormatConversion *conv = mGLFormat->conversion;
+    GLint pitch, bpp;
+    if(conv)
+    {
+        pitch = conv->calcPitch(mDesc.Width);
+        bpp = conv->glbytesperpixel;
+    }
+    else
+    {
+        pitch = mGLFormat->calcPitch(mDesc.Width, mGLFormat->bytesperpixel);
+        bpp = mGLFormat->bytesperpixel;
+    }
+    if(!mPackBufferSize)
+    {
+        mPackBufferSize = pitch * mDesc.Height;
+        glNamedBufferDataEXT(mPackBufferId, mPackBufferSize, nullptr, GL_STREAM_READ);
+    }
+
+    mReadRect.left = dst_point.x;
+    mReadRect.top = dst_point.y;
+    mReadRect.right = dst_point.x + src_rect.right-src_rect.left;
+    mReadRect.bottom = dst_point.y + src_rect.bottom-src_rect.top;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, mPackBufferId);
+    glPixelStorei(GL_PACK_ROW_LENGTH, mDesc.Width);
+    // Nothing waits on this; the fence tracks the read instead.
+    std::atomic<ULONG> pending(1);
+    GLubyte *offset = reinterpret_cast<GLubyte*>(dst_point.y*pitch + dst_point.x*bpp);
+    mParent->readFramebufferGL(src_target, src_binding, src_level, src_rect,
+                               mGLFormat->format, mGLFormat->type, offset, pending);
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    mReadFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    checkGLError();
+    mParent->addReadbackGL(this);
+}
+
+bool D3DGLPlainSurface::resolveReadbackGL(bool wait)
+{
+    if(!mReadFence)
+        return true;
+
+    GLenum ret;
+    if(!wait)
+        ret = glClientWaitSync(mReadFence, 0, 0);
+    else do {
+        ret = glClientWaitSync(mReadFence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+    } while(ret == GL_TIMEOUT_EXPIRED);
+    if(ret == GL_TIMEOUT_EXPIRED)
+        return false;
+    if(ret == GL_WAIT_FAILED)
+        ERR("Failed to wait on readback fence\n");
+    glDeleteSync(mReadFence);
+    mReadFence = 0;
+
+    const GLubyte *src = reinterpret_cast<const GLubyte*>(
+        glMapNamedBufferRangeEXT(mPackBufferId, 0, mPackBufferSize, GL_MAP_READ_BIT)
+    );
+    if(!src)
+        ERR("Failed to map readback buffer\n");
+    else
+    {
+        // Only copy what was read, leaving the rest of the surface alone.
+        GLint pitch = mGLFormat->calcPitch(mDesc.Width, mGLFormat->bytesperpixel);
+        GLubyte *dst = mBufData.get() + mReadRect.top*pitch +
+                       mReadRect.left*mGLFormat->bytesperpixel;
+        UINT w = mReadRect.right - mReadRect.left;
+        UINT h = mReadRect.bottom - mReadRect.top;
+        // GL can only give back the converted format, so convert it back.
+        if(const GLFormatConversion *conv = mGLFormat->conversion)
+        {
+            GLint srcpitch = conv->calcPitch(mDesc.Width);
+            src += mReadRect.top*srcpitch + mReadRect.left*conv->glbytesperpixel;
+            for(UINT y = 0;y < h;++y)
+                conv->fromGLRect(dst + y*pitch, pitch, src + y*srcpitch, w, 1);
+        }
+        else
+        {
+            src += dst - mBufData.get();
+            for(UINT y = 0;y < h;++y)
+                memcpy(dst + y*pitch, src + y*pitch, w*mGLFormat->bytesperpixel);
+        }
+        glUnmapNamedBufferEXT(mPackBufferId);
+    }
+    checkGLError();
+
+    --mPendingUpdates;
+    return true;
+}
+
+
+void D3DGLPlainSurface::queueReadback(GLenum src_target, GLuint src_binding, GLint src_level,
+                                      const RECT &src_rect, const POINT &dst_point)
+{
+    if(!mPackBufferId)
+        mPackBufferId = mParent->getBufferName();
+    ++mPendingUpdates;
+    mParent->getQueue().send<PlainSurfaceReadbackCmd>(this, src_target, src_binding, src_level,
+                                                      src_rect, dst_point);
+}
+
+void D3DGLPlainSurface::finishReadback()
+{
+    if(mPendingUpdates == 0)
+        return;
+    // Readbacks are resolved at each Present once the GPU is done with them.
+    // Otherwise, have the command thread wait on it now.
+    mParent->getQueue().send<PlainSurfaceResolveCmd>(this);
+    while(mPendingUpdates > 0)
+        mParent->getQueue().wakeAndSleep();
+}
+
+
 HRESULT D3DGLPlainSurface::QueryInterface(REFIID riid, void **obj)
 {
     TRACE("iface %p, riid %s, obj %p\n", this, debugstr_guid(riid), obj);
@@ -80,7 +257,7 @@ ULONG D3DGLPlainSurface::Release()
     if(ret == 0)
     {
         D3DGLDevice *device = mParent;
-        delete this;
+        device->getQueue().send<CommandDelete<D3DGLPlainSurface>>(this);
         device->Release();
     }
     return ret;
@@ -190,8 +367,7 @@ HRESULT D3DGLPlainSurface::LockRect(D3DLOCKED_RECT *lockedRect, const RECT *rect
         }
     }
 
-    while(mPendingUpdates > 0)
-        mParent->getQueue().wakeAndSleep();
+    finishReadback();
 
     GLubyte *memPtr = mBufData.get();
     mLockRegion = *rect;
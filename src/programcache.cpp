@@ -0,0 +1,309 @@
+
+#include "programcache.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+#include "mojoshader/mojoshader.h"
+#include "trace.hpp"
+
+
+namespace
+{
+
+// Bump when a change here or in the shader setup invalidates old binaries.
+const UINT32 sCacheVersion = 2;
+
+struct CacheHeader {
+    char mMagic[4];
+    UINT32 mVersion;
+    UINT64 mKey;
+    GLenum mFormat;
+    UINT32 mLength;
+};
+const char sCacheMagic[4] = { 'D', 'G', 'P', 'B' };
+
+// The variant manifest is text, one "<code hash> <shadow mask>" pair per
+// line after the header. New pairs are appended as they're used, so nothing
+// is lost if the app doesn't shut down cleanly.
+const char sManifestName[] = "\\variants.txt";
+const char sManifestHeader[] = "d3dgl variants 1\n";
+
+UINT64 HashString(UINT64 hash, const GLubyte *str)
+{
+    if(!str) return hash;
+    return HashBytes(hash, str, strlen(reinterpret_cast<const char*>(str))+1);
+}
+
+} // namespace
+
+
+UINT64 HashBytes(UINT64 hash, const void *data, size_t len)
+{
+    const BYTE *bytes = reinterpret_cast<const BYTE*>(data);
+    for(size_t i = 0;i < len;++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+
+ProgramCache::ProgramCache()
+  : mEnabled(false)
+  , mEnvHash(HashBasis)
+  , mNumHits(0)
+  , mNumMisses(0)
+  , mNumRejected(0)
+{
+}
+
+ProgramCache::~ProgramCache()
+{
+    if(mEnabled)
+        TRACE("Program cache: %lu hits, %lu misses, %lu rejected\n", mNumHits, mNumMisses, mNumRejected);
+}
+
+void ProgramCache::initGL()
+{
+    if(ShaderCacheDir.empty())
+        return;
+
+    if(!(GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary))
+    {
+        WARN("Program binaries not supported, not caching shaders\n");
+        return;
+    }
+    GLint numformats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numformats);
+    if(numformats < 1)
+    {
+        WARN("No program binary formats, not caching shaders\n");
+        return;
+    }
+
+    if(!CreateDirectoryA(ShaderCacheDir.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS)
+    {
+        ERR("Failed to create shader cache directory %s, error %lu\n", ShaderCacheDir.c_str(),
+            GetLastError());
+        return;
+    }
+
+    UINT64 hash = HashBytes(HashBasis, &sCacheVersion, sizeof(sCacheVersion));
+    int mojoversion = MOJOSHADER_version();
+    hash = HashBytes(hash, &mojoversion, sizeof(mojoversion));
+    hash = HashString(hash, glGetString(GL_VENDOR));
+    hash = HashString(hash, glGetString(GL_RENDERER));
+    hash = HashString(hash, glGetString(GL_VERSION));
+    mEnvHash = hash;
+    mEnabled = true;
+
+    TRACE("Caching shader programs in %s\n", ShaderCacheDir.c_str());
+}
+
+
+std::string ProgramCache::getPath(UINT64 key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "\\%016llx.bin", (unsigned long long)key);
+    return ShaderCacheDir + name;
+}
+
+UINT64 ProgramCache::makeKey(GLenum type, const std::vector<DWORD> &code, UINT variant) const
+{
+    UINT64 hash = HashBytes(mEnvHash, &type, sizeof(type));
+    hash = HashBytes(hash, &variant, sizeof(variant));
+    return HashBytes(hash, code.data(), code.size()*sizeof(DWORD));
+}
+
+
+GLuint ProgramCache::loadGL(UINT64 key)
+{
+    if(!mEnabled)
+        return 0;
+
+    std::string path = getPath(key);
+    FILE *f = fopen(path.c_str(), "rb");
+    if(!f)
+    {
+        ++mNumMisses;
+        return 0;
+    }
+
+    CacheHeader hdr;
+    std::vector<char> binary;
+    bool ok = (fread(&hdr, sizeof(hdr), 1, f) == 1 &&
+               memcmp(hdr.mMagic, sCacheMagic, sizeof(sCacheMagic)) == 0 &&
+               hdr.mVersion == sCacheVersion && hdr.mKey == key && hdr.mLength > 0);
+    if(ok)
+    {
+        binary.resize(hdr.mLength);
+        ok = (fread(binary.data(), 1, binary.size(), f) == binary.size());
+    }
+    fclose(f);
+
+    GLuint program = 0;
+    if(ok)
+    {
+        program = glCreateProgram();
+        glProgramParameteri(program, GL_PROGRAM_SEPARABLE, GL_TRUE);
+        glProgramBinary(program, hdr.mFormat, binary.data(), binary.size());
+
+        GLint status = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        if(status == GL_FALSE)
+        {
+            glDeleteProgram(program);
+            program = 0;
+        }
+        checkGLError();
+    }
+
+    if(!program)
+    {
+        // Corrupt, or the driver no longer takes it. It'll be stored again
+        // once compiled.
+        TRACE("Rejected cached program %s\n", path.c_str());
+        DeleteFileA(path.c_str());
+        ++mNumRejected;
+        return 0;
+    }
+
+    TRACE("Loaded cached program 0x%x from %s\n", program, path.c_str());
+    ++mNumHits;
+    return program;
+}
+
+void ProgramCache::storeGL(UINT64 key, GLuint program)
+{
+    if(!mEnabled)
+        return;
+
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if(length <= 0)
+    {
+        WARN("No binary for program 0x%x\n", program);
+        return;
+    }
+
+    CacheHeader hdr;
+    memcpy(hdr.mMagic, sCacheMagic, sizeof(sCacheMagic));
+    hdr.mVersion = sCacheVersion;
+    hdr.mKey = key;
+    hdr.mFormat = GL_NONE;
+    std::vector<char> binary(length);
+    glGetProgramBinary(program, length, &length, &hdr.mFormat, binary.data());
+    checkGLError();
+    if(length <= 0)
+        return;
+    hdr.mLength = length;
+
+    // Write to a temporary file first, so other processes never see a
+    // partial entry.
+    std::string path = getPath(key);
+    std::string tmppath = path + ".tmp";
+    FILE *f = fopen(tmppath.c_str(), "wb");
+    if(!f)
+    {
+        ERR("Failed to open %s for writing\n", tmppath.c_str());
+        return;
+    }
+    bool ok = (fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+               fwrite(binary.data(), 1, hdr.mLength, f) == hdr.mLength);
+    ok = (fclose(f) == 0) && ok;
+    if(!ok || !MoveFileExA(tmppath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        ERR("Failed to write %s\n", path.c_str());
+        DeleteFileA(tmppath.c_str());
+        return;
+    }
+    TRACE("Stored program 0x%x to %s\n", program, path.c_str());
+}
+
+
+VariantManifest::VariantManifest()
+  : mEnabled(false)
+  , mNumLoaded(0)
+  , mNumRecorded(0)
+{
+    InitializeCriticalSection(&mLock);
+}
+
+VariantManifest::~VariantManifest()
+{
+    if(mEnabled)
+        TRACE("Variant manifest: %lu loaded, %lu recorded\n", mNumLoaded, mNumRecorded);
+    DeleteCriticalSection(&mLock);
+}
+
+void VariantManifest::load()
+{
+    if(ShaderCacheDir.empty())
+        return;
+
+    EnterCriticalSection(&mLock);
+    mPath = ShaderCacheDir + sManifestName;
+    mEnabled = true;
+
+    if(FILE *f = fopen(mPath.c_str(), "r"))
+    {
+        char header[sizeof(sManifestHeader)];
+        if(!fgets(header, sizeof(header), f) || strcmp(header, sManifestHeader) != 0)
+        {
+            // Unknown format, so start over.
+            fclose(f);
+            f = nullptr;
+            WARN("Discarding variant manifest %s\n", mPath.c_str());
+            DeleteFileA(mPath.c_str());
+        }
+        else
+        {
+            unsigned long long hash;
+            unsigned int mask;
+            while(fscanf(f, "%llx %x", &hash, &mask) == 2)
+            {
+                if(mVariants.insert(std::make_pair(UINT64(hash), UINT(mask))).second)
+                    ++mNumLoaded;
+            }
+            fclose(f);
+        }
+    }
+    LeaveCriticalSection(&mLock);
+
+    TRACE("Loaded %lu shader variants from %s\n", mNumLoaded, mPath.c_str());
+}
+
+std::vector<UINT> VariantManifest::get(UINT64 hash)
+{
+    std::vector<UINT> masks;
+    EnterCriticalSection(&mLock);
+    auto iter = mVariants.lower_bound(std::make_pair(hash, 0u));
+    for(;iter != mVariants.end() && iter->first == hash;++iter)
+        masks.push_back(iter->second);
+    LeaveCriticalSection(&mLock);
+    return masks;
+}
+
+void VariantManifest::record(UINT64 hash, UINT mask)
+{
+    EnterCriticalSection(&mLock);
+    if(mEnabled && mVariants.insert(std::make_pair(hash, mask)).second)
+    {
+        ++mNumRecorded;
+        bool isnew = (GetFileAttributesA(mPath.c_str()) == INVALID_FILE_ATTRIBUTES);
+        if(FILE *f = fopen(mPath.c_str(), "a"))
+        {
+            if(isnew) fputs(sManifestHeader, f);
+            fprintf(f, "%016llx %x\n", (unsigned long long)hash, mask);
+            fclose(f);
+        }
+        else
+        {
+            ERR("Failed to open %s for writing, not recording variants\n", mPath.c_str());
+            mEnabled = false;
+        }
+    }
+    LeaveCriticalSection(&mLock);
+}
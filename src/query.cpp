@@ -5,38 +5,6 @@
 #include "private_iids.hpp"
 
 
-void D3DGLQuery::initGL()
-{
-    glGenQueries(1, &mQueryId);
-    checkGLError();
-}
-class QueryInitCmd : public Command {
-    D3DGLQuery *mTarget;
-
-public:
-    QueryInitCmd(D3DGLQuery *target) : mTarget(target) { }
-
-    virtual ULONG execute()
-    {
-        mTarget->initGL();
-        return sizeof(*this);
-    }
-};
-
-class QueryDeinitCmd : public Command {
-    GLuint mQueryId;
-
-public:
-    QueryDeinitCmd(GLuint queryid) : mQueryId(queryid) { }
-
-    virtual ULONG execute()
-    {
-        glDeleteQueries(1, &mQueryId);
-        checkGLError();
-        return sizeof(*this);
-    }
-};
-
 void D3DGLQuery::beginQueryGL()
 {
     glBeginQuery(mQueryType, mQueryId);
@@ -107,20 +75,14 @@ D3DGLQuery::D3DGLQuery(D3DGLDevice *parent)
   , mPendingQueries(0)
   , mState(Signaled)
 {
-    mParent->AddRef();
 }
 
 D3DGLQuery::~D3DGLQuery()
 {
+    // Deleted on the command thread, so there are no more pending queries.
     if(mQueryId)
-    {
-        mParent->getQueue().send<QueryDeinitCmd>(mQueryId);
-        while(mPendingQueries)
-            mParent->getQueue().wakeAndSleep();
-        mQueryId = 0;
-    }
-
-    mParent->Release();
+        mParent->deleteQueryGL(mQueryId);
+    mQueryId = 0;
 }
 
 bool D3DGLQuery::init(D3DQUERYTYPE type)
@@ -135,7 +97,7 @@ bool D3DGLQuery::init(D3DQUERYTYPE type)
         return false;
     }
 
-    mParent->getQueue().sendSync<QueryInitCmd>(this);
+    mQueryId = mParent->getQueryName();
     return true;
 }
 
@@ -157,6 +119,7 @@ ULONG D3DGLQuery::AddRef()
 {
     ULONG ret = ++mRefCount;
     TRACE("%p New refcount: %lu\n", this, ret);
+    if(ret == 1) mParent->AddRef();
     return ret;
 }
 
@@ -164,7 +127,12 @@ ULONG D3DGLQuery::Release()
 {
     ULONG ret = --mRefCount;
     TRACE("%p New refcount: %lu\n", this, ret);
-    if(ret == 0) delete this;
+    if(ret == 0)
+    {
+        D3DGLDevice *device = mParent;
+        device->getQueue().send<CommandDelete<D3DGLQuery>>(this);
+        device->Release();
+    }
     return ret;
 }
 
@@ -5,6 +5,7 @@
 #include "glformat.hpp"
 #include "device.hpp"
 #include "private_iids.hpp"
+#include "lockbuffer.hpp"
 
 
 class DeleteRenderbuffer : public Command {
@@ -22,30 +23,32 @@ public:
 };
 
 
-void D3DGLRenderTarget::initGL()
-{
-    glGenRenderbuffers(1, &mId);
-    glBindRenderbuffer(GL_RENDERBUFFER, mId);
-    checkGLError();
-
-    if(mDesc.MultiSampleType <= D3DMULTISAMPLE_NONE)
-        glRenderbufferStorage(GL_RENDERBUFFER, mGLFormat->internalformat, mDesc.Width, mDesc.Height);
-    else
-        glRenderbufferStorageMultisample(GL_RENDERBUFFER, mDesc.MultiSampleType, mGLFormat->internalformat,
-                                         mDesc.Width, mDesc.Height);
-
-    glBindRenderbuffer(GL_RENDERBUFFER, 0);
-    checkGLError();
-}
+// Takes everything by value so the render target may be destroyed before
+// this is processed.
 class InitRenderTargetCmd : public Command {
-    D3DGLRenderTarget *mTarget;
+    GLuint mId;
+    GLenum mInternalFormat;
+    GLsizei mWidth;
+    GLsizei mHeight;
+    GLsizei mSamples;
 
 public:
-    InitRenderTargetCmd(D3DGLRenderTarget *target) : mTarget(target) { }
+    InitRenderTargetCmd(GLuint id, GLenum internalformat, GLsizei width, GLsizei height, GLsizei samples)
+      : mId(id), mInternalFormat(internalformat), mWidth(width), mHeight(height), mSamples(samples)
+    { }
 
     virtual ULONG execute()
     {
-        mTarget->initGL();
+        glBindRenderbuffer(GL_RENDERBUFFER, mId);
+        checkGLError();
+
+        if(mSamples <= 0)
+            glRenderbufferStorage(GL_RENDERBUFFER, mInternalFormat, mWidth, mHeight);
+        else
+            glRenderbufferStorageMultisample(GL_RENDERBUFFER, mSamples, mInternalFormat, mWidth, mHeight);
+
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        checkGLError();
         return sizeof(*this);
     }
 };
@@ -55,20 +58,27 @@ D3DGLRenderTarget::D3DGLRenderTarget(D3DGLDevice *parent)
   , mParent(parent)
   , mGLFormat(nullptr)
   , mIsAuto(false)
+  , mIsLockable(false)
   , mId(0)
+  , mLock(LT_Unlocked)
+  , mLockBuffer(nullptr)
 {
 }
 
 D3DGLRenderTarget::~D3DGLRenderTarget()
 {
+    if(mLockBuffer)
+        mParent->getQueue().send<CommandDelete<LockBuffer>>(mLockBuffer);
+    mLockBuffer = nullptr;
     if(mId != 0)
         mParent->getQueue().send<DeleteRenderbuffer>(mId);
 }
 
-bool D3DGLRenderTarget::init(const D3DSURFACE_DESC *desc, bool isauto)
+bool D3DGLRenderTarget::init(const D3DSURFACE_DESC *desc, bool isauto, bool lockable)
 {
     mDesc = *desc;
     mIsAuto = isauto;
+    mIsLockable = lockable;
 
     auto fmtinfo = gFormatList.find(mDesc.Format);
     if(fmtinfo == gFormatList.end())
@@ -77,9 +87,22 @@ bool D3DGLRenderTarget::init(const D3DSURFACE_DESC *desc, bool isauto)
         return false;
     }
     mGLFormat = &fmtinfo->second;
+    if(mGLFormat->conversion)
+    {
+        FIXME("Render targets not supported with format %s\n", d3dfmt_to_str(mDesc.Format));
+        return false;
+    }
 
     if(mDesc.Format != D3DFMT_NULL)
-        mParent->getQueue().sendSync<InitRenderTargetCmd>(this);
+    {
+        GLsizei samples = 0;
+        if(mDesc.MultiSampleType > D3DMULTISAMPLE_NONE)
+            samples = mDesc.MultiSampleType;
+
+        mId = mParent->getRenderbufferName();
+        mParent->getQueue().send<InitRenderTargetCmd>(mId, mGLFormat->internalformat,
+                                                      mDesc.Width, mDesc.Height, samples);
+    }
 
     return true;
 }
@@ -191,14 +214,97 @@ HRESULT D3DGLRenderTarget::GetDesc(D3DSURFACE_DESC *desc)
 
 HRESULT D3DGLRenderTarget::LockRect(D3DLOCKED_RECT *lockedRect, const RECT *rect, DWORD flags)
 {
-    FIXME("iface %p, lockedRect %p, rect %p, flags 0x%lx : stub!\n", this, lockedRect, rect, flags);
-    return E_NOTIMPL;
+    TRACE("iface %p, lockedRect %p, rect %p, flags 0x%lx\n", this, lockedRect, rect, flags);
+
+    if(!mIsLockable)
+    {
+        WARN("Attempting to lock non-lockable render target\n");
+        return D3DERR_INVALIDCALL;
+    }
+    if(mDesc.Format == D3DFMT_NULL || !(mGLFormat->buffermask&GL_COLOR_BUFFER_BIT))
+    {
+        FIXME("Attempting to lock non-color render target (format %s)\n", d3dfmt_to_str(mDesc.Format));
+        return D3DERR_INVALIDCALL;
+    }
+    if(mDesc.MultiSampleType != D3DMULTISAMPLE_NONE)
+    {
+        FIXME("Attempting to lock multisampled render target\n");
+        return D3DERR_INVALIDCALL;
+    }
+
+    DWORD unknown_flags = flags & ~(D3DLOCK_DISCARD|D3DLOCK_NOOVERWRITE|D3DLOCK_READONLY|D3DLOCK_NO_DIRTY_UPDATE);
+    if(unknown_flags) FIXME("Unknown lock flags: 0x%lx\n", unknown_flags);
+
+    RECT full = { 0, 0, (LONG)mDesc.Width, (LONG)mDesc.Height };
+    if((flags&D3DLOCK_DISCARD))
+    {
+        if((flags&D3DLOCK_READONLY))
+        {
+            WARN("Read-only discard specified\n");
+            return D3DERR_INVALIDCALL;
+        }
+        if(rect)
+        {
+            WARN("Discardable rect specified\n");
+            return D3DERR_INVALIDCALL;
+        }
+    }
+    if(!rect)
+        rect = &full;
+
+    {
+        LockType lt = ((flags&D3DLOCK_READONLY) ? LT_ReadOnly : LT_Full);
+        LockType nolock = LT_Unlocked;
+        if(!mLock.compare_exchange_strong(nolock, lt))
+        {
+            WARN("Render target already locked!\n");
+            return D3DERR_INVALIDCALL;
+        }
+    }
+
+    int pitch = GLFormatInfo::calcPitch(mDesc.Width, mGLFormat->bytesperpixel);
+    if(!mLockBuffer)
+        mLockBuffer = new LockBuffer(mParent, pitch*mDesc.Height);
+    // Read the renderbuffer back into a pixel buffer and map it. Discarding
+    // doesn't need the old contents.
+    mParent->getQueue().sendSync<LockBufferReadCmd>(mLockBuffer,
+        GL_RENDERBUFFER, mId, 0, mGLFormat, false, mDesc.Width, mDesc.Height,
+        (flags&D3DLOCK_DISCARD) != 0, false
+    );
+    GLubyte *memPtr = mLockBuffer->getMappedPtr();
+    if(!memPtr)
+    {
+        mLock = LT_Unlocked;
+        return D3DERR_INVALIDCALL;
+    }
+
+    mLockRegion = *rect;
+    memPtr += (rect->top*pitch) + (rect->left*mGLFormat->bytesperpixel);
+    lockedRect->Pitch = pitch;
+    lockedRect->pBits = memPtr;
+
+    TRACE("Locked region: pBits=%p, Pitch=%d\n", lockedRect->pBits, lockedRect->Pitch);
+    return D3D_OK;
 }
 
 HRESULT D3DGLRenderTarget::UnlockRect()
 {
-    FIXME("iface %p : stub!\n", this);
-    return E_NOTIMPL;
+    TRACE("iface %p\n", this);
+
+    if(mLock == LT_Unlocked)
+    {
+        ERR("Attempted to unlock an unlocked surface\n");
+        return D3DERR_INVALIDCALL;
+    }
+
+    // Read-only locks just unmap, without writing back.
+    mParent->getQueue().send<LockBufferWriteCmd>(mLockBuffer,
+        GL_RENDERBUFFER, mId, 0, mGLFormat, false, mDesc.Width, mDesc.Height,
+        mLockRegion, mLock != LT_ReadOnly
+    );
+
+    mLock = LT_Unlocked;
+    return D3D_OK;
 }
 
 HRESULT D3DGLRenderTarget::GetDC(HDC *hdc)
@@ -0,0 +1,151 @@
+
+#include "residency.hpp"
+
+#include "trace.hpp"
+
+
+ManagedResource::ManagedResource()
+  : mLastUsed(0)
+  , mSize(0)
+  , mTracked(false)
+  , mResident(false)
+{
+}
+
+
+ResidencyManager::ResidencyManager()
+  : mBudget(0)
+  , mResidentBytes(0)
+  , mFixedBytes(0)
+  , mFrame(1)
+  , mNumEvicted(0)
+  , mNumRestored(0)
+  , mSpinLock(false)
+{
+}
+
+void ResidencyManager::evictLocked(ManagedResource *res)
+{
+    TRACE("Evicting %p (%lu bytes, last used frame %lu)\n", res, (ULONG)res->mSize,
+          (ULONG)res->mLastUsed);
+    res->evict();
+    mLru.erase(res->mLruPos);
+    res->mResident = false;
+    mResidentBytes -= res->mSize;
+    ++mNumEvicted;
+}
+
+void ResidencyManager::enforceBudgetLocked()
+{
+    if(!mBudget)
+        return;
+
+    // Evict from the least recently used end, leaving what's been used this
+    // frame and what's currently set on the device.
+    auto iter = mLru.end();
+    while(mResidentBytes+mFixedBytes.load() > mBudget && iter != mLru.begin())
+    {
+        ManagedResource *res = *(--iter);
+        if(res->mLastUsed >= mFrame)
+            break;
+        if(res->isBound())
+            continue;
+
+        ++iter;
+        evictLocked(res);
+    }
+}
+
+void ResidencyManager::add(ManagedResource *res, UINT64 size)
+{
+    lock();
+    res->mSize = size;
+    res->mLastUsed = mFrame;
+    res->mTracked = true;
+    res->mResident = true;
+    res->mLruPos = mLru.insert(mLru.begin(), res);
+    mResidentBytes += size;
+    enforceBudgetLocked();
+    unlock();
+}
+
+void ResidencyManager::remove(ManagedResource *res)
+{
+    lock();
+    if(res->mResident)
+    {
+        mLru.erase(res->mLruPos);
+        res->mResident = false;
+        mResidentBytes -= res->mSize;
+    }
+    res->mTracked = false;
+    unlock();
+}
+
+void ResidencyManager::resize(ManagedResource *res, UINT64 size)
+{
+    lock();
+    if(res->mResident)
+    {
+        mResidentBytes -= res->mSize;
+        mResidentBytes += size;
+    }
+    res->mSize = size;
+    enforceBudgetLocked();
+    unlock();
+}
+
+void ResidencyManager::touch(ManagedResource *res)
+{
+    if(!res->mTracked)
+        return;
+
+    lock();
+    res->mLastUsed = mFrame;
+    if(res->mResident)
+        mLru.splice(mLru.begin(), mLru, res->mLruPos);
+    else
+    {
+        res->restore();
+        res->mResident = true;
+        res->mLruPos = mLru.insert(mLru.begin(), res);
+        mResidentBytes += res->mSize;
+        ++mNumRestored;
+        enforceBudgetLocked();
+    }
+    unlock();
+}
+
+void ResidencyManager::nextFrame()
+{
+    lock();
+    if(mNumEvicted || mNumRestored)
+        TRACE("Frame %lu: %lu evicted, %lu restored, %lu of %lu bytes used\n", (ULONG)mFrame,
+              mNumEvicted, mNumRestored, (ULONG)(mResidentBytes+mFixedBytes.load()), (ULONG)mBudget);
+    mNumEvicted = 0;
+    mNumRestored = 0;
+    ++mFrame;
+    unlock();
+}
+
+void ResidencyManager::evictAll()
+{
+    lock();
+    auto iter = mLru.begin();
+    while(iter != mLru.end())
+    {
+        ManagedResource *res = *(iter++);
+        if(!res->isBound())
+            evictLocked(res);
+    }
+    unlock();
+}
+
+UINT64 ResidencyManager::getAvailable()
+{
+    lock();
+    UINT64 used = mResidentBytes + mFixedBytes.load();
+    UINT64 avail = (used < mBudget) ? (mBudget-used) : 0;
+    unlock();
+    return avail;
+}
@@ -0,0 +1,289 @@
+
+#include "shaderbuild.hpp"
+
+#include <cstring>
+#include <sstream>
+
+#include "trace.hpp"
+#include "threadpool.hpp"
+#include "programcache.hpp"
+
+
+#ifndef GL_KHR_parallel_shader_compile
+#define GL_KHR_parallel_shader_compile 1
+#define GL_MAX_SHADER_COMPILER_THREADS_KHR 0x91B0
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+typedef void (GLAPIENTRY *PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+#endif
+
+
+class ShaderTranslation::Task : public ThreadPool::Task {
+    std::shared_ptr<ShaderTranslation> mTranslation;
+    DoneFunc mFunc;
+    void *mUserData;
+
+public:
+    Task(const std::shared_ptr<ShaderTranslation> &translation, DoneFunc func, void *userdata)
+      : mTranslation(translation), mFunc(func), mUserData(userdata)
+    { }
+
+    virtual void run()
+    {
+        mTranslation->get();
+        if(mFunc) mFunc(mTranslation.get(), mUserData);
+    }
+};
+
+
+ShaderTranslation::ShaderTranslation(const std::vector<DWORD> &code)
+  : mCode(code)
+  , mShadowSamplers(0)
+  , mParseData(nullptr)
+  , mState(TS_Pending)
+  , mIntermediate(nullptr)
+{
+    InitializeCriticalSection(&mEmitLock);
+}
+
+ShaderTranslation::ShaderTranslation(const std::shared_ptr<ShaderTranslation> &base, UINT shadowsamplers)
+  : mShadowSamplers(shadowsamplers)
+  , mParseData(nullptr)
+  , mState(TS_Pending)
+  , mBase(base)
+  , mIntermediate(nullptr)
+{
+    InitializeCriticalSection(&mEmitLock);
+}
+
+void *ShaderTranslation::ArenaMalloc(int bytes, void *data)
+{ return static_cast<ArenaAllocator*>(data)->allocate(bytes); }
+
+void ShaderTranslation::ArenaFree(void *ptr, void *data)
+{ static_cast<ArenaAllocator*>(data)->deallocate(ptr); }
+
+
+ShaderTranslation::~ShaderTranslation()
+{
+    if(mBase)
+    {
+        // Freed into the default variant's arena, which others may be using.
+        EnterCriticalSection(&mBase->mEmitLock);
+        MOJOSHADER_freeParseData(mParseData);
+        LeaveCriticalSection(&mBase->mEmitLock);
+    }
+    else
+        MOJOSHADER_freeParseData(mParseData);
+    mParseData = nullptr;
+    MOJOSHADER_freeIntermediate(mIntermediate);
+    mIntermediate = nullptr;
+    DeleteCriticalSection(&mEmitLock);
+}
+
+bool ShaderTranslation::Start(const std::shared_ptr<ShaderTranslation> &translation, DoneFunc func, void *userdata)
+{
+    Task *task = new Task(translation, func, userdata);
+    if(ThreadPool::get().submit(task))
+        return true;
+    delete task;
+    return false;
+}
+
+const MOJOSHADER_parseData *ShaderTranslation::emitVariant(UINT shadowsamplers)
+{
+    // Variants share the intermediate's output buffers, so one at a time.
+    EnterCriticalSection(&mEmitLock);
+    const ArenaAllocator::Stats prev = mArena.getStats();
+    const MOJOSHADER_parseData *shader = MOJOSHADER_emitVariant(mIntermediate, shadowsamplers);
+    const ArenaAllocator::Stats &stats = mArena.getStats();
+    TRACE("Emitted variant 0x%x with %lu allocations, %lu bytes (arena %lu bytes)\n",
+          shadowsamplers, (ULONG)(stats.mNumAllocs-prev.mNumAllocs),
+          (ULONG)(stats.mAllocBytes-prev.mAllocBytes), (ULONG)stats.mChunkBytes);
+    LeaveCriticalSection(&mEmitLock);
+    return shader;
+}
+
+const MOJOSHADER_parseData *ShaderTranslation::get()
+{
+    State state = TS_Pending;
+    if(!mState.compare_exchange_strong(state, TS_Running))
+    {
+        // Being translated elsewhere. It shouldn't take long.
+        while(mState.load() != TS_Done)
+            SwitchToThread();
+        return mParseData;
+    }
+
+    const std::vector<DWORD> &code = mBase ? mBase->mCode : mCode;
+    const MOJOSHADER_parseData *shader = nullptr;
+    if(!mBase)
+    {
+        // Nothing else touches the arena until this is done.
+        shader = MOJOSHADER_parseIntermediate(MOJOSHADER_PROFILE_GLSL330,
+            reinterpret_cast<const unsigned char*>(code.data()), code.size() * sizeof(DWORD),
+            nullptr, 0, 0, ArenaMalloc, ArenaFree, &mArena, &mIntermediate
+        );
+        const ArenaAllocator::Stats &stats = mArena.getStats();
+        TRACE("Parsed with %lu allocations, %lu bytes (arena %lu bytes)\n",
+              (ULONG)stats.mNumAllocs, (ULONG)stats.mAllocBytes, (ULONG)stats.mChunkBytes);
+    }
+    else
+    {
+        mBase->get();
+        if(mBase->mIntermediate)
+            shader = mBase->emitVariant(mShadowSamplers);
+        else
+        {
+            // The default variant failed, so this likely will too. Parse it
+            // anyway, for the errors.
+            shader = MOJOSHADER_parse(MOJOSHADER_PROFILE_GLSL330,
+                reinterpret_cast<const unsigned char*>(code.data()), code.size() * sizeof(DWORD),
+                nullptr, 0, mShadowSamplers, nullptr, nullptr, nullptr
+            );
+        }
+    }
+    if(shader->error_count > 0)
+    {
+        std::stringstream sstr;
+        for(int i = 0;i < shader->error_count;++i)
+            sstr<< shader->errors[i].error_position<<":"<<shader->errors[i].error <<std::endl;
+        ERR("Failed to parse shader:\n----\n%s\n----\n", sstr.str().c_str());
+    }
+    else
+    {
+        if(code.size() != (std::size_t)shader->token_count)
+            ERR("Token count mismatch (previous: %u, now: %d)\n",
+                code.size(), shader->token_count);
+        TRACE("Parsed shader:\n----\n%s\n----\n", shader->output);
+    }
+
+    mParseData = shader;
+    mState = TS_Done;
+    return mParseData;
+}
+
+
+void InitShaderBuildGL()
+{
+    GLint numexts = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &numexts);
+    for(GLint i = 0;i < numexts;++i)
+    {
+        const char *ext = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+        if(ext && (strcmp(ext, "GL_KHR_parallel_shader_compile") == 0 ||
+                   strcmp(ext, "GL_ARB_parallel_shader_compile") == 0))
+        {
+            // The ARB version has the same enums, only the function name
+            // differs.
+            PFNGLMAXSHADERCOMPILERTHREADSKHRPROC MaxShaderCompilerThreads;
+            MaxShaderCompilerThreads = reinterpret_cast<PFNGLMAXSHADERCOMPILERTHREADSKHRPROC>(
+                wglGetProcAddress(ext[3] == 'K' ? "glMaxShaderCompilerThreadsKHR" :
+                                                  "glMaxShaderCompilerThreadsARB")
+            );
+            if(MaxShaderCompilerThreads)
+            {
+                TRACE("Using %s\n", ext);
+                // Let the driver pick how many.
+                MaxShaderCompilerThreads(0xffffffff);
+                checkGLError();
+                return;
+            }
+        }
+    }
+}
+
+
+PendingProgram StartProgramGL(ProgramCache &cache, GLenum type, const std::vector<DWORD> &code,
+                              ShaderTranslation *translation)
+{
+    PendingProgram pending{ 0, 0, false };
+    pending.mCacheKey = cache.makeKey(type, code, translation->getShadowSamplers());
+    pending.mProgram = cache.loadGL(pending.mCacheKey);
+    if(pending.mProgram)
+    {
+        pending.mCached = true;
+        return pending;
+    }
+
+    const MOJOSHADER_parseData *shader = translation->get();
+    if(shader->error_count > 0)
+        return pending;
+
+    GLuint shaderobj = glCreateShader(type);
+    if(!shaderobj)
+    {
+        FIXME("Failed to create shader object\n");
+        return pending;
+    }
+    glShaderSource(shaderobj, 1, &shader->output, nullptr);
+    glCompileShader(shaderobj);
+
+    pending.mProgram = glCreateProgram();
+    if(pending.mProgram)
+    {
+        glProgramParameteri(pending.mProgram, GL_PROGRAM_SEPARABLE, GL_TRUE);
+        if(cache.isEnabled())
+            glProgramParameteri(pending.mProgram, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        // Fixed locations, so the app thread knows them without asking GL.
+        for(int i = 0;i < shader->attribute_count;++i)
+            glBindAttribLocation(pending.mProgram, i, shader->attributes[i].name);
+        glAttachShader(pending.mProgram, shaderobj);
+        glLinkProgram(pending.mProgram);
+    }
+    else
+        FIXME("Failed to create shader program\n");
+    // Stays attached until the program is finished, for its info log.
+    glDeleteShader(shaderobj);
+    checkGLError();
+
+    return pending;
+}
+
+GLuint FinishProgramGL(ProgramCache &cache, const PendingProgram &pending, ShaderTranslation *translation)
+{
+    GLuint program = pending.mProgram;
+    if(!program || pending.mCached)
+        return program;
+
+    const MOJOSHADER_parseData *shader = translation->get();
+    GLuint shaderobj = 0;
+    GLsizei count = 0;
+    glGetAttachedShaders(program, 1, &count, &shaderobj);
+
+    GLint logLen = 0;
+    GLint status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if(status == GL_FALSE)
+    {
+        if(count > 0)
+        {
+            glGetShaderiv(shaderobj, GL_INFO_LOG_LENGTH, &logLen);
+            std::vector<char> log(logLen+1);
+            glGetShaderInfoLog(shaderobj, logLen, &logLen, log.data());
+            FIXME("Shader compile log:\n----\n%s\n----\n", log.data());
+        }
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLen);
+        std::vector<char> log(logLen+1);
+        glGetProgramInfoLog(program, logLen, &logLen, log.data());
+        FIXME("Shader not linked:\n----\n%s\n----\nShader text:\n----\n%s\n----\n",
+              log.data(), shader->output);
+
+        glDeleteProgram(program);
+        checkGLError();
+        return 0;
+    }
+    if(count > 0)
+        glDetachShader(program, shaderobj);
+
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLen);
+    if(logLen > 4)
+    {
+        std::vector<char> log(logLen+1);
+        glGetProgramInfoLog(program, logLen, &logLen, log.data());
+        WARN("Compile warning log:\n----\n%s\n----\nShader text:\n----\n%s\n----\n",
+             log.data(), shader->output);
+    }
+    checkGLError();
+
+    cache.storeGL(pending.mCacheKey, program);
+    return program;
+}
@@ -0,0 +1,67 @@
+
+#include "shaderregistry.hpp"
+
+
+// Real shaders are far smaller, even with large comments. This just keeps a
+// missing end token from running off into the rest of memory.
+static const size_t MaxShaderTokens = 1<<20;
+
+size_t GetShaderTokenCount(const DWORD *data)
+{
+    const DWORD type = data[0]>>16;
+    const DWORD major = (data[0]>>8) & 0xff;
+    const DWORD minor = data[0] & 0xff;
+    bool version_ok;
+    if(type == 0xfffe)
+        version_ok = (major == 1 && minor == 1) || ((major == 2 || major == 3) && minor <= 1);
+    else if(type == 0xffff)
+        version_ok = (major == 1 && minor <= 4) || ((major == 2 || major == 3) && minor <= 1);
+    else
+        version_ok = false;
+    if(!version_ok)
+    {
+        WARN("Invalid shader version token 0x%08lx\n", data[0]);
+        return 0;
+    }
+
+    const DWORD *token = data+1;
+    while(*token != 0x0000ffff)
+    {
+        if((size_t)(token-data) >= MaxShaderTokens)
+        {
+            WARN("No end token within %lu tokens\n", (ULONG)MaxShaderTokens);
+            return 0;
+        }
+
+        DWORD opcode = *token & 0xffff;
+        if(opcode == 0xfffe)
+        {
+            // Comment, with its length in dwords.
+            token += 1 + ((*token>>16)&0x7fff);
+            continue;
+        }
+        // Past the last instruction (breakp), only phase is valid.
+        if(opcode > 0x0060 && opcode != 0xfffd)
+        {
+            WARN("Invalid opcode 0x%04lx at token %lu\n", opcode, (ULONG)(token-data));
+            return 0;
+        }
+        if(major >= 2)
+        {
+            // Instructions carry their length from shader model 2 on.
+            token += 1 + ((*token>>24)&0x0f);
+            continue;
+        }
+        // Before that, parameter tokens have the top bit set, except for the
+        // literal values of a def instruction.
+        if(opcode == 0x0051)
+        {
+            token += 6;
+            continue;
+        }
+        ++token;
+        while((*token & 0x80000000) && (size_t)(token-data) < MaxShaderTokens)
+            ++token;
+    }
+    return token - data + 1;
+}
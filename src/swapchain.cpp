@@ -1,15 +1,21 @@
 
 #include "swapchain.hpp"
 
+#include <algorithm>
+
 #include "glew.h"
 #include "wglew.h"
 #include "trace.hpp"
 #include "device.hpp"
+#include "glformat.hpp"
 #include "rendertarget.hpp"
+#include "plainsurface.hpp"
+#include "framecapture.hpp"
 #include "private_iids.hpp"
+#include "allocators.hpp"
 
 
-void D3DGLSwapChain::swapBuffersGL(size_t backbuffer)
+void D3DGLSwapChain::swapBuffersGL(size_t backbuffer, GLuint frontbuffer)
 {
     // Flip the destination since we rendered upside down.
     RECT src_rect = { 0, 0, (INT)mParams.BackBufferWidth, (INT)mParams.BackBufferHeight };
@@ -20,6 +26,19 @@ void D3DGLSwapChain::swapBuffersGL(size_t backbuffer)
     if(!SwapBuffers(mDevCtx))
         ERR("Failed to swap buffers, error: 0x%lx\n", GetLastError());
 
+    // Keep what was presented, since the app will draw over the backbuffer.
+    mParent->blitFramebufferGL(GL_RENDERBUFFER, mBackbuffers[backbuffer]->getId(), 0, src_rect,
+                               GL_RENDERBUFFER, frontbuffer, 0, src_rect, GL_NEAREST);
+    // Read after the swap, so the capture doesn't hold up the frame. The copy
+    // is resolved, which a multisampled backbuffer can't be read without.
+    if(mCapture)
+        mCapture->captureGL(frontbuffer);
+
+    // Delete any objects released during the frame
+    mParent->flushDeletesGL();
+    mParent->getUploadRing().retireGL();
+    mParent->pollReadbacksGL();
+
     mParent->getQueue().beginWait();
     --mPendingSwaps;
     mParent->getQueue().endWait();
@@ -27,13 +46,16 @@ void D3DGLSwapChain::swapBuffersGL(size_t backbuffer)
 class SwapchainSwapBuffers : public Command {
     D3DGLSwapChain *mTarget;
     size_t mBackbuffer;
+    GLuint mFrontbuffer;
 
 public:
-    SwapchainSwapBuffers(D3DGLSwapChain *target, size_t backbuffer) : mTarget(target), mBackbuffer(backbuffer) { }
+    SwapchainSwapBuffers(D3DGLSwapChain *target, size_t backbuffer, GLuint frontbuffer)
+      : mTarget(target), mBackbuffer(backbuffer), mFrontbuffer(frontbuffer)
+    { }
 
     virtual ULONG execute()
     {
-        mTarget->swapBuffersGL(mBackbuffer);
+        mTarget->swapBuffersGL(mBackbuffer, mFrontbuffer);
         return sizeof(*this);
     }
 };
@@ -64,6 +86,8 @@ D3DGLSwapChain::D3DGLSwapChain(D3DGLDevice *parent)
   , mDevCtx(nullptr)
   , mIsAuto(false)
   , mPendingSwaps(0)
+  , mCapture(nullptr)
+  , mFrontBuffer(nullptr)
 {
 }
 
@@ -77,6 +101,13 @@ D3DGLSwapChain::~D3DGLSwapChain()
         mParent->getQueue().endWait();
     }
 
+    if(mCapture)
+        mParent->getQueue().send<CommandDelete<FrameCapture>>(mCapture);
+    mCapture = nullptr;
+
+    delete mFrontBuffer;
+    mFrontBuffer = nullptr;
+
     for(auto surface : mBackbuffers)
         delete surface;
     mBackbuffers.clear();
@@ -135,10 +166,20 @@ bool D3DGLSwapChain::init(const D3DPRESENT_PARAMETERS *params, HWND window, bool
     for(UINT i = 0;i < mParams.BackBufferCount;++i)
     {
         mBackbuffers.push_back(new D3DGLRenderTarget(mParent));
-        if(!mBackbuffers.back()->init(&desc, true))
+        if(!mBackbuffers.back()->init(&desc, true, (mParams.Flags&D3DPRESENTFLAG_LOCKABLE_BACKBUFFER) != 0))
             return false;
     }
 
+    // Presenting resolves into this, so it's never multisampled.
+    desc.MultiSampleType = D3DMULTISAMPLE_NONE;
+    desc.MultiSampleQuality = 0;
+    mFrontBuffer = new D3DGLRenderTarget(mParent);
+    if(!mFrontBuffer->init(&desc, true))
+    {
+        ERR("Failed to create front buffer copy\n");
+        return false;
+    }
+
     int interval = -1;
     switch(mParams.PresentationInterval)
     {
@@ -167,6 +208,16 @@ bool D3DGLSwapChain::init(const D3DPRESENT_PARAMETERS *params, HWND window, bool
     if(interval >= 0)
         mParent->getQueue().send<SetSwapIntervalCmd>(interval);
 
+    if(!CaptureFile.empty() && mIsAuto)
+    {
+        mCapture = new FrameCapture(mParent, mParams.BackBufferWidth, mParams.BackBufferHeight);
+        if(!mCapture->init(CaptureFile))
+        {
+            delete mCapture;
+            mCapture = nullptr;
+        }
+    }
+
     return true;
 }
 
@@ -251,18 +302,73 @@ HRESULT D3DGLSwapChain::Present(const RECT *srcRect, const RECT *dstRect, HWND d
     // occuring in between the buffer check and the SleepConditionVariableCS
     // call.
     ++mPendingSwaps;
-    cmdqueue.send<SwapchainSwapBuffers>(this, 0);
+    cmdqueue.send<SwapchainSwapBuffers>(this, 0, mFrontBuffer->getId());
     cmdqueue.endWait();
 
     cmdqueue.wake();
 
+    SlabAllocator::logStats();
+    mParent->getResidency().nextFrame();
+    mParent->getCompressor().update();
+
     return D3D_OK;
 }
 
 HRESULT D3DGLSwapChain::GetFrontBufferData(IDirect3DSurface9 *dstSurface)
 {
-    FIXME("iface %p, dstSurface %p : stub!\n", this, dstSurface);
-    return E_NOTIMPL;
+    TRACE("iface %p, dstSurface %p\n", this, dstSurface);
+
+    union {
+        void *pointer;
+        D3DGLPlainSurface *plainsurface;
+    };
+    if(!dstSurface || FAILED(dstSurface->QueryInterface(IID_D3DGLPlainSurface, &pointer)))
+    {
+        WARN("Destination %p is not a plain surface\n", dstSurface);
+        return D3DERR_INVALIDCALL;
+    }
+
+    // GL converts the frame to the destination's format as it's read, so
+    // anything it can read back into works.
+    const D3DSURFACE_DESC &desc = plainsurface->getDesc();
+    const GLFormatInfo &format = plainsurface->getFormat();
+    if(plainsurface->isCompressed() || (format.conversion && !format.conversion->fromGL))
+    {
+        WARN("Can't read the front buffer into format %s\n", d3dfmt_to_str(desc.Format));
+        plainsurface->Release();
+        return D3DERR_INVALIDCALL;
+    }
+
+    // The destination covers the screen, so a windowed frame goes where the
+    // window's client area is. The rest is left alone.
+    RECT src_rect = { 0, 0, (LONG)mParams.BackBufferWidth, (LONG)mParams.BackBufferHeight };
+    POINT dst_point = { 0, 0 };
+    if(mParams.Windowed)
+        ClientToScreen(mWindow, &dst_point);
+    if(dst_point.x < 0)
+    {
+        src_rect.left -= dst_point.x;
+        dst_point.x = 0;
+    }
+    if(dst_point.y < 0)
+    {
+        src_rect.top -= dst_point.y;
+        dst_point.y = 0;
+    }
+    src_rect.right = std::min<LONG>(src_rect.right, src_rect.left + (LONG)desc.Width - dst_point.x);
+    src_rect.bottom = std::min<LONG>(src_rect.bottom, src_rect.top + (LONG)desc.Height - dst_point.y);
+    if(src_rect.right <= src_rect.left || src_rect.bottom <= src_rect.top)
+    {
+        plainsurface->Release();
+        return D3D_OK;
+    }
+
+    // Queued into the surface's pack buffer, so nothing waits until it's
+    // locked.
+    plainsurface->queueReadback(GL_RENDERBUFFER, mFrontBuffer->getId(), 0, src_rect, dst_point);
+    plainsurface->Release();
+
+    return D3D_OK;
 }
 
 HRESULT D3DGLSwapChain::GetBackBuffer(UINT backbuffer, D3DBACKBUFFER_TYPE type, IDirect3DSurface9 **out)
@@ -0,0 +1,333 @@
+
+#include "texcompress.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "trace.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2_INTRINSICS
+#endif
+
+
+// Compression is a background job, so leave most cores to the app.
+static const DWORD MAX_COMPRESS_THREADS = 4;
+
+
+namespace
+{
+
+inline UINT Expand5(UINT v) { return (v<<3) | (v>>2); }
+inline UINT Expand6(UINT v) { return (v<<2) | (v>>4); }
+inline UINT Quantize5(UINT v) { return (v*31 + 127) / 255; }
+inline UINT Quantize6(UINT v) { return (v*63 + 127) / 255; }
+
+// Copies a 4x4 block of pixels, repeating the edge pixels past the rect.
+void LoadBlock(GLubyte *block, const GLubyte *src, int srcpitch, int bx, int by, int width, int height)
+{
+    if(bx*4+4 <= width && by*4+4 <= height)
+    {
+        for(int y = 0;y < 4;++y)
+            memcpy(block + y*16, src + (by*4+y)*srcpitch + bx*16, 16);
+        return;
+    }
+
+    for(int y = 0;y < 4;++y)
+    {
+        const GLubyte *row = src + std::min(by*4+y, height-1)*srcpitch;
+        for(int x = 0;x < 4;++x)
+            memcpy(block + (y*4+x)*4, row + std::min(bx*4+x, width-1)*4, 4);
+    }
+}
+
+
+/* Encodes the block's colors, using the inset bounding box of the colors as
+ * the endpoints and projecting each pixel onto the line between them.
+ */
+void EncodeColorBlock(GLubyte *dst, const GLubyte *block)
+{
+    UINT minpx, maxpx;
+#ifdef HAVE_SSE2_INTRINSICS
+    {
+        const __m128i *rows = reinterpret_cast<const __m128i*>(block);
+        __m128i vmin = _mm_load_si128(rows);
+        __m128i vmax = vmin;
+        for(int y = 1;y < 4;++y)
+        {
+            __m128i v = _mm_load_si128(rows + y);
+            vmin = _mm_min_epu8(vmin, v);
+            vmax = _mm_max_epu8(vmax, v);
+        }
+        vmin = _mm_min_epu8(vmin, _mm_shuffle_epi32(vmin, _MM_SHUFFLE(1,0,3,2)));
+        vmin = _mm_min_epu8(vmin, _mm_shuffle_epi32(vmin, _MM_SHUFFLE(2,3,0,1)));
+        vmax = _mm_max_epu8(vmax, _mm_shuffle_epi32(vmax, _MM_SHUFFLE(1,0,3,2)));
+        vmax = _mm_max_epu8(vmax, _mm_shuffle_epi32(vmax, _MM_SHUFFLE(2,3,0,1)));
+        minpx = _mm_cvtsi128_si32(vmin);
+        maxpx = _mm_cvtsi128_si32(vmax);
+    }
+#else
+    minpx = maxpx = 0;
+    for(int c = 0;c < 3;++c)
+    {
+        UINT l = 255, h = 0;
+        for(int i = 0;i < 16;++i)
+        {
+            l = std::min<UINT>(l, block[i*4 + c]);
+            h = std::max<UINT>(h, block[i*4 + c]);
+        }
+        minpx |= l << (c*8);
+        maxpx |= h << (c*8);
+    }
+#endif
+
+    // Pull the endpoints in a bit, which lowers the error for most blocks.
+    UINT lo[3], hi[3];
+    for(int c = 0;c < 3;++c)
+    {
+        UINT l = (minpx>>(c*8)) & 0xff;
+        UINT h = (maxpx>>(c*8)) & 0xff;
+        UINT inset = (h-l) >> 4;
+        lo[c] = l + inset;
+        hi[c] = h - inset;
+    }
+
+    // Each channel of the max is at least that of the min, so c0 >= c1 and
+    // the block is in the 4-color mode unless they're equal.
+    UINT c0 = (Quantize5(hi[2])<<11) | (Quantize6(hi[1])<<5) | Quantize5(hi[0]);
+    UINT c1 = (Quantize5(lo[2])<<11) | (Quantize6(lo[1])<<5) | Quantize5(lo[0]);
+    dst[0] = c0&0xff; dst[1] = c0>>8;
+    dst[2] = c1&0xff; dst[3] = c1>>8;
+    memset(dst+4, 0, 4);
+    if(c0 == c1)
+        return;
+
+    float e0[3] = { float(Expand5(c0&0x1f)), float(Expand6((c0>>5)&0x3f)), float(Expand5(c0>>11)) };
+    float e1[3] = { float(Expand5(c1&0x1f)), float(Expand6((c1>>5)&0x3f)), float(Expand5(c1>>11)) };
+    float d[3] = { e0[0]-e1[0], e0[1]-e1[1], e0[2]-e1[2] };
+    float dd = d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+    if(dd <= 0.0f)
+        return;
+
+    // The position of each pixel along the line from c0, in steps of 1/3.
+    // Positions 0-3 map to indices 0, 2, 3, 1.
+    float scale = 3.0f / dd;
+    float base = (e0[0]*d[0] + e0[1]*d[1] + e0[2]*d[2]) * scale;
+#ifdef HAVE_SSE2_INTRINSICS
+    const __m128 vdb = _mm_set1_ps(d[0]*scale);
+    const __m128 vdg = _mm_set1_ps(d[1]*scale);
+    const __m128 vdr = _mm_set1_ps(d[2]*scale);
+    const __m128 vbase = _mm_set1_ps(base);
+    const __m128i bytemask = _mm_set1_epi32(0xff);
+    const __m128i three = _mm_set1_epi32(3);
+    const __m128i packmul = _mm_setr_epi32(1, 1<<2, 1<<4, 1<<6);
+    for(int y = 0;y < 4;++y)
+    {
+        __m128i v = _mm_load_si128(reinterpret_cast<const __m128i*>(block) + y);
+        __m128 b = _mm_cvtepi32_ps(_mm_and_si128(v, bytemask));
+        __m128 g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, 8), bytemask));
+        __m128 r = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, 16), bytemask));
+        __m128 t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(b, vdb), _mm_mul_ps(g, vdg)), _mm_mul_ps(r, vdr));
+        t = _mm_min_ps(_mm_max_ps(_mm_sub_ps(vbase, t), _mm_setzero_ps()), _mm_set1_ps(3.0f));
+
+        __m128i p = _mm_cvtps_epi32(t);
+        __m128i idx = _mm_add_epi32(p, _mm_set1_epi32(1));
+        idx = _mm_add_epi32(idx, _mm_cmpeq_epi32(p, _mm_setzero_si128()));
+        __m128i is3 = _mm_cmpeq_epi32(p, three);
+        idx = _mm_add_epi32(idx, _mm_add_epi32(is3, _mm_add_epi32(is3, is3)));
+
+        // Pack the row's four 2-bit indices into a byte.
+        idx = _mm_madd_epi16(idx, packmul);
+        idx = _mm_add_epi32(idx, _mm_shuffle_epi32(idx, _MM_SHUFFLE(1,0,3,2)));
+        idx = _mm_add_epi32(idx, _mm_shuffle_epi32(idx, _MM_SHUFFLE(2,3,0,1)));
+        dst[4+y] = _mm_cvtsi128_si32(idx);
+    }
+#else
+    static const GLubyte posmap[4] = { 0, 2, 3, 1 };
+    for(int i = 0;i < 16;++i)
+    {
+        const GLubyte *px = block + i*4;
+        float t = base - (px[0]*d[0] + px[1]*d[1] + px[2]*d[2])*scale;
+        int p = (int)std::lrint(std::min(std::max(t, 0.0f), 3.0f));
+        dst[4 + i/4] |= posmap[p] << ((i%4)*2);
+    }
+#endif
+}
+
+/* Encodes the block's alpha with the 8-value mode, between the min and max. */
+void EncodeAlphaBlock(GLubyte *dst, const GLubyte *block)
+{
+    UINT amin = 255, amax = 0;
+    for(int i = 0;i < 16;++i)
+    {
+        amin = std::min<UINT>(amin, block[i*4 + 3]);
+        amax = std::max<UINT>(amax, block[i*4 + 3]);
+    }
+
+    dst[0] = amax;
+    dst[1] = amin;
+    UINT64 bits = 0;
+    if(amax > amin)
+    {
+        // Positions 0-7 along the range from the min map to indices 1, 7-2, 0.
+        UINT range = amax - amin;
+        for(int i = 0;i < 16;++i)
+        {
+            UINT p = ((block[i*4 + 3]-amin)*14 + range) / (range*2);
+            UINT idx = (p == 7) ? 0 : (p == 0) ? 1 : (8-p);
+            bits |= UINT64(idx) << (i*3);
+        }
+    }
+    for(int i = 0;i < 6;++i)
+        dst[2+i] = (bits>>(i*8)) & 0xff;
+}
+
+} // namespace
+
+
+void EncodeBC1(GLubyte *dst, int dstpitch, const GLubyte *src, int srcpitch, int width, int height)
+{
+    alignas(16) GLubyte block[4*4*4];
+    int blockswide = (width+3) / 4;
+    int blockshigh = (height+3) / 4;
+    for(int by = 0;by < blockshigh;++by)
+    {
+        GLubyte *out = dst + by*dstpitch;
+        for(int bx = 0;bx < blockswide;++bx)
+        {
+            LoadBlock(block, src, srcpitch, bx, by, width, height);
+            EncodeColorBlock(out + bx*8, block);
+        }
+    }
+}
+
+void EncodeBC3(GLubyte *dst, int dstpitch, const GLubyte *src, int srcpitch, int width, int height)
+{
+    alignas(16) GLubyte block[4*4*4];
+    int blockswide = (width+3) / 4;
+    int blockshigh = (height+3) / 4;
+    for(int by = 0;by < blockshigh;++by)
+    {
+        GLubyte *out = dst + by*dstpitch;
+        for(int bx = 0;bx < blockswide;++bx)
+        {
+            LoadBlock(block, src, srcpitch, bx, by, width, height);
+            EncodeAlphaBlock(out + bx*16, block);
+            EncodeColorBlock(out + bx*16 + 8, block);
+        }
+    }
+}
+
+
+TextureCompressor::TextureCompressor()
+  : mEnabled(false)
+  , mQuit(false)
+{
+    InitializeCriticalSection(&mLock);
+    InitializeConditionVariable(&mWorkCond);
+}
+
+TextureCompressor::~TextureCompressor()
+{
+    stop();
+    DeleteCriticalSection(&mLock);
+}
+
+void TextureCompressor::startThreads()
+{
+    SYSTEM_INFO sysinfo;
+    GetSystemInfo(&sysinfo);
+    DWORD count = std::max<DWORD>(1, std::min(sysinfo.dwNumberOfProcessors/2, MAX_COMPRESS_THREADS));
+    for(DWORD i = 0;i < count;++i)
+    {
+        HANDLE thrd = CreateThread(nullptr, 256*1024, thread_func, this, 0, nullptr);
+        if(!thrd)
+        {
+            ERR("Failed to create compression thread, error %lu\n", GetLastError());
+            break;
+        }
+        SetThreadPriority(thrd, THREAD_PRIORITY_BELOW_NORMAL);
+        mThreads.push_back(thrd);
+    }
+    TRACE("Created %u compression threads\n", mThreads.size());
+}
+
+DWORD TextureCompressor::workerLoop(void)
+{
+    EnterCriticalSection(&mLock);
+    while(1)
+    {
+        while(mPending.empty() && !mQuit)
+            SleepConditionVariableCS(&mWorkCond, &mLock, INFINITE);
+        if(mQuit) break;
+
+        Task *task = mPending.front();
+        mPending.pop_front();
+        LeaveCriticalSection(&mLock);
+
+        task->run();
+        task->mDone = true;
+
+        EnterCriticalSection(&mLock);
+        mCompleted.push_back(task);
+    }
+    LeaveCriticalSection(&mLock);
+
+    return 0;
+}
+
+void TextureCompressor::submit(Task *task)
+{
+    EnterCriticalSection(&mLock);
+    if(mThreads.empty() && !mQuit)
+        startThreads();
+    // Without workers, the task is dropped on the next update.
+    if(mThreads.empty() || mQuit)
+        mCompleted.push_back(task);
+    else
+    {
+        mPending.push_back(task);
+        WakeConditionVariable(&mWorkCond);
+    }
+    LeaveCriticalSection(&mLock);
+}
+
+void TextureCompressor::update()
+{
+    std::vector<Task*> completed;
+    EnterCriticalSection(&mLock);
+    completed.swap(mCompleted);
+    LeaveCriticalSection(&mLock);
+
+    for(Task *task : completed)
+    {
+        task->finish();
+        delete task;
+    }
+}
+
+void TextureCompressor::stop()
+{
+    mEnabled = false;
+
+    EnterCriticalSection(&mLock);
+    mQuit = true;
+    WakeAllConditionVariable(&mWorkCond);
+    LeaveCriticalSection(&mLock);
+
+    for(HANDLE thrd : mThreads)
+    {
+        WaitForSingleObject(thrd, INFINITE);
+        CloseHandle(thrd);
+    }
+    mThreads.clear();
+
+    // Tasks that didn't get to run are dropped.
+    EnterCriticalSection(&mLock);
+    mCompleted.insert(mCompleted.end(), mPending.begin(), mPending.end());
+    mPending.clear();
+    LeaveCriticalSection(&mLock);
+    update();
+}
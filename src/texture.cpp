@@ -2,6 +2,7 @@
 #include "texture.hpp"
 
 #include <limits>
+#include <memory>
 
 #include "trace.hpp"
 #include "glformat.hpp"
@@ -9,134 +10,179 @@
 #include "device.hpp"
 #include "adapter.hpp"
 #include "private_iids.hpp"
+#include "lockbuffer.hpp"
+#include "texcompress.hpp"
 
 
-void D3DGLTexture::initGL()
+void D3DGLTexture::initGL(DWORD lod)
 {
-    UINT total_size = 0;
-    GLint w = mDesc.Width;
-    GLint h = mDesc.Height;
-    for(D3DGLTextureSurface *surface : mSurfaces)
-    {
-        w = std::max(1, w);
-        h = std::max(1, h);
+    // GL's levels match the texture's, with the LOD as the base level. Only
+    // levels from the LOD down get storage.
+    GLsizei levels = mSurfaces.size();
+    glTextureParameteriEXT(mTexId, GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels-1);
+    checkGLError();
 
-        UINT level_size;
-        if(mDesc.Format == D3DFMT_DXT1 || mDesc.Format == D3DFMT_DXT2 ||
-           mDesc.Format == D3DFMT_DXT3 || mDesc.Format == D3DFMT_DXT4 ||
-           mDesc.Format == D3DFMT_DXT5 || mDesc.Format == D3DFMT_ATI1 ||
-           mDesc.Format == D3DFMT_ATI2)
-        {
-            level_size  = mGLFormat->calcBlockPitch(w, mGLFormat->bytesperblock);
-            level_size *= ((h+3)/4);
-        }
+    // Allocate all levels at once as immutable storage, if possible. Managed
+    // textures get their storage respecified in place when evicted or when
+    // the LOD changes, so they keep their name (and any stages they're bound
+    // to). Other textures don't have a LOD.
+    bool allocated = false;
+    if(GLEW_ARB_texture_storage && mDesc.Pool != D3DPOOL_MANAGED)
+    {
+        glTextureStorage2DEXT(mTexId, GL_TEXTURE_2D, levels, mGLFormat->internalformat,
+                              mDesc.Width, mDesc.Height);
+        GLenum err = glGetError();
+        if(err == GL_NO_ERROR)
+            allocated = true;
         else
-        {
-            level_size  = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
-            level_size *= h;
-        }
+            WARN("Failed to allocate texture storage for format 0x%04x: 0x%04x\n",
+                 mGLFormat->internalformat, err);
+    }
 
-        surface->init(total_size, level_size);
-        total_size += (level_size+15) & ~15;
+    if(!allocated)
+    {
+        addLevelsGL(lod, levels);
+        // Drop any levels left over from a lower LOD.
+        clearLevelsGL(0, lod);
+        checkGLError();
+    }
 
-        w >>= 1;
-        h >>= 1;
+    --mUpdateInProgress;
+}
+class TextureInitCmd : public Command {
+    D3DGLTexture *mTarget;
+    DWORD mLod;
+
+public:
+    TextureInitCmd(D3DGLTexture *target, DWORD lod) : mTarget(target), mLod(lod) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->initGL(mLod);
+        return sizeof(*this);
     }
+};
 
-    glGenTextures(1, &mTexId);
-    glTextureParameteriEXT(mTexId, GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, mSurfaces.size()-1);
-    glTextureImage2DEXT(mTexId, GL_TEXTURE_2D, 0, mGLFormat->internalformat, mDesc.Width, mDesc.Height, 0,
-                        mGLFormat->format, mGLFormat->type, nullptr);
+
+void D3DGLTexture::genMipmapGL()
+{
+    glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_2D);
     checkGLError();
+}
+class TextureGenMipCmd : public Command {
+    D3DGLTexture *mTarget;
+
+public:
+    TextureGenMipCmd(D3DGLTexture *target) : mTarget(target) { }
 
-    // Force allocation of mipmap levels, if any
-    if(mSurfaces.size() > 1)
+    virtual ULONG execute()
     {
-        glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_2D);
-        checkGLError();
+        mTarget->genMipmapGL();
+        return sizeof(*this);
     }
+};
 
-    if(mDesc.Pool != D3DPOOL_DEFAULT)
-        mSysMem.assign(total_size, 0);
 
-    mUpdateInProgress = 0;
+void D3DGLTexture::clearLevelsGL(GLint first, GLint end)
+{
+    // Respecifying a level as empty frees its storage, while the texture
+    // object stays valid and bound wherever it was.
+    for(GLint i = first;i < end;++i)
+        glTextureImage2DEXT(mTexId, GL_TEXTURE_2D, i, GL_RGBA8, 0, 0, 0,
+                            GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 }
-class TextureInitCmd : public Command {
+
+void D3DGLTexture::addLevelsGL(DWORD lod, DWORD end)
+{
+    for(DWORD i = lod;i < end;++i)
+        glTextureImage2DEXT(mTexId, GL_TEXTURE_2D, i, mGLFormat->internalformat,
+                            std::max(1u, mDesc.Width>>i), std::max(1u, mDesc.Height>>i), 0,
+                            mGLFormat->format, mGLFormat->type, nullptr);
+    glTextureParameteriEXT(mTexId, GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, lod);
+    checkGLError();
+}
+class TextureAddLevelsCmd : public Command {
     D3DGLTexture *mTarget;
+    DWORD mLod;
+    DWORD mEnd;
 
 public:
-    TextureInitCmd(D3DGLTexture *target) : mTarget(target) { }
+    TextureAddLevelsCmd(D3DGLTexture *target, DWORD lod, DWORD end)
+      : mTarget(target), mLod(lod), mEnd(end)
+    { }
 
     virtual ULONG execute()
     {
-        mTarget->initGL();
+        mTarget->addLevelsGL(mLod, mEnd);
         return sizeof(*this);
     }
 };
 
-class TextureDeinitCmd : public Command {
-    GLuint mTexId;
+void D3DGLTexture::dropLevelsGL(DWORD oldlod, DWORD lod)
+{
+    glTextureParameteriEXT(mTexId, GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, lod);
+    clearLevelsGL(oldlod, lod);
+    checkGLError();
+}
+class TextureDropLevelsCmd : public Command {
+    D3DGLTexture *mTarget;
+    DWORD mOldLod;
+    DWORD mLod;
 
 public:
-    TextureDeinitCmd(GLuint texid) : mTexId(texid) { }
+    TextureDropLevelsCmd(D3DGLTexture *target, DWORD oldlod, DWORD lod)
+      : mTarget(target), mOldLod(oldlod), mLod(lod)
+    { }
 
     virtual ULONG execute()
     {
-        glDeleteTextures(1, &mTexId);
-        checkGLError();
+        mTarget->dropLevelsGL(mOldLod, mLod);
         return sizeof(*this);
     }
 };
 
-
-void D3DGLTexture::genMipmapGL()
+void D3DGLTexture::evictGL()
 {
-    glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_2D);
+    clearLevelsGL(0, mSurfaces.size());
     checkGLError();
 }
-class TextureGenMipCmd : public Command {
+class TextureEvictCmd : public Command {
     D3DGLTexture *mTarget;
 
 public:
-    TextureGenMipCmd(D3DGLTexture *target) : mTarget(target) { }
+    TextureEvictCmd(D3DGLTexture *target) : mTarget(target) { }
 
     virtual ULONG execute()
     {
-        mTarget->genMipmapGL();
+        mTarget->evictGL();
         return sizeof(*this);
     }
 };
 
 
-void D3DGLTexture::loadTexLevelGL(DWORD level, const RECT &rect, const GLubyte *dataPtr)
+void D3DGLTexture::loadTexLevelGL(DWORD level, const RECT &rect, const GLubyte *dataPtr, GLsizei len, size_t stagedEnd, bool converted)
 {
     UINT w = std::max(1u, mDesc.Width>>level);
     /*UINT h = std::max(1u, mDesc.Height>>Level);*/
 
-    D3DGLTextureSurface *surface = mSurfaces[level];
-    if(mIsCompressed)
+    // Staged uploads source from the upload ring, with dataPtr being the
+    // offset in it.
+    UploadRing &ring = mParent->getUploadRing();
+    if(stagedEnd)
     {
-        GLsizei len = -1;
-        if(mDesc.Format == D3DFMT_DXT1 || mDesc.Format == D3DFMT_DXT2 ||
-           mDesc.Format == D3DFMT_DXT3 || mDesc.Format == D3DFMT_DXT4 ||
-           mDesc.Format == D3DFMT_DXT5 || mDesc.Format == D3DFMT_ATI1 ||
-           mDesc.Format == D3DFMT_ATI2)
-        {
-            int pitch = mGLFormat->calcBlockPitch(w, mGLFormat->bytesperblock);
-            int offset = (rect.top/4*pitch) + (rect.left/4*mGLFormat->bytesperblock);
-            len = surface->getDataLength() - offset;
-            dataPtr += offset;
-        }
+        ring.retireGL();
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring.getBufferId());
+    }
+
+    if(mIsCompressed && !mGLFormat->conversion)
         glCompressedTextureSubImage2DEXT(mTexId, GL_TEXTURE_2D, level,
             rect.left, rect.top, rect.right-rect.left, rect.bottom-rect.top,
             mGLFormat->internalformat, len, dataPtr
         );
-    }
     else
     {
-        int pitch = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
-        dataPtr += (rect.top*pitch) + (rect.left*mGLFormat->bytesperpixel);
-        glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
+        // Converted and copied data is packed to the rect.
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, converted ? 0 : w);
         glTextureSubImage2DEXT(mTexId, GL_TEXTURE_2D, level,
             rect.left, rect.top, rect.right-rect.left, rect.bottom-rect.top,
             mGLFormat->format, mGLFormat->type, dataPtr
@@ -144,53 +190,138 @@ void D3DGLTexture::loadTexLevelGL(DWORD level, const RECT &rect, const GLubyte *
         glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
     }
 
+    if(stagedEnd)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        ring.fenceGL(stagedEnd);
+    }
+
     if(level == 0 && (mDesc.Usage&D3DUSAGE_AUTOGENMIPMAP) && mSurfaces.size() > 1)
         glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_2D);
     checkGLError();
 
-    --mUpdateInProgress;
+    // Staged uploads don't read from sysmem, so aren't counted.
+    if(!stagedEnd && !converted)
+        --mUpdateInProgress;
 }
 class TextureLoadLevelCmd : public Command {
     D3DGLTexture *mTarget;
     DWORD mLevel;
     RECT mRect;
     const GLubyte *mDataPtr;
+    GLsizei mDataLen;
+    size_t mStagedEnd;
+    bool mConverted;
+    // Holds unstaged converted or copied data until it's uploaded.
+    std::shared_ptr<GLubyte> mConvData;
+
+public:
+    TextureLoadLevelCmd(D3DGLTexture *target, DWORD level, const RECT &rect, const GLubyte *dataPtr, GLsizei dataLen, size_t stagedEnd, bool converted=false, std::shared_ptr<GLubyte> convData=std::shared_ptr<GLubyte>())
+      : mTarget(target), mLevel(level), mRect(rect), mDataPtr(dataPtr), mDataLen(dataLen), mStagedEnd(stagedEnd)
+      , mConverted(converted), mConvData(convData)
+    { }
+
+    virtual ULONG execute()
+    {
+        mTarget->loadTexLevelGL(mLevel, mRect, mDataPtr, mDataLen, mStagedEnd, mConverted);
+        return sizeof(*this);
+    }
+};
+
+
+void D3DGLTexture::loadCompressedGL(const GLFormatInfo *format, const GLubyte *data, DWORD lod, DWORD end)
+{
+    // Respecify the levels in the compressed format in place. The texture
+    // keeps its name, so stages it's bound to see the new data right away.
+    // Levels finer than the LOD already have no storage.
+    glTextureParameteriEXT(mTexId, GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, mSurfaces.size()-1);
+
+    GLint w = mDesc.Width;
+    GLint h = mDesc.Height;
+    size_t offset = 0;
+    for(DWORD i = 0;i < end;++i)
+    {
+        w = std::max(1, w);
+        h = std::max(1, h);
+
+        GLsizei len = GLFormatInfo::calcBlockPitch(w, format->bytesperblock) * ((h+3)/4);
+        if(i >= lod)
+            glCompressedTextureImage2DEXT(mTexId, GL_TEXTURE_2D, i, format->internalformat,
+                                          w, h, 0, len, data+offset);
+        offset += (len+15) & ~15;
+
+        w >>= 1;
+        h >>= 1;
+    }
+    glTextureParameteriEXT(mTexId, GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, lod);
+    checkGLError();
+}
+class TextureLoadCompressedCmd : public Command {
+    D3DGLTexture *mTarget;
+    const GLFormatInfo *mFormat;
+    std::shared_ptr<GLubyte> mData;
+    DWORD mLod;
+    DWORD mEnd;
 
 public:
-    TextureLoadLevelCmd(D3DGLTexture *target, DWORD level, const RECT &rect, const GLubyte *dataPtr)
-      : mTarget(target), mLevel(level), mRect(rect), mDataPtr(dataPtr)
+    TextureLoadCompressedCmd(D3DGLTexture *target, const GLFormatInfo *format, const std::shared_ptr<GLubyte> &data, DWORD lod, DWORD end)
+      : mTarget(target), mFormat(format), mData(data), mLod(lod), mEnd(end)
     { }
 
     virtual ULONG execute()
     {
-        mTarget->loadTexLevelGL(mLevel, mRect, mDataPtr);
+        mTarget->loadCompressedGL(mFormat, mData.get(), mLod, mEnd);
         return sizeof(*this);
     }
 };
 
 
+class TextureCompressTask : public TextureCompressor::Task {
+    D3DGLTexture *mTarget;
+    ULONG mWriteCount;
+
+    std::shared_ptr<GLubyte> mData;
+    const GLFormatInfo *mFormat;
+    UINT mSize;
+
+public:
+    TextureCompressTask(D3DGLTexture *target, ULONG writecount)
+      : mTarget(target), mWriteCount(writecount), mFormat(nullptr), mSize(0)
+    { }
+
+    virtual void run()
+    { mTarget->encodeCompressed(mData, mFormat, mSize); }
+    virtual void finish()
+    { mTarget->finishCompress(mData, mFormat, mSize, mWriteCount, isDone()); }
+};
+
+
 D3DGLTexture::D3DGLTexture(D3DGLDevice *parent)
   : mRefCount(0)
   , mIfaceCount(0)
   , mParent(parent)
   , mGLFormat(nullptr)
   , mTexId(0)
+  , mStorageSize(0)
   , mDirtyRect({std::numeric_limits<LONG>::max(), std::numeric_limits<LONG>::max(),
                 std::numeric_limits<LONG>::min(), std::numeric_limits<LONG>::min()})
   , mUpdateInProgress(0)
+  , mDirty(false)
+  , mContentSerial(1)
   , mLodLevel(0)
+  , mStorageLod(0)
+  , mCompressState(CS_None)
+  , mWriteCount(0)
+  , mCompressedFormat(nullptr)
 {
 }
 
 D3DGLTexture::~D3DGLTexture()
 {
+    // Deleted on the command thread, so there are no more pending updates.
     if(mTexId)
-    {
-        mParent->getQueue().send<TextureDeinitCmd>(mTexId);
-        while(mUpdateInProgress)
-            mParent->getQueue().wakeAndSleep();
-        mTexId = 0;
-    }
+        mParent->deleteTextureGL(mTexId);
+    mTexId = 0;
 
     for(auto surface : mSurfaces)
         delete surface;
@@ -207,6 +338,8 @@ bool D3DGLTexture::init(const D3DSURFACE_DESC *desc, UINT levels)
         ERR("Width of height of 0: %ux%u\n", mDesc.Width, mDesc.Height);
         return false;
     }
+    // New textures start out fully dirty, for UpdateTexture.
+    mDirtyRect = RECT{0, 0, (LONG)mDesc.Width, (LONG)mDesc.Height};
 
     auto fmtinfo = gFormatList.find(mDesc.Format);
     if(fmtinfo == gFormatList.end())
@@ -215,6 +348,10 @@ bool D3DGLTexture::init(const D3DSURFACE_DESC *desc, UINT levels)
         return false;
     }
     mGLFormat = &fmtinfo->second;
+    // Compressed formats GL can't take are decoded on upload, keeping the
+    // compressed layout in system memory.
+    if(const GLFormatInfo *decoded = mParent->getAdapter().getDecodedFormat(mDesc.Format))
+        mGLFormat = decoded;
 
     if((mDesc.Usage&D3DUSAGE_RENDERTARGET))
     {
@@ -223,6 +360,11 @@ bool D3DGLTexture::init(const D3DSURFACE_DESC *desc, UINT levels)
             WARN("RenderTarget not allowed in non-default pool\n");
             return false;
         }
+        if(mGLFormat->conversion)
+        {
+            FIXME("RenderTarget not supported with format %s\n", d3dfmt_to_str(mDesc.Format));
+            return false;
+        }
     }
     else if((mDesc.Usage&D3DUSAGE_DEPTHSTENCIL))
     {
@@ -269,13 +411,51 @@ bool D3DGLTexture::init(const D3DSURFACE_DESC *desc, UINT levels)
 
     if(!levels || levels > maxLevels)
         levels = maxLevels;
+
+    UINT total_size = 0;
+    GLint w = mDesc.Width;
+    GLint h = mDesc.Height;
     for(UINT i = 0;i < levels;++i)
+    {
+        w = std::max(1, w);
+        h = std::max(1, h);
+
+        UINT level_size;
+        if(mIsCompressed)
+        {
+            level_size  = mGLFormat->calcBlockPitch(w, mGLFormat->bytesperblock);
+            level_size *= ((h+3)/4);
+        }
+        else
+        {
+            level_size  = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
+            level_size *= h;
+        }
+
         mSurfaces.push_back(new D3DGLTextureSurface(this, i));
+        mSurfaces.back()->init(total_size, level_size);
+        total_size += (level_size+15) & ~15;
+
+        w >>= 1;
+        h >>= 1;
+    }
 
     if(mDesc.Format != D3DFMT_NULL)
     {
+        // The layout and system memory are set up here so the texture can be
+        // locked immediately, while the GL texture is created asynchronously.
+        if(mDesc.Pool != D3DPOOL_DEFAULT)
+            mSysMem.assign(total_size, 0);
+
+        mTexId = mParent->getTextureName();
         mUpdateInProgress = 1;
-        mParent->getQueue().sendSync<TextureInitCmd>(this);
+        mParent->getQueue().send<TextureInitCmd>(this, 0);
+
+        mStorageSize = total_size;
+        if(mDesc.Pool == D3DPOOL_MANAGED)
+            mParent->getResidency().add(this, mStorageSize);
+        else if(mDesc.Pool == D3DPOOL_DEFAULT)
+            mParent->getResidency().addFixed(mStorageSize);
     }
 
     return true;
@@ -283,13 +463,296 @@ bool D3DGLTexture::init(const D3DSURFACE_DESC *desc, UINT levels)
 
 void D3DGLTexture::updateTexture(DWORD level, const RECT &rect, const GLubyte *dataPtr)
 {
+    // Levels finer than the LOD have no storage. They're loaded if the LOD is
+    // lowered.
+    if(level < mStorageLod)
+        return;
+
+    UINT w = std::max(1u, mDesc.Width>>level);
+
+    const GLFormatConversion *conv = mGLFormat->conversion;
+    int pitch = 0;
+
+    // Find the start of the rect and how many bytes the upload reads.
+    GLsizei len;
+    if(mIsCompressed)
+    {
+        pitch = mGLFormat->calcBlockPitch(w, mGLFormat->bytesperblock);
+        int offset = (rect.top/4*pitch) + (rect.left/4*mGLFormat->bytesperblock);
+        dataPtr += offset;
+        // Blocks are decoded to the rect's pixels when GL can't take them.
+        if(conv)
+            len = conv->calcPitch(rect.right-rect.left) * (rect.bottom-rect.top);
+        else
+            len = mSurfaces[level]->getDataLength() - offset;
+    }
+    else
+    {
+        pitch = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
+        dataPtr += (rect.top*pitch) + (rect.left*mGLFormat->bytesperpixel);
+        // Formats GL can't take are converted as they're sent, with the rows
+        // packed to the rect.
+        if(conv)
+            len = conv->calcPitch(rect.right-rect.left) * (rect.bottom-rect.top);
+        else
+            len = (rect.bottom-rect.top-1)*pitch + (rect.right-rect.left)*mGLFormat->bytesperpixel;
+    }
+
     CommandQueue &queue = mParent->getQueue();
     queue.lock();
-    ++mUpdateInProgress;
-    queue.doSend<TextureLoadLevelCmd>(this, level, rect, dataPtr);
+    GLintptr offset;
+    size_t endpos;
+    if(GLubyte *staging = mParent->getUploadRing().reserve(len, offset, endpos))
+    {
+        if(conv)
+            conv->toGLRect(staging, dataPtr, pitch, rect.right-rect.left, rect.bottom-rect.top,
+                           mParent->getCurrentPalette());
+        else
+            memcpy(staging, dataPtr, len);
+        queue.doSend<TextureLoadLevelCmd>(this, level, rect, (const GLubyte*)offset, len, endpos, conv != nullptr);
+    }
+    else if(conv)
+    {
+        std::shared_ptr<GLubyte> data(DataAllocator<GLubyte>()(len), DataDeallocator<GLubyte>());
+        conv->toGLRect(data.get(), dataPtr, pitch, rect.right-rect.left, rect.bottom-rect.top,
+                       mParent->getCurrentPalette());
+        queue.doSend<TextureLoadLevelCmd>(this, level, rect, data.get(), len, 0, true, data);
+    }
+    else
+    {
+        ++mUpdateInProgress;
+        queue.doSend<TextureLoadLevelCmd>(this, level, rect, dataPtr, len, 0);
+    }
+    queue.unlock();
+}
+
+void D3DGLTexture::uploadRect(DWORD level, const RECT &rect, const GLubyte *src, int srcpitch)
+{
+    if(level < mStorageLod)
+        return;
+
+    const GLFormatConversion *conv = mGLFormat->conversion;
+    int w = rect.right - rect.left;
+    int h = rect.bottom - rect.top;
+
+    // The data is copied with the rows packed to the rect, so the source can
+    // be changed as soon as this returns.
+    int rowlen = 0, rows = 0, pitch = 0;
+    GLsizei len;
+    if(conv)
+        len = conv->calcPitch(w) * h;
+    else
+    {
+        if(mIsCompressed)
+        {
+            rowlen = pitch = (w+3)/4 * mGLFormat->bytesperblock;
+            rows = (h+3)/4;
+        }
+        else
+        {
+            rowlen = w * mGLFormat->bytesperpixel;
+            pitch = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
+            rows = h;
+        }
+        len = pitch * rows;
+    }
+
+    CommandQueue &queue = mParent->getQueue();
+    queue.lock();
+    GLintptr offset;
+    size_t endpos;
+    std::shared_ptr<GLubyte> data;
+    GLubyte *dst = mParent->getUploadRing().reserve(len, offset, endpos);
+    if(!dst)
+    {
+        data.reset(DataAllocator<GLubyte>()(len), DataDeallocator<GLubyte>());
+        dst = data.get();
+    }
+
+    if(conv)
+        conv->toGLRect(dst, src, srcpitch, w, h, mParent->getCurrentPalette());
+    else
+    {
+        for(int i = 0;i < rows;++i)
+            memcpy(dst + i*pitch, src + i*srcpitch, rowlen);
+    }
+
+    if(!data)
+        queue.doSend<TextureLoadLevelCmd>(this, level, rect, (const GLubyte*)offset, len, endpos, true);
+    else
+        queue.doSend<TextureLoadLevelCmd>(this, level, rect, data.get(), len, 0, true, data);
     queue.unlock();
 }
 
+bool D3DGLTexture::takeDirtyRect(RECT &rect)
+{
+    if(mDirtyRect.left >= mDirtyRect.right || mDirtyRect.top >= mDirtyRect.bottom)
+        return false;
+    rect = mDirtyRect;
+    mDirtyRect = RECT{std::numeric_limits<LONG>::max(), std::numeric_limits<LONG>::max(),
+                      std::numeric_limits<LONG>::min(), std::numeric_limits<LONG>::min()};
+    return true;
+}
+
+void D3DGLTexture::flushUpdates()
+{
+    if(!mDirty.exchange(false))
+        return;
+    // Evicted textures are fully reloaded when restored.
+    if(isEvicted())
+        return;
+    for(auto surface : mSurfaces)
+        surface->flushUpdates();
+}
+
+void D3DGLTexture::checkCompress()
+{
+    if(mCompressState != CS_None)
+        return;
+
+    TextureCompressor &compressor = mParent->getCompressor();
+    if(!compressor.isEnabled() || mDesc.Pool != D3DPOOL_MANAGED ||
+       (mDesc.Format != D3DFMT_A8R8G8B8 && mDesc.Format != D3DFMT_X8R8G8B8) ||
+       (mDesc.Usage&D3DUSAGE_AUTOGENMIPMAP))
+    {
+        mCompressState = CS_Never;
+        return;
+    }
+
+    // Try again next time if the app is still filling it in.
+    for(auto surface : mSurfaces)
+    {
+        if(surface->isLocked())
+            return;
+    }
+
+    TRACE("Compressing texture %p, %ux%u, %u levels\n", this, mDesc.Width, mDesc.Height,
+          mSurfaces.size());
+    mCompressState = CS_Pending;
+    // Keep the texture alive until the task is finished.
+    addIface();
+    compressor.submit(new TextureCompressTask(this, mWriteCount.load()));
+}
+
+void D3DGLTexture::encodeCompressed(std::shared_ptr<GLubyte> &data, const GLFormatInfo *&format, UINT &size)
+{
+    // Opaque textures fit in BC1, otherwise BC3 keeps the alpha.
+    bool opaque = true;
+    if(mDesc.Format == D3DFMT_A8R8G8B8)
+    {
+        for(auto surface : mSurfaces)
+        {
+            UINT w = std::max(1u, mDesc.Width>>surface->getLevel());
+            UINT h = std::max(1u, mDesc.Height>>surface->getLevel());
+            int pitch = GLFormatInfo::calcPitch(w, 4);
+            const GLubyte *src = &mSysMem[surface->getDataOffset()];
+            for(UINT y = 0;y < h && opaque;++y)
+            {
+                for(UINT x = 0;x < w && opaque;++x)
+                    opaque = (src[y*pitch + x*4 + 3] == 0xff);
+            }
+        }
+    }
+    format = &gFormatList.find(opaque ? D3DFMT_DXT1 : D3DFMT_DXT5)->second;
+
+    // Same layout as compressed textures' system memory.
+    size = 0;
+    GLint w = mDesc.Width;
+    GLint h = mDesc.Height;
+    for(size_t i = 0;i < mSurfaces.size();++i)
+    {
+        w = std::max(1, w);
+        h = std::max(1, h);
+        UINT level_size = GLFormatInfo::calcBlockPitch(w, format->bytesperblock) * ((h+3)/4);
+        size += (level_size+15) & ~15;
+        w >>= 1;
+        h >>= 1;
+    }
+    data.reset(DataAllocator<GLubyte>()(size), DataDeallocator<GLubyte>());
+
+    w = mDesc.Width;
+    h = mDesc.Height;
+    size_t offset = 0;
+    for(auto surface : mSurfaces)
+    {
+        w = std::max(1, w);
+        h = std::max(1, h);
+
+        const GLubyte *src = &mSysMem[surface->getDataOffset()];
+        int srcpitch = GLFormatInfo::calcPitch(w, 4);
+        int dstpitch = GLFormatInfo::calcBlockPitch(w, format->bytesperblock);
+        if(opaque)
+            EncodeBC1(data.get()+offset, dstpitch, src, srcpitch, w, h);
+        else
+            EncodeBC3(data.get()+offset, dstpitch, src, srcpitch, w, h);
+        offset += (dstpitch*((h+3)/4) + 15) & ~15;
+
+        w >>= 1;
+        h >>= 1;
+    }
+}
+
+void D3DGLTexture::finishCompress(const std::shared_ptr<GLubyte> &data, const GLFormatInfo *format, UINT size, ULONG writecount, bool done)
+{
+    // Drop the result if the texture was written to since it was queued.
+    if(mCompressState == CS_Pending)
+    {
+        if(!done)
+            mCompressState = CS_None;
+        else if(writecount != mWriteCount)
+            mCompressState = CS_Never;
+        else
+        {
+            TRACE("Compressed texture %p, %u -> %u bytes\n", this, mStorageSize, size);
+            mCompressedFormat = format;
+            mCompressedData = data;
+            mCompressState = CS_Compressed;
+            mParent->getResidency().resize(this, calcStorageSize());
+            // Evicted textures get the compressed data when restored.
+            if(!isEvicted())
+                mParent->getQueue().send<TextureLoadCompressedCmd>(this, format, data, mStorageLod,
+                                                                   mSurfaces.size());
+        }
+    }
+    releaseIface();
+}
+
+void D3DGLTexture::markWritten()
+{
+    ++mWriteCount;
+    if(mCompressState == CS_Pending)
+        mCompressState = CS_Never;
+    else if(mCompressState == CS_Compressed)
+    {
+        // Go back to the uncompressed data, since the texture will be
+        // written to again. The storage is respecified in place, so it stays
+        // bound wherever it's set.
+        TRACE("Uncompressing texture %p\n", this);
+        mCompressState = CS_Never;
+        mCompressedData.reset();
+        mParent->getResidency().resize(this, calcStorageSize());
+        if(!isEvicted())
+            restore();
+    }
+}
+
+UINT D3DGLTexture::calcStorageSize() const
+{
+    UINT size = 0;
+    for(size_t i = mStorageLod;i < mSurfaces.size();++i)
+    {
+        if(mCompressState == CS_Compressed)
+        {
+            UINT w = std::max(1u, mDesc.Width>>i);
+            UINT h = std::max(1u, mDesc.Height>>i);
+            size += GLFormatInfo::calcBlockPitch(w, mCompressedFormat->bytesperblock) * ((h+3)/4);
+        }
+        else
+            size += mSurfaces[i]->getDataLength();
+    }
+    return size;
+}
+
 void D3DGLTexture::addIface()
 {
     ++mIfaceCount;
@@ -298,7 +761,38 @@ void D3DGLTexture::addIface()
 void D3DGLTexture::releaseIface()
 {
     if(--mIfaceCount == 0)
-        delete this;
+    {
+        if(mDesc.Pool == D3DPOOL_MANAGED)
+            mParent->getResidency().remove(this);
+        else if(mDesc.Pool == D3DPOOL_DEFAULT)
+            mParent->getResidency().removeFixed(mStorageSize);
+        mParent->getQueue().send<CommandDelete<D3DGLTexture>>(this);
+    }
+}
+
+void D3DGLTexture::evict()
+{
+    mParent->getQueue().send<TextureEvictCmd>(this);
+}
+
+void D3DGLTexture::restore()
+{
+    if(mCompressState == CS_Compressed)
+    {
+        mParent->getQueue().send<TextureLoadCompressedCmd>(this, mCompressedFormat, mCompressedData,
+                                                           mStorageLod, mSurfaces.size());
+        return;
+    }
+
+    ++mUpdateInProgress;
+    mParent->getQueue().send<TextureInitCmd>(this, mStorageLod);
+    for(auto surface : mSurfaces)
+        surface->reload();
+}
+
+bool D3DGLTexture::isBound()
+{
+    return mParent->isTextureBound(this);
 }
 
 
@@ -383,7 +877,9 @@ DWORD D3DGLTexture::GetPriority()
 
 void D3DGLTexture::PreLoad()
 {
-    FIXME("iface %p : stub!\n", this);
+    TRACE("iface %p\n", this);
+    mParent->getResidency().touch(this);
+    flushUpdates();
 }
 
 D3DRESOURCETYPE D3DGLTexture::GetType()
@@ -402,10 +898,32 @@ DWORD D3DGLTexture::SetLOD(DWORD lod)
 
     lod = std::min(lod, (DWORD)mSurfaces.size()-1);
 
-    // FIXME: Set GL_TEXTURE_BASE_LEVEL? Or GL_TEXTURE_MIN_LOD?
-    lod = mLodLevel.exchange(lod);
+    DWORD oldlod = mLodLevel.exchange(lod);
+    if(lod != oldlod)
+    {
+        // The GL storage is changed in place, so the texture stays bound
+        // wherever it's set. Raising the LOD just frees the levels it drops,
+        // and lowering it only loads the levels it adds. Evicted textures get
+        // the new set of levels when they're restored.
+        mStorageLod = lod;
+        mParent->getResidency().resize(this, calcStorageSize());
+        if(!isEvicted())
+        {
+            if(lod > oldlod)
+                mParent->getQueue().send<TextureDropLevelsCmd>(this, oldlod, lod);
+            else if(mCompressState == CS_Compressed)
+                mParent->getQueue().send<TextureLoadCompressedCmd>(this, mCompressedFormat,
+                                                                   mCompressedData, lod, oldlod);
+            else
+            {
+                mParent->getQueue().send<TextureAddLevelsCmd>(this, lod, oldlod);
+                for(DWORD i = lod;i < oldlod;++i)
+                    mSurfaces[i]->reload();
+            }
+        }
+    }
 
-    return lod;
+    return oldlod;
 }
 
 DWORD D3DGLTexture::GetLOD()
@@ -436,7 +954,11 @@ void D3DGLTexture::GenerateMipSubLevels()
 {
     TRACE("iface %p\n", this);
     if(mDesc.Format != D3DFMT_NULL)
+    {
+        flushUpdates();
+        markContentChanged();
         mParent->getQueue().send<TextureGenMipCmd>(this);
+    }
 }
 
 
@@ -497,6 +1019,9 @@ HRESULT D3DGLTexture::UnlockRect(UINT level)
 HRESULT D3DGLTexture::AddDirtyRect(const RECT *rect)
 {
     TRACE("iface %p, rect %p\n", this, rect);
+    // A null rect dirties the whole texture.
+    RECT full = { 0, 0, (LONG)mDesc.Width, (LONG)mDesc.Height };
+    if(!rect) rect = &full;
     mDirtyRect.left = std::min(mDirtyRect.left, rect->left);
     mDirtyRect.top = std::min(mDirtyRect.top, rect->top);
     mDirtyRect.right = std::max(mDirtyRect.right, rect->right);
@@ -510,6 +1035,8 @@ D3DGLTextureSurface::D3DGLTextureSurface(D3DGLTexture *parent, UINT level)
   : mParent(parent)
   , mLevel(level)
   , mLock(LT_Unlocked)
+  , mLockBuffer(nullptr)
+  , mReadSerial(0)
   , mDataOffset(0)
   , mDataLength(0)
 {
@@ -517,6 +1044,9 @@ D3DGLTextureSurface::D3DGLTextureSurface(D3DGLTexture *parent, UINT level)
 
 D3DGLTextureSurface::~D3DGLTextureSurface()
 {
+    // Deleted with the texture on the command thread.
+    delete mLockBuffer;
+    mLockBuffer = nullptr;
 }
 
 void D3DGLTextureSurface::init(UINT offset, UINT length)
@@ -525,6 +1055,44 @@ void D3DGLTextureSurface::init(UINT offset, UINT length)
     mDataLength = length;
 }
 
+void D3DGLTextureSurface::flushUpdates()
+{
+    for(const RECT &rect : mDirtyRegions.get())
+        mParent->updateTexture(mLevel, rect, &mParent->mSysMem[mDataOffset]);
+    mDirtyRegions.clear();
+}
+
+const GLubyte *D3DGLTextureSurface::getSysMemData() const
+{
+    return &mParent->mSysMem[mDataOffset];
+}
+
+void D3DGLTextureSurface::reload()
+{
+    // The whole level is uploaded, which covers any pending regions.
+    mDirtyRegions.clear();
+
+    UINT w = std::max(1u, mParent->mDesc.Width>>mLevel);
+    UINT h = std::max(1u, mParent->mDesc.Height>>mLevel);
+    RECT full = { 0, 0, (LONG)w, (LONG)h };
+    mParent->updateTexture(mLevel, full, &mParent->mSysMem[mDataOffset]);
+}
+
+void D3DGLTextureSurface::queueReadback()
+{
+    // Only surfaces that were locked have a buffer, and it's in use while
+    // locked.
+    if(!mLockBuffer || mLock != LT_Unlocked)
+        return;
+
+    UINT w = std::max(1u, mParent->mDesc.Width>>mLevel);
+    UINT h = std::max(1u, mParent->mDesc.Height>>mLevel);
+    mReadSerial = mParent->mContentSerial;
+    mParent->mParent->getQueue().send<LockBufferPackCmd>(mLockBuffer,
+        GL_TEXTURE_2D, mParent->mTexId, mLevel, mParent->mGLFormat, mParent->mIsCompressed, w, h
+    );
+}
+
 
 HRESULT D3DGLTextureSurface::QueryInterface(REFIID riid, void **obj)
 {
@@ -591,7 +1159,8 @@ DWORD D3DGLTextureSurface::GetPriority()
 
 void D3DGLTextureSurface::PreLoad()
 {
-    FIXME("iface %p : stub!\n", this);
+    TRACE("iface %p\n", this);
+    mParent->PreLoad();
 }
 
 D3DRESOURCETYPE D3DGLTextureSurface::GetType()
@@ -631,9 +1200,15 @@ HRESULT D3DGLTextureSurface::LockRect(D3DLOCKED_RECT *lockedRect, const RECT *re
         return D3DERR_INVALIDCALL;
     }
 
-    if(mParent->mDesc.Pool == D3DPOOL_DEFAULT)
+    if(mParent->mDesc.Pool == D3DPOOL_DEFAULT && (mParent->mDesc.Usage&D3DUSAGE_DEPTHSTENCIL))
     {
-        FIXME("Trying to lock texture in default pool\n");
+        FIXME("Trying to lock depth-stencil texture in default pool\n");
+        return D3DERR_INVALIDCALL;
+    }
+    if(mParent->mDesc.Pool == D3DPOOL_DEFAULT && mParent->mGLFormat->conversion &&
+       !mParent->mGLFormat->conversion->fromGL)
+    {
+        FIXME("Trying to lock %s texture in default pool\n", d3dfmt_to_str(mParent->mDesc.Format));
         return D3DERR_INVALIDCALL;
     }
 
@@ -669,14 +1244,42 @@ HRESULT D3DGLTextureSurface::LockRect(D3DLOCKED_RECT *lockedRect, const RECT *re
         }
     }
 
-    // No need to wait if we're not writing over previous data.
-    if(!(flags&D3DLOCK_NOOVERWRITE) && !(flags&D3DLOCK_READONLY))
+    GLubyte *memPtr;
+    if(mParent->mDesc.Pool == D3DPOOL_DEFAULT)
+    {
+        // Read the level back into a pixel buffer and map it. If nothing
+        // wrote to the texture since the buffer last got its contents, either
+        // from a queued readback or the last lock, this only waits on that.
+        // Discarding doesn't need the old contents.
+        if(!mLockBuffer)
+            mLockBuffer = new LockBuffer(mParent->mParent, mDataLength);
+        ULONG serial = mParent->mContentSerial;
+        bool current = (mReadSerial == serial && !mParent->mParent->isRenderTarget(this));
+        mParent->mParent->getQueue().sendSync<LockBufferReadCmd>(mLockBuffer,
+            GL_TEXTURE_2D, mParent->mTexId, mLevel, mParent->mGLFormat, mParent->mIsCompressed,
+            w, h, (flags&D3DLOCK_DISCARD) != 0, current
+        );
+        memPtr = mLockBuffer->getMappedPtr();
+        if(!memPtr)
+        {
+            mLock = LT_Unlocked;
+            return D3DERR_INVALIDCALL;
+        }
+        mReadSerial = serial;
+    }
+    else
     {
-        while(mParent->mUpdateInProgress)
-            mParent->mParent->getQueue().wakeAndSleep();
+        if(!(flags&D3DLOCK_READONLY))
+            mParent->markWritten();
+        // No need to wait if we're not writing over previous data.
+        if(!(flags&D3DLOCK_NOOVERWRITE) && !(flags&D3DLOCK_READONLY))
+        {
+            while(mParent->mUpdateInProgress)
+                mParent->mParent->getQueue().wakeAndSleep();
+        }
+        memPtr = &mParent->mSysMem[mDataOffset];
     }
 
-    GLubyte *memPtr = &mParent->mSysMem[mDataOffset];
     mLockRegion = *rect;
     if(mParent->mIsCompressed && !(mParent->mGLFormat->flags&GLFormatInfo::BadPitch))
     {
@@ -713,8 +1316,34 @@ HRESULT D3DGLTextureSurface::UnlockRect()
         return D3DERR_INVALIDCALL;
     }
 
-    if(mLock != LT_ReadOnly)
-        mParent->updateTexture(mLevel, mLockRegion, &mParent->mSysMem[mDataOffset]);
+    if(mParent->mDesc.Pool == D3DPOOL_DEFAULT)
+    {
+        // Read-only locks just unmap, without writing back.
+        UINT w = std::max(1u, mParent->mDesc.Width>>mLevel);
+        UINT h = std::max(1u, mParent->mDesc.Height>>mLevel);
+        bool writeback = (mLock != LT_ReadOnly);
+        // The buffer keeps what gets written back, but other surfaces' may
+        // not (e.g. with generated mipmaps).
+        if(writeback)
+            mReadSerial = ++mParent->mContentSerial;
+        CommandQueue &queue = mParent->mParent->getQueue();
+        queue.lock();
+        queue.doSend<LockBufferWriteCmd>(mLockBuffer,
+            GL_TEXTURE_2D, mParent->mTexId, mLevel, mParent->mGLFormat, mParent->mIsCompressed,
+            w, h, mLockRegion, writeback
+        );
+        if(writeback && mLevel == 0 && (mParent->mDesc.Usage&D3DUSAGE_AUTOGENMIPMAP) &&
+           mParent->mSurfaces.size() > 1)
+            queue.doSend<TextureGenMipCmd>(mParent);
+        queue.unlock();
+    }
+    else if(mLock != LT_ReadOnly)
+    {
+        // Uploaded when the texture is next used.
+        mDirtyRegions.add(mLockRegion);
+        mParent->mDirty = true;
+        mParent->mParent->setTexturesDirty();
+    }
 
     mLock = LT_Unlocked;
     return D3D_OK;
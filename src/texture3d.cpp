@@ -2,6 +2,7 @@
 #include "texture3d.hpp"
 
 #include <limits>
+#include <memory>
 
 #include "trace.hpp"
 #include "glformat.hpp"
@@ -13,56 +14,38 @@
 
 void D3DGLTexture3D::initGL()
 {
-    UINT total_size = 0;
-    GLint w = mDesc.Width;
-    GLint h = mDesc.Height;
-    GLint d = mDesc.Depth;
-    for(D3DGLTextureVolume *volume : mVolumes)
-    {
-        w = std::max(1, w);
-        h = std::max(1, h);
-        d = std::min(1, d);
+    glTextureParameteriEXT(mTexId, GL_TEXTURE_3D, GL_TEXTURE_MAX_LEVEL, mVolumes.size()-1);
+    checkGLError();
 
-        UINT level_size;
-        if(mDesc.Format == D3DFMT_DXT1 || mDesc.Format == D3DFMT_DXT2 ||
-           mDesc.Format == D3DFMT_DXT3 || mDesc.Format == D3DFMT_DXT4 ||
-           mDesc.Format == D3DFMT_DXT5 || mDesc.Format == D3DFMT_ATI1 ||
-           mDesc.Format == D3DFMT_ATI2)
-        {
-            level_size  = mGLFormat->calcBlockPitch(w, mGLFormat->bytesperblock);
-            level_size *= ((h+3)/4) * d;
-        }
+    // Allocate all levels at once as immutable storage, if possible.
+    bool allocated = false;
+    if(GLEW_ARB_texture_storage)
+    {
+        glTextureStorage3DEXT(mTexId, GL_TEXTURE_3D, mVolumes.size(), mGLFormat->internalformat,
+                              mDesc.Width, mDesc.Height, mDesc.Depth);
+        GLenum err = glGetError();
+        if(err == GL_NO_ERROR)
+            allocated = true;
         else
-        {
-            level_size  = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
-            level_size *= h * d;
-        }
-
-        volume->init(total_size, level_size);
-        total_size += (level_size+15) & ~15;
-
-        w >>= 1;
-        h >>= 1;
-        d >>= 1;
+            WARN("Failed to allocate texture storage for format 0x%04x: 0x%04x\n",
+                 mGLFormat->internalformat, err);
     }
 
-    glGenTextures(1, &mTexId);
-    glTextureParameteriEXT(mTexId, GL_TEXTURE_3D, GL_TEXTURE_MAX_LEVEL, mVolumes.size()-1);
-    glTextureImage3DEXT(mTexId, GL_TEXTURE_3D, 0, mGLFormat->internalformat, mDesc.Width, mDesc.Height, mDesc.Depth,
-                        0, mGLFormat->format, mGLFormat->type, nullptr);
-    checkGLError();
-
-    // Force allocation of mipmap levels, if any
-    if(mVolumes.size() > 1)
+    if(!allocated)
     {
-        glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_3D);
+        glTextureImage3DEXT(mTexId, GL_TEXTURE_3D, 0, mGLFormat->internalformat, mDesc.Width, mDesc.Height, mDesc.Depth,
+                            0, mGLFormat->format, mGLFormat->type, nullptr);
         checkGLError();
-    }
 
-    if(mDesc.Pool != D3DPOOL_DEFAULT)
-        mSysMem.assign(total_size, 0);
+        // Force allocation of mipmap levels, if any
+        if(mVolumes.size() > 1)
+        {
+            glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_3D);
+            checkGLError();
+        }
+    }
 
-    mUpdateInProgress = 0;
+    --mUpdateInProgress;
 }
 class Texture3DInitCmd : public Command {
     D3DGLTexture3D *mTarget;
@@ -77,73 +60,68 @@ public:
     }
 };
 
-class Texture3DDeinitCmd : public Command {
-    GLuint mTexId;
+
+void D3DGLTexture3D::genMipmapGL()
+{
+    glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_3D);
+    checkGLError();
+}
+class Texture3DGenMipCmd : public Command {
+    D3DGLTexture3D *mTarget;
 
 public:
-    Texture3DDeinitCmd(GLuint texid) : mTexId(texid) { }
+    Texture3DGenMipCmd(D3DGLTexture3D *target) : mTarget(target) { }
 
     virtual ULONG execute()
     {
-        glDeleteTextures(1, &mTexId);
-        checkGLError();
+        mTarget->genMipmapGL();
         return sizeof(*this);
     }
 };
 
-
-void D3DGLTexture3D::genMipmapGL()
+void D3DGLTexture3D::setLodGL(DWORD lod)
 {
-    glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_3D);
+    glTextureParameteriEXT(mTexId, GL_TEXTURE_3D, GL_TEXTURE_BASE_LEVEL, lod);
     checkGLError();
 }
-class Texture3DGenMipCmd : public Command {
+class Texture3DSetLodCmd : public Command {
     D3DGLTexture3D *mTarget;
+    DWORD mLod;
 
 public:
-    Texture3DGenMipCmd(D3DGLTexture3D *target) : mTarget(target) { }
+    Texture3DSetLodCmd(D3DGLTexture3D *target, DWORD lod) : mTarget(target), mLod(lod) { }
 
     virtual ULONG execute()
     {
-        mTarget->genMipmapGL();
+        mTarget->setLodGL(mLod);
         return sizeof(*this);
     }
 };
 
 
-void D3DGLTexture3D::loadTexLevelGL(DWORD level, const D3DBOX &box, const GLubyte *dataPtr)
+void D3DGLTexture3D::loadTexLevelGL(DWORD level, const D3DBOX &box, const GLubyte *dataPtr, GLsizei len, size_t stagedEnd, bool converted)
 {
     UINT w = std::max(1u, mDesc.Width>>level);
     UINT h = std::max(1u, mDesc.Height>>level);
     /*UINT d = std::max(1u, mDesc.Depth>>level);*/
 
-    D3DGLTextureVolume *volume = mVolumes[level];
-    if(mIsCompressed)
+    UploadRing &ring = mParent->getUploadRing();
+    if(stagedEnd)
     {
-        GLsizei len = -1;
-        if(mDesc.Format == D3DFMT_DXT1 || mDesc.Format == D3DFMT_DXT2 ||
-           mDesc.Format == D3DFMT_DXT3 || mDesc.Format == D3DFMT_DXT4 ||
-           mDesc.Format == D3DFMT_DXT5 || mDesc.Format == D3DFMT_ATI1 ||
-           mDesc.Format == D3DFMT_ATI2)
-        {
-            int pitch = mGLFormat->calcBlockPitch(w, mGLFormat->bytesperblock);
-            int slice = pitch * ((h+3)/4);
-            int offset = box.Front*slice + (box.Top/4*pitch) + (box.Left/4*mGLFormat->bytesperblock);
-            len = volume->getDataLength() - offset;
-            dataPtr += offset;
-        }
+        ring.retireGL();
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring.getBufferId());
+    }
+
+    if(mIsCompressed && !converted)
         glCompressedTextureSubImage3DEXT(mTexId, GL_TEXTURE_3D, level,
             box.Left, box.Top, box.Front, box.Right-box.Left, box.Bottom-box.Top, box.Back-box.Front,
             mGLFormat->internalformat, len, dataPtr
         );
-    }
     else
     {
-        int pitch = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
-        int slice = pitch * h;
-        dataPtr += box.Front*slice + (box.Top*pitch) + (box.Left*mGLFormat->bytesperpixel);
-        glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
-        glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, h);
+        // Converted data is packed to the box.
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, converted ? 0 : w);
+        glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, converted ? 0 : h);
         glTextureSubImage3DEXT(mTexId, GL_TEXTURE_3D, level,
             box.Left, box.Top, box.Front, box.Right-box.Left, box.Bottom-box.Top, box.Back-box.Front,
             mGLFormat->format, mGLFormat->type, dataPtr
@@ -152,26 +130,39 @@ void D3DGLTexture3D::loadTexLevelGL(DWORD level, const D3DBOX &box, const GLubyt
         glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
     }
 
+    if(stagedEnd)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        ring.fenceGL(stagedEnd);
+    }
+
     if(level == 0 && (mDesc.Usage&D3DUSAGE_AUTOGENMIPMAP) && mVolumes.size() > 1)
         glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_3D);
     checkGLError();
 
-    --mUpdateInProgress;
+    if(!stagedEnd && !converted)
+        --mUpdateInProgress;
 }
 class Texture3DLoadLevelCmd : public Command {
     D3DGLTexture3D *mTarget;
     DWORD mLevel;
     D3DBOX mBox;
     const GLubyte *mDataPtr;
+    GLsizei mDataLen;
+    size_t mStagedEnd;
+    bool mConverted;
+    // Holds unstaged converted data until it's uploaded.
+    std::shared_ptr<GLubyte> mConvData;
 
 public:
-    Texture3DLoadLevelCmd(D3DGLTexture3D *target, DWORD level, const D3DBOX &box, const GLubyte *dataPtr)
-      : mTarget(target), mLevel(level), mBox(box), mDataPtr(dataPtr)
+    Texture3DLoadLevelCmd(D3DGLTexture3D *target, DWORD level, const D3DBOX &box, const GLubyte *dataPtr, GLsizei dataLen, size_t stagedEnd, bool converted=false, std::shared_ptr<GLubyte> convData=std::shared_ptr<GLubyte>())
+      : mTarget(target), mLevel(level), mBox(box), mDataPtr(dataPtr), mDataLen(dataLen), mStagedEnd(stagedEnd)
+      , mConverted(converted), mConvData(convData)
     { }
 
     virtual ULONG execute()
     {
-        mTarget->loadTexLevelGL(mLevel, mBox, mDataPtr);
+        mTarget->loadTexLevelGL(mLevel, mBox, mDataPtr, mDataLen, mStagedEnd, mConverted);
         return sizeof(*this);
     }
 };
@@ -183,23 +174,22 @@ D3DGLTexture3D::D3DGLTexture3D(D3DGLDevice *parent)
   , mParent(parent)
   , mGLFormat(nullptr)
   , mTexId(0)
+  , mStorageSize(0)
   , mDirtyBox({std::numeric_limits<UINT>::max(), std::numeric_limits<UINT>::max(),
                std::numeric_limits<UINT>::min(), std::numeric_limits<UINT>::min(),
                std::numeric_limits<UINT>::min(), std::numeric_limits<UINT>::max()})
   , mUpdateInProgress(0)
+  , mDirty(false)
   , mLodLevel(0)
 {
 }
 
 D3DGLTexture3D::~D3DGLTexture3D()
 {
+    // Deleted on the command thread, so there are no more pending updates.
     if(mTexId)
-    {
-        mParent->getQueue().send<Texture3DDeinitCmd>(mTexId);
-        while(mUpdateInProgress)
-            mParent->getQueue().wakeAndSleep();
-        mTexId = 0;
-    }
+        mParent->deleteTextureGL(mTexId);
+    mTexId = 0;
 
     for(auto volume : mVolumes)
         delete volume;
@@ -224,6 +214,10 @@ bool D3DGLTexture3D::init(const D3DVOLUME_DESC *desc, UINT levels)
         return false;
     }
     mGLFormat = &fmtinfo->second;
+    // Compressed formats GL can't take are decoded on upload, keeping the
+    // compressed layout in system memory.
+    if(const GLFormatInfo *decoded = mParent->getAdapter().getDecodedFormat(mDesc.Format))
+        mGLFormat = decoded;
 
     if((mDesc.Usage&D3DUSAGE_RENDERTARGET))
     {
@@ -278,13 +272,52 @@ bool D3DGLTexture3D::init(const D3DVOLUME_DESC *desc, UINT levels)
 
     if(!levels || levels > maxLevels)
         levels = maxLevels;
+
+    UINT total_size = 0;
+    GLint w = mDesc.Width;
+    GLint h = mDesc.Height;
+    GLint d = mDesc.Depth;
     for(UINT i = 0;i < levels;++i)
+    {
+        w = std::max(1, w);
+        h = std::max(1, h);
+        d = std::max(1, d);
+
+        UINT level_size;
+        if(mIsCompressed)
+        {
+            level_size  = mGLFormat->calcBlockPitch(w, mGLFormat->bytesperblock);
+            level_size *= ((h+3)/4) * d;
+        }
+        else
+        {
+            level_size  = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
+            level_size *= h * d;
+        }
+
         mVolumes.push_back(new D3DGLTextureVolume(this, i));
+        mVolumes.back()->init(total_size, level_size);
+        total_size += (level_size+15) & ~15;
+
+        w >>= 1;
+        h >>= 1;
+        d >>= 1;
+    }
 
     if(mDesc.Format != D3DFMT_NULL)
     {
+        // The layout and system memory are set up here so the texture can be
+        // locked immediately, while the GL texture is created asynchronously.
+        if(mDesc.Pool != D3DPOOL_DEFAULT)
+            mSysMem.assign(total_size, 0);
+
+        mTexId = mParent->getTextureName();
         mUpdateInProgress = 1;
-        mParent->getQueue().sendSync<Texture3DInitCmd>(this);
+        mParent->getQueue().send<Texture3DInitCmd>(this);
+
+        mStorageSize = total_size;
+        if(mDesc.Pool == D3DPOOL_MANAGED || mDesc.Pool == D3DPOOL_DEFAULT)
+            mParent->getResidency().addFixed(mStorageSize);
     }
 
     return true;
@@ -292,13 +325,74 @@ bool D3DGLTexture3D::init(const D3DVOLUME_DESC *desc, UINT levels)
 
 void D3DGLTexture3D::updateTexture(DWORD level, const D3DBOX &box, const GLubyte *dataPtr)
 {
+    UINT w = std::max(1u, mDesc.Width>>level);
+    UINT h = std::max(1u, mDesc.Height>>level);
+
+    const GLFormatConversion *conv = mGLFormat->conversion;
+    int pitch = 0, slice = 0;
+    GLsizei len;
+    if(mIsCompressed)
+    {
+        pitch = mGLFormat->calcBlockPitch(w, mGLFormat->bytesperblock);
+        slice = pitch * ((h+3)/4);
+        int offset = box.Front*slice + (box.Top/4*pitch) + (box.Left/4*mGLFormat->bytesperblock);
+        dataPtr += offset;
+        // Blocks are decoded to the box's pixels when GL can't take them.
+        if(conv)
+            len = conv->calcPitch(box.Right-box.Left) * (box.Bottom-box.Top) * (box.Back-box.Front);
+        else
+            len = mVolumes[level]->getDataLength() - offset;
+    }
+    else
+    {
+        pitch = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
+        slice = pitch * h;
+        dataPtr += box.Front*slice + (box.Top*pitch) + (box.Left*mGLFormat->bytesperpixel);
+        // Formats GL can't take are converted as they're sent, packed to the
+        // box.
+        if(conv)
+            len = conv->calcPitch(box.Right-box.Left) * (box.Bottom-box.Top) * (box.Back-box.Front);
+        else
+            len = ((int)(box.Back-box.Front)-1)*slice + ((int)(box.Bottom-box.Top)-1)*pitch +
+                  (int)(box.Right-box.Left)*mGLFormat->bytesperpixel;
+    }
+
     CommandQueue &queue = mParent->getQueue();
     queue.lock();
-    ++mUpdateInProgress;
-    queue.doSend<Texture3DLoadLevelCmd>(this, level, box, dataPtr);
+    GLintptr offset;
+    size_t endpos;
+    if(GLubyte *staging = mParent->getUploadRing().reserve(len, offset, endpos))
+    {
+        if(conv)
+            conv->toGLBox(staging, dataPtr, pitch, slice, box.Right-box.Left, box.Bottom-box.Top,
+                          box.Back-box.Front, mParent->getCurrentPalette());
+        else
+            memcpy(staging, dataPtr, len);
+        queue.doSend<Texture3DLoadLevelCmd>(this, level, box, (const GLubyte*)offset, len, endpos, conv != nullptr);
+    }
+    else if(conv)
+    {
+        std::shared_ptr<GLubyte> data(DataAllocator<GLubyte>()(len), DataDeallocator<GLubyte>());
+        conv->toGLBox(data.get(), dataPtr, pitch, slice, box.Right-box.Left, box.Bottom-box.Top,
+                      box.Back-box.Front, mParent->getCurrentPalette());
+        queue.doSend<Texture3DLoadLevelCmd>(this, level, box, data.get(), len, 0, true, data);
+    }
+    else
+    {
+        ++mUpdateInProgress;
+        queue.doSend<Texture3DLoadLevelCmd>(this, level, box, dataPtr, len, 0);
+    }
     queue.unlock();
 }
 
+void D3DGLTexture3D::flushUpdates()
+{
+    if(!mDirty.exchange(false))
+        return;
+    for(auto volume : mVolumes)
+        volume->flushUpdates();
+}
+
 void D3DGLTexture3D::addIface()
 {
     ++mIfaceCount;
@@ -307,7 +401,11 @@ void D3DGLTexture3D::addIface()
 void D3DGLTexture3D::releaseIface()
 {
     if(--mIfaceCount == 0)
-        delete this;
+    {
+        if(mDesc.Pool == D3DPOOL_MANAGED || mDesc.Pool == D3DPOOL_DEFAULT)
+            mParent->getResidency().removeFixed(mStorageSize);
+        mParent->getQueue().send<CommandDelete<D3DGLTexture3D>>(this);
+    }
 }
 
 
@@ -392,7 +490,8 @@ DWORD D3DGLTexture3D::GetPriority()
 
 void D3DGLTexture3D::PreLoad()
 {
-    FIXME("iface %p : stub!\n", this);
+    TRACE("iface %p\n", this);
+    flushUpdates();
 }
 
 D3DRESOURCETYPE D3DGLTexture3D::GetType()
@@ -411,10 +510,13 @@ DWORD D3DGLTexture3D::SetLOD(DWORD lod)
 
     lod = std::min(lod, (DWORD)mVolumes.size()-1);
 
-    // FIXME: Set GL_TEXTURE_BASE_LEVEL? Or GL_TEXTURE_MIN_LOD?
-    lod = mLodLevel.exchange(lod);
+    // Sampling starts from the LOD level. The storage still covers every
+    // level, so nothing needs to be reloaded when it changes.
+    DWORD oldlod = mLodLevel.exchange(lod);
+    if(lod != oldlod)
+        mParent->getQueue().send<Texture3DSetLodCmd>(this, lod);
 
-    return lod;
+    return oldlod;
 }
 
 DWORD D3DGLTexture3D::GetLOD()
@@ -445,7 +547,10 @@ void D3DGLTexture3D::GenerateMipSubLevels()
 {
     TRACE("iface %p\n", this);
     if(mDesc.Format != D3DFMT_NULL)
+    {
+        flushUpdates();
         mParent->getQueue().send<Texture3DGenMipCmd>(this);
+    }
 }
 
 
@@ -536,6 +641,13 @@ void D3DGLTextureVolume::init(UINT offset, UINT length)
     mDataLength = length;
 }
 
+void D3DGLTextureVolume::flushUpdates()
+{
+    for(const D3DBOX &box : mDirtyRegions.get())
+        mParent->updateTexture(mLevel, box, &mParent->mSysMem[mDataOffset]);
+    mDirtyRegions.clear();
+}
+
 
 HRESULT D3DGLTextureVolume::QueryInterface(REFIID riid, void **obj)
 {
@@ -705,7 +817,12 @@ HRESULT D3DGLTextureVolume::UnlockBox()
     }
 
     if(mLock != LT_ReadOnly)
-        mParent->updateTexture(mLevel, mLockRegion, &mParent->mSysMem[mDataOffset]);
+    {
+        // Uploaded when the texture is next used.
+        mDirtyRegions.add(mLockRegion);
+        mParent->mDirty = true;
+        mParent->mParent->setTexturesDirty();
+    }
 
     mLock = LT_Unlocked;
     return D3D_OK;
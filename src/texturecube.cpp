@@ -3,6 +3,7 @@
 
 #include <limits>
 #include <array>
+#include <memory>
 
 #include "trace.hpp"
 #include "glformat.hpp"
@@ -10,6 +11,7 @@
 #include "device.hpp"
 #include "adapter.hpp"
 #include "private_iids.hpp"
+#include "lockbuffer.hpp"
 
 
 namespace
@@ -28,52 +30,38 @@ const std::array<GLenum,6> D3D2GLCubeFace{
 
 void D3DGLCubeTexture::initGL()
 {
-    UINT total_size = 0;
-    for(auto &surfaces : mSurfaces)
-    {
-        for(D3DGLCubeSurface *surface : surfaces)
-        {
-            GLint w = std::max(1u, mDesc.Width>>surface->getLevel());
-            GLint h = std::max(1u, mDesc.Height>>surface->getLevel());
-
-            UINT level_size;
-            if(mDesc.Format == D3DFMT_DXT1 || mDesc.Format == D3DFMT_DXT2 ||
-               mDesc.Format == D3DFMT_DXT3 || mDesc.Format == D3DFMT_DXT4 ||
-               mDesc.Format == D3DFMT_DXT5 || mDesc.Format == D3DFMT_ATI1 ||
-               mDesc.Format == D3DFMT_ATI2)
-            {
-                level_size  = mGLFormat->calcBlockPitch(w, mGLFormat->bytesperblock);
-                level_size *= ((h+3)/4);
-            }
-            else
-            {
-                level_size  = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
-                level_size *= h;
-            }
-
-            surface->init(total_size, level_size);
-            total_size += (level_size+15) & ~15;
-        }
-    }
-
-    glGenTextures(1, &mTexId);
     glTextureParameteriEXT(mTexId, GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, mSurfaces.size()-1);
-    for(GLenum face : D3D2GLCubeFace)
-        glTextureImage2DEXT(mTexId, face, 0, mGLFormat->internalformat, mDesc.Width, mDesc.Height, 0,
-                            mGLFormat->format, mGLFormat->type, nullptr);
     checkGLError();
 
-    // Force allocation of mipmap levels, if any
-    if(mSurfaces.size() > 1)
+    // Allocate all levels at once as immutable storage, if possible. Managed
+    // textures get their storage respecified in place when evicted, so they
+    // keep their name (and any stages they're bound to).
+    bool allocated = false;
+    if(GLEW_ARB_texture_storage && mDesc.Pool != D3DPOOL_MANAGED)
     {
-        glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_CUBE_MAP);
-        checkGLError();
+        glTextureStorage2DEXT(mTexId, GL_TEXTURE_CUBE_MAP, mSurfaces.size(), mGLFormat->internalformat,
+                              mDesc.Width, mDesc.Height);
+        GLenum err = glGetError();
+        if(err == GL_NO_ERROR)
+            allocated = true;
+        else
+            WARN("Failed to allocate texture storage for format 0x%04x: 0x%04x\n",
+                 mGLFormat->internalformat, err);
     }
 
-    if(mDesc.Pool != D3DPOOL_DEFAULT)
-        mSysMem.assign(total_size, 0);
+    if(!allocated)
+    {
+        for(GLint i = 0;i < (GLint)mSurfaces.size();++i)
+        {
+            for(GLenum face : D3D2GLCubeFace)
+                glTextureImage2DEXT(mTexId, face, i, mGLFormat->internalformat,
+                                    std::max(1u, mDesc.Width>>i), std::max(1u, mDesc.Height>>i), 0,
+                                    mGLFormat->format, mGLFormat->type, nullptr);
+        }
+        checkGLError();
+    }
 
-    mUpdateInProgress = 0;
+    --mUpdateInProgress;
 }
 class CubeTextureInitCmd : public Command {
     D3DGLCubeTexture *mTarget;
@@ -89,69 +77,92 @@ public:
 };
 
 
-class CubeTextureDeinitCmd : public Command {
-    GLuint mTexId;
+
+void D3DGLCubeTexture::genMipmapGL()
+{
+    glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_CUBE_MAP);
+    checkGLError();
+}
+class CubeTextureGenMipCmd : public Command {
+    D3DGLCubeTexture *mTarget;
 
 public:
-    CubeTextureDeinitCmd(GLuint texid) : mTexId(texid) { }
+    CubeTextureGenMipCmd(D3DGLCubeTexture *target) : mTarget(target) { }
 
     virtual ULONG execute()
     {
-        glDeleteTextures(1, &mTexId);
-        checkGLError();
+        mTarget->genMipmapGL();
         return sizeof(*this);
     }
 };
 
+void D3DGLCubeTexture::setLodGL(DWORD lod)
+{
+    glTextureParameteriEXT(mTexId, GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, lod);
+    checkGLError();
+}
+class CubeTextureSetLodCmd : public Command {
+    D3DGLCubeTexture *mTarget;
+    DWORD mLod;
 
-void D3DGLCubeTexture::genMipmapGL()
+public:
+    CubeTextureSetLodCmd(D3DGLCubeTexture *target, DWORD lod) : mTarget(target), mLod(lod) { }
+
+    virtual ULONG execute()
+    {
+        mTarget->setLodGL(mLod);
+        return sizeof(*this);
+    }
+};
+
+
+void D3DGLCubeTexture::evictGL()
 {
-    glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_CUBE_MAP);
+    // Respecifying the levels as empty frees their storage, while the texture
+    // object stays valid and bound wherever it was.
+    for(GLint i = 0;i < (GLint)mSurfaces.size();++i)
+    {
+        for(GLenum face : D3D2GLCubeFace)
+            glTextureImage2DEXT(mTexId, face, i, GL_RGBA8, 0, 0, 0,
+                                GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    }
     checkGLError();
 }
-class CubeTextureGenMipCmd : public Command {
+class CubeTextureEvictCmd : public Command {
     D3DGLCubeTexture *mTarget;
 
 public:
-    CubeTextureGenMipCmd(D3DGLCubeTexture *target) : mTarget(target) { }
+    CubeTextureEvictCmd(D3DGLCubeTexture *target) : mTarget(target) { }
 
     virtual ULONG execute()
     {
-        mTarget->genMipmapGL();
+        mTarget->evictGL();
         return sizeof(*this);
     }
 };
 
 
-void D3DGLCubeTexture::loadTexLevelGL(DWORD level, GLint facenum, const RECT &rect, const GLubyte *dataPtr)
+void D3DGLCubeTexture::loadTexLevelGL(DWORD level, GLint facenum, const RECT &rect, const GLubyte *dataPtr, GLsizei len, size_t stagedEnd, bool converted)
 {
     UINT w = std::max(1u, mDesc.Width>>level);
     /*UINT h = std::max(1u, mDesc.Height>>Level);*/
 
-    if(mIsCompressed)
+    UploadRing &ring = mParent->getUploadRing();
+    if(stagedEnd)
     {
-        D3DGLCubeSurface *surface = mSurfaces[level][facenum];
-        GLsizei len = -1;
-        if(mDesc.Format == D3DFMT_DXT1 || mDesc.Format == D3DFMT_DXT2 ||
-           mDesc.Format == D3DFMT_DXT3 || mDesc.Format == D3DFMT_DXT4 ||
-           mDesc.Format == D3DFMT_DXT5 || mDesc.Format == D3DFMT_ATI1 ||
-           mDesc.Format == D3DFMT_ATI2)
-        {
-            int pitch = mGLFormat->calcBlockPitch(w, mGLFormat->bytesperblock);
-            int offset = (rect.top/4*pitch) + (rect.left/4*mGLFormat->bytesperblock);
-            len = surface->getDataLength() - offset;
-            dataPtr += offset;
-        }
+        ring.retireGL();
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring.getBufferId());
+    }
+
+    if(mIsCompressed && !mGLFormat->conversion)
         glCompressedTextureSubImage2DEXT(mTexId, D3D2GLCubeFace[facenum], level,
             rect.left, rect.top, rect.right-rect.left, rect.bottom-rect.top,
             mGLFormat->internalformat, len, dataPtr
         );
-    }
     else
     {
-        int pitch = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
-        dataPtr += (rect.top*pitch) + (rect.left*mGLFormat->bytesperpixel);
-        glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
+        // Converted and copied data is packed to the rect.
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, converted ? 0 : w);
         glTextureSubImage2DEXT(mTexId, D3D2GLCubeFace[facenum], level,
             rect.left, rect.top, rect.right-rect.left, rect.bottom-rect.top,
             mGLFormat->format, mGLFormat->type, dataPtr
@@ -159,11 +170,18 @@ void D3DGLCubeTexture::loadTexLevelGL(DWORD level, GLint facenum, const RECT &re
         glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
     }
 
+    if(stagedEnd)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        ring.fenceGL(stagedEnd);
+    }
+
     if(level == 0 && (mDesc.Usage&D3DUSAGE_AUTOGENMIPMAP) && mSurfaces.size() > 1)
         glGenerateTextureMipmapEXT(mTexId, GL_TEXTURE_CUBE_MAP);
     checkGLError();
 
-    --mUpdateInProgress;
+    if(!stagedEnd && !converted)
+        --mUpdateInProgress;
 }
 class CubeTextureLoadLevelCmd : public Command {
     D3DGLCubeTexture *mTarget;
@@ -171,15 +189,21 @@ class CubeTextureLoadLevelCmd : public Command {
     GLint mFaceNum;
     RECT mRect;
     const GLubyte *mDataPtr;
+    GLsizei mDataLen;
+    size_t mStagedEnd;
+    bool mConverted;
+    // Holds unstaged converted or copied data until it's uploaded.
+    std::shared_ptr<GLubyte> mConvData;
 
 public:
-    CubeTextureLoadLevelCmd(D3DGLCubeTexture *target, DWORD level, GLint facenum, const RECT &rect, const GLubyte *dataPtr)
-      : mTarget(target), mLevel(level), mFaceNum(facenum), mRect(rect), mDataPtr(dataPtr)
+    CubeTextureLoadLevelCmd(D3DGLCubeTexture *target, DWORD level, GLint facenum, const RECT &rect, const GLubyte *dataPtr, GLsizei dataLen, size_t stagedEnd, bool converted=false, std::shared_ptr<GLubyte> convData=std::shared_ptr<GLubyte>())
+      : mTarget(target), mLevel(level), mFaceNum(facenum), mRect(rect), mDataPtr(dataPtr), mDataLen(dataLen), mStagedEnd(stagedEnd)
+      , mConverted(converted), mConvData(convData)
     { }
 
     virtual ULONG execute()
     {
-        mTarget->loadTexLevelGL(mLevel, mFaceNum, mRect, mDataPtr);
+        mTarget->loadTexLevelGL(mLevel, mFaceNum, mRect, mDataPtr, mDataLen, mStagedEnd, mConverted);
         return sizeof(*this);
     }
 };
@@ -191,7 +215,10 @@ D3DGLCubeTexture::D3DGLCubeTexture(D3DGLDevice *parent)
   , mParent(parent)
   , mGLFormat(nullptr)
   , mTexId(0)
+  , mStorageSize(0)
   , mUpdateInProgress(0)
+  , mDirty(false)
+  , mContentSerial(1)
   , mLodLevel(0)
 {
     for(RECT &rect : mDirtyRect)
@@ -201,13 +228,10 @@ D3DGLCubeTexture::D3DGLCubeTexture(D3DGLDevice *parent)
 
 D3DGLCubeTexture::~D3DGLCubeTexture()
 {
+    // Deleted on the command thread, so there are no more pending updates.
     if(mTexId)
-    {
-        mParent->getQueue().send<CubeTextureDeinitCmd>(mTexId);
-        while(mUpdateInProgress)
-            mParent->getQueue().wakeAndSleep();
-        mTexId = 0;
-    }
+        mParent->deleteTextureGL(mTexId);
+    mTexId = 0;
 
     for(auto &surfaces : mSurfaces)
     {
@@ -226,6 +250,9 @@ bool D3DGLCubeTexture::init(const D3DSURFACE_DESC *desc, UINT levels)
         ERR("Width or height of 0: %ux%u\n", mDesc.Width, mDesc.Height);
         return false;
     }
+    // New textures start out fully dirty, for UpdateTexture.
+    for(RECT &rect : mDirtyRect)
+        rect = RECT{0, 0, (LONG)mDesc.Width, (LONG)mDesc.Height};
 
     auto fmtinfo = gFormatList.find(mDesc.Format);
     if(fmtinfo == gFormatList.end())
@@ -234,6 +261,10 @@ bool D3DGLCubeTexture::init(const D3DSURFACE_DESC *desc, UINT levels)
         return false;
     }
     mGLFormat = &fmtinfo->second;
+    // Compressed formats GL can't take are decoded on upload, keeping the
+    // compressed layout in system memory.
+    if(const GLFormatInfo *decoded = mParent->getAdapter().getDecodedFormat(mDesc.Format))
+        mGLFormat = decoded;
 
     if((mDesc.Usage&D3DUSAGE_RENDERTARGET))
     {
@@ -242,6 +273,11 @@ bool D3DGLCubeTexture::init(const D3DSURFACE_DESC *desc, UINT levels)
             WARN("RenderTarget not allowed in non-default pool\n");
             return false;
         }
+        if(mGLFormat->conversion)
+        {
+            FIXME("RenderTarget not supported with format %s\n", d3dfmt_to_str(mDesc.Format));
+            return false;
+        }
     }
     else if((mDesc.Usage&D3DUSAGE_DEPTHSTENCIL))
     {
@@ -296,10 +332,47 @@ bool D3DGLCubeTexture::init(const D3DSURFACE_DESC *desc, UINT levels)
     if(mDesc.Format == D3DFMT_DXT2 || mDesc.Format == D3DFMT_DXT4)
         WARN("Pre-mulitplied alpha textures not supported; loading anyway.");
 
+    UINT total_size = 0;
+    for(auto &surfaces : mSurfaces)
+    {
+        for(D3DGLCubeSurface *surface : surfaces)
+        {
+            GLint w = std::max(1u, mDesc.Width>>surface->getLevel());
+            GLint h = std::max(1u, mDesc.Height>>surface->getLevel());
+
+            UINT level_size;
+            if(mIsCompressed)
+            {
+                level_size  = mGLFormat->calcBlockPitch(w, mGLFormat->bytesperblock);
+                level_size *= ((h+3)/4);
+            }
+            else
+            {
+                level_size  = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
+                level_size *= h;
+            }
+
+            surface->init(total_size, level_size);
+            total_size += (level_size+15) & ~15;
+        }
+    }
+
     if(mDesc.Format != D3DFMT_NULL)
     {
+        // The layout and system memory are set up here so the texture can be
+        // locked immediately, while the GL texture is created asynchronously.
+        if(mDesc.Pool != D3DPOOL_DEFAULT)
+            mSysMem.assign(total_size, 0);
+
+        mTexId = mParent->getTextureName();
         mUpdateInProgress = 1;
-        mParent->getQueue().sendSync<CubeTextureInitCmd>(this);
+        mParent->getQueue().send<CubeTextureInitCmd>(this);
+
+        mStorageSize = total_size;
+        if(mDesc.Pool == D3DPOOL_MANAGED)
+            mParent->getResidency().add(this, mStorageSize);
+        else if(mDesc.Pool == D3DPOOL_DEFAULT)
+            mParent->getResidency().addFixed(mStorageSize);
     }
 
     return true;
@@ -307,13 +380,141 @@ bool D3DGLCubeTexture::init(const D3DSURFACE_DESC *desc, UINT levels)
 
 void D3DGLCubeTexture::updateTexture(DWORD level, GLint facenum, const RECT &rect, const GLubyte *dataPtr)
 {
+    UINT w = std::max(1u, mDesc.Width>>level);
+
+    const GLFormatConversion *conv = mGLFormat->conversion;
+    int pitch = 0;
+    GLsizei len;
+    if(mIsCompressed)
+    {
+        pitch = mGLFormat->calcBlockPitch(w, mGLFormat->bytesperblock);
+        int offset = (rect.top/4*pitch) + (rect.left/4*mGLFormat->bytesperblock);
+        dataPtr += offset;
+        // Blocks are decoded to the rect's pixels when GL can't take them.
+        if(conv)
+            len = conv->calcPitch(rect.right-rect.left) * (rect.bottom-rect.top);
+        else
+            len = mSurfaces[level][facenum]->getDataLength() - offset;
+    }
+    else
+    {
+        pitch = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
+        dataPtr += (rect.top*pitch) + (rect.left*mGLFormat->bytesperpixel);
+        // Formats GL can't take are converted as they're sent, with the rows
+        // packed to the rect.
+        if(conv)
+            len = conv->calcPitch(rect.right-rect.left) * (rect.bottom-rect.top);
+        else
+            len = (rect.bottom-rect.top-1)*pitch + (rect.right-rect.left)*mGLFormat->bytesperpixel;
+    }
+
     CommandQueue &queue = mParent->getQueue();
     queue.lock();
-    ++mUpdateInProgress;
-    queue.doSend<CubeTextureLoadLevelCmd>(this, level, facenum, rect, dataPtr);
+    GLintptr offset;
+    size_t endpos;
+    if(GLubyte *staging = mParent->getUploadRing().reserve(len, offset, endpos))
+    {
+        if(conv)
+            conv->toGLRect(staging, dataPtr, pitch, rect.right-rect.left, rect.bottom-rect.top,
+                           mParent->getCurrentPalette());
+        else
+            memcpy(staging, dataPtr, len);
+        queue.doSend<CubeTextureLoadLevelCmd>(this, level, facenum, rect, (const GLubyte*)offset, len, endpos, conv != nullptr);
+    }
+    else if(conv)
+    {
+        std::shared_ptr<GLubyte> data(DataAllocator<GLubyte>()(len), DataDeallocator<GLubyte>());
+        conv->toGLRect(data.get(), dataPtr, pitch, rect.right-rect.left, rect.bottom-rect.top,
+                       mParent->getCurrentPalette());
+        queue.doSend<CubeTextureLoadLevelCmd>(this, level, facenum, rect, data.get(), len, 0, true, data);
+    }
+    else
+    {
+        ++mUpdateInProgress;
+        queue.doSend<CubeTextureLoadLevelCmd>(this, level, facenum, rect, dataPtr, len, 0);
+    }
+    queue.unlock();
+}
+
+void D3DGLCubeTexture::uploadRect(DWORD level, GLint facenum, const RECT &rect, const GLubyte *src, int srcpitch)
+{
+    const GLFormatConversion *conv = mGLFormat->conversion;
+    int w = rect.right - rect.left;
+    int h = rect.bottom - rect.top;
+
+    // Packed to the rect, like 2D textures.
+    int rowlen = 0, rows = 0, pitch = 0;
+    GLsizei len;
+    if(conv)
+        len = conv->calcPitch(w) * h;
+    else
+    {
+        if(mIsCompressed)
+        {
+            rowlen = pitch = (w+3)/4 * mGLFormat->bytesperblock;
+            rows = (h+3)/4;
+        }
+        else
+        {
+            rowlen = w * mGLFormat->bytesperpixel;
+            pitch = mGLFormat->calcPitch(w, mGLFormat->bytesperpixel);
+            rows = h;
+        }
+        len = pitch * rows;
+    }
+
+    CommandQueue &queue = mParent->getQueue();
+    queue.lock();
+    GLintptr offset;
+    size_t endpos;
+    std::shared_ptr<GLubyte> data;
+    GLubyte *dst = mParent->getUploadRing().reserve(len, offset, endpos);
+    if(!dst)
+    {
+        data.reset(DataAllocator<GLubyte>()(len), DataDeallocator<GLubyte>());
+        dst = data.get();
+    }
+
+    if(conv)
+        conv->toGLRect(dst, src, srcpitch, w, h, mParent->getCurrentPalette());
+    else
+    {
+        for(int i = 0;i < rows;++i)
+            memcpy(dst + i*pitch, src + i*srcpitch, rowlen);
+    }
+
+    if(!data)
+        queue.doSend<CubeTextureLoadLevelCmd>(this, level, facenum, rect, (const GLubyte*)offset, len, endpos, true);
+    else
+        queue.doSend<CubeTextureLoadLevelCmd>(this, level, facenum, rect, data.get(), len, 0, true, data);
     queue.unlock();
 }
 
+bool D3DGLCubeTexture::takeDirtyRect(GLint facenum, RECT &rect)
+{
+    RECT &dirty = mDirtyRect[facenum];
+    if(dirty.left >= dirty.right || dirty.top >= dirty.bottom)
+        return false;
+    rect = dirty;
+    dirty = RECT{std::numeric_limits<LONG>::max(), std::numeric_limits<LONG>::max(),
+                 std::numeric_limits<LONG>::min(), std::numeric_limits<LONG>::min()};
+    return true;
+}
+
+void D3DGLCubeTexture::flushUpdates()
+{
+    if(!mDirty.exchange(false))
+        return;
+    // Evicted textures are fully reloaded when restored.
+    if(isEvicted())
+        return;
+    for(auto &faces : mSurfaces)
+    {
+        for(auto surface : faces)
+            surface->flushUpdates();
+    }
+}
+
 void D3DGLCubeTexture::addIface()
 {
     ++mIfaceCount;
@@ -322,7 +523,34 @@ void D3DGLCubeTexture::addIface()
 void D3DGLCubeTexture::releaseIface()
 {
     if(--mIfaceCount == 0)
-        delete this;
+    {
+        if(mDesc.Pool == D3DPOOL_MANAGED)
+            mParent->getResidency().remove(this);
+        else if(mDesc.Pool == D3DPOOL_DEFAULT)
+            mParent->getResidency().removeFixed(mStorageSize);
+        mParent->getQueue().send<CommandDelete<D3DGLCubeTexture>>(this);
+    }
+}
+
+void D3DGLCubeTexture::evict()
+{
+    mParent->getQueue().send<CubeTextureEvictCmd>(this);
+}
+
+void D3DGLCubeTexture::restore()
+{
+    ++mUpdateInProgress;
+    mParent->getQueue().send<CubeTextureInitCmd>(this);
+    for(auto &surfaces : mSurfaces)
+    {
+        for(D3DGLCubeSurface *surface : surfaces)
+            surface->reload();
+    }
+}
+
+bool D3DGLCubeTexture::isBound()
+{
+    return mParent->isTextureBound(this);
 }
 
 
@@ -407,7 +635,9 @@ DWORD D3DGLCubeTexture::GetPriority()
 
 void D3DGLCubeTexture::PreLoad()
 {
-    FIXME("iface %p : stub!\n", this);
+    TRACE("iface %p\n", this);
+    mParent->getResidency().touch(this);
+    flushUpdates();
 }
 
 D3DRESOURCETYPE D3DGLCubeTexture::GetType()
@@ -426,10 +656,13 @@ DWORD D3DGLCubeTexture::SetLOD(DWORD lod)
 
     lod = std::min(lod, (DWORD)mSurfaces.size()-1);
 
-    // FIXME: Set GL_TEXTURE_BASE_LEVEL? Or GL_TEXTURE_MIN_LOD?
-    lod = mLodLevel.exchange(lod);
+    // Sampling starts from the LOD level. The storage still covers every
+    // level, so nothing needs to be reloaded when it changes.
+    DWORD oldlod = mLodLevel.exchange(lod);
+    if(lod != oldlod)
+        mParent->getQueue().send<CubeTextureSetLodCmd>(this, lod);
 
-    return lod;
+    return oldlod;
 }
 
 DWORD D3DGLCubeTexture::GetLOD()
@@ -460,7 +693,11 @@ void D3DGLCubeTexture::GenerateMipSubLevels()
 {
     TRACE("iface %p\n", this);
     if(mDesc.Format != D3DFMT_NULL)
+    {
+        flushUpdates();
+        markContentChanged();
         mParent->getQueue().send<CubeTextureGenMipCmd>(this);
+    }
 }
 
 
@@ -528,6 +765,14 @@ HRESULT D3DGLCubeTexture::UnlockRect(D3DCUBEMAP_FACES face, UINT level)
 HRESULT D3DGLCubeTexture::AddDirtyRect(D3DCUBEMAP_FACES face, const RECT *rect)
 {
     TRACE("iface %p, face %u, rect %p\n", this, face, rect);
+    if(face >= mDirtyRect.size())
+    {
+        WARN("Face out of range: %u >= %u\n", face, mDirtyRect.size());
+        return D3DERR_INVALIDCALL;
+    }
+    // A null rect dirties the whole face.
+    RECT full = { 0, 0, (LONG)mDesc.Width, (LONG)mDesc.Height };
+    if(!rect) rect = &full;
     mDirtyRect[face].left = std::min(mDirtyRect[face].left, rect->left);
     mDirtyRect[face].top = std::min(mDirtyRect[face].top, rect->top);
     mDirtyRect[face].right = std::max(mDirtyRect[face].right, rect->right);
@@ -542,6 +787,8 @@ D3DGLCubeSurface::D3DGLCubeSurface(D3DGLCubeTexture *parent, UINT level, GLint f
   , mLevel(level)
   , mFaceNum(facenum)
   , mLock(LT_Unlocked)
+  , mLockBuffer(nullptr)
+  , mReadSerial(0)
   , mDataOffset(0)
   , mDataLength(0)
 {
@@ -549,6 +796,9 @@ D3DGLCubeSurface::D3DGLCubeSurface(D3DGLCubeTexture *parent, UINT level, GLint f
 
 D3DGLCubeSurface::~D3DGLCubeSurface()
 {
+    // Deleted with the texture on the command thread.
+    delete mLockBuffer;
+    mLockBuffer = nullptr;
 }
 
 void D3DGLCubeSurface::init(UINT offset, UINT length)
@@ -557,6 +807,44 @@ void D3DGLCubeSurface::init(UINT offset, UINT length)
     mDataLength = length;
 }
 
+void D3DGLCubeSurface::flushUpdates()
+{
+    for(const RECT &rect : mDirtyRegions.get())
+        mParent->updateTexture(mLevel, mFaceNum, rect, &mParent->mSysMem[mDataOffset]);
+    mDirtyRegions.clear();
+}
+
+const GLubyte *D3DGLCubeSurface::getSysMemData() const
+{
+    return &mParent->mSysMem[mDataOffset];
+}
+
+void D3DGLCubeSurface::reload()
+{
+    // The whole level is uploaded, which covers any pending regions.
+    mDirtyRegions.clear();
+
+    UINT w = std::max(1u, mParent->mDesc.Width>>mLevel);
+    UINT h = std::max(1u, mParent->mDesc.Height>>mLevel);
+    RECT full = { 0, 0, (LONG)w, (LONG)h };
+    mParent->updateTexture(mLevel, mFaceNum, full, &mParent->mSysMem[mDataOffset]);
+}
+
+void D3DGLCubeSurface::queueReadback()
+{
+    // Only surfaces that were locked have a buffer, and it's in use while
+    // locked.
+    if(!mLockBuffer || mLock != LT_Unlocked)
+        return;
+
+    UINT w = std::max(1u, mParent->mDesc.Width>>mLevel);
+    UINT h = std::max(1u, mParent->mDesc.Height>>mLevel);
+    mReadSerial = mParent->mContentSerial;
+    mParent->mParent->getQueue().send<LockBufferPackCmd>(mLockBuffer,
+        getTarget(), mParent->mTexId, mLevel, mParent->mGLFormat, mParent->mIsCompressed, w, h
+    );
+}
+
 GLenum D3DGLCubeSurface::getTarget() const
 {
     return D3D2GLCubeFace[mFaceNum];
@@ -628,7 +916,8 @@ DWORD D3DGLCubeSurface::GetPriority()
 
 void D3DGLCubeSurface::PreLoad()
 {
-    FIXME("iface %p : stub!\n", this);
+    TRACE("iface %p\n", this);
+    mParent->PreLoad();
 }
 
 D3DRESOURCETYPE D3DGLCubeSurface::GetType()
@@ -668,9 +957,15 @@ HRESULT D3DGLCubeSurface::LockRect(D3DLOCKED_RECT *lockedRect, const RECT *rect,
         return D3DERR_INVALIDCALL;
     }
 
-    if(mParent->mDesc.Pool == D3DPOOL_DEFAULT)
+    if(mParent->mDesc.Pool == D3DPOOL_DEFAULT && (mParent->mDesc.Usage&D3DUSAGE_DEPTHSTENCIL))
+    {
+        FIXME("Trying to lock depth-stencil texture in default pool\n");
+        return D3DERR_INVALIDCALL;
+    }
+    if(mParent->mDesc.Pool == D3DPOOL_DEFAULT && mParent->mGLFormat->conversion &&
+       !mParent->mGLFormat->conversion->fromGL)
     {
-        FIXME("Trying to lock texture in default pool\n");
+        FIXME("Trying to lock %s texture in default pool\n", d3dfmt_to_str(mParent->mDesc.Format));
         return D3DERR_INVALIDCALL;
     }
 
@@ -706,14 +1001,40 @@ HRESULT D3DGLCubeSurface::LockRect(D3DLOCKED_RECT *lockedRect, const RECT *rect,
         }
     }
 
-    // No need to wait if we're not writing over previous data.
-    if(!(flags&D3DLOCK_NOOVERWRITE) && !(flags&D3DLOCK_READONLY))
+    GLubyte *memPtr;
+    if(mParent->mDesc.Pool == D3DPOOL_DEFAULT)
     {
-        while(mParent->mUpdateInProgress)
-            mParent->mParent->getQueue().wakeAndSleep();
+        // Read the level back into a pixel buffer and map it. If nothing
+        // wrote to the texture since the buffer last got its contents, either
+        // from a queued readback or the last lock, this only waits on that.
+        // Discarding doesn't need the old contents.
+        if(!mLockBuffer)
+            mLockBuffer = new LockBuffer(mParent->mParent, mDataLength);
+        ULONG serial = mParent->mContentSerial;
+        bool current = (mReadSerial == serial && !mParent->mParent->isRenderTarget(this));
+        mParent->mParent->getQueue().sendSync<LockBufferReadCmd>(mLockBuffer,
+            getTarget(), mParent->mTexId, mLevel, mParent->mGLFormat, mParent->mIsCompressed,
+            w, h, (flags&D3DLOCK_DISCARD) != 0, current
+        );
+        memPtr = mLockBuffer->getMappedPtr();
+        if(!memPtr)
+        {
+            mLock = LT_Unlocked;
+            return D3DERR_INVALIDCALL;
+        }
+        mReadSerial = serial;
+    }
+    else
+    {
+        // No need to wait if we're not writing over previous data.
+        if(!(flags&D3DLOCK_NOOVERWRITE) && !(flags&D3DLOCK_READONLY))
+        {
+            while(mParent->mUpdateInProgress)
+                mParent->mParent->getQueue().wakeAndSleep();
+        }
+        memPtr = &mParent->mSysMem[mDataOffset];
     }
 
-    GLubyte *memPtr = &mParent->mSysMem[mDataOffset];
     mLockRegion = *rect;
     if(mParent->mIsCompressed && !(mParent->mGLFormat->flags&GLFormatInfo::BadPitch))
     {
@@ -749,8 +1070,34 @@ HRESULT D3DGLCubeSurface::UnlockRect()
         return D3DERR_INVALIDCALL;
     }
 
-    if(mLock != LT_ReadOnly)
-        mParent->updateTexture(mLevel, mFaceNum, mLockRegion, &mParent->mSysMem[mDataOffset]);
+    if(mParent->mDesc.Pool == D3DPOOL_DEFAULT)
+    {
+        // Read-only locks just unmap, without writing back.
+        UINT w = std::max(1u, mParent->mDesc.Width>>mLevel);
+        UINT h = std::max(1u, mParent->mDesc.Height>>mLevel);
+        bool writeback = (mLock != LT_ReadOnly);
+        // The buffer keeps what gets written back, but other surfaces' may
+        // not (e.g. with generated mipmaps).
+        if(writeback)
+            mReadSerial = ++mParent->mContentSerial;
+        CommandQueue &queue = mParent->mParent->getQueue();
+        queue.lock();
+        queue.doSend<LockBufferWriteCmd>(mLockBuffer,
+            getTarget(), mParent->mTexId, mLevel, mParent->mGLFormat, mParent->mIsCompressed,
+            w, h, mLockRegion, writeback
+        );
+        if(writeback && mLevel == 0 && (mParent->mDesc.Usage&D3DUSAGE_AUTOGENMIPMAP) &&
+           mParent->mSurfaces.size() > 1)
+            queue.doSend<CubeTextureGenMipCmd>(mParent);
+        queue.unlock();
+    }
+    else if(mLock != LT_ReadOnly)
+    {
+        // Uploaded when the texture is next used.
+        mDirtyRegions.add(mLockRegion);
+        mParent->mDirty = true;
+        mParent->mParent->setTexturesDirty();
+    }
 
     mLock = LT_Unlocked;
     return D3D_OK;
@@ -0,0 +1,147 @@
+
+#include "threadpool.hpp"
+
+#include <algorithm>
+
+#include "trace.hpp"
+
+
+// More threads than this don't help with the sizes of work given out.
+static const DWORD MAX_POOL_THREADS = 8;
+
+
+ThreadPool::ThreadPool()
+  : mFunc(nullptr)
+  , mUserData(nullptr)
+  , mCount(0)
+  , mBatchSize(1)
+  , mNextItem(0)
+  , mJobId(0)
+  , mNumActive(0)
+{
+    InitializeCriticalSection(&mJobLock);
+    InitializeCriticalSection(&mLock);
+    InitializeConditionVariable(&mWorkCond);
+    InitializeConditionVariable(&mDoneCond);
+
+    // Leave a core for the calling thread.
+    SYSTEM_INFO sysinfo;
+    GetSystemInfo(&sysinfo);
+    DWORD count = std::min(sysinfo.dwNumberOfProcessors, MAX_POOL_THREADS+1);
+    for(DWORD i = 1;i < count;++i)
+    {
+        HANDLE thrd = CreateThread(nullptr, 256*1024, thread_func, this, 0, nullptr);
+        if(!thrd)
+        {
+            ERR("Failed to create worker thread, error %lu\n", GetLastError());
+            break;
+        }
+        mThreads.push_back(thrd);
+    }
+    TRACE("Created %u worker threads\n", mThreads.size());
+}
+
+ThreadPool &ThreadPool::get()
+{
+    static ThreadPool *pool = new ThreadPool();
+    return *pool;
+}
+
+
+void ThreadPool::work(RangeFunc func, void *userdata, UINT count, UINT batch)
+{
+    while(1)
+    {
+        UINT start = mNextItem.fetch_add(batch);
+        if(start >= count) break;
+        func(start, std::min(start+batch, count), userdata);
+    }
+}
+
+DWORD ThreadPool::workerLoop(void)
+{
+    UINT64 lastjob = 0;
+
+    EnterCriticalSection(&mLock);
+    while(1)
+    {
+        while((mJobId == lastjob || !mFunc) && mTasks.empty())
+            SleepConditionVariableCS(&mWorkCond, &mLock, INFINITE);
+        // Jobs go first, since their caller is waiting on them.
+        if(mJobId == lastjob || !mFunc)
+        {
+            Task *task = mTasks.front();
+            mTasks.pop_front();
+            LeaveCriticalSection(&mLock);
+
+            task->run();
+            delete task;
+
+            EnterCriticalSection(&mLock);
+            continue;
+        }
+        lastjob = mJobId;
+
+        RangeFunc func = mFunc;
+        void *userdata = mUserData;
+        UINT count = mCount;
+        UINT batch = mBatchSize;
+        ++mNumActive;
+        LeaveCriticalSection(&mLock);
+
+        work(func, userdata, count, batch);
+
+        EnterCriticalSection(&mLock);
+        if(--mNumActive == 0)
+            WakeAllConditionVariable(&mDoneCond);
+    }
+    LeaveCriticalSection(&mLock);
+
+    return 0;
+}
+
+void ThreadPool::run(UINT count, UINT batch, RangeFunc func, void *userdata)
+{
+    batch = std::max(batch, 1u);
+    if(mThreads.empty() || count <= batch)
+    {
+        func(0, count, userdata);
+        return;
+    }
+
+    EnterCriticalSection(&mJobLock);
+
+    EnterCriticalSection(&mLock);
+    mFunc = func;
+    mUserData = userdata;
+    mCount = count;
+    mBatchSize = batch;
+    mNextItem = 0;
+    ++mJobId;
+    WakeAllConditionVariable(&mWorkCond);
+    LeaveCriticalSection(&mLock);
+
+    work(func, userdata, count, batch);
+
+    // Workers that didn't pick up the job before it was finished will see it
+    // cleared and go back to waiting.
+    EnterCriticalSection(&mLock);
+    while(mNumActive > 0)
+        SleepConditionVariableCS(&mDoneCond, &mLock, INFINITE);
+    mFunc = nullptr;
+    LeaveCriticalSection(&mLock);
+
+    LeaveCriticalSection(&mJobLock);
+}
+
+bool ThreadPool::submit(Task *task)
+{
+    if(mThreads.empty())
+        return false;
+
+    EnterCriticalSection(&mLock);
+    mTasks.push_back(task);
+    WakeConditionVariable(&mWorkCond);
+    LeaveCriticalSection(&mLock);
+    return true;
+}
@@ -0,0 +1,91 @@
+
+#include "uploadring.hpp"
+
+#include "trace.hpp"
+
+
+UploadRing::UploadRing()
+  : mBufferId(0)
+  , mMappedPtr(nullptr)
+  , mWritePos(0)
+  , mFreePos(0)
+{
+}
+
+void UploadRing::initGL()
+{
+    if(!GLEW_ARB_buffer_storage)
+    {
+        WARN("GL_ARB_buffer_storage not available, texture uploads will not be staged\n");
+        return;
+    }
+
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &mBufferId);
+    glNamedBufferStorageEXT(mBufferId, sRingSize, nullptr, flags);
+    mMappedPtr = reinterpret_cast<GLubyte*>(glMapNamedBufferRangeEXT(mBufferId, 0, sRingSize, flags));
+    checkGLError();
+
+    if(!mMappedPtr)
+    {
+        ERR("Failed to map upload ring buffer\n");
+        glDeleteBuffers(1, &mBufferId);
+        mBufferId = 0;
+    }
+}
+
+void UploadRing::deinitGL()
+{
+    for(auto &fence : mFences)
+        glDeleteSync(fence.first);
+    mFences.clear();
+
+    if(mBufferId)
+    {
+        glUnmapNamedBufferEXT(mBufferId);
+        glDeleteBuffers(1, &mBufferId);
+        checkGLError();
+    }
+    mBufferId = 0;
+    mMappedPtr = nullptr;
+}
+
+GLubyte *UploadRing::reserve(size_t len, GLintptr &offset, size_t &endpos)
+{
+    if(!mMappedPtr || len == 0 || len > sMaxUploadSize)
+        return nullptr;
+
+    // Keep uploads aligned, and don't let them wrap around the end.
+    size_t pos = (mWritePos+31) & ~size_t(31);
+    if((pos&sRingMask) + len > sRingSize)
+        pos += sRingSize - (pos&sRingMask);
+    if(pos+len - mFreePos.load() > sRingSize)
+        return nullptr;
+
+    mWritePos = pos+len;
+    offset = pos&sRingMask;
+    endpos = mWritePos;
+    return mMappedPtr + offset;
+}
+
+void UploadRing::fenceGL(size_t endpos)
+{
+    GLsync sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    checkGLError();
+    mFences.push_back(std::make_pair(sync, endpos));
+}
+
+void UploadRing::retireGL()
+{
+    while(!mFences.empty())
+    {
+        GLenum ret = glClientWaitSync(mFences.front().first, 0, 0);
+        if(ret != GL_ALREADY_SIGNALED && ret != GL_CONDITION_SATISFIED)
+            break;
+
+        glDeleteSync(mFences.front().first);
+        mFreePos.store(mFences.front().second);
+        mFences.pop_front();
+    }
+    checkGLError();
+}
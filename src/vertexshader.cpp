@@ -1,84 +1,50 @@
 
 #include "vertexshader.hpp"
 
-#include <sstream>
-
 #include "mojoshader/mojoshader.h"
 #include "device.hpp"
+#include "programcache.hpp"
 #include "trace.hpp"
 #include "private_iids.hpp"
 
 
-GLuint D3DGLVertexShader::compileShaderGL(UINT shadowsamplers)
+void SharedVertexShader::startProgramGL(ShaderTranslation *translation)
 {
-    const MOJOSHADER_parseData *shader = nullptr;
-    GLuint program = mProgram.exchange(0);
-    if(program)
+    UINT mask = translation->getShadowSamplers();
+    if(mPrograms.count(mask) || mStartedPrograms.count(mask))
+        return;
+
+    mStartedPrograms.insert(std::make_pair(mask,
+        StartProgramGL(mParent->getProgramCache(), GL_VERTEX_SHADER, mCode, translation)
+    ));
+}
+
+GLuint SharedVertexShader::compileShaderGL(ShaderTranslation *translation)
+{
+    UINT mask = translation->getShadowSamplers();
+    auto prog = mPrograms.find(mask);
+    if(prog != mPrograms.end())
     {
-        glDeleteProgram(program);
-        program = 0;
+        --mPendingUpdates;
+        return prog->second;
     }
 
-    shader = MOJOSHADER_parse(MOJOSHADER_PROFILE_GLSL330,
-        reinterpret_cast<const unsigned char*>(mCode.data()),
-        mCode.size() * sizeof(decltype(mCode)::value_type),
-        nullptr, 0, shadowsamplers
-    );
-    if(shader->error_count > 0)
+    PendingProgram pending;
+    auto iter = mStartedPrograms.find(mask);
+    if(iter != mStartedPrograms.end())
     {
-        std::stringstream sstr;
-        for(int i = 0;i < shader->error_count;++i)
-            sstr<< shader->errors[i].error_position<<":"<<shader->errors[i].error <<std::endl;
-        ERR("Failed to parse shader:\n----\n%s\n----\n", sstr.str().c_str());
-        goto done;
+        pending = iter->second;
+        mStartedPrograms.erase(iter);
     }
-    if(mCode.size() != (std::size_t)shader->token_count)
-        ERR("Token count mismatch (previous: %u, now: %d)\n",
-            mCode.size(), shader->token_count);
-    TRACE("Parsed shader:\n----\n%s\n----\n", shader->output);
-
+    else
+        pending = StartProgramGL(mParent->getProgramCache(), GL_VERTEX_SHADER, mCode, translation);
 
+    GLuint program = FinishProgramGL(mParent->getProgramCache(), pending, translation);
+    if(program)
     {
-        program = glCreateShaderProgramv(GL_VERTEX_SHADER, 1, &shader->output);
-        checkGLError();
-        if(!program)
-        {
-            FIXME("Failed to create shader program\n");
-            goto done;
-        }
-
-        GLint logLen = 0;
-        GLint status = GL_FALSE;
-        glGetProgramiv(program, GL_LINK_STATUS, &status);
-        if(status == GL_FALSE)
-        {
-            glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLen);
-            std::vector<char> log(logLen+1);
-            glGetProgramInfoLog(program, logLen, &logLen, log.data());
-            FIXME("Shader not linked:\n----\n%s\n----\nShader text:\n----\n%s\n----\n",
-                  log.data(), shader->output);
-
-            glDeleteProgram(program);
-            program = 0;
-            checkGLError();
-
-            goto done;
-        }
-
-        mProgram = program;
+        const MOJOSHADER_parseData *shader = translation->get();
         TRACE("Created vertex shader program 0x%x\n", program);
 
-        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLen);
-        if(logLen > 4)
-        {
-            std::vector<char> log(logLen+1);
-            glGetProgramInfoLog(program, logLen, &logLen, log.data());
-            WARN("Compile warning log:\n----\n%s\n----\nShader text:\n----\n%s\n----\n",
-                 log.data(), shader->output);
-        }
-    }
-
-    {
         GLuint v4f_idx = glGetUniformBlockIndex(program, "vs_vec4");
         if(v4f_idx != GL_INVALID_INDEX)
             glUniformBlockBinding(program, v4f_idx, VSF_BINDING_IDX);
@@ -88,26 +54,19 @@ GLuint D3DGLVertexShader::compileShaderGL(UINT shadowsamplers)
         GLuint pos_fixup_idx = glGetUniformBlockIndex(program, "pos_fixup");
         if(pos_fixup_idx != GL_INVALID_INDEX)
             glUniformBlockBinding(program, pos_fixup_idx, POSFIXUP_BINDING_IDX);
-    }
 
-    for(int i = 0;i < shader->attribute_count;++i)
-    {
-        GLint loc = glGetAttribLocation(program, shader->attributes[i].name);
-        TRACE("Got attribute %s at location %d\n", shader->attributes[i].name, loc);
-        mUsageMap[(shader->attributes[i].usage<<8) | shader->attributes[i].index] = loc;
-    }
+        for(int i = 0;i < shader->sampler_count;++i)
+        {
+            GLint loc = glGetUniformLocation(program, shader->samplers[i].name);
+            TRACE("Got sampler %s:%d at location %d\n", shader->samplers[i].name, shader->samplers[i].index, loc);
+            glProgramUniform1i(program, loc, shader->samplers[i].index+MAX_FRAGMENT_SAMPLERS);
+        }
 
-    for(int i = 0;i < shader->sampler_count;++i)
-    {
-        GLint loc = glGetUniformLocation(program, shader->samplers[i].name);
-        TRACE("Got sampler %s:%d at location %d\n", shader->samplers[i].name, shader->samplers[i].index, loc);
-        glProgramUniform1i(program, loc, shader->samplers[i].index+MAX_FRAGMENT_SAMPLERS);
+        checkGLError();
     }
 
-    checkGLError();
-
-done:
-    MOJOSHADER_freeParseData(shader);
+    // A failed program is remembered too, so it isn't retried every draw.
+    mPrograms.insert(std::make_pair(mask, program));
 
     --mPendingUpdates;
     return program;
@@ -127,79 +86,161 @@ public:
 };
 
 
-D3DGLVertexShader::D3DGLVertexShader(D3DGLDevice *parent)
-  : mRefCount(0)
-  , mParent(parent)
+SharedVertexShader::SharedVertexShader(D3DGLDevice *parent)
+  : mParent(parent)
+  , mCodeHash(0)
   , mPendingUpdates(0)
-  , mProgram(0)
+  , mPendingStarts(0)
+  , mHaveInfo(false)
+  , mProgramSet(false)
   , mSamplerMask(0)
   , mShadowSamplers(0)
 {
-    mParent->AddRef();
 }
 
-D3DGLVertexShader::~D3DGLVertexShader()
+SharedVertexShader::~SharedVertexShader()
 {
-    if(GLuint program = mProgram.exchange(0))
+    // Nothing else is referencing this now, so once the queued commands are
+    // done, the command thread state is safe to look at.
+    while(mPendingUpdates > 0 || mPendingStarts > 0)
+        mParent->getQueue().wakeAndSleep();
+
+    for(auto &program : mPrograms)
     {
-        mParent->getQueue().send<DeinitVShaderCmd>(program);
-        if(mPendingUpdates > 0)
-            mParent->getQueue().wakeAndSleep();
+        if(program.second)
+            mParent->getQueue().send<DeinitVShaderCmd>(program.second);
     }
-    mParent->Release();
-}
-
-bool D3DGLVertexShader::init(const DWORD *data)
-{
-    if(*data>>16 != 0xfffe)
+    for(auto &started : mStartedPrograms)
     {
-        WARN("Shader is not a vertex shader (0x%04lx, expected 0xfffe)\n", *data>>16);
-        return false;
+        if(started.second.mProgram)
+            mParent->getQueue().send<DeinitVShaderCmd>(started.second.mProgram);
     }
+}
 
+bool SharedVertexShader::init(const DWORD *data, size_t count, UINT64 hash)
+{
     TRACE("Parsing %s shader %lu.%lu using profile %s\n",
           (((*data>>16)==0xfffe) ? "vertex" : ((*data>>16)==0xffff) ? "pixel" : "unknown"),
           (*data>>8)&0xff, *data&0xff, MOJOSHADER_PROFILE_GLSL330);
 
-    const MOJOSHADER_parseData *shader = MOJOSHADER_parse(MOJOSHADER_PROFILE_GLSL330,
-        reinterpret_cast<const unsigned char*>(data), 0, nullptr, 0, 0
-    );
-    if(shader->error_count > 0)
+    mCode.insert(mCode.end(), data, data+count);
+    mCodeHash = hash;
+
+    // Get the default variant going, so it's likely done by the time the
+    // first draw needs it. Same for the variants used in earlier runs.
+    getTranslation(0);
+    for(UINT mask : mParent->getVariantManifest().get(mCodeHash))
     {
-        std::stringstream sstr;
-        for(int i = 0;i < shader->error_count;++i)
-            sstr<< shader->errors[i].error_position<<":"<<shader->errors[i].error <<std::endl;
-        ERR("Failed to parse shader:\n----\n%s\n----\n", sstr.str().c_str());
-        MOJOSHADER_freeParseData(shader);
-        return false;
+        TRACE("Starting recorded shadow sampler variant 0x%x\n", mask);
+        getTranslation(mask);
     }
-    // Save the tokens used
-    mCode.insert(mCode.end(), data, data+shader->token_count);
 
-    TRACE("Parsed shader:\n----\n%s\n----\n", shader->output);
+    return true;
+}
 
+void SharedVertexShader::translationDone(ShaderTranslation *translation, void *userdata)
+{
+    SharedVertexShader *self = static_cast<SharedVertexShader*>(userdata);
+    self->mParent->getQueue().send<StartVShaderCmd>(self, translation);
+}
+
+ShaderTranslation *SharedVertexShader::getTranslation(UINT shadowsamplers)
+{
+    auto iter = mTranslations.find(shadowsamplers);
+    if(iter != mTranslations.end())
+        return iter->second.get();
+
+    // Other variants are emitted from the default one's parse.
+    std::shared_ptr<ShaderTranslation> translation;
+    if(shadowsamplers == 0)
+        translation.reset(new ShaderTranslation(mCode));
+    else
+    {
+        getTranslation(0);
+        translation.reset(new ShaderTranslation(mTranslations[0], shadowsamplers));
+    }
+    mTranslations.insert(std::make_pair(shadowsamplers, translation));
+
+    ++mPendingStarts;
+    if(!ShaderTranslation::Start(translation, translationDone, this))
+        --mPendingStarts;
+    return translation.get();
+}
+
+void SharedVertexShader::getInfo()
+{
+    if(mHaveInfo) return;
+
+    // Shadow samplers don't change the attributes or sampler indices, so the
+    // default variant has what's needed.
+    const MOJOSHADER_parseData *shader = getTranslation(0)->get();
+    // Creation only checks the bytecode's structure, so translation errors
+    // are reported the first time the shader is used.
+    if(shader->error_count > 0)
+        ERR("Vertex shader %p failed to translate, it won't draw: %s\n", this,
+            shader->errors[0].error);
+    for(int i = 0;i < shader->attribute_count;++i)
+    {
+        TRACE("Got attribute %s at location %d\n", shader->attributes[i].name, i);
+        mUsageMap[(shader->attributes[i].usage<<8) | shader->attributes[i].index] = i;
+    }
     for(int i = 0;i < shader->sampler_count;++i)
         mSamplerMask |= 1<<(shader->samplers[i].index+MAX_FRAGMENT_SAMPLERS);
 
-    MOJOSHADER_freeParseData(shader);
+    mHaveInfo = true;
+}
 
-    return true;
+void SharedVertexShader::setProgram(GLuint pipeline)
+{
+    mProgramSet = true;
+    ++mPendingUpdates;
+    mParent->getQueue().doSend<CompileAndSetVShaderCmd>(this, pipeline,
+        getTranslation(mShadowSamplers)
+    );
 }
 
-void D3DGLVertexShader::checkShadowSamplers(UINT mask)
+void SharedVertexShader::checkShadowSamplers(UINT mask)
 {
-    if(mPendingUpdates > 0 || mProgram)
-    {
-        if(mShadowSamplers == (mask&mSamplerMask))
-            return;
+    getInfo();
+
+    mask &= mSamplerMask;
+    if(mProgramSet && mShadowSamplers == mask)
+        return;
+
+    if(!mTranslations.count(mask))
+        TRACE("Building program for shadow sampler mask 0x%x\n", mask);
+
+    if(mask != 0)
+        mParent->getVariantManifest().record(mCodeHash, mask);
+    mShadowSamplers = mask;
+    setProgram(mParent->getShaderPipeline());
+}
+
+
+D3DGLVertexShader::D3DGLVertexShader(D3DGLDevice *parent)
+  : mRefCount(0)
+  , mParent(parent)
+{
+    mParent->AddRef();
+}
 
-        WARN("Rebuilding vertex shader %p because of shadow mismatch: 0x%x / 0x%x\n",
-             this, mShadowSamplers, (mask&mSamplerMask));
+D3DGLVertexShader::~D3DGLVertexShader()
+{
+    // The shared state needs the device until it's gone.
+    mShared.reset();
+    mParent->Release();
+}
+
+bool D3DGLVertexShader::init(const DWORD *data)
+{
+    if(*data>>16 != 0xfffe)
+    {
+        WARN("Shader is not a vertex shader (0x%04lx, expected 0xfffe)\n", *data>>16);
+        return false;
     }
 
-    mShadowSamplers = (mask&mSamplerMask);
-    ++mPendingUpdates;
-    mParent->getQueue().doSend<CompileAndSetVShaderCmd>(this, mParent->getShaderPipeline(), mShadowSamplers);
+    mShared = mParent->getVShaderRegistry().get(mParent, data);
+    return mShared != nullptr;
 }
 
 
@@ -245,8 +286,9 @@ HRESULT D3DGLVertexShader::GetFunction(void *data, UINT *size)
 {
     TRACE("iface %p, data %p, size %p\n", this, data, size);
 
-    *size = mCode.size() * sizeof(decltype(mCode)::value_type);
+    const std::vector<DWORD> &code = mShared->getCode();
+    *size = code.size() * sizeof(DWORD);
     if(data)
-        memcpy(data, mCode.data(), mCode.size() * sizeof(decltype(mCode)::value_type));
+        memcpy(data, code.data(), code.size() * sizeof(DWORD));
     return D3D_OK;
 }